@@ -0,0 +1,370 @@
+/**
+ * CRC32 and CRC32C computation for verifying bulk transfers
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#define CRC_HAVE_X86                    1
+#endif
+
+#include "crc32.h"
+
+/** Reflected polynomials */
+#define CRC32_POLY                      0xedb88320u
+#define CRC32C_POLY                     0x82f63b78u
+/** The PCLMULQDQ folding needs at least this many bytes */
+#define CRC_FOLD_MIN_LEN                64
+
+/** Raw update function: takes and returns the un-inverted CRC register */
+typedef uint32_t (*crc_fn)(
+    uint32_t                crc,
+    const uint8_t*          buf,
+    size_t                  len);
+
+static const char* const type_names[CRC_TYPE_NUM] = {
+    [CRC_TYPE_CRC32]    = "crc32",
+    [CRC_TYPE_CRC32C]   = "crc32c",
+};
+
+/** Slicing-by-8 tables for the table implementation */
+static uint32_t crc_tables[CRC_TYPE_NUM][8][256];
+
+static uint32_t crc32_table(
+    uint32_t                crc,
+    const uint8_t*          buf,
+    size_t                  len);
+
+static uint32_t crc32c_table(
+    uint32_t                crc,
+    const uint8_t*          buf,
+    size_t                  len);
+
+#ifdef CRC_HAVE_X86
+static uint32_t crc32c_sse42(
+    uint32_t                crc,
+    const uint8_t*          buf,
+    size_t                  len);
+
+static uint32_t crc32_pclmul(
+    uint32_t                crc,
+    const uint8_t*          buf,
+    size_t                  len);
+#endif
+
+static crc_fn crc_impl[CRC_TYPE_NUM] = {
+    [CRC_TYPE_CRC32]    = crc32_table,
+    [CRC_TYPE_CRC32C]   = crc32c_table,
+};
+
+static const char* crc_impl_names[CRC_TYPE_NUM] = {
+    [CRC_TYPE_CRC32]    = "table",
+    [CRC_TYPE_CRC32C]   = "table",
+};
+
+/**
+ * @brief Build the tables and pick the fastest implementation for this CPU.
+ *        Run before main so that crc_update needs no locking
+ */
+__attribute__((constructor))
+static void crc_init(
+    void)
+{
+    static const uint32_t polys[CRC_TYPE_NUM] = {
+        [CRC_TYPE_CRC32]    = CRC32_POLY,
+        [CRC_TYPE_CRC32C]   = CRC32C_POLY,
+    };
+    uint32_t crc = 0;
+    unsigned int t = 0;
+    unsigned int i = 0;
+    unsigned int j = 0;
+
+    for(t = 0; t < CRC_TYPE_NUM; ++t) {
+        for(i = 0; i < 256; ++i) {
+            crc = i;
+            for(j = 0; j < 8; ++j) {
+                crc = (crc >> 1) ^ (crc & 1 ? polys[t] : 0);
+            }
+            crc_tables[t][0][i] = crc;
+        }
+
+        /* Table n holds the effect of a byte followed by n zero bytes */
+        for(i = 0; i < 256; ++i) {
+            crc = crc_tables[t][0][i];
+            for(j = 1; j < 8; ++j) {
+                crc = (crc >> 8) ^ crc_tables[t][0][crc & 0xff];
+                crc_tables[t][j][i] = crc;
+            }
+        }
+    }
+
+#ifdef CRC_HAVE_X86
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("sse4.2")) {
+        crc_impl[CRC_TYPE_CRC32C] = crc32c_sse42;
+        crc_impl_names[CRC_TYPE_CRC32C] = "sse4.2";
+    }
+
+    if(__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        crc_impl[CRC_TYPE_CRC32] = crc32_pclmul;
+        crc_impl_names[CRC_TYPE_CRC32] = "pclmul";
+    }
+#endif
+}
+
+uint32_t crc_update(
+    enum crc_type           type,
+    uint32_t                crc,
+    const void*             buf,
+    size_t                  len)
+{
+    if((unsigned int)type >= CRC_TYPE_NUM) {
+        return crc;
+    }
+
+    /* Both checksums start with all ones and invert the result, doing
+     * that here lets callers chain calls starting from 0 */
+    return ~crc_impl[type](~crc, buf, len);
+}
+
+const char* crc_type_name(
+    enum crc_type           type)
+{
+    if((unsigned int)type >= CRC_TYPE_NUM) {
+        return "unknown";
+    }
+
+    return type_names[type];
+}
+
+int crc_type_parse(
+    const char*             name)
+{
+    int i = 0;
+
+    for(i = 0; i < CRC_TYPE_NUM; ++i) {
+        if(strcmp(name, type_names[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+const char* crc_impl_name(
+    enum crc_type           type)
+{
+    if((unsigned int)type >= CRC_TYPE_NUM) {
+        return "unknown";
+    }
+
+    return crc_impl_names[type];
+}
+
+/**
+ * @brief Slicing-by-8 table CRC, processing 8 bytes per step once the
+ *        buffer is aligned
+ */
+static uint32_t crc_slice8(
+    uint32_t                (*tab)[256],
+    uint32_t                crc,
+    const uint8_t*          buf,
+    size_t                  len)
+{
+    uint32_t lo = 0;
+    uint32_t hi = 0;
+
+    while(len && ((uintptr_t)buf & 7)) {
+        crc = (crc >> 8) ^ tab[0][(crc ^ *buf++) & 0xff];
+        --len;
+    }
+
+    while(len >= 8) {
+        memcpy(&lo, buf, 4);
+        memcpy(&hi, buf + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= crc;
+        crc = tab[7][lo & 0xff] ^ tab[6][(lo >> 8) & 0xff] ^
+              tab[5][(lo >> 16) & 0xff] ^ tab[4][lo >> 24] ^
+              tab[3][hi & 0xff] ^ tab[2][(hi >> 8) & 0xff] ^
+              tab[1][(hi >> 16) & 0xff] ^ tab[0][hi >> 24];
+        buf += 8;
+        len -= 8;
+    }
+
+    while(len--) {
+        crc = (crc >> 8) ^ tab[0][(crc ^ *buf++) & 0xff];
+    }
+
+    return crc;
+}
+
+static uint32_t crc32_table(
+    uint32_t                crc,
+    const uint8_t*          buf,
+    size_t                  len)
+{
+    return crc_slice8(crc_tables[CRC_TYPE_CRC32], crc, buf, len);
+}
+
+static uint32_t crc32c_table(
+    uint32_t                crc,
+    const uint8_t*          buf,
+    size_t                  len)
+{
+    return crc_slice8(crc_tables[CRC_TYPE_CRC32C], crc, buf, len);
+}
+
+#ifdef CRC_HAVE_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(
+    uint32_t                crc,
+    const uint8_t*          buf,
+    size_t                  len)
+{
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    uint64_t val = 0;
+
+    while(len >= 8) {
+        memcpy(&val, buf, 8);
+        crc64 = _mm_crc32_u64(crc64, val);
+        buf += 8;
+        len -= 8;
+    }
+
+    crc = (uint32_t)crc64;
+#else
+    uint32_t val = 0;
+
+    while(len >= 4) {
+        memcpy(&val, buf, 4);
+        crc = _mm_crc32_u32(crc, val);
+        buf += 4;
+        len -= 4;
+    }
+#endif
+
+    while(len--) {
+        crc = _mm_crc32_u8(crc, *buf++);
+    }
+
+    return crc;
+}
+
+/**
+ * @brief Fold a 128 bit value forward by the distance encoded in k (the
+ *        high and low halves are multiplied by different constants)
+ */
+__attribute__((target("pclmul,sse4.1")))
+static inline __m128i crc_fold(
+    __m128i                 x,
+    __m128i                 k)
+{
+    return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+                         _mm_clmulepi64_si128(x, k, 0x11));
+}
+
+/**
+ * @brief CRC32 by carry-less multiplication folding ("Fast CRC Computation
+ *        for Generic Polynomials Using PCLMULQDQ Instruction", Intel 2009).
+ *        Four 128 bit lanes are folded 64 bytes at a time, folded down to
+ *        one lane, then reduced to 32 bits with a Barrett reduction. Any
+ *        tail shorter than 16 bytes is finished with the table
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(
+    uint32_t                crc,
+    const uint8_t*          buf,
+    size_t                  len)
+{
+    /* x^(4*128+32) mod P, x^(4*128-32) mod P (bit reflected) */
+    const __m128i k1k2 = _mm_set_epi64x(0x1c6e41596ll, 0x154442bd4ll);
+    /* x^(128+32) mod P, x^(128-32) mod P */
+    const __m128i k3k4 = _mm_set_epi64x(0x0ccaa009ell, 0x1751997d0ll);
+    /* x^64 mod P */
+    const __m128i k5 = _mm_set_epi64x(0, 0x163cd6124ll);
+    /* The polynomial and its Barrett constant */
+    const __m128i poly = _mm_set_epi64x(0x1f7011641ll, 0x1db710641ll);
+    const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+    __m128i x0, x1, x2, x3, t;
+
+    if(len < CRC_FOLD_MIN_LEN) {
+        return crc32_table(crc, buf, len);
+    }
+
+    x0 = _mm_loadu_si128((const __m128i*)buf);
+    x1 = _mm_loadu_si128((const __m128i*)(buf + 16));
+    x2 = _mm_loadu_si128((const __m128i*)(buf + 32));
+    x3 = _mm_loadu_si128((const __m128i*)(buf + 48));
+    x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128((int)crc));
+    buf += 64;
+    len -= 64;
+
+    while(len >= 64) {
+        x0 = _mm_xor_si128(crc_fold(x0, k1k2), _mm_loadu_si128((const __m128i*)buf));
+        x1 = _mm_xor_si128(crc_fold(x1, k1k2), _mm_loadu_si128((const __m128i*)(buf + 16)));
+        x2 = _mm_xor_si128(crc_fold(x2, k1k2), _mm_loadu_si128((const __m128i*)(buf + 32)));
+        x3 = _mm_xor_si128(crc_fold(x3, k1k2), _mm_loadu_si128((const __m128i*)(buf + 48)));
+        buf += 64;
+        len -= 64;
+    }
+
+    /* Fold the four lanes into one */
+    x0 = _mm_xor_si128(crc_fold(x0, k3k4), x1);
+    x0 = _mm_xor_si128(crc_fold(x0, k3k4), x2);
+    x0 = _mm_xor_si128(crc_fold(x0, k3k4), x3);
+
+    while(len >= 16) {
+        x0 = _mm_xor_si128(crc_fold(x0, k3k4), _mm_loadu_si128((const __m128i*)buf));
+        buf += 16;
+        len -= 16;
+    }
+
+    /* 128 to 64 bits, which also appends the 32 zero bits the CRC needs */
+    t = _mm_clmulepi64_si128(x0, k3k4, 0x10);
+    x0 = _mm_xor_si128(_mm_srli_si128(x0, 8), t);
+
+    /* 64 to 32 bits */
+    t = _mm_srli_si128(x0, 4);
+    x0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), k5, 0x00);
+    x0 = _mm_xor_si128(x0, t);
+
+    /* Barrett reduction down to the 32 bit CRC */
+    t = x0;
+    x0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), poly, 0x10);
+    x0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), poly, 0x00);
+    x0 = _mm_xor_si128(x0, t);
+    crc = (uint32_t)_mm_extract_epi32(x0, 1);
+
+    return crc32_table(crc, buf, len);
+}
+#endif
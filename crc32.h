@@ -0,0 +1,93 @@
+/**
+ * CRC32 and CRC32C computation for verifying bulk transfers
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** The supported checksums */
+enum crc_type {
+    /** IEEE 802.3 CRC32, as used by zlib, gzip and crc32(1) */
+    CRC_TYPE_CRC32 = 0,
+    /** Castagnoli CRC32C, as used by iSCSI, ext4 and btrfs */
+    CRC_TYPE_CRC32C,
+    CRC_TYPE_NUM
+};
+
+/**
+ * @brief Add data to a running checksum
+ *
+ * The checksum starts at 0 and the data can be passed in pieces of any
+ * size, so it can be computed while streaming:
+ *
+ *     crc = crc_update(type, 0, first, first_len);
+ *     crc = crc_update(type, crc, second, second_len);
+ *
+ * CRC32C uses the SSE4.2 crc32 instruction and CRC32 uses PCLMULQDQ folding
+ * when the CPU supports them, otherwise both fall back to a table.
+ *
+ * @param type - The checksum to compute
+ * @param crc - The checksum of the data so far (0 to start)
+ * @param buf - The data to add
+ * @param len - The number of bytes in buf
+ *
+ * @return The updated checksum
+ */
+uint32_t crc_update(
+    enum crc_type           type,
+    uint32_t                crc,
+    const void*             buf,
+    size_t                  len);
+
+/**
+ * @brief Get the name of a checksum ("crc32" or "crc32c")
+ */
+const char* crc_type_name(
+    enum crc_type           type);
+
+/**
+ * @brief Look up a checksum by name
+ *
+ * @return The checksum type, or -1 if the name is unknown
+ */
+int crc_type_parse(
+    const char*             name);
+
+/**
+ * @brief Get the name of the implementation used for a checksum on this CPU
+ *        ("sse4.2", "pclmul" or "table")
+ */
+const char* crc_impl_name(
+    enum crc_type           type);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CRC32_H */
@@ -27,55 +27,130 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
-#define SMBUS_MAX_BLOCK_LEN             32
+#include "crc32.h"
+#include "i2c_bus.h"
+#include "i2c_fru.h"
+#include "i2c_mon.h"
+#include "i2c_sim.h"
+#include "i2c_xfer.h"
+
 #define OP_INDEX                        1
 #define BUS_INDEX                       2
 #define ADDR_INDEX                      3
 #define ARGS_START                      4
-#define OP_RD                           0
-#define OP_WR                           1
+/** Where decoded FRU data is cached unless overridden with -C */
+#define FRU_CACHE_DIR                   "/var/cache/i2c-fru"
+/** Bytes read per transfer when checksumming */
+#define CRC_CHUNK_LEN                   I2C_XFER_MAX_MSG_LEN
+/** Time to let an EEPROM finish its write cycle before reading it back */
+#define VERIFY_DELAY_US                 10000
 
 static void print_usage(
     void);
 
-static int do_smbus_transfer(
-    int             bus,
-    unsigned long   addr,
-    int             op,
-    unsigned long   offset_len,
-    unsigned char*  wr_data,
-    unsigned long   wr_count,
-    unsigned char*  rd_data,
-    unsigned long   rd_count);
+static int parse_offset_len(
+    const char*     width,
+    unsigned long*  offset_len);
+
+static int run_monitor(
+    const char*         bus_spec,
+    const char*         config,
+    unsigned long       duration_s,
+    int                 use_lock,
+    int                 verbose);
+
+static int crc_read(
+    struct i2c_bus*     bus,
+    unsigned short      addr,
+    unsigned int        offset_len,
+    unsigned long       offset,
+    unsigned long       count,
+    enum crc_type       type,
+    uint32_t*           crc);
+
+static int check_lock(
+    struct i2c_bus*     bus,
+    int                 use_lock);
 
 int main(int argc, char* argv[])
 {
     const char* op = NULL;
-    unsigned long bus_no = 0;
     unsigned long addr = 0;
     unsigned long rd_count = 0;
     unsigned long wr_count = 0;
     unsigned long offset = 0;
     unsigned char* rd_data = NULL;
     unsigned char* wr_data = NULL;
-    unsigned long funcs;
     unsigned long offset_len = 0;
-    int operation = OP_RD;
-    int bus = 0;
-    char bus_dev[32] = {0};
+    struct i2c_bus* bus = NULL;
     char* end = NULL;
-    struct i2c_msg msgs[2];
-    struct i2c_rdwr_ioctl_data ioctl_data = {0};
-    int msg_idx = 0;
     int ret = 0;
     int i = 0;
     int data_idx = 0;
+    int opt = 0;
+    int use_lock = 1;
+    int verbose = 0;
+    int ten_bit = 0;
+    int fru = 0;
+    int fru_cached = 0;
+    char* fru_text = NULL;
+    const char* fru_cache_dir = FRU_CACHE_DIR;
+    int fru_cache_set = 0;
+    int use_crc = 0;
+    int check_crc = 0;
+    int crc_type = CRC_TYPE_CRC32;
+    uint32_t crc = 0;
+    uint32_t expected_crc = 0;
+
+    while((opt = getopt(argc, argv, "+LvtC:Rc:e:")) != -1) {
+        switch(opt) {
+            case 'c':
+                crc_type = crc_type_parse(optarg);
+                if(crc_type < 0) {
+                    printf("Unknown checksum %s\n", optarg);
+                    return 1;
+                }
+                use_crc = 1;
+                break;
+            case 'e':
+                expected_crc = strtoul(optarg, &end, 16);
+                check_crc = 1;
+                use_crc = 1;
+                break;
+            case 't':
+                ten_bit = 1;
+                break;
+            case 'C':
+                fru_cache_dir = optarg;
+                fru_cache_set = 1;
+                break;
+            case 'R':
+                fru_cache_dir = NULL;
+                fru_cache_set = 1;
+                break;
+            case 'L':
+                use_lock = 0;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                print_usage();
+                return 1;
+        }
+    }
+
+    /* Drop the options so the positional arguments are where we expect */
+    argc -= optind - 1;
+    argv += optind - 1;
 
     if(argc < ARGS_START) {
         printf("Not enough arguments\n");
@@ -84,193 +159,199 @@ int main(int argc, char* argv[])
     }
 
     op = argv[OP_INDEX];
-    bus_no = strtoul(argv[BUS_INDEX], &end, 0);
-    addr = strtoul(argv[ADDR_INDEX], &end, 0);
 
-    if(strcmp(op, "r") == 0) {
-        /* Plain read */
-        if(argc < (ARGS_START + 1)) {
-            printf("Please provide a number of bytes to read\n");
-            return 1;
-        }
-
-        rd_count = strtoul(argv[ARGS_START], &end, 0);
-        if(!rd_count) {
-            printf("Please provide a non-zero number of bytes to read\n");
-            return 1;
-        }
+    if(strcmp(op, "mon") == 0) {
+        /* The monitor takes a config file where the address would go */
+        return run_monitor(argv[BUS_INDEX], argv[ADDR_INDEX],
+                           argc > ARGS_START ? strtoul(argv[ARGS_START], &end, 0) : 0,
+                           use_lock, verbose);
+    }
 
-        rd_data = calloc(1, rd_count);
-    } else if(strcmp(op, "r8") == 0) {
-        offset_len = 1;
+    addr = strtoul(argv[ADDR_INDEX], &end, 0);
 
-        if(argc < (ARGS_START + 2)) {
-            printf("Please provide an offset and a number of bytes to read\n");
+    /* Addresses above the 7-bit range must be 10-bit ones */
+    if(ten_bit || addr > 0x7f) {
+        if(addr > 0x3ff) {
+            printf("Invalid 10-bit address 0x%lx\n", addr);
             return 1;
         }
+        addr |= I2C_ADDR_TEN;
+    }
 
-        /* Read 8 bit offset */
-        wr_count = 1;
-        wr_data = calloc(1, 1);
-        offset = strtoul(argv[ARGS_START], &end, 0);
-        wr_data[0] = (unsigned char)(offset & 0xff);
-        rd_count = strtoul(argv[ARGS_START + 1], &end, 0);
-        if(!rd_count) {
-            printf("Please provide a non-zero number of bytes to read\n");
-            return 1;
-        }
-        rd_data = calloc(1, rd_count);
-    } else if(strcmp(op, "r16") == 0) {
-        offset_len = 2;
+    if((op[0] == 'r' || op[0] == 'w') && parse_offset_len(&op[1], &offset_len) == 0) {
+        /* r/w with an optional offset width: r8, w16, r24, w32 etc. */
+        if(offset_len) {
+            if(argc < (ARGS_START + 2)) {
+                printf(op[0] == 'r' ?
+                       "Please provide an offset and a number of bytes to read\n" :
+                       "Please provide an offset and some data to write\n");
+                return 1;
+            }
 
-        /* Read 16 bit offset */
-        if(argc < (ARGS_START + 2)) {
-            printf("Please provide an offset and a number of bytes to read\n");
+            offset = strtoul(argv[ARGS_START], &end, 0);
+        } else if(argc < (ARGS_START + 1)) {
+            printf(op[0] == 'r' ?
+                   "Please provide a number of bytes to read\n" :
+                   "Please provide some data to write\n");
             return 1;
         }
 
-        /* Read 8 bit offset */
-        wr_count = 2;
-        wr_data = calloc(1, 2);
-        offset = strtoul(argv[ARGS_START], &end, 0);
-        wr_data[0] = (unsigned char)(offset >> 8);
-        wr_data[1] = (unsigned char)(offset & 0xff);
-        rd_count = strtoul(argv[ARGS_START + 1], &end, 0);
-        if(!rd_count) {
-            printf("Please provide a non-zero number of bytes to read\n");
-            return 1;
+        /* The offset goes first, followed by any data we're writing */
+        data_idx = ARGS_START + (offset_len ? 1 : 0);
+        wr_count = offset_len;
+        if(op[0] == 'w') {
+            wr_count += argc - data_idx;
         }
-        rd_data = calloc(1, rd_count);
-    } else if(strcmp(op, "w") == 0) {
-        operation = OP_WR;
 
-        /* Plain write */
-        if(argc < (ARGS_START + 1)) {
-            printf("Please provide some data to write\n");
-            return 1;
-        }
+        wr_data = calloc(1, wr_count ? wr_count : 1);
+        i2c_xfer_put_offset(wr_data, offset, offset_len);
 
-        wr_count = argc - ARGS_START;
-        wr_data = calloc(1, wr_count);
+        if(op[0] == 'r') {
+            rd_count = strtoul(argv[data_idx], &end, 0);
+            if(!rd_count) {
+                printf("Please provide a non-zero number of bytes to read\n");
+                return 1;
+            }
+            if(!use_crc) {
+                rd_data = calloc(1, rd_count);
+            }
+        } else {
+            for(i = data_idx; i < argc; ++i) {
+                wr_data[offset_len + i - data_idx] = (unsigned char)strtoul(argv[i], &end, 0);
+            }
+        }
 
-        for(i = ARGS_START; i < argc; ++i) {
-            wr_data[i - ARGS_START] = (unsigned char)strtoul(argv[i], &end, 0);
+        if(!wr_count) {
+            free(wr_data);
+            wr_data = NULL;
         }
-    } else if(strcmp(op, "w8") == 0) {
-        operation = OP_WR;
+    } else if(strcmp(op, "fru") == 0) {
+        /* IPMI FRU decode, 8 bit offset unless told otherwise */
+        fru = 1;
         offset_len = 1;
+        if(argc > ARGS_START) {
+            offset_len = strtoul(argv[ARGS_START], &end, 0);
+        }
 
-        /* Write 8 bit offset */
-        if(argc < (ARGS_START + 2)) {
-            printf("Please provide an offset and some data to write\n");
+        if(offset_len != 1 && offset_len != 2) {
+            printf("The FRU offset length must be 1 or 2 bytes\n");
             return 1;
         }
+    } else {
+        printf("Unknown operation %s\n", op);
+        print_usage();
+        return 1;
+    }
 
-        wr_count = argc - (ARGS_START + 1);
+    bus = i2c_bus_open(argv[BUS_INDEX]);
+    if(!bus) {
+        printf("Unable to open bus %s (errno: %d)\n", argv[BUS_INDEX], errno);
+        return 1;
+    }
 
-        /* Add bytes for the offset */
-        wr_count += 1;
-        wr_data = calloc(1, wr_count);
+    if(check_lock(bus, use_lock) < 0) {
+        i2c_bus_close(bus);
+        return 1;
+    }
 
-        offset = strtoul(argv[ARGS_START], &end, 0);
-        wr_data[0] = (unsigned char)(offset & 0xff);
-        data_idx = 1;
+    if(fru) {
+        /* Keep simulated FRU data out of the system cache */
+        if(!fru_cache_set && i2c_sim_is_sim(bus)) {
+            fru_cache_dir = NULL;
+        }
 
-        for(i = ARGS_START+1; i < argc; ++i) {
-            wr_data[data_idx] = (unsigned char)strtoul(argv[i], &end, 0);
-            ++data_idx;
+        if(fru_cache_dir) {
+            /* Best effort, without a cache directory we just don't cache */
+            mkdir(fru_cache_dir, 0755);
         }
-    } else if(strcmp(op, "w16") == 0) {
-        operation = OP_WR;
-        offset_len = 2;
 
-        /* Write 16 bit offset */
-        if(argc < (ARGS_START + 2)) {
-            printf("Please provide an offset and some data to write\n");
+        ret = i2c_fru_read(bus, addr, offset_len, fru_cache_dir,
+                           &fru_text, &fru_cached);
+        if(ret < 0) {
+            printf("Error reading FRU data (errno: %d)\n", errno);
             return 1;
         }
 
-        wr_count = argc - (ARGS_START + 1);
-
-        /* Add bytes for the offset */
-        wr_count += 2;
-        wr_data = calloc(1, wr_count);
-
-        offset = strtoul(argv[ARGS_START], &end, 0);
-        wr_data[0] = (unsigned char)(offset >> 8);
-        wr_data[1] = (unsigned char)(offset & 0xff);
-        data_idx = 2;
-
-        for(i = ARGS_START+1; i < argc; ++i) {
-            wr_data[data_idx] = (unsigned char)strtoul(argv[i], &end, 0);
-            ++data_idx;
+        printf("%s", fru_text);
+        if(verbose) {
+            printf("FRU data %s\n", fru_cached ? "served from cache" : "read from device");
         }
-    }
 
-    snprintf(bus_dev, 32, "/dev/i2c-%d", bus_no);
+        free(fru_text);
+        i2c_bus_close(bus);
 
-    bus = open(bus_dev, O_RDWR);
-    if(bus < 0) {
-        printf("Unable to open bus %d (errno: %d)\n", bus_no, errno);
-        return 1;
+        return 0;
     }
 
-    if (ioctl(bus, I2C_FUNCS, &funcs) < 0) {
-        printf("Unable to retrieve I2C function support flags\n");
-        return 1;
-    }
-
-    if(!(funcs & I2C_FUNC_I2C)) {
-        /* Device doesn't support normal transfers, try and perform the
-         * operation using smbus transfers instead. Note: this is more dangerous
-         * as there will be a stop between the write and read of offset based
-         * reads, so if we are on a multi master bus this could cause problems.
-         * 
-         * Also note that this limits the size of an individual transfer due to
-         * the max block length of smbus */
-        ret = do_smbus_transfer(bus,
-                                addr,
-                                operation,
-                                offset_len,
-                                wr_data, wr_count,
-                                rd_data, rd_count);
+    if(use_crc && rd_count) {
+        /* Checksum the device contents without holding the whole image */
+        ret = crc_read(bus, addr, offset_len, offset, rd_count, crc_type, &crc);
         if(ret < 0) {
-            printf("Error performing smbus emulated transfer\n");
+            printf("Error performing I2C operation (errno: %d)\n", errno);
             return 1;
         }
-    } else {
-        /* If we have a write - add that first */
-        if(wr_count > 0 && wr_data) {
-            msgs[msg_idx].addr = addr;
-            msgs[msg_idx].len = wr_count;
-            msgs[msg_idx].buf = wr_data;
-            msgs[msg_idx].flags = 0;
-            ++msg_idx;
-        }
 
-        /* Add a read if we have one */
-        if(rd_count > 0 && rd_data) {
-            msgs[msg_idx].addr = addr;
-            msgs[msg_idx].len = rd_count;
-            msgs[msg_idx].buf = rd_data;
-            msgs[msg_idx].flags = I2C_M_RD;
-            ++msg_idx;
+        printf("Read %lu bytes, %s 0x%08x\n", rd_count, crc_type_name(crc_type), crc);
+        if(verbose) {
+            printf("Checksum implementation: %s\n", crc_impl_name(crc_type));
         }
 
-        ioctl_data.msgs = msgs;
-        ioctl_data.nmsgs = msg_idx;
+        i2c_bus_close(bus);
 
-        ret = ioctl(bus, I2C_RDWR, &ioctl_data);
-        if(ret < 0) {
-            printf("Error performing I2C operation (errno: %d)\n", errno);
+        if(check_crc && crc != expected_crc) {
+            printf("Checksum mismatch, expected 0x%08x\n", expected_crc);
             return 1;
         }
+
+        return 0;
+    }
+
+    ret = i2c_xfer(bus,
+                   addr,
+                   I2C_XFER_AUTO,
+                   offset_len,
+                   wr_data, wr_count,
+                   rd_data, rd_count);
+    if(ret < 0) {
+        printf("Error performing I2C operation (errno: %d)\n", errno);
+        return 1;
     }
 
     if(wr_count) {
         printf("Written %d bytes\n", wr_count);
     }
 
+    if(use_crc && wr_count > offset_len) {
+        /* Checksum what we wrote, then read it back and compare */
+        crc = crc_update(crc_type, 0, &wr_data[offset_len], wr_count - offset_len);
+        printf("Written data %s 0x%08x\n", crc_type_name(crc_type), crc);
+
+        if(offset_len) {
+            uint32_t readback_crc = 0;
+
+            i2c_bus_delay(bus, VERIFY_DELAY_US);
+            ret = crc_read(bus, addr, offset_len, offset, wr_count - offset_len,
+                           crc_type, &readback_crc);
+            if(ret < 0) {
+                printf("Error reading back written data (errno: %d)\n", errno);
+                return 1;
+            }
+
+            if(readback_crc != crc) {
+                printf("Verify failed, read back %s 0x%08x\n",
+                       crc_type_name(crc_type), readback_crc);
+                return 1;
+            }
+
+            printf("Verified\n");
+        }
+
+        if(check_crc && crc != expected_crc) {
+            printf("Checksum mismatch, expected 0x%08x\n", expected_crc);
+            return 1;
+        }
+    }
+
     if(rd_count && rd_data) {
         printf("Read %d byte\n", rd_count);
         for(i = 0; i < rd_count; ++i) {
@@ -286,7 +367,17 @@ int main(int argc, char* argv[])
     if(rd_data) {
         free(rd_data);
     }
-    
+
+    if(verbose) {
+        printf("Bus lock: %lu acquisitions, %lu contended, %llu us total wait, %llu us max wait\n",
+               bus->lock_stats.acquisitions,
+               bus->lock_stats.contended,
+               (unsigned long long)(bus->lock_stats.wait_ns_total / 1000),
+               (unsigned long long)(bus->lock_stats.wait_ns_max / 1000));
+    }
+
+    i2c_bus_close(bus);
+
     return 0;
 }
 
@@ -295,7 +386,21 @@ static void print_usage(
 {
     printf("I2C read/write utility\n");
     printf("Usage:\n");
-    printf("    ./i2c <op> <bus> <addr> [args...]\n");
+    printf("    ./i2c [options] <op> <bus> <addr> [args...]\n");
+    printf("\n");
+    printf("Options:\n");
+    printf("    -t      - Use 10-bit addressing (implied for addresses > 0x7f)\n");
+    printf("    -L      - Don't take the cross-process bus lock\n");
+    printf("    -v      - Print bus lock wait statistics\n");
+    printf("    -C dir  - Cache decoded FRU data in dir (default %s, or\n", FRU_CACHE_DIR);
+    printf("              no cache for simulated buses)\n");
+    printf("    -R      - Don't use the FRU cache\n");
+    printf("    -c type - Checksum the data (crc32 or crc32c). Reads print the\n");
+    printf("              checksum instead of the data and are streamed rather\n");
+    printf("              than held in memory, offset writes are read back and\n");
+    printf("              verified against the checksum of the written data\n");
+    printf("    -e crc  - Fail unless the checksum matches crc (hex), implies\n");
+    printf("              -c crc32 unless -c is given\n");
     printf("\n");
     printf("Where:\n");
     printf("    op      - The Operation to perform. One of:\n");
@@ -305,236 +410,218 @@ static void print_usage(
     printf("                * w     - Plain write to the device\n");
     printf("                    Arguments: <bytes...>\n");
     printf("                        - bytes - The bytes to write\n");
-    printf("                * r8    - Read from an 8 bit offset\n");
+    printf("                * r<N>  - Read from an N bit offset, N is 8, 16, 24\n");
+    printf("                          or 32 (r8, r16, r24, r32)\n");
     printf("                    Arguments: <offset> <count>\n");
     printf("                        - offset    - the offset to read from\n");
     printf("                        - count     - The number of bytes to read\n");
-    printf("                * w8    - Write to an 8 bit offset\n");
-    printf("                    Arguments: <offset> <bytes...>\n");
-    printf("                        - offset - the offset to write to\n");
-    printf("                        - bytes - The bytes to write\n");
-    printf("                * r16   - Read from a 16 bit offset\n");
-    printf("                    Arguments: <offset> <count>\n");
-    printf("                        - offset - the offset to read from\n");
-    printf("                        - count     - The number of bytes to read\n");
-    printf("                * w16   - Write to a 16 bit offset\n");
+    printf("                * w<N>  - Write to an N bit offset, N is 8, 16, 24\n");
+    printf("                          or 32 (w8, w16, w24, w32)\n");
     printf("                    Arguments: <offset> <bytes...>\n");
     printf("                        - offset - the offset to write to\n");
     printf("                        - bytes - The bytes to write\n");
-    printf("    bus     - The I2C bus to perform the operation on\n");
-    printf("    addr    - The I2C address of the device to access (7-bit)\n");
+    printf("                * fru   - Decode IPMI FRU data from an EEPROM\n");
+    printf("                    Arguments: [offset_len]\n");
+    printf("                        - offset_len - EEPROM offset size, 1 or 2\n");
+    printf("                                       bytes (default 1)\n");
+    printf("                * mon   - Monitor sensor thresholds, printing an\n");
+    printf("                          event for each state change. Takes a\n");
+    printf("                          config file in place of addr (see\n");
+    printf("                          i2c_mon.h for the format)\n");
+    printf("                    Arguments: [seconds]\n");
+    printf("                        - seconds - Stop after this long (default\n");
+    printf("                                    run until interrupted)\n");
+    printf("    bus     - The I2C bus to perform the operation on. Either the\n");
+    printf("              adapter number or sim[:options] for a simulated\n");
+    printf("              adapter (see i2c_sim.h for the options)\n");
+    printf("    addr    - The I2C address of the device to access (7-bit, or\n");
+    printf("              10-bit with -t or when above 0x7f)\n");
     printf("    val...  - Optional arguments for the operation (see above)\n");
 }
 
-static int do_smbus_transfer(
-    int             bus,
-    unsigned long   addr,
-    int             op,
-    unsigned long   offset_len,
-    unsigned char*  wr_data,
-    unsigned long   wr_count,
-    unsigned char*  rd_data,
-    unsigned long   rd_count)
+static int parse_offset_len(
+    const char*     width,
+    unsigned long*  offset_len)
 {
-    int ret = 0;
-    unsigned long offset = 0;
+    char* end = NULL;
+    unsigned long bits = 0;
 
-    ret = ioctl(bus, I2C_SLAVE_FORCE, addr);
-    if(ret < 0) {
-        printf("Unable to set slave address\n");
+    if(*width == '\0') {
+        *offset_len = 0;
+        return 0;
+    }
+
+    bits = strtoul(width, &end, 10);
+    if(end == width || *end != '\0' || bits % 8 ||
+       bits == 0 || bits / 8 > I2C_XFER_MAX_OFFSET_LEN) {
         return -1;
     }
 
-    /* Process the command based on the operation and offset length */
-    if(op == OP_RD) {
-        if(offset_len == 0) {
-            /* 0 byte offset - we can just read byte-by-byte */
-            while(offset < rd_count) {
-                struct i2c_smbus_ioctl_data smb;
-
-                smb.read_write = I2C_SMBUS_READ;
-                smb.command = 0;
-                smb.size = I2C_SMBUS_BYTE;
-                smb.data = &rd_data[offset];
-
-                ret = ioctl(bus, I2C_SMBUS, &smb);
-                if(ret < 0) {
-                    printf("Failed to perform smbus byte read\n");
-                    return -1;
-                }
+    *offset_len = bits / 8;
 
-                ++offset;
-            }
-        } else if(offset_len == 1) {
-            /* 1 byte offset - we use read byte commands, which send the offset
-             * and then read a byte, so we increment the offset for each byte
-             * we read */
-            unsigned char dev_offset = wr_data[0];
-
-            while(offset < rd_count) {
-                struct i2c_smbus_ioctl_data smb;
-
-                smb.read_write = I2C_SMBUS_READ;
-                smb.command = dev_offset;
-                smb.size = I2C_SMBUS_BYTE_DATA;
-                smb.data = &rd_data[offset];
-
-                ret = ioctl(bus, I2C_SMBUS, &smb);
-                if(ret < 0) {
-                    printf("Failed to perform smbus byte read\n");
-                    return -1;
-                }
+    return 0;
+}
 
-                ++offset;
-                ++dev_offset;
-            }
-        } else if(offset_len == 2) {
-            /* 2 byte offset - we use write byte followed by read commands. This
-             * sends the offset, a STOP, and then reads a signle data byte. We
-             * need to update and resend the offset for each subsequent byte */
-            unsigned short dev_offset = wr_data[0] << 8 | wr_data[1];
-
-            while(offset < rd_count) {
-                struct i2c_smbus_ioctl_data smb;
-                unsigned char lsb = dev_offset & 0xff;
-
-                smb.read_write = I2C_SMBUS_WRITE;
-                smb.command = dev_offset >> 8;
-                smb.size = I2C_SMBUS_BYTE_DATA;
-                smb.data = &lsb;
-
-                ret = ioctl(bus, I2C_SMBUS, &smb);
-                if(ret < 0) {
-                    printf("Failed to perform smbus byte read\n");
-                    return -1;
-                }
+/** Set by SIGINT/SIGTERM to stop the monitor */
+static volatile int mon_stop = 0;
 
-                smb.read_write = I2C_SMBUS_READ;
-                smb.command = 0;
-                smb.size = I2C_SMBUS_BYTE;
-                smb.data = &rd_data[offset];
+static void mon_signal(
+    int                 sig)
+{
+    (void)sig;
+    mon_stop = 1;
+}
 
-                ret = ioctl(bus, I2C_SMBUS, &smb);
-                if(ret < 0) {
-                    printf("Failed to perform smbus byte read\n");
-                    return -1;
-                }
+static void mon_event(
+    const struct i2c_mon_event* event,
+    void*               user)
+{
+    (void)user;
+
+    printf("%llu.%03llu %s %s -> %s",
+           (unsigned long long)(event->time_ns / 1000000000ull),
+           (unsigned long long)(event->time_ns / 1000000ull % 1000),
+           event->sensor->name,
+           i2c_mon_state_name(event->from),
+           i2c_mon_state_name(event->to));
+    if(event->to != I2C_MON_FAULT) {
+        printf(" %g", event->value);
+    }
+    printf("\n");
 
-                ++offset;
-                ++dev_offset;
-            }
-        } else {
-            printf("Unsupported I2C operation for smbus emulation\n");
-            return -1;
-        }
-    } else {
-        if(offset_len == 0) {
-            /* No offset - we can just write data byte-by-byte */
-            while(offset < wr_count) {
-                struct i2c_smbus_ioctl_data smb;
-
-                smb.read_write = I2C_SMBUS_READ;
-                smb.command = 0;
-                smb.size = I2C_SMBUS_BYTE;
-                smb.data = &rd_data[offset];
-
-                ret = ioctl(bus, I2C_SMBUS, &smb);
-                if(ret < 0) {
-                    printf("Failed to perform smbus byte read\n");
-                    return -1;
-                }
+    /* Events are usually piped to something else, don't sit on them */
+    fflush(stdout);
+}
 
-                ++offset;
+static int run_monitor(
+    const char*         bus_spec,
+    const char*         config,
+    unsigned long       duration_s,
+    int                 use_lock,
+    int                 verbose)
+{
+    struct sigaction sa;
+    struct i2c_mon_stats stats;
+    struct i2c_bus* bus = NULL;
+    struct i2c_mon* mon = NULL;
+
+    bus = i2c_bus_open(bus_spec);
+    if(!bus) {
+        printf("Unable to open bus %s (errno: %d)\n", bus_spec, errno);
+        return 1;
+    }
 
-                /* Wait between bytes - we could be talking to an eeprom and we
-                 * get a NACK if it is busy committing data to the device */
-                usleep(6000);
-            }
-        } else if(offset_len == 1) {
-            /* 1 byte offset - we use write byte commands, which send the offset
-             * and then a byte of data, so we increment the offset for each byte
-             * we write */
-            unsigned char dev_offset = wr_data[0];
-
-            uint32_t this_len = SMBUS_MAX_BLOCK_LEN;
-            uint8_t block_buffer[SMBUS_MAX_BLOCK_LEN+1] = {0};
-
-            while(offset < (wr_count - offset_len)) {
-                struct i2c_smbus_ioctl_data smb;
-
-                if((offset + SMBUS_MAX_BLOCK_LEN) > (wr_count - offset_len)) {
-                    this_len = (wr_count - offset_len) - offset;
-                } else {
-                    this_len = SMBUS_MAX_BLOCK_LEN;
-                }
+    if(check_lock(bus, use_lock) < 0) {
+        i2c_bus_close(bus);
+        return 1;
+    }
 
-                block_buffer[0] = this_len;
-                memcpy(&block_buffer[1], &wr_data[offset_len + offset], this_len);
+    mon = i2c_mon_create(bus);
+    if(!mon) {
+        printf("Unable to create the monitor (errno: %d)\n", errno);
+        return 1;
+    }
 
-                smb.read_write = I2C_SMBUS_WRITE;
-                smb.command = dev_offset;
-                smb.size = I2C_SMBUS_I2C_BLOCK_DATA;
-                smb.data = block_buffer;
+    if(i2c_mon_load(mon, config) < 0) {
+        printf("Unable to load monitor config %s (errno: %d)\n", config, errno);
+        return 1;
+    }
 
-                ret = ioctl(bus, I2C_SMBUS, &smb);
-                if(ret < 0) {
-                    printf("Failed to perform smbus byte read\n");
-                    return -1;
-                }
+    /* No SA_RESTART, so a signal also cuts short the wait for the next
+     * poll */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = mon_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
 
-                offset += this_len;
-                dev_offset += this_len;
+    i2c_mon_run(mon, duration_s * 1000000000ull, &mon_stop, mon_event, NULL);
 
-                /* Wait between bytes - we could be talking to an eeprom and we
-                 * get a NACK if it is busy committing data to the device */
-                usleep(6000);
-            }
-        } else if(offset_len == 2) {
-            /* 2 byte offset - we use write word commands, which send the msb of
-             * the offset and then 2 bytes of data which is made up of the lsb
-             * of the offset, followed by the byte we're writing. We increment
-             * the offset for each byte we write */
-            unsigned short dev_offset = wr_data[0] << 8 | wr_data[1];
-
-            uint32_t this_len = SMBUS_MAX_BLOCK_LEN;
-            uint8_t block_buffer[SMBUS_MAX_BLOCK_LEN + 1] = {0};
-
-            while(offset < (wr_count - offset_len)) {
-                struct i2c_smbus_ioctl_data smb;
-
-                if((offset + (SMBUS_MAX_BLOCK_LEN - 1)) > (wr_count - offset_len)) {
-                    this_len = (wr_count - offset_len) - offset;
-                } else {
-                    this_len = SMBUS_MAX_BLOCK_LEN-1;
-                }
+    if(verbose) {
+        i2c_mon_get_stats(mon, &stats);
+        printf("Monitor: %lu polls (%lu fast), %lu errors, %lu events\n",
+               stats.polls, stats.fast_polls, stats.errors, stats.events);
+    }
 
-                block_buffer[0] = this_len + 1;
-                block_buffer[1] = dev_offset & 0xff;
-                memcpy(&block_buffer[2], &wr_data[offset + offset_len], this_len);
+    i2c_mon_destroy(mon);
+    i2c_bus_close(bus);
+
+    return 0;
+}
 
-                smb.read_write = I2C_SMBUS_WRITE;
-                smb.command = dev_offset >> 8;
-                smb.size = I2C_SMBUS_I2C_BLOCK_DATA;
-                smb.data = block_buffer;
+static int crc_read(
+    struct i2c_bus*     bus,
+    unsigned short      addr,
+    unsigned int        offset_len,
+    unsigned long       offset,
+    unsigned long       count,
+    enum crc_type       type,
+    uint32_t*           crc)
+{
+    uint8_t wr_data[I2C_XFER_MAX_OFFSET_LEN] = {0};
+    uint8_t* buf = NULL;
+    unsigned long pos = 0;
+    unsigned long this_len = 0;
+    int ret = 0;
 
-                ret = ioctl(bus, I2C_SMBUS, &smb);
-                if(ret < 0) {
-                    printf("Failed to perform smbus byte read\n");
-                    return -1;
-                }
+    buf = malloc(count < CRC_CHUNK_LEN ? count : CRC_CHUNK_LEN);
+    if(!buf) {
+        return -1;
+    }
 
-                offset += this_len;
-                dev_offset += this_len;
+    *crc = 0;
 
-                /* Wait between bytes - we could be talking to an eeprom and we
-                 * get a NACK if it is busy committing data to the device */
-                usleep(6000);
-            }
-        } else {
-            printf("Unsupported I2C operation for smbus emulation\n");
-            return -1;
+    /* Hold the lock throughout so that plain reads without an offset carry
+     * on from where the previous chunk stopped */
+    if(i2c_bus_lock(bus) < 0) {
+        free(buf);
+        return -1;
+    }
+
+    while(pos < count) {
+        this_len = count - pos;
+        if(this_len > CRC_CHUNK_LEN) {
+            this_len = CRC_CHUNK_LEN;
+        }
+
+        i2c_xfer_put_offset(wr_data, offset + pos, offset_len);
+        ret = i2c_xfer(bus, addr, I2C_XFER_AUTO, offset_len,
+                       offset_len ? wr_data : NULL, offset_len,
+                       buf, this_len);
+        if(ret < 0) {
+            break;
         }
+
+        *crc = crc_update(type, *crc, buf, this_len);
+        pos += this_len;
+    }
+
+    i2c_bus_unlock(bus);
+    free(buf);
+
+    return ret;
+}
+
+/**
+ * @brief Disable the bus lock if asked to, otherwise take it once up front so
+ *        that a lock file that can't be opened is reported as such rather
+ *        than as a failed transfer
+ */
+static int check_lock(
+    struct i2c_bus*     bus,
+    int                 use_lock)
+{
+    if(!use_lock) {
+        i2c_bus_set_locking(bus, 0);
+        return 0;
     }
 
+    if(i2c_bus_lock(bus) < 0) {
+        printf("Unable to open the bus lock file (errno: %d), set I2C_LOCK_DIR or use "
+               "-L to run unlocked\n", errno);
+        return -1;
+    }
+
+    i2c_bus_unlock(bus);
+
     return 0;
 }
@@ -0,0 +1,442 @@
+/**
+ * Asynchronous I2C request queue with a worker thread per adapter
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "i2c_async.h"
+#include "i2c_bus.h"
+
+struct i2c_async_bus {
+    struct i2c_async*       ctx;
+    struct i2c_bus*         bus;
+    unsigned long           funcs;
+    /** Set once the adapter has rejected a coalesced transaction, e.g.
+     *  because its quirks limit the number of messages */
+    int                     no_coalesce;
+    pthread_t               thread;
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;
+    /** Queued operations, oldest first */
+    struct i2c_async_op*    head;
+    struct i2c_async_op*    tail;
+    int                     stop;
+    struct i2c_async_bus*   next;
+};
+
+struct i2c_async {
+    struct i2c_async_bus*   buses;
+    int                     efd;
+    pthread_mutex_t         lock;
+    /** Completed operations waiting to be reaped, oldest first */
+    struct i2c_async_op*    done_head;
+    struct i2c_async_op*    done_tail;
+};
+
+static void* worker(
+    void*                   arg);
+
+static unsigned int op_msgs(
+    struct i2c_async_op*    op);
+
+static int op_can_coalesce(
+    struct i2c_async_bus*   abus,
+    struct i2c_async_op*    op);
+
+static void run_batch(
+    struct i2c_async_bus*   abus,
+    struct i2c_async_op*    batch);
+
+static void complete(
+    struct i2c_async*       ctx,
+    struct i2c_async_op*    op,
+    int                     result);
+
+struct i2c_async* i2c_async_create(
+    void)
+{
+    struct i2c_async* ctx = NULL;
+
+    ctx = calloc(1, sizeof(*ctx));
+    if(!ctx) {
+        return NULL;
+    }
+
+    ctx->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(ctx->efd < 0) {
+        free(ctx);
+        return NULL;
+    }
+
+    pthread_mutex_init(&ctx->lock, NULL);
+
+    return ctx;
+}
+
+struct i2c_async_bus* i2c_async_open_bus(
+    struct i2c_async*       ctx,
+    const char*             spec)
+{
+    struct i2c_async_bus* abus = NULL;
+    int ret = 0;
+
+    abus = calloc(1, sizeof(*abus));
+    if(!abus) {
+        return NULL;
+    }
+
+    abus->ctx = ctx;
+    abus->bus = i2c_bus_open(spec);
+    if(!abus->bus) {
+        free(abus);
+        return NULL;
+    }
+
+    if(i2c_bus_ioctl(abus->bus, I2C_FUNCS, &abus->funcs) < 0) {
+        abus->funcs = 0;
+    }
+
+    pthread_mutex_init(&abus->lock, NULL);
+    pthread_cond_init(&abus->cond, NULL);
+
+    ret = pthread_create(&abus->thread, NULL, worker, abus);
+    if(ret != 0) {
+        i2c_bus_close(abus->bus);
+        free(abus);
+        errno = ret;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    abus->next = ctx->buses;
+    ctx->buses = abus;
+    pthread_mutex_unlock(&ctx->lock);
+
+    return abus;
+}
+
+int i2c_async_submit(
+    struct i2c_async_bus*   abus,
+    struct i2c_async_op*    op)
+{
+    if(!abus || !op) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    op->next = NULL;
+    op->result = 0;
+
+    pthread_mutex_lock(&abus->lock);
+
+    if(abus->stop) {
+        pthread_mutex_unlock(&abus->lock);
+        errno = ESHUTDOWN;
+        return -1;
+    }
+
+    if(abus->tail) {
+        abus->tail->next = op;
+    } else {
+        abus->head = op;
+    }
+    abus->tail = op;
+
+    pthread_cond_signal(&abus->cond);
+    pthread_mutex_unlock(&abus->lock);
+
+    return 0;
+}
+
+int i2c_async_eventfd(
+    struct i2c_async*       ctx)
+{
+    return ctx->efd;
+}
+
+struct i2c_async_op* i2c_async_reap(
+    struct i2c_async*       ctx)
+{
+    struct i2c_async_op* op = NULL;
+    uint64_t count = 0;
+
+    pthread_mutex_lock(&ctx->lock);
+
+    op = ctx->done_head;
+    if(op) {
+        ctx->done_head = op->next;
+        if(!ctx->done_head) {
+            ctx->done_tail = NULL;
+        }
+        op->next = NULL;
+    }
+
+    /* Clear the eventfd once everything has been reaped. This is done under
+     * the lock so that it can't swallow the signal for a new completion */
+    if(!ctx->done_head) {
+        if(read(ctx->efd, &count, sizeof(count)) < 0) {
+            /* Nothing to clear */
+        }
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    return op;
+}
+
+struct i2c_bus* i2c_async_get_bus(
+    struct i2c_async_bus*   abus)
+{
+    return abus->bus;
+}
+
+void i2c_async_destroy(
+    struct i2c_async*       ctx)
+{
+    struct i2c_async_bus* abus = NULL;
+    struct i2c_async_bus* next = NULL;
+
+    if(!ctx) {
+        return;
+    }
+
+    for(abus = ctx->buses; abus; abus = abus->next) {
+        pthread_mutex_lock(&abus->lock);
+        abus->stop = 1;
+        pthread_cond_signal(&abus->cond);
+        pthread_mutex_unlock(&abus->lock);
+    }
+
+    for(abus = ctx->buses; abus; abus = next) {
+        next = abus->next;
+        pthread_join(abus->thread, NULL);
+        pthread_mutex_destroy(&abus->lock);
+        pthread_cond_destroy(&abus->cond);
+        i2c_bus_close(abus->bus);
+        free(abus);
+    }
+
+    close(ctx->efd);
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+}
+
+static void* worker(
+    void*                   arg)
+{
+    struct i2c_async_bus* abus = arg;
+    struct i2c_async_op* batch = NULL;
+    struct i2c_async_op* last = NULL;
+    unsigned int nmsgs = 0;
+
+    for(;;) {
+        pthread_mutex_lock(&abus->lock);
+
+        while(!abus->head && !abus->stop) {
+            pthread_cond_wait(&abus->cond, &abus->lock);
+        }
+
+        if(!abus->head) {
+            /* Stopping and everything has been drained */
+            pthread_mutex_unlock(&abus->lock);
+            break;
+        }
+
+        /* Take as many reads of the same device as fit in one transaction,
+         * so that a device that NACKs only fails its own operations.
+         * Operations that write data are never coalesced, so they run alone
+         * and end with a STOP */
+        batch = abus->head;
+        last = batch;
+        nmsgs = op_msgs(batch);
+
+        if(op_can_coalesce(abus, batch)) {
+            while(last->next &&
+                  last->next->addr == batch->addr &&
+                  op_can_coalesce(abus, last->next) &&
+                  nmsgs + op_msgs(last->next) <= I2C_RDWR_IOCTL_MAX_MSGS) {
+                last = last->next;
+                nmsgs += op_msgs(last);
+            }
+        }
+
+        abus->head = last->next;
+        if(!abus->head) {
+            abus->tail = NULL;
+        }
+        last->next = NULL;
+
+        pthread_mutex_unlock(&abus->lock);
+
+        run_batch(abus, batch);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Get the number of I2C_RDWR messages an operation needs
+ */
+static unsigned int op_msgs(
+    struct i2c_async_op*    op)
+{
+    return (op->wr_data && op->wr_count ? 1 : 0) +
+           (op->rd_data && op->rd_count ? 1 : 0);
+}
+
+/**
+ * @brief Check whether an operation is a read (an optional offset write then
+ *        a read) that can go in a batch with others
+ */
+static int op_can_coalesce(
+    struct i2c_async_bus*   abus,
+    struct i2c_async_op*    op)
+{
+    return !abus->no_coalesce &&
+           (abus->funcs & I2C_FUNC_I2C) &&
+           (op->method == I2C_XFER_AUTO || op->method == I2C_XFER_RDWR) &&
+           op->offset_len <= I2C_XFER_MAX_OFFSET_LEN &&
+           (!(op->addr & I2C_ADDR_TEN) || (abus->funcs & I2C_FUNC_10BIT_ADDR)) &&
+           op->wr_count == op->offset_len &&
+           op->rd_data && op->rd_count &&
+           op->rd_count <= I2C_XFER_MAX_MSG_LEN;
+}
+
+static void run_batch(
+    struct i2c_async_bus*   abus,
+    struct i2c_async_op*    batch)
+{
+    struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+    struct i2c_rdwr_ioctl_data ioctl_data = {0};
+    struct i2c_async_op* op = NULL;
+    struct i2c_async_op* next = NULL;
+    unsigned int nmsgs = 0;
+    int ret = 0;
+
+    if(!batch->next) {
+        /* Nothing to coalesce with, run it as it is */
+        ret = i2c_xfer(abus->bus, batch->addr, batch->method, batch->offset_len,
+                       batch->wr_data, batch->wr_count,
+                       batch->rd_data, batch->rd_count);
+        complete(abus->ctx, batch, ret < 0 ? -errno : 0);
+        return;
+    }
+
+    for(op = batch; op; op = op->next) {
+        unsigned short flags = (op->addr & I2C_ADDR_TEN) ? I2C_M_TEN : 0;
+
+        if(op->wr_data && op->wr_count) {
+            msgs[nmsgs].addr = op->addr & ~I2C_ADDR_TEN;
+            msgs[nmsgs].flags = flags;
+            msgs[nmsgs].len = op->wr_count;
+            msgs[nmsgs].buf = (uint8_t*)op->wr_data;
+            ++nmsgs;
+        }
+
+        if(op->rd_data && op->rd_count) {
+            msgs[nmsgs].addr = op->addr & ~I2C_ADDR_TEN;
+            msgs[nmsgs].flags = flags | I2C_M_RD;
+            msgs[nmsgs].len = op->rd_count;
+            msgs[nmsgs].buf = op->rd_data;
+            ++nmsgs;
+        }
+    }
+
+    ioctl_data.msgs = msgs;
+    ioctl_data.nmsgs = nmsgs;
+
+    ret = i2c_bus_lock(abus->bus);
+    if(ret == 0) {
+        ret = i2c_bus_ioctl(abus->bus, I2C_RDWR, &ioctl_data);
+        if(ret < 0) {
+            ret = -errno;
+        }
+        i2c_bus_unlock(abus->bus);
+    } else {
+        ret = -errno;
+    }
+
+    if(ret == -EOPNOTSUPP) {
+        /* The adapter's quirks (a message limit, or write-then-read pairs
+         * only) rejected the batch. They are checked before anything goes
+         * on the wire, so the operations can safely run one by one, and
+         * later ones aren't coalesced on this adapter */
+        abus->no_coalesce = 1;
+
+        for(op = batch; op; op = next) {
+            next = op->next;
+            ret = i2c_xfer(abus->bus, op->addr, op->method, op->offset_len,
+                           op->wr_data, op->wr_count,
+                           op->rd_data, op->rd_count);
+            complete(abus->ctx, op, ret < 0 ? -errno : 0);
+        }
+        return;
+    }
+
+    /* There's no telling which message failed, and the ones before it have
+     * already been performed, so the whole batch fails together rather than
+     * repeating reads that may have side effects */
+    for(op = batch; op; op = next) {
+        next = op->next;
+        complete(abus->ctx, op, ret < 0 ? ret : 0);
+    }
+}
+
+static void complete(
+    struct i2c_async*       ctx,
+    struct i2c_async_op*    op,
+    int                     result)
+{
+    uint64_t one = 1;
+
+    op->result = result;
+    op->next = NULL;
+
+    if(op->callback) {
+        op->callback(op);
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+
+    if(ctx->done_tail) {
+        ctx->done_tail->next = op;
+    } else {
+        ctx->done_head = op;
+    }
+    ctx->done_tail = op;
+
+    if(write(ctx->efd, &one, sizeof(one)) < 0) {
+        /* The counter can't realistically overflow */
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+}
@@ -0,0 +1,151 @@
+/**
+ * Asynchronous I2C request queue with a worker thread per adapter
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef I2C_ASYNC_H
+#define I2C_ASYNC_H
+
+#include <stdint.h>
+
+#include "i2c_xfer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** An asynchronous I2C context, owning one worker thread per adapter */
+struct i2c_async;
+
+/** An adapter opened within an asynchronous context */
+struct i2c_async_bus;
+
+struct i2c_async_op;
+
+/** Completion callback, called on the adapter's worker thread */
+typedef void (*i2c_async_cb)(struct i2c_async_op* op);
+
+/**
+ * A queued operation. The caller owns the structure and the data buffers,
+ * which must stay valid until the operation completes. The request fields
+ * have the same meaning as the arguments of i2c_xfer().
+ */
+struct i2c_async_op {
+    /* Request */
+    unsigned short          addr;
+    enum i2c_xfer_method    method;
+    unsigned int            offset_len;
+    const uint8_t*          wr_data;
+    unsigned long           wr_count;
+    uint8_t*                rd_data;
+    unsigned long           rd_count;
+
+    /** Called on completion if set, otherwise the operation is put on the
+     *  context's completion queue */
+    i2c_async_cb            callback;
+    /** Caller data, not touched by the queue */
+    void*                   user;
+
+    /* Completion */
+    /** 0 on success or a negative errno value */
+    int                     result;
+
+    /* Internal */
+    struct i2c_async_op*    next;
+};
+
+/**
+ * @brief Create an asynchronous context
+ *
+ * @return The context, or NULL on failure with errno set
+ */
+struct i2c_async* i2c_async_create(
+    void);
+
+/**
+ * @brief Open an adapter and start its worker thread
+ *
+ * @param spec - The bus, as accepted by i2c_bus_open()
+ *
+ * @return The adapter, or NULL on failure with errno set
+ */
+struct i2c_async_bus* i2c_async_open_bus(
+    struct i2c_async*       ctx,
+    const char*             spec);
+
+/**
+ * @brief Queue an operation on an adapter. Never blocks on the bus
+ *
+ * Operations queued on the same adapter complete in submission order. When
+ * the adapter supports plain I2C, consecutive queued operations on the same
+ * address are coalesced into a single I2C_RDWR transaction (up to the i2c-dev
+ * limit of I2C_RDWR_IOCTL_MAX_MSGS messages). Only reads (an offset write
+ * followed by a read) are coalesced; an operation that writes data always
+ * runs as its own transaction, so that devices such as EEPROMs see the STOP
+ * they need to commit the write. If a coalesced transaction fails, every
+ * operation in it completes with that transaction's error. They aren't
+ * retried, as some messages may already have reached the device and
+ * repeating a read can have side effects (FIFOs, clear on read status). The
+ * exception is EOPNOTSUPP, which adapters with quirks (a message limit, or
+ * write-then-read pairs only) return before touching the bus: the
+ * operations then run one at a time and coalescing is turned off for the
+ * adapter.
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int i2c_async_submit(
+    struct i2c_async_bus*   bus,
+    struct i2c_async_op*    op);
+
+/**
+ * @brief Get an eventfd that is readable while completed operations without
+ *        a callback are waiting to be reaped, for use with poll/epoll
+ */
+int i2c_async_eventfd(
+    struct i2c_async*       ctx);
+
+/**
+ * @brief Take the oldest completed operation off the completion queue
+ *
+ * @return The operation, or NULL if none have completed
+ */
+struct i2c_async_op* i2c_async_reap(
+    struct i2c_async*       ctx);
+
+/**
+ * @brief Get the underlying bus of an adapter, e.g. for its lock statistics.
+ *        It must not be used for transfers while the worker is running
+ */
+struct i2c_bus* i2c_async_get_bus(
+    struct i2c_async_bus*   bus);
+
+/**
+ * @brief Finish all queued operations, stop the workers and free the context
+ *        and its adapters
+ */
+void i2c_async_destroy(
+    struct i2c_async*       ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* I2C_ASYNC_H */
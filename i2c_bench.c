@@ -0,0 +1,680 @@
+/**
+ * I2C throughput and latency benchmark
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "i2c_async.h"
+#include "i2c_bus.h"
+#include "i2c_sim.h"
+#include "i2c_xfer.h"
+
+#define DEFAULT_ITERATIONS              100
+#define DEFAULT_SIZES                   "1,32,256,4096"
+#define MAX_SIZES                       16
+#define MAX_ASYNC_BUSES                 16
+#define MAX_ASYNC_DEPTH                 256
+
+/** Results of benchmarking one method at one transfer size */
+struct bench_result {
+    int             valid;
+    double          ops_per_sec;
+    double          bytes_per_sec;
+    double          p50_us;
+    double          p90_us;
+    double          p99_us;
+    double          max_us;
+};
+
+/** State of one adapter in the asynchronous benchmark */
+struct async_bench_bus {
+    const char*             spec;
+    struct i2c_async_bus*   abus;
+    /** The data read before the benchmark, which every read must match */
+    uint8_t*                ref;
+    unsigned long           submitted;
+    unsigned long           completed;
+    unsigned long           transactions;
+    uint64_t                elapsed_ns;
+};
+
+static void print_usage(
+    void);
+
+static int parse_sizes(
+    const char*         list,
+    unsigned long*      sizes,
+    int                 max_sizes);
+
+static int run_bench(
+    struct i2c_bus*         bus,
+    unsigned short          addr,
+    enum i2c_xfer_method    method,
+    unsigned int            offset_len,
+    unsigned long           offset,
+    unsigned long           size,
+    unsigned long           iterations,
+    struct bench_result*    result);
+
+static int run_async_bench(
+    struct async_bench_bus* buses,
+    int                     num_buses,
+    unsigned short          addr,
+    unsigned int            offset_len,
+    unsigned long           offset,
+    unsigned long           size,
+    unsigned long           iterations,
+    unsigned long           depth);
+
+static int async_run(
+    struct i2c_async*       ctx,
+    struct i2c_async_op*    ops,
+    unsigned long           num_ops,
+    unsigned long           iterations,
+    unsigned long           size,
+    int                     check,
+    uint64_t                start);
+
+static unsigned long bus_transactions(
+    struct i2c_bus*         bus);
+
+static uint64_t monotonic_ns(
+    void);
+
+int main(int argc, char* argv[])
+{
+    struct i2c_bus* bus = NULL;
+    unsigned long addr = 0;
+    unsigned long iterations = DEFAULT_ITERATIONS;
+    unsigned long offset_len = 1;
+    unsigned long offset = 0;
+    unsigned long sizes[MAX_SIZES] = {0};
+    unsigned long depth = 0;
+    struct async_bench_bus buses[MAX_ASYNC_BUSES];
+    int num_buses = 0;
+    int num_sizes = 0;
+    int methods[I2C_XFER_NUM_METHODS] = {0};
+    struct bench_result results[MAX_SIZES][I2C_XFER_NUM_METHODS];
+    unsigned long funcs = 0;
+    char* list = NULL;
+    char* save = NULL;
+    char* tok = NULL;
+    int method = 0;
+    int best = 0;
+    int opt = 0;
+    int s = 0;
+
+    num_sizes = parse_sizes(DEFAULT_SIZES, sizes, MAX_SIZES);
+    for(method = I2C_XFER_RDWR; method < I2C_XFER_NUM_METHODS; ++method) {
+        methods[method] = 1;
+    }
+
+    while((opt = getopt(argc, argv, "n:s:o:O:m:a:h")) != -1) {
+        switch(opt) {
+            case 'n':
+                iterations = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                num_sizes = parse_sizes(optarg, sizes, MAX_SIZES);
+                if(num_sizes <= 0) {
+                    printf("Invalid size list: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'o':
+                offset_len = strtoul(optarg, NULL, 0);
+                break;
+            case 'O':
+                offset = strtoul(optarg, NULL, 0);
+                break;
+            case 'm':
+                memset(methods, 0, sizeof(methods));
+                list = strdup(optarg);
+                for(tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+                    method = i2c_xfer_method_parse(tok);
+                    if(method <= I2C_XFER_AUTO) {
+                        printf("Unknown transfer method: %s\n", tok);
+                        return 1;
+                    }
+                    methods[method] = 1;
+                }
+                free(list);
+                break;
+            case 'a':
+                depth = strtoul(optarg, NULL, 0);
+                if(!depth || depth > MAX_ASYNC_DEPTH) {
+                    printf("Invalid queue depth: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                print_usage();
+                return 1;
+        }
+    }
+
+    if(argc - optind < 2) {
+        printf("Not enough arguments\n");
+        print_usage();
+        return 1;
+    }
+
+    if(offset_len > I2C_XFER_MAX_OFFSET_LEN || !iterations) {
+        printf("Invalid offset length or iteration count\n");
+        return 1;
+    }
+
+    addr = strtoul(argv[optind + 1], NULL, 0);
+    if(addr > 0x3ff) {
+        printf("Invalid address 0x%lx\n", addr);
+        return 1;
+    }
+
+    /* Addresses above the 7-bit range must be 10-bit ones */
+    if(addr > 0x7f) {
+        addr |= I2C_ADDR_TEN;
+    }
+
+    if(depth) {
+        /* The bus and any further adapters given after the address */
+        memset(buses, 0, sizeof(buses));
+        buses[num_buses++].spec = argv[optind];
+        for(s = optind + 2; s < argc && num_buses < MAX_ASYNC_BUSES; ++s) {
+            buses[num_buses++].spec = argv[s];
+        }
+
+        printf("Address 0x%02lx, %lu bit offset 0x%lx, %lu reads per adapter, "
+               "%lu queued per adapter, wall clock\n",
+               addr & ~I2C_ADDR_TEN, offset_len * 8, offset, iterations, depth);
+        printf("\n");
+        printf("%-8s %-40s %10s %12s %12s\n",
+               "size", "bus", "ops/s", "bytes/s", "transactions");
+
+        for(s = 0; s < num_sizes; ++s) {
+            if(run_async_bench(buses, num_buses, addr, offset_len, offset,
+                               sizes[s], iterations, depth) < 0) {
+                printf("%-8lu failed (errno: %d)\n", sizes[s], errno);
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    bus = i2c_bus_open(argv[optind]);
+    if(!bus) {
+        printf("Unable to open bus %s (errno: %d)\n", argv[optind], errno);
+        return 1;
+    }
+
+    if(i2c_bus_ioctl(bus, I2C_FUNCS, &funcs) < 0) {
+        printf("Unable to retrieve I2C function support flags\n");
+        return 1;
+    }
+
+    printf("Bus %s, address 0x%02lx, %lu bit offset 0x%lx, %lu iterations%s\n",
+           bus->name, addr & ~I2C_ADDR_TEN, offset_len * 8, offset, iterations,
+           i2c_sim_is_sim(bus) ? " (simulated, virtual time)" : "");
+    printf("\n");
+    printf("%-8s %-12s %10s %12s %10s %10s %10s %10s\n",
+           "size", "method", "ops/s", "bytes/s", "p50(us)", "p90(us)", "p99(us)", "max(us)");
+
+    for(s = 0; s < num_sizes; ++s) {
+        for(method = I2C_XFER_RDWR; method < I2C_XFER_NUM_METHODS; ++method) {
+            struct bench_result* res = &results[s][method];
+
+            memset(res, 0, sizeof(*res));
+
+            if(!methods[method] || !i2c_xfer_supported(funcs, method, offset_len, 1)) {
+                continue;
+            }
+
+            if(run_bench(bus, addr, method, offset_len, offset, sizes[s],
+                         iterations, res) < 0) {
+                printf("%-8lu %-12s failed (errno: %d)\n",
+                       sizes[s], i2c_xfer_method_name(method), errno);
+                continue;
+            }
+
+            printf("%-8lu %-12s %10.0f %12.0f %10.1f %10.1f %10.1f %10.1f\n",
+                   sizes[s], i2c_xfer_method_name(method),
+                   res->ops_per_sec, res->bytes_per_sec,
+                   res->p50_us, res->p90_us, res->p99_us, res->max_us);
+        }
+    }
+
+    printf("\n");
+    printf("Fastest method by size:\n");
+    for(s = 0; s < num_sizes; ++s) {
+        best = -1;
+        for(method = I2C_XFER_RDWR; method < I2C_XFER_NUM_METHODS; ++method) {
+            if(results[s][method].valid &&
+               (best < 0 || results[s][method].ops_per_sec > results[s][best].ops_per_sec)) {
+                best = method;
+            }
+        }
+
+        if(best < 0) {
+            printf("    %-8lu none\n", sizes[s]);
+        } else {
+            printf("    %-8lu %s\n", sizes[s], i2c_xfer_method_name(best));
+        }
+    }
+
+    printf("\n");
+    printf("Bus lock: %lu acquisitions, %lu contended, %llu us total wait, %llu us max wait\n",
+           bus->lock_stats.acquisitions,
+           bus->lock_stats.contended,
+           (unsigned long long)(bus->lock_stats.wait_ns_total / 1000),
+           (unsigned long long)(bus->lock_stats.wait_ns_max / 1000));
+
+    i2c_bus_close(bus);
+
+    return 0;
+}
+
+static void print_usage(
+    void)
+{
+    printf("I2C throughput and latency benchmark\n");
+    printf("Usage:\n");
+    printf("    ./i2c_bench [options] <bus> <addr> [bus...]\n");
+    printf("\n");
+    printf("Where:\n");
+    printf("    bus     - The adapter number, or sim[:options] for the simulated\n");
+    printf("              adapter\n");
+    printf("    addr    - The address of the device to read from (10-bit if\n");
+    printf("              above 0x7f)\n");
+    printf("\n");
+    printf("Options:\n");
+    printf("    -n <count>      - Iterations per size and method (default %d)\n", DEFAULT_ITERATIONS);
+    printf("    -s <sizes>      - Comma separated read sizes in bytes (default %s)\n", DEFAULT_SIZES);
+    printf("    -o <len>        - Offset length in bytes, 0 to 4 (default 1)\n");
+    printf("    -O <offset>     - The offset to read from (default 0)\n");
+    printf("    -m <methods>    - Comma separated methods to compare, any of rdwr,\n");
+    printf("                      smbus-byte and smbus-block (default all the\n");
+    printf("                      adapter supports)\n");
+    printf("    -a <depth>      - Benchmark the asynchronous queue instead, keeping\n");
+    printf("                      depth reads queued on each adapter. Any further\n");
+    printf("                      buses are run at the same time and every read\n");
+    printf("                      is checked against a reference read\n");
+    printf("\n");
+    printf("Only reads are performed, so the benchmark is safe to run against\n");
+    printf("devices in service.\n");
+}
+
+static int parse_sizes(
+    const char*         list,
+    unsigned long*      sizes,
+    int                 max_sizes)
+{
+    const char* p = list;
+    char* end = NULL;
+    int count = 0;
+
+    while(*p && count < max_sizes) {
+        sizes[count] = strtoul(p, &end, 0);
+        if(end == p || !sizes[count]) {
+            return -1;
+        }
+        ++count;
+
+        p = end;
+        if(*p == ',') {
+            ++p;
+        } else if(*p) {
+            return -1;
+        }
+    }
+
+    return count;
+}
+
+static int compare_u64(
+    const void*         a,
+    const void*         b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(
+    const uint64_t*     sorted,
+    unsigned long       count,
+    unsigned int        pct)
+{
+    unsigned long idx = (count * pct + 99) / 100;
+
+    if(idx) {
+        --idx;
+    }
+
+    return sorted[idx] / 1000.0;
+}
+
+static int run_bench(
+    struct i2c_bus*         bus,
+    unsigned short          addr,
+    enum i2c_xfer_method    method,
+    unsigned int            offset_len,
+    unsigned long           offset,
+    unsigned long           size,
+    unsigned long           iterations,
+    struct bench_result*    result)
+{
+    uint8_t wr_data[I2C_XFER_MAX_OFFSET_LEN] = {0};
+    uint8_t* rd_data = NULL;
+    uint64_t* latency = NULL;
+    uint64_t start = 0;
+    uint64_t total = 0;
+    unsigned long i = 0;
+    int ret = 0;
+
+    i2c_xfer_put_offset(wr_data, offset, offset_len);
+
+    rd_data = malloc(size);
+    latency = calloc(iterations, sizeof(*latency));
+    if(!rd_data || !latency) {
+        free(rd_data);
+        free(latency);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* One untimed transfer to warm up the adapter and check it works */
+    ret = i2c_xfer(bus, addr, method, offset_len, wr_data, offset_len, rd_data, size);
+
+    for(i = 0; i < iterations && ret == 0; ++i) {
+        start = i2c_bus_time_ns(bus);
+        ret = i2c_xfer(bus, addr, method, offset_len, wr_data, offset_len, rd_data, size);
+        latency[i] = i2c_bus_time_ns(bus) - start;
+        total += latency[i];
+    }
+
+    if(ret == 0) {
+        qsort(latency, iterations, sizeof(*latency), compare_u64);
+
+        result->valid = 1;
+        result->ops_per_sec = total ? iterations * 1e9 / total : 0;
+        result->bytes_per_sec = result->ops_per_sec * size;
+        result->p50_us = percentile_us(latency, iterations, 50);
+        result->p90_us = percentile_us(latency, iterations, 90);
+        result->p99_us = percentile_us(latency, iterations, 99);
+        result->max_us = latency[iterations - 1] / 1000.0;
+    }
+
+    free(rd_data);
+    free(latency);
+
+    return ret;
+}
+
+static int run_async_bench(
+    struct async_bench_bus* buses,
+    int                     num_buses,
+    unsigned short          addr,
+    unsigned int            offset_len,
+    unsigned long           offset,
+    unsigned long           size,
+    unsigned long           iterations,
+    unsigned long           depth)
+{
+    uint8_t wr_data[I2C_XFER_MAX_OFFSET_LEN] = {0};
+    struct i2c_async_op ref_ops[MAX_ASYNC_BUSES];
+    struct i2c_async* ctx = NULL;
+    struct i2c_async_op* ops = NULL;
+    struct async_bench_bus* b = NULL;
+    uint8_t* data = NULL;
+    unsigned long num_ops = num_buses * depth;
+    unsigned long i = 0;
+    uint64_t start = 0;
+    uint64_t elapsed = 0;
+    double ops_per_sec = 0;
+    int saved_errno = 0;
+    int ret = 0;
+    int n = 0;
+
+    i2c_xfer_put_offset(wr_data, offset, offset_len);
+
+    ctx = i2c_async_create();
+    ops = calloc(num_ops, sizeof(*ops));
+    data = malloc(num_ops * size);
+    if(!ctx || !ops || !data) {
+        ret = -1;
+    }
+
+    for(n = 0; n < num_buses && ret == 0; ++n) {
+        b = &buses[n];
+
+        b->ref = malloc(size);
+        b->abus = i2c_async_open_bus(ctx, b->spec);
+        if(!b->ref || !b->abus) {
+            printf("Unable to open bus %s (errno: %d)\n", b->spec, errno);
+            ret = -1;
+            break;
+        }
+
+        for(i = 0; i < depth; ++i) {
+            struct i2c_async_op* op = &ops[n * depth + i];
+
+            op->addr = addr;
+            op->method = I2C_XFER_AUTO;
+            op->offset_len = offset_len;
+            op->wr_data = wr_data;
+            op->wr_count = offset_len;
+            op->rd_data = &data[(n * depth + i) * size];
+            op->rd_count = size;
+            op->user = b;
+        }
+
+        ref_ops[n] = ops[n * depth];
+        ref_ops[n].rd_data = b->ref;
+    }
+
+    /* A reference read on each adapter, which every timed read must match.
+     * This also catches a missing device before anything is timed */
+    if(ret == 0) {
+        ret = async_run(ctx, ref_ops, num_buses, 1, size, 0, 0);
+    }
+
+    if(ret == 0) {
+        for(n = 0; n < num_buses; ++n) {
+            buses[n].transactions = bus_transactions(i2c_async_get_bus(buses[n].abus));
+        }
+
+        start = monotonic_ns();
+        ret = async_run(ctx, ops, num_ops, iterations, size, 1, start);
+        elapsed = monotonic_ns() - start;
+    }
+
+    if(ret == 0) {
+        for(n = 0; n < num_buses; ++n) {
+            b = &buses[n];
+            b->transactions = bus_transactions(i2c_async_get_bus(b->abus)) - b->transactions;
+            ops_per_sec = b->elapsed_ns ? iterations * 1e9 / b->elapsed_ns : 0;
+
+            printf("%-8lu %-40s %10.0f %12.0f %12lu\n",
+                   size, b->spec, ops_per_sec, ops_per_sec * size, b->transactions);
+        }
+
+        if(num_buses > 1) {
+            ops_per_sec = elapsed ? num_buses * iterations * 1e9 / elapsed : 0;
+
+            printf("%-8lu %-40s %10.0f %12.0f\n",
+                   size, "total", ops_per_sec, ops_per_sec * size);
+        }
+    }
+
+    saved_errno = errno;
+
+    /* Waits for anything still queued before the buffers are freed */
+    i2c_async_destroy(ctx);
+    for(n = 0; n < num_buses; ++n) {
+        free(buses[n].ref);
+        buses[n].ref = NULL;
+        buses[n].abus = NULL;
+    }
+    free(ops);
+    free(data);
+
+    errno = saved_errno;
+
+    return ret;
+}
+
+/**
+ * @brief Keep the operations queued on their adapters until each adapter has
+ *        completed iterations of them, recording when each one finished
+ *
+ * @param check - Non-zero to compare every read against the adapter's
+ *                reference read
+ * @param start - The time the run started, for the adapters' elapsed times
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+static int async_run(
+    struct i2c_async*       ctx,
+    struct i2c_async_op*    ops,
+    unsigned long           num_ops,
+    unsigned long           iterations,
+    unsigned long           size,
+    int                     check,
+    uint64_t                start)
+{
+    struct i2c_async_op* op = NULL;
+    struct async_bench_bus* b = NULL;
+    struct pollfd pfd = {0};
+    unsigned long pending = 0;
+    unsigned long i = 0;
+    int err = 0;
+    int ret = 0;
+
+    for(i = 0; i < num_ops; ++i) {
+        b = ops[i].user;
+        b->submitted = 0;
+        b->completed = 0;
+    }
+
+    for(i = 0; i < num_ops && ret == 0; ++i) {
+        b = ops[i].user;
+        if(b->submitted < iterations) {
+            ret = i2c_async_submit(b->abus, &ops[i]);
+            if(ret == 0) {
+                ++b->submitted;
+                ++pending;
+            } else {
+                err = errno;
+            }
+        }
+    }
+
+    pfd.fd = i2c_async_eventfd(ctx);
+    pfd.events = POLLIN;
+
+    /* Everything submitted must be reaped before returning, as the caller
+     * owns the operations */
+    while(pending) {
+        if(poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            return -1;
+        }
+
+        while((op = i2c_async_reap(ctx))) {
+            b = op->user;
+            --pending;
+
+            if(op->result < 0) {
+                if(ret == 0) {
+                    printf("Read from %s failed (errno: %d)\n", b->spec, -op->result);
+                    err = -op->result;
+                    ret = -1;
+                }
+                continue;
+            }
+
+            if(check && memcmp(op->rd_data, b->ref, size) != 0) {
+                if(ret == 0) {
+                    printf("Read from %s doesn't match the reference read\n", b->spec);
+                    err = EIO;
+                    ret = -1;
+                }
+                continue;
+            }
+
+            if(++b->completed == iterations) {
+                b->elapsed_ns = monotonic_ns() - start;
+            }
+
+            if(ret == 0 && b->submitted < iterations) {
+                if(i2c_async_submit(b->abus, op) < 0) {
+                    err = errno;
+                    ret = -1;
+                    continue;
+                }
+                ++b->submitted;
+                ++pending;
+            }
+        }
+    }
+
+    /* Reaping clears the eventfd, which leaves errno set */
+    errno = err;
+
+    return ret;
+}
+
+/**
+ * @brief Get the number of transactions an adapter has performed: the
+ *        simulated adapter counts them, otherwise each takes the bus lock
+ */
+static unsigned long bus_transactions(
+    struct i2c_bus*         bus)
+{
+    struct i2c_sim_stats stats;
+
+    if(i2c_sim_is_sim(bus)) {
+        i2c_sim_get_stats(bus, &stats);
+        return stats.transactions;
+    }
+
+    return bus->lock_stats.acquisitions;
+}
+
+static uint64_t monotonic_ns(
+    void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
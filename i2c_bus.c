@@ -0,0 +1,320 @@
+/**
+ * I2C bus abstraction for the userspace I2C utilities
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "i2c_bus.h"
+#include "i2c_sim.h"
+
+static int dev_ioctl(
+    struct i2c_bus*     bus,
+    unsigned long       request,
+    void*               arg);
+
+static void dev_delay(
+    struct i2c_bus*     bus,
+    unsigned long       usecs);
+
+static uint64_t dev_time_ns(
+    struct i2c_bus*     bus);
+
+static void dev_close(
+    struct i2c_bus*     bus);
+
+/** Directory for the bus lock files when $I2C_LOCK_DIR is not set. Every
+ *  process has to use the same one for the lock to exclude anything */
+#define LOCK_DIR_DEFAULT    "/run/lock"
+
+static int open_lock_file(
+    struct i2c_bus*     bus);
+
+static uint64_t monotonic_ns(
+    void);
+
+/** Backend for real adapters accessed through /dev/i2c-N */
+static const struct i2c_bus_ops dev_ops = {
+    .ioctl = dev_ioctl,
+    .delay = dev_delay,
+    .time_ns = dev_time_ns,
+    .close = dev_close,
+};
+
+struct i2c_bus* i2c_bus_open(
+    const char*         spec)
+{
+    struct i2c_bus* bus = NULL;
+    char path[32] = {0};
+    char* end = NULL;
+    unsigned long bus_no = 0;
+
+    if(!spec) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(strncmp(spec, "sim", 3) == 0 && (spec[3] == '\0' || spec[3] == ':')) {
+        return i2c_sim_open(spec[3] == ':' ? &spec[4] : NULL);
+    }
+
+    if(spec[0] == '/') {
+        snprintf(path, sizeof(path), "%s", spec);
+    } else {
+        bus_no = strtoul(spec, &end, 0);
+        if(end == spec || *end != '\0') {
+            errno = EINVAL;
+            return NULL;
+        }
+        snprintf(path, sizeof(path), "/dev/i2c-%lu", bus_no);
+    }
+
+    bus = calloc(1, sizeof(*bus));
+    if(!bus) {
+        return NULL;
+    }
+
+    bus->lock_fd = -1;
+    bus->fd = open(path, O_RDWR);
+    if(bus->fd < 0) {
+        free(bus);
+        return NULL;
+    }
+
+    bus->ops = &dev_ops;
+    snprintf(bus->name, sizeof(bus->name), "%s",
+             strncmp(path, "/dev/", 5) == 0 ? &path[5] : path);
+
+    return bus;
+}
+
+void i2c_bus_close(
+    struct i2c_bus*     bus)
+{
+    if(bus) {
+        if(bus->lock_fd >= 0) {
+            close(bus->lock_fd);
+        }
+        bus->ops->close(bus);
+    }
+}
+
+int i2c_bus_ioctl(
+    struct i2c_bus*     bus,
+    unsigned long       request,
+    void*               arg)
+{
+    return bus->ops->ioctl(bus, request, arg);
+}
+
+void i2c_bus_delay(
+    struct i2c_bus*     bus,
+    unsigned long       usecs)
+{
+    bus->ops->delay(bus, usecs);
+}
+
+uint64_t i2c_bus_time_ns(
+    struct i2c_bus*     bus)
+{
+    return bus->ops->time_ns(bus);
+}
+
+int i2c_bus_lock(
+    struct i2c_bus*     bus)
+{
+    uint64_t start = 0;
+    uint64_t wait = 0;
+    int ret = 0;
+
+    if(bus->lock_disabled) {
+        return 0;
+    }
+
+    if(bus->lock_depth++) {
+        /* Already held by us */
+        return 0;
+    }
+
+    if(bus->lock_fd < 0 && open_lock_file(bus) < 0) {
+        bus->lock_depth = 0;
+        return -1;
+    }
+
+    /* Only time the lock when it is actually contended */
+    if(flock(bus->lock_fd, LOCK_EX | LOCK_NB) == 0) {
+        bus->lock_stats.acquisitions++;
+        return 0;
+    }
+
+    if(errno != EWOULDBLOCK) {
+        bus->lock_depth = 0;
+        return -1;
+    }
+
+    bus->lock_stats.contended++;
+    start = monotonic_ns();
+
+    do {
+        ret = flock(bus->lock_fd, LOCK_EX);
+    } while(ret < 0 && errno == EINTR);
+
+    wait = monotonic_ns() - start;
+    bus->lock_stats.wait_ns_total += wait;
+    if(wait > bus->lock_stats.wait_ns_max) {
+        bus->lock_stats.wait_ns_max = wait;
+    }
+
+    if(ret < 0) {
+        bus->lock_depth = 0;
+        return -1;
+    }
+
+    bus->lock_stats.acquisitions++;
+
+    return 0;
+}
+
+void i2c_bus_unlock(
+    struct i2c_bus*     bus)
+{
+    if(bus->lock_disabled || !bus->lock_depth) {
+        return;
+    }
+
+    if(--bus->lock_depth == 0) {
+        flock(bus->lock_fd, LOCK_UN);
+    }
+}
+
+void i2c_bus_set_locking(
+    struct i2c_bus*     bus,
+    int                 enable)
+{
+    if(!enable && bus->lock_depth && bus->lock_fd >= 0) {
+        flock(bus->lock_fd, LOCK_UN);
+    }
+
+    bus->lock_depth = 0;
+    bus->lock_disabled = !enable;
+}
+
+static int open_lock_file(
+    struct i2c_bus*     bus)
+{
+    const char* dir = getenv("I2C_LOCK_DIR");
+    struct stat st;
+    char path[256] = {0};
+    char name[sizeof(bus->name)] = {0};
+    unsigned int i = 0;
+
+    if(fstat(bus->fd, &st) == 0 && S_ISCHR(st.st_mode)) {
+        /* The i2c-dev minor is the adapter number, so every path to the
+         * adapter (/dev/i2c-3, a udev symlink) takes the same lock */
+        snprintf(name, sizeof(name), "i2c-%u", minor(st.st_rdev));
+    } else {
+        /* The bus name may contain path separators if it was opened by
+         * path */
+        for(i = 0; i < sizeof(name) - 1 && bus->name[i]; ++i) {
+            name[i] = bus->name[i] == '/' ? '_' : bus->name[i];
+        }
+    }
+
+    if(!dir || !*dir) {
+        dir = LOCK_DIR_DEFAULT;
+    }
+
+    if(snprintf(path, sizeof(path), "%s/%s.lock", dir, name) >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    /* flock only needs a read only descriptor, so a file another user
+     * created (with their umask) can still be locked. Open an existing file
+     * without O_CREAT, as protected_regular refuses O_CREAT on other users'
+     * files in sticky directories, and never follow a planted symlink */
+    for(;;) {
+        bus->lock_fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if(bus->lock_fd >= 0 || errno != ENOENT) {
+            break;
+        }
+
+        bus->lock_fd = open(path, O_RDONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                            0666);
+        if(bus->lock_fd >= 0 || errno != EEXIST) {
+            break;
+        }
+    }
+
+    return bus->lock_fd < 0 ? -1 : 0;
+}
+
+static uint64_t monotonic_ns(
+    void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int dev_ioctl(
+    struct i2c_bus*     bus,
+    unsigned long       request,
+    void*               arg)
+{
+    return ioctl(bus->fd, request, arg);
+}
+
+static void dev_delay(
+    struct i2c_bus*     bus,
+    unsigned long       usecs)
+{
+    (void)bus;
+    usleep(usecs);
+}
+
+static uint64_t dev_time_ns(
+    struct i2c_bus*     bus)
+{
+    (void)bus;
+
+    return monotonic_ns();
+}
+
+static void dev_close(
+    struct i2c_bus*     bus)
+{
+    close(bus->fd);
+    free(bus);
+}
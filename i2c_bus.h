@@ -0,0 +1,161 @@
+/**
+ * I2C bus abstraction for the userspace I2C utilities
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef I2C_BUS_H
+#define I2C_BUS_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct i2c_bus;
+
+/** OR'd into a device address to mark it as a 10-bit address. Addresses
+ *  without it are 7-bit */
+#define I2C_ADDR_TEN                    0x8000
+
+/** Counters for the cross-process bus lock */
+struct i2c_bus_lock_stats {
+    /** Number of times the lock was taken (outermost acquisitions only) */
+    unsigned long   acquisitions;
+    /** Number of acquisitions that had to wait for another holder */
+    unsigned long   contended;
+    /** Total time spent waiting for the lock */
+    uint64_t        wait_ns_total;
+    /** Longest single wait for the lock */
+    uint64_t        wait_ns_max;
+};
+
+/** Operations implemented by a bus backend. The ioctl operation takes the same
+ *  requests and arguments as an i2c-dev file descriptor (I2C_FUNCS,
+ *  I2C_SLAVE, I2C_SLAVE_FORCE, I2C_TENBIT, I2C_RDWR and I2C_SMBUS) and reports
+ *  errors the same way, by returning -1 and setting errno */
+struct i2c_bus_ops {
+    int (*ioctl)(struct i2c_bus* bus, unsigned long request, void* arg);
+    void (*delay)(struct i2c_bus* bus, unsigned long usecs);
+    uint64_t (*time_ns)(struct i2c_bus* bus);
+    void (*close)(struct i2c_bus* bus);
+};
+
+/** An open I2C bus, either an i2c-dev node or a simulated adapter */
+struct i2c_bus {
+    /** The backend implementing this bus */
+    const struct i2c_bus_ops* ops;
+    /** A short name for the bus, used in messages */
+    char name[32];
+    /** The i2c-dev file descriptor, or -1 for buses without one */
+    int fd;
+    /** Backend private data */
+    void* priv;
+    /** The lock file descriptor, -1 until the lock is first taken */
+    int lock_fd;
+    /** Nesting depth of i2c_bus_lock calls */
+    unsigned int lock_depth;
+    /** Non-zero if locking has been disabled for this bus */
+    int lock_disabled;
+    /** Lock wait statistics */
+    struct i2c_bus_lock_stats lock_stats;
+};
+
+/**
+ * @brief Open an I2C bus
+ *
+ * @param spec - Either an adapter number ("3"), an i2c-dev path
+ *               ("/dev/i2c-3") or "sim[:options]" for the simulated adapter
+ *
+ * @return The opened bus, or NULL on failure (with errno set)
+ */
+struct i2c_bus* i2c_bus_open(
+    const char*         spec);
+
+/**
+ * @brief Close a bus opened with i2c_bus_open
+ */
+void i2c_bus_close(
+    struct i2c_bus*     bus);
+
+/**
+ * @brief Perform an i2c-dev style ioctl on the bus
+ *
+ * @return >= 0 on success, -1 on failure with errno set
+ */
+int i2c_bus_ioctl(
+    struct i2c_bus*     bus,
+    unsigned long       request,
+    void*               arg);
+
+/**
+ * @brief Wait for a number of microseconds, e.g. for an EEPROM write cycle.
+ *        Simulated buses advance their virtual clock instead of sleeping
+ */
+void i2c_bus_delay(
+    struct i2c_bus*     bus,
+    unsigned long       usecs);
+
+/**
+ * @brief Get the current bus time in nanoseconds. This is CLOCK_MONOTONIC for
+ *        real buses and the virtual clock for simulated ones
+ */
+uint64_t i2c_bus_time_ns(
+    struct i2c_bus*     bus);
+
+/**
+ * @brief Take the advisory cross-process lock for the bus
+ *
+ * Sequences spanning several ioctls (SMBus emulated offset reads, selecting a
+ * mux channel and then accessing a device, setting a PMBus page and then
+ * reading) should be performed with the lock held so that other processes
+ * using these tools can't interleave their own transfers. The lock is an
+ * flock on a per-adapter lock file in $I2C_LOCK_DIR (default /run/lock),
+ * named after the adapter number of the device node so that symlinks to
+ * the same adapter share it, and it nests, so callers can hold it around
+ * calls that take it themselves.
+ * If the lock file can't be opened or created this fails rather than
+ * running unlocked; use i2c_bus_set_locking() to opt out.
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int i2c_bus_lock(
+    struct i2c_bus*     bus);
+
+/**
+ * @brief Release the lock taken by i2c_bus_lock
+ */
+void i2c_bus_unlock(
+    struct i2c_bus*     bus);
+
+/**
+ * @brief Enable or disable locking for a bus (enabled by default for real
+ *        adapters, simulated adapters are never shared between processes)
+ */
+void i2c_bus_set_locking(
+    struct i2c_bus*     bus,
+    int                 enable);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* I2C_BUS_H */
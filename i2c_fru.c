@@ -0,0 +1,705 @@
+/**
+ * IPMI FRU reader and decoder
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc32.h"
+#include "i2c_fru.h"
+#include "i2c_xfer.h"
+
+#define FRU_FORMAT_VERSION              0x01
+/** Area offsets and lengths are in multiples of 8 bytes */
+#define FRU_MULTIPLIER                  8
+/** Type/length byte marking the end of an area's fields */
+#define FRU_END_OF_FIELDS               0xc1
+#define FRU_TYPE_BINARY                 0
+#define FRU_TYPE_BCD_PLUS               1
+#define FRU_TYPE_6BIT_ASCII             2
+#define FRU_TYPE_8BIT                   3
+#define FRU_MR_HEADER_LEN               5
+#define FRU_MR_END_OF_LIST              0x80
+/** Upper bound on multirecords, in case the end of list flag is missing */
+#define FRU_MR_MAX_RECORDS              64
+/** Seconds between the Unix epoch and the FRU epoch, 1996-01-01 00:00 UTC */
+#define FRU_EPOCH_OFFSET                820454400L
+/** Longest decoded field: 63 6-bit ASCII bytes expand to 84 characters */
+#define FRU_MAX_FIELD_LEN               96
+/** Longest info area, the length byte counts multiples of 8 bytes */
+#define FRU_AREA_MAX_LEN                (255 * FRU_MULTIPLIER)
+/** The cache key: the common header, the version, length and CRC32 of each
+ *  info area and the header of every multirecord */
+#define FRU_CACHE_KEY_MAX               (FRU_HEADER_LEN + 3 * 6 + \
+                                         FRU_MR_MAX_RECORDS * FRU_MR_HEADER_LEN)
+
+/** Indexes of the area offsets in the common header */
+enum {
+    FRU_HDR_VERSION = 0,
+    FRU_HDR_INTERNAL,
+    FRU_HDR_CHASSIS,
+    FRU_HDR_BOARD,
+    FRU_HDR_PRODUCT,
+    FRU_HDR_MULTIRECORD,
+    FRU_HDR_PAD,
+    FRU_HDR_CHECKSUM,
+};
+
+static const char* const chassis_fields[] = {
+    "Chassis Part Number",
+    "Chassis Serial",
+};
+
+static const char* const board_fields[] = {
+    "Board Manufacturer",
+    "Board Product",
+    "Board Serial",
+    "Board Part Number",
+    "Board FRU File ID",
+};
+
+static const char* const product_fields[] = {
+    "Product Manufacturer",
+    "Product Name",
+    "Product Part Number",
+    "Product Version",
+    "Product Serial",
+    "Product Asset Tag",
+    "Product FRU File ID",
+};
+
+static int fru_read(
+    struct i2c_bus*     bus,
+    unsigned short      addr,
+    unsigned int        offset_len,
+    unsigned long       offset,
+    uint8_t*            buf,
+    unsigned long       len);
+
+static uint8_t fru_sum(
+    const uint8_t*      data,
+    unsigned long       len);
+
+static int decode_area(
+    struct i2c_bus*     bus,
+    unsigned short      addr,
+    unsigned int        offset_len,
+    int                 area,
+    unsigned long       offset,
+    FILE*               out);
+
+static int decode_multirecord(
+    struct i2c_bus*     bus,
+    unsigned short      addr,
+    unsigned int        offset_len,
+    unsigned long       offset,
+    FILE*               out);
+
+static int decode_fields(
+    const uint8_t*      data,
+    unsigned long       len,
+    const char* const*  names,
+    unsigned int        num_names,
+    const char*         custom_name,
+    FILE*               out);
+
+static void decode_field(
+    uint8_t             type_len,
+    const uint8_t*      data,
+    char*               text,
+    size_t              text_len);
+
+static void cache_path(
+    struct i2c_bus*     bus,
+    unsigned short      addr,
+    const char*         cache_dir,
+    char*               path,
+    size_t              path_len);
+
+static int cache_key(
+    struct i2c_bus*     bus,
+    unsigned short      addr,
+    unsigned int        offset_len,
+    const uint8_t*      header,
+    uint8_t*            key,
+    unsigned int*       key_len);
+
+static char* cache_lookup(
+    const char*         path,
+    const uint8_t*      key,
+    unsigned int        key_len);
+
+static void cache_store(
+    const char*         path,
+    const uint8_t*      key,
+    unsigned int        key_len,
+    const char*         text);
+
+int i2c_fru_read(
+    struct i2c_bus*     bus,
+    unsigned short      addr,
+    unsigned int        offset_len,
+    const char*         cache_dir,
+    char**              text,
+    int*                cached)
+{
+    uint8_t header[FRU_HEADER_LEN] = {0};
+    uint8_t key[FRU_CACHE_KEY_MAX] = {0};
+    unsigned int key_len = 0;
+    char path[256] = {0};
+    char* buf = NULL;
+    size_t buf_len = 0;
+    FILE* out = NULL;
+    int ret = 0;
+    int area = 0;
+
+    *text = NULL;
+    if(cached) {
+        *cached = 0;
+    }
+
+    if(fru_read(bus, addr, offset_len, 0, header, sizeof(header)) < 0) {
+        return -1;
+    }
+
+    if(header[FRU_HDR_VERSION] != FRU_FORMAT_VERSION ||
+       fru_sum(header, sizeof(header)) != 0) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    if(cache_dir) {
+        if(cache_key(bus, addr, offset_len, header, key, &key_len) < 0) {
+            return -1;
+        }
+        cache_path(bus, addr, cache_dir, path, sizeof(path));
+        *text = cache_lookup(path, key, key_len);
+        if(*text) {
+            if(cached) {
+                *cached = 1;
+            }
+            return 0;
+        }
+    }
+
+    out = open_memstream(&buf, &buf_len);
+    if(!out) {
+        return -1;
+    }
+
+    for(area = FRU_HDR_INTERNAL; area <= FRU_HDR_MULTIRECORD && ret == 0; ++area) {
+        if(!header[area]) {
+            continue;
+        }
+
+        if(area == FRU_HDR_INTERNAL) {
+            /* Internal use data is opaque, just say where it is */
+            fprintf(out, "Internal Use Area: offset 0x%x\n",
+                    header[area] * FRU_MULTIPLIER);
+        } else if(area == FRU_HDR_MULTIRECORD) {
+            ret = decode_multirecord(bus, addr, offset_len,
+                                     header[area] * FRU_MULTIPLIER, out);
+        } else {
+            ret = decode_area(bus, addr, offset_len, area,
+                              header[area] * FRU_MULTIPLIER, out);
+        }
+    }
+
+    fclose(out);
+
+    if(ret < 0) {
+        ret = errno;
+        free(buf);
+        errno = ret;
+        return -1;
+    }
+
+    if(cache_dir) {
+        cache_store(path, key, key_len, buf);
+    }
+
+    *text = buf;
+
+    return 0;
+}
+
+static int fru_read(
+    struct i2c_bus*     bus,
+    unsigned short      addr,
+    unsigned int        offset_len,
+    unsigned long       offset,
+    uint8_t*            buf,
+    unsigned long       len)
+{
+    uint8_t wr_data[I2C_XFER_MAX_OFFSET_LEN] = {0};
+
+    i2c_xfer_put_offset(wr_data, offset, offset_len);
+
+    return i2c_xfer(bus, addr, I2C_XFER_AUTO, offset_len,
+                    wr_data, offset_len, buf, len);
+}
+
+/**
+ * @brief Sum bytes modulo 256. All FRU checksums make the sum of the covered
+ *        bytes, including the checksum itself, zero
+ */
+static uint8_t fru_sum(
+    const uint8_t*      data,
+    unsigned long       len)
+{
+    uint8_t sum = 0;
+
+    while(len--) {
+        sum += *data++;
+    }
+
+    return sum;
+}
+
+static int decode_area(
+    struct i2c_bus*     bus,
+    unsigned short      addr,
+    unsigned int        offset_len,
+    int                 area,
+    unsigned long       offset,
+    FILE*               out)
+{
+    uint8_t hdr[2] = {0};
+    uint8_t* data = NULL;
+    unsigned long len = 0;
+    unsigned long minutes = 0;
+    time_t when = 0;
+    struct tm tm;
+    char date[32] = {0};
+    int ret = 0;
+
+    /* Version and length first, then the rest of the area */
+    if(fru_read(bus, addr, offset_len, offset, hdr, sizeof(hdr)) < 0) {
+        return -1;
+    }
+
+    len = hdr[1] * FRU_MULTIPLIER;
+    if(hdr[0] != FRU_FORMAT_VERSION || len < FRU_MULTIPLIER) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    data = malloc(len);
+    if(!data) {
+        return -1;
+    }
+
+    memcpy(data, hdr, sizeof(hdr));
+    if(fru_read(bus, addr, offset_len, offset + sizeof(hdr),
+                &data[sizeof(hdr)], len - sizeof(hdr)) < 0) {
+        free(data);
+        return -1;
+    }
+
+    if(fru_sum(data, len) != 0) {
+        free(data);
+        errno = EBADMSG;
+        return -1;
+    }
+
+    switch(area) {
+        case FRU_HDR_CHASSIS:
+            fprintf(out, "Chassis Type: 0x%02x\n", data[2]);
+            ret = decode_fields(&data[3], len - 3, chassis_fields,
+                                sizeof(chassis_fields) / sizeof(chassis_fields[0]),
+                                "Chassis Extra", out);
+            break;
+
+        case FRU_HDR_BOARD:
+            minutes = data[3] | (data[4] << 8) | ((unsigned long)data[5] << 16);
+            if(minutes) {
+                when = FRU_EPOCH_OFFSET + (time_t)minutes * 60;
+                gmtime_r(&when, &tm);
+                strftime(date, sizeof(date), "%Y-%m-%d %H:%M UTC", &tm);
+                fprintf(out, "Board Mfg Date: %s\n", date);
+            } else {
+                fprintf(out, "Board Mfg Date: unspecified\n");
+            }
+            ret = decode_fields(&data[6], len - 6, board_fields,
+                                sizeof(board_fields) / sizeof(board_fields[0]),
+                                "Board Extra", out);
+            break;
+
+        case FRU_HDR_PRODUCT:
+            ret = decode_fields(&data[3], len - 3, product_fields,
+                                sizeof(product_fields) / sizeof(product_fields[0]),
+                                "Product Extra", out);
+            break;
+
+        default:
+            break;
+    }
+
+    free(data);
+
+    return ret;
+}
+
+static int decode_multirecord(
+    struct i2c_bus*     bus,
+    unsigned short      addr,
+    unsigned int        offset_len,
+    unsigned long       offset,
+    FILE*               out)
+{
+    uint8_t hdr[FRU_MR_HEADER_LEN] = {0};
+    uint8_t data[256] = {0};
+    unsigned int records = 0;
+    unsigned int i = 0;
+
+    for(records = 0; records < FRU_MR_MAX_RECORDS; ++records) {
+        if(fru_read(bus, addr, offset_len, offset, hdr, sizeof(hdr)) < 0) {
+            return -1;
+        }
+
+        if(fru_sum(hdr, sizeof(hdr)) != 0) {
+            errno = EBADMSG;
+            return -1;
+        }
+
+        if(hdr[2] && fru_read(bus, addr, offset_len, offset + sizeof(hdr),
+                              data, hdr[2]) < 0) {
+            return -1;
+        }
+
+        if((uint8_t)(fru_sum(data, hdr[2]) + hdr[3]) != 0) {
+            errno = EBADMSG;
+            return -1;
+        }
+
+        fprintf(out, "Multirecord: type 0x%02x, %u bytes:", hdr[0], hdr[2]);
+        for(i = 0; i < hdr[2]; ++i) {
+            fprintf(out, " %02x", data[i]);
+        }
+        fprintf(out, "\n");
+
+        if(hdr[1] & FRU_MR_END_OF_LIST) {
+            break;
+        }
+
+        offset += sizeof(hdr) + hdr[2];
+    }
+
+    return 0;
+}
+
+static int decode_fields(
+    const uint8_t*      data,
+    unsigned long       len,
+    const char* const*  names,
+    unsigned int        num_names,
+    const char*         custom_name,
+    FILE*               out)
+{
+    char text[FRU_MAX_FIELD_LEN] = {0};
+    unsigned long pos = 0;
+    unsigned int field = 0;
+    unsigned int field_len = 0;
+
+    while(pos < len && data[pos] != FRU_END_OF_FIELDS) {
+        field_len = data[pos] & 0x3f;
+        if(pos + 1 + field_len > len) {
+            errno = EBADMSG;
+            return -1;
+        }
+
+        decode_field(data[pos], &data[pos + 1], text, sizeof(text));
+
+        if(field < num_names) {
+            fprintf(out, "%s: %s\n", names[field], text);
+        } else {
+            fprintf(out, "%s: %s\n", custom_name, text);
+        }
+
+        ++field;
+        pos += 1 + field_len;
+    }
+
+    if(pos >= len) {
+        /* No end of fields marker */
+        errno = EBADMSG;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Decode one type/length prefixed field into printable text
+ */
+static void decode_field(
+    uint8_t             type_len,
+    const uint8_t*      data,
+    char*               text,
+    size_t              text_len)
+{
+    static const char bcd_plus[] = "0123456789 -.???";
+    unsigned int len = type_len & 0x3f;
+    unsigned int i = 0;
+    size_t pos = 0;
+    uint32_t bits = 0;
+
+    text[0] = '\0';
+
+    switch(type_len >> 6) {
+        case FRU_TYPE_BINARY:
+            for(i = 0; i < len && pos + 3 < text_len; ++i) {
+                pos += snprintf(&text[pos], text_len - pos, "%02x", data[i]);
+            }
+            break;
+
+        case FRU_TYPE_BCD_PLUS:
+            for(i = 0; i < len && pos + 2 < text_len; ++i) {
+                text[pos++] = bcd_plus[data[i] >> 4];
+                text[pos++] = bcd_plus[data[i] & 0xf];
+            }
+            text[pos] = '\0';
+            break;
+
+        case FRU_TYPE_6BIT_ASCII:
+            /* Every 3 bytes hold 4 characters, packed lsb first, each an
+             * offset from 0x20 */
+            for(i = 0; i < len; i += 3) {
+                unsigned int chunk = (len - i) >= 3 ? 3 : (len - i);
+                unsigned int chars = chunk == 3 ? 4 : chunk;
+                unsigned int c = 0;
+
+                bits = data[i];
+                if(chunk > 1) {
+                    bits |= data[i + 1] << 8;
+                }
+                if(chunk > 2) {
+                    bits |= (uint32_t)data[i + 2] << 16;
+                }
+
+                /* A trailing group of 1 or 2 bytes holds 1 or 2 characters */
+                for(c = 0; c < chars && pos + 1 < text_len; ++c) {
+                    text[pos++] = 0x20 + ((bits >> (c * 6)) & 0x3f);
+                }
+            }
+            text[pos] = '\0';
+            break;
+
+        case FRU_TYPE_8BIT:
+            for(i = 0; i < len && pos + 1 < text_len; ++i) {
+                text[pos++] = (data[i] >= 0x20 && data[i] < 0x7f) ? data[i] : '.';
+            }
+            text[pos] = '\0';
+            break;
+    }
+
+    /* Fields are often padded with spaces */
+    while(pos > 0 && text[pos - 1] == ' ') {
+        text[--pos] = '\0';
+    }
+}
+
+static void cache_path(
+    struct i2c_bus*     bus,
+    unsigned short      addr,
+    const char*         cache_dir,
+    char*               path,
+    size_t              path_len)
+{
+    char name[sizeof(bus->name)] = {0};
+    unsigned int i = 0;
+
+    for(i = 0; i < sizeof(name) - 1 && bus->name[i]; ++i) {
+        name[i] = bus->name[i] == '/' ? '_' : bus->name[i];
+    }
+
+    snprintf(path, path_len, "%s/fru-%s-0x%02x.txt", cache_dir, name, addr);
+}
+
+/**
+ * @brief Build the cache key for the data on the device. The common header
+ *        alone doesn't change when another board with the same layout is
+ *        fitted, so the key adds a CRC32 of each info area, which hold the
+ *        serial numbers, and each multirecord header (which holds the
+ *        record's checksum). An area's own 8-bit checksum isn't enough, as
+ *        one board in 256 would share it
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+static int cache_key(
+    struct i2c_bus*     bus,
+    unsigned short      addr,
+    unsigned int        offset_len,
+    const uint8_t*      header,
+    uint8_t*            key,
+    unsigned int*       key_len)
+{
+    uint8_t data[FRU_AREA_MAX_LEN];
+    unsigned long offset = 0;
+    unsigned long area_len = 0;
+    unsigned int len = 0;
+    unsigned int records = 0;
+    uint32_t crc = 0;
+    int area = 0;
+
+    memcpy(key, header, FRU_HEADER_LEN);
+    len = FRU_HEADER_LEN;
+
+    for(area = FRU_HDR_CHASSIS; area <= FRU_HDR_PRODUCT; ++area) {
+        if(!header[area]) {
+            continue;
+        }
+
+        /* Version and length, then the whole area for its CRC */
+        offset = header[area] * FRU_MULTIPLIER;
+        if(fru_read(bus, addr, offset_len, offset, data, 2) < 0) {
+            return -1;
+        }
+
+        area_len = data[1] * FRU_MULTIPLIER;
+        if(area_len > 2 && fru_read(bus, addr, offset_len, offset + 2,
+                                    &data[2], area_len - 2) < 0) {
+            return -1;
+        }
+
+        crc = crc_update(CRC_TYPE_CRC32, 0, data, area_len > 2 ? area_len : 2);
+        key[len++] = data[0];
+        key[len++] = data[1];
+        key[len++] = crc & 0xff;
+        key[len++] = (crc >> 8) & 0xff;
+        key[len++] = (crc >> 16) & 0xff;
+        key[len++] = (crc >> 24) & 0xff;
+    }
+
+    offset = header[FRU_HDR_MULTIRECORD] * FRU_MULTIPLIER;
+    for(records = 0; offset && records < FRU_MR_MAX_RECORDS; ++records) {
+        if(fru_read(bus, addr, offset_len, offset, &key[len], FRU_MR_HEADER_LEN) < 0) {
+            return -1;
+        }
+
+        offset += FRU_MR_HEADER_LEN + key[len + 2];
+        if(key[len + 1] & FRU_MR_END_OF_LIST) {
+            offset = 0;
+        }
+        len += FRU_MR_HEADER_LEN;
+    }
+
+    *key_len = len;
+
+    return 0;
+}
+
+/**
+ * @brief Look up cached FRU text. The first line of a cache file holds the
+ *        key of the data it was decoded from
+ *
+ * @return The cached text (to be freed by the caller), or NULL on a miss
+ */
+static char* cache_lookup(
+    const char*         path,
+    const uint8_t*      key,
+    unsigned int        key_len)
+{
+    char hex[FRU_CACHE_KEY_MAX * 2 + 1] = {0};
+    char line[FRU_CACHE_KEY_MAX * 2 + 16] = {0};
+    char* text = NULL;
+    long size = 0;
+    long start = 0;
+    FILE* f = NULL;
+    unsigned int i = 0;
+
+    f = fopen(path, "r");
+    if(!f) {
+        return NULL;
+    }
+
+    for(i = 0; i < key_len; ++i) {
+        snprintf(&hex[i * 2], sizeof(hex) - i * 2, "%02x", key[i]);
+    }
+
+    if(!fgets(line, sizeof(line), f) ||
+       strncmp(line, "# key ", 6) != 0 ||
+       strncmp(&line[6], hex, key_len * 2) != 0 ||
+       line[6 + key_len * 2] != '\n') {
+        fclose(f);
+        return NULL;
+    }
+
+    start = ftell(f);
+    fseek(f, 0, SEEK_END);
+    size = ftell(f) - start;
+    fseek(f, start, SEEK_SET);
+
+    text = calloc(1, size + 1);
+    if(text && fread(text, 1, size, f) != (size_t)size) {
+        free(text);
+        text = NULL;
+    }
+
+    fclose(f);
+
+    return text;
+}
+
+static void cache_store(
+    const char*         path,
+    const uint8_t*      key,
+    unsigned int        key_len,
+    const char*         text)
+{
+    char tmp_path[300] = {0};
+    FILE* f = NULL;
+    unsigned int i = 0;
+    int ok = 1;
+
+    /* Write to a temporary file and rename it into place so that concurrent
+     * readers never see a partial entry */
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+
+    f = fopen(tmp_path, "w");
+    if(!f) {
+        return;
+    }
+
+    fprintf(f, "# key ");
+    for(i = 0; i < key_len; ++i) {
+        fprintf(f, "%02x", key[i]);
+    }
+    fprintf(f, "\n");
+
+    if(fputs(text, f) < 0) {
+        ok = 0;
+    }
+
+    if(fclose(f) != 0) {
+        ok = 0;
+    }
+
+    if(!ok || rename(tmp_path, path) < 0) {
+        unlink(tmp_path);
+    }
+}
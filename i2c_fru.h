@@ -0,0 +1,67 @@
+/**
+ * IPMI FRU reader and decoder
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef I2C_FRU_H
+#define I2C_FRU_H
+
+#include "i2c_bus.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Size of the IPMI FRU common header */
+#define FRU_HEADER_LEN                  8
+
+/**
+ * @brief Read and decode the IPMI FRU data held in an EEPROM
+ *
+ * Only the common header and the areas it points to are read. If a cache
+ * directory is given, the decoded text is cached there keyed by the bus, the
+ * device address, the common header, a CRC32 of each info area and each
+ * multirecord header; if these match the device the cached text is returned
+ * without reading or decoding the multirecords.
+ *
+ * @param bus - The bus the EEPROM is on
+ * @param addr - The 7-bit address of the EEPROM
+ * @param offset_len - The number of offset bytes the EEPROM uses (1 or 2)
+ * @param cache_dir - Directory to cache decoded data in, or NULL for none
+ * @param text - Set to the decoded text, which the caller must free
+ * @param cached - Optional, set to non-zero if the text came from the cache
+ *
+ * @return 0 on success, -1 on failure with errno set (EBADMSG for corrupt
+ *         FRU data)
+ */
+int i2c_fru_read(
+    struct i2c_bus*     bus,
+    unsigned short      addr,
+    unsigned int        offset_len,
+    const char*         cache_dir,
+    char**              text,
+    int*                cached);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* I2C_FRU_H */
@@ -0,0 +1,543 @@
+/**
+ * Sensor threshold monitoring for the userspace I2C utilities
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "i2c_mon.h"
+#include "i2c_xfer.h"
+
+#define MON_MAX_LINE_LEN                256
+#define MON_SENSOR_FIELDS               13
+#define NS_PER_MS                       1000000ull
+
+struct mon_entry {
+    struct i2c_mon_sensor   cfg;
+    /** The reported state */
+    enum i2c_mon_state      state;
+    /** A different state seen on recent polls, and how many polls in a row
+     *  it has been seen for */
+    enum i2c_mon_state      pending;
+    unsigned int            pending_count;
+    /** Bus time the sensor is next due */
+    uint64_t                next_ns;
+};
+
+struct i2c_mon {
+    struct i2c_bus*         bus;
+    struct mon_entry*       entries;
+    unsigned int            count;
+    unsigned int            alloc;
+    uint64_t                period_ns;
+    uint64_t                fast_period_ns;
+    unsigned int            near_pct;
+    struct i2c_mon_stats    stats;
+};
+
+static const char* const state_names[] = {
+    [I2C_MON_UNKNOWN]   = "UNKNOWN",
+    [I2C_MON_NORMAL]    = "NORMAL",
+    [I2C_MON_LOW]       = "LOW",
+    [I2C_MON_HIGH]      = "HIGH",
+    [I2C_MON_FAULT]     = "FAULT",
+};
+
+static int read_sensor(
+    struct i2c_mon*         mon,
+    const struct i2c_mon_sensor* cfg,
+    double*                 value);
+
+static enum i2c_mon_state classify(
+    const struct i2c_mon_sensor* cfg,
+    enum i2c_mon_state      state,
+    double                  value);
+
+static int near_threshold(
+    struct i2c_mon*         mon,
+    const struct i2c_mon_sensor* cfg,
+    double                  value);
+
+static int parse_sensor(
+    char*                   line,
+    struct i2c_mon_sensor*  cfg);
+
+struct i2c_mon* i2c_mon_create(
+    struct i2c_bus*         bus)
+{
+    struct i2c_mon* mon = NULL;
+
+    mon = calloc(1, sizeof(*mon));
+    if(!mon) {
+        return NULL;
+    }
+
+    mon->bus = bus;
+    i2c_mon_set_period(mon, I2C_MON_DEFAULT_PERIOD_MS,
+                       I2C_MON_DEFAULT_FAST_PERIOD_MS,
+                       I2C_MON_DEFAULT_NEAR_PCT);
+
+    return mon;
+}
+
+void i2c_mon_set_period(
+    struct i2c_mon*         mon,
+    unsigned long           period_ms,
+    unsigned long           fast_period_ms,
+    unsigned int            near_pct)
+{
+    mon->period_ns = period_ms * NS_PER_MS;
+    mon->fast_period_ns = fast_period_ms * NS_PER_MS;
+    mon->near_pct = near_pct;
+
+    /* Fast polling is never slower than normal polling */
+    if(mon->fast_period_ns > mon->period_ns) {
+        mon->fast_period_ns = mon->period_ns;
+    }
+}
+
+int i2c_mon_add(
+    struct i2c_mon*         mon,
+    const struct i2c_mon_sensor* sensor)
+{
+    struct mon_entry* entries = NULL;
+
+    if(sensor->bytes < 1 || sensor->bytes > 4 ||
+       sensor->offset_len > I2C_XFER_MAX_OFFSET_LEN ||
+       sensor->shift >= sensor->bytes * 8 ||
+       (sensor->decode == I2C_MON_LINEAR11 && sensor->bytes != 2) ||
+       sensor->low >= sensor->high || sensor->hyst < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(mon->count == mon->alloc) {
+        entries = realloc(mon->entries,
+                          (mon->alloc ? mon->alloc * 2 : 8) * sizeof(*entries));
+        if(!entries) {
+            return -1;
+        }
+        mon->entries = entries;
+        mon->alloc = mon->alloc ? mon->alloc * 2 : 8;
+    }
+
+    memset(&mon->entries[mon->count], 0, sizeof(mon->entries[0]));
+    mon->entries[mon->count].cfg = *sensor;
+    ++mon->count;
+
+    return 0;
+}
+
+int i2c_mon_load(
+    struct i2c_mon*         mon,
+    const char*             path)
+{
+    struct i2c_mon_sensor cfg;
+    char line[MON_MAX_LINE_LEN] = {0};
+    unsigned long period_ms = mon->period_ns / NS_PER_MS;
+    unsigned long fast_ms = mon->fast_period_ns / NS_PER_MS;
+    unsigned int near_pct = mon->near_pct;
+    unsigned int line_no = 0;
+    char key[32] = {0};
+    unsigned long val = 0;
+    char* hash = NULL;
+    FILE* f = NULL;
+    int ret = 0;
+
+    f = fopen(path, "r");
+    if(!f) {
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), f)) {
+        ++line_no;
+
+        hash = strchr(line, '#');
+        if(hash) {
+            *hash = '\0';
+        }
+
+        if(sscanf(line, "%31s", key) != 1) {
+            /* Blank line */
+            continue;
+        }
+
+        /* A zero period would poll in a busy loop */
+        if(strcmp(key, "period") == 0 && sscanf(line, "%*s %lu", &val) == 1 && val) {
+            period_ms = val;
+        } else if(strcmp(key, "fast_period") == 0 && sscanf(line, "%*s %lu", &val) == 1 && val) {
+            fast_ms = val;
+        } else if(strcmp(key, "near") == 0 && sscanf(line, "%*s %lu", &val) == 1) {
+            near_pct = val;
+        } else if(parse_sensor(line, &cfg) < 0 || i2c_mon_add(mon, &cfg) < 0) {
+            printf("%s:%u: invalid monitor config line\n", path, line_no);
+            errno = EINVAL;
+            ret = -1;
+            break;
+        }
+    }
+
+    fclose(f);
+
+    if(ret == 0) {
+        i2c_mon_set_period(mon, period_ms, fast_ms, near_pct);
+    }
+
+    return ret;
+}
+
+uint64_t i2c_mon_poll(
+    struct i2c_mon*         mon,
+    i2c_mon_cb              cb,
+    void*                   user)
+{
+    struct i2c_mon_event event;
+    struct mon_entry* entry = NULL;
+    enum i2c_mon_state seen = I2C_MON_UNKNOWN;
+    uint64_t now = i2c_bus_time_ns(mon->bus);
+    uint64_t next = UINT64_MAX;
+    unsigned int debounce = 0;
+    double value = NAN;
+    int fast = 0;
+    unsigned int i = 0;
+
+    for(i = 0; i < mon->count; ++i) {
+        entry = &mon->entries[i];
+
+        if(entry->next_ns > now) {
+            if(entry->next_ns < next) {
+                next = entry->next_ns;
+            }
+            continue;
+        }
+
+        mon->stats.polls++;
+        if(read_sensor(mon, &entry->cfg, &value) < 0) {
+            mon->stats.errors++;
+            value = NAN;
+            seen = I2C_MON_FAULT;
+        } else {
+            seen = classify(&entry->cfg, entry->state, value);
+        }
+
+        /* A new state has to be seen on enough consecutive polls before it
+         * is reported. The first reading is reported straight away */
+        debounce = entry->state == I2C_MON_UNKNOWN ? 1 : entry->cfg.debounce;
+        if(seen == entry->state) {
+            entry->pending_count = 0;
+        } else if(seen == entry->pending && entry->pending_count) {
+            entry->pending_count++;
+        } else {
+            entry->pending = seen;
+            entry->pending_count = 1;
+        }
+
+        if(entry->pending_count && entry->pending_count >= debounce) {
+            event.sensor = &entry->cfg;
+            event.from = entry->state;
+            event.to = seen;
+            event.value = value;
+            event.time_ns = now;
+
+            entry->state = seen;
+            entry->pending_count = 0;
+            mon->stats.events++;
+
+            if(cb) {
+                cb(&event, user);
+            }
+        }
+
+        /* Poll quickly while a transition is being confirmed or one could
+         * be coming up */
+        fast = entry->pending_count ||
+               (seen != I2C_MON_FAULT && near_threshold(mon, &entry->cfg, value));
+        if(fast) {
+            mon->stats.fast_polls++;
+        }
+
+        /* Keep to the schedule unless we've fallen more than a period
+         * behind, in which case restart it from now */
+        if(!entry->next_ns || now - entry->next_ns > mon->period_ns) {
+            entry->next_ns = now;
+        }
+        entry->next_ns += fast ? mon->fast_period_ns : mon->period_ns;
+
+        if(entry->next_ns < next) {
+            next = entry->next_ns;
+        }
+    }
+
+    return next;
+}
+
+void i2c_mon_run(
+    struct i2c_mon*         mon,
+    uint64_t                duration_ns,
+    volatile int*           stop,
+    i2c_mon_cb              cb,
+    void*                   user)
+{
+    uint64_t start = i2c_bus_time_ns(mon->bus);
+    uint64_t next = 0;
+    uint64_t now = 0;
+
+    if(!mon->count) {
+        return;
+    }
+
+    while(!stop || !*stop) {
+        next = i2c_mon_poll(mon, cb, user);
+
+        now = i2c_bus_time_ns(mon->bus);
+        if(duration_ns && next - start >= duration_ns) {
+            break;
+        }
+
+        if(next > now) {
+            i2c_bus_delay(mon->bus, (next - now + 999) / 1000);
+        }
+    }
+}
+
+void i2c_mon_get_stats(
+    struct i2c_mon*         mon,
+    struct i2c_mon_stats*   stats)
+{
+    *stats = mon->stats;
+}
+
+const char* i2c_mon_state_name(
+    enum i2c_mon_state      state)
+{
+    if((unsigned int)state >= sizeof(state_names) / sizeof(state_names[0])) {
+        return "INVALID";
+    }
+
+    return state_names[state];
+}
+
+void i2c_mon_destroy(
+    struct i2c_mon*         mon)
+{
+    if(mon) {
+        free(mon->entries);
+        free(mon);
+    }
+}
+
+static int read_sensor(
+    struct i2c_mon*         mon,
+    const struct i2c_mon_sensor* cfg,
+    double*                 value)
+{
+    uint8_t wr_data[I2C_XFER_MAX_OFFSET_LEN] = {0};
+    uint8_t rd_data[4] = {0};
+    unsigned int bits = cfg->bytes * 8 - cfg->shift;
+    uint32_t raw = 0;
+    int32_t mantissa = 0;
+    int exponent = 0;
+    unsigned int i = 0;
+
+    i2c_xfer_put_offset(wr_data, cfg->reg, cfg->offset_len);
+    if(i2c_xfer(mon->bus, cfg->addr, I2C_XFER_AUTO, cfg->offset_len,
+                cfg->offset_len ? wr_data : NULL, cfg->offset_len,
+                rd_data, cfg->bytes) < 0) {
+        return -1;
+    }
+
+    for(i = 0; i < cfg->bytes; ++i) {
+        raw |= (uint32_t)rd_data[cfg->big_endian ? i : cfg->bytes - 1 - i] <<
+               (8 * (cfg->bytes - 1 - i));
+    }
+
+    raw >>= cfg->shift;
+    if(bits < 32) {
+        raw &= (1u << bits) - 1;
+    }
+
+    switch(cfg->decode) {
+        case I2C_MON_SIGNED:
+            if(bits < 32 && (raw & (1u << (bits - 1)))) {
+                *value = (double)raw - (double)(1ull << bits);
+            } else {
+                *value = (int32_t)raw;
+            }
+            break;
+        case I2C_MON_LINEAR11:
+            mantissa = raw & 0x7ff;
+            if(mantissa & 0x400) {
+                mantissa -= 0x800;
+            }
+            exponent = (raw >> 11) & 0x1f;
+            if(exponent & 0x10) {
+                exponent -= 0x20;
+            }
+            *value = ldexp(mantissa, exponent);
+            break;
+        default:
+            *value = raw;
+            break;
+    }
+
+    *value *= cfg->scale;
+
+    return 0;
+}
+
+/**
+ * @brief Work out the state for a value. Leaving LOW or HIGH needs the value
+ *        to come back inside the threshold by the hysteresis
+ */
+static enum i2c_mon_state classify(
+    const struct i2c_mon_sensor* cfg,
+    enum i2c_mon_state      state,
+    double                  value)
+{
+    if(value >= cfg->high) {
+        return I2C_MON_HIGH;
+    }
+
+    if(value <= cfg->low) {
+        return I2C_MON_LOW;
+    }
+
+    if(state == I2C_MON_HIGH && value > cfg->high - cfg->hyst) {
+        return I2C_MON_HIGH;
+    }
+
+    if(state == I2C_MON_LOW && value < cfg->low + cfg->hyst) {
+        return I2C_MON_LOW;
+    }
+
+    return I2C_MON_NORMAL;
+}
+
+static int near_threshold(
+    struct i2c_mon*         mon,
+    const struct i2c_mon_sensor* cfg,
+    double                  value)
+{
+    double margin = cfg->hyst;
+
+    /* With both thresholds set the margin scales with the span between
+     * them, otherwise only the hysteresis band counts as near */
+    if(isfinite(cfg->low) && isfinite(cfg->high)) {
+        margin = fmax(margin, (cfg->high - cfg->low) * mon->near_pct / 100.0);
+    }
+
+    return fabs(value - cfg->high) <= margin || fabs(value - cfg->low) <= margin;
+}
+
+static int parse_number(
+    const char*             str,
+    double*                 value)
+{
+    char* end = NULL;
+
+    if(strcmp(str, "-") == 0) {
+        *value = NAN;
+        return 0;
+    }
+
+    /* strtod accepts 0x prefixed hex too */
+    *value = strtod(str, &end);
+
+    return (end == str || *end != '\0') ? -1 : 0;
+}
+
+static int parse_sensor(
+    char*                   line,
+    struct i2c_mon_sensor*  cfg)
+{
+    char* fields[MON_SENSOR_FIELDS] = {0};
+    char* save = NULL;
+    char* tok = NULL;
+    double num[MON_SENSOR_FIELDS] = {0};
+    unsigned int n = 0;
+    unsigned int i = 0;
+
+    for(tok = strtok_r(line, " \t\r\n", &save); tok; tok = strtok_r(NULL, " \t\r\n", &save)) {
+        if(n == MON_SENSOR_FIELDS) {
+            return -1;
+        }
+        fields[n++] = tok;
+    }
+
+    if(n != MON_SENSOR_FIELDS || strlen(fields[0]) >= sizeof(cfg->name)) {
+        return -1;
+    }
+
+    /* Everything but the name, endian and decode fields is a number */
+    for(i = 1; i < MON_SENSOR_FIELDS; ++i) {
+        if(i == 5 || i == 6) {
+            continue;
+        }
+        if(parse_number(fields[i], &num[i]) < 0 ||
+           (isnan(num[i]) && i != 9 && i != 10)) {
+            return -1;
+        }
+    }
+
+    memset(cfg, 0, sizeof(*cfg));
+    strcpy(cfg->name, fields[0]);
+    cfg->addr = (unsigned short)num[1];
+    cfg->reg = (unsigned long)num[2];
+    cfg->offset_len = (unsigned int)num[3];
+    cfg->bytes = (unsigned int)num[4];
+    cfg->shift = (unsigned int)num[7];
+    cfg->scale = num[8];
+    cfg->low = isnan(num[9]) ? -INFINITY : num[9];
+    cfg->high = isnan(num[10]) ? INFINITY : num[10];
+    cfg->hyst = num[11];
+    cfg->debounce = (unsigned int)num[12];
+
+    /* Addresses above the 7-bit range must be 10-bit ones */
+    if(num[1] > 0x3ff || num[1] < 0) {
+        return -1;
+    }
+    if(cfg->addr > 0x7f) {
+        cfg->addr |= I2C_ADDR_TEN;
+    }
+
+    if(strcmp(fields[5], "be") == 0) {
+        cfg->big_endian = 1;
+    } else if(strcmp(fields[5], "le") != 0) {
+        return -1;
+    }
+
+    if(strcmp(fields[6], "u") == 0) {
+        cfg->decode = I2C_MON_UNSIGNED;
+    } else if(strcmp(fields[6], "s") == 0) {
+        cfg->decode = I2C_MON_SIGNED;
+    } else if(strcmp(fields[6], "linear11") == 0) {
+        cfg->decode = I2C_MON_LINEAR11;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
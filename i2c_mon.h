@@ -0,0 +1,222 @@
+/**
+ * Sensor threshold monitoring for the userspace I2C utilities
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef I2C_MON_H
+#define I2C_MON_H
+
+#include <stdint.h>
+
+#include "i2c_bus.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Default time between polls of a sensor */
+#define I2C_MON_DEFAULT_PERIOD_MS       1000
+/** Default time between polls of a sensor near a threshold */
+#define I2C_MON_DEFAULT_FAST_PERIOD_MS  100
+/** Default distance from a threshold, as a percentage of the low to high
+ *  span, within which a sensor is polled at the fast rate */
+#define I2C_MON_DEFAULT_NEAR_PCT        10
+
+struct i2c_mon;
+
+/** The state of a monitored sensor */
+enum i2c_mon_state {
+    /** Not read yet */
+    I2C_MON_UNKNOWN = 0,
+    /** Between the thresholds */
+    I2C_MON_NORMAL,
+    /** At or below the low threshold */
+    I2C_MON_LOW,
+    /** At or above the high threshold */
+    I2C_MON_HIGH,
+    /** The sensor can't be read */
+    I2C_MON_FAULT,
+};
+
+/** How the raw register value is turned into a number */
+enum i2c_mon_decode {
+    I2C_MON_UNSIGNED = 0,
+    /** Two's complement, the sign bit being the top bit left after the
+     *  shift */
+    I2C_MON_SIGNED,
+    /** PMBus LINEAR11, a 5 bit exponent and 11 bit mantissa */
+    I2C_MON_LINEAR11,
+};
+
+/** A sensor to monitor */
+struct i2c_mon_sensor {
+    /** Name used in events */
+    char                    name[32];
+    /** Device address (OR'd with I2C_ADDR_TEN for 10-bit devices) */
+    unsigned short          addr;
+    /** Register offset and its length in bytes */
+    unsigned long           reg;
+    unsigned int            offset_len;
+    /** Register size, 1 to 4 bytes */
+    unsigned int            bytes;
+    /** Non-zero if the register is sent msb first */
+    int                     big_endian;
+    enum i2c_mon_decode     decode;
+    /** Number of unused low bits in the register */
+    unsigned int            shift;
+    /** Multiplier converting the decoded register to the value */
+    double                  scale;
+    /** Thresholds, -INFINITY/INFINITY to disable one */
+    double                  low;
+    double                  high;
+    /** How far back inside a threshold the value must go to clear it */
+    double                  hyst;
+    /** Consecutive polls a new state must be seen for before it is
+     *  reported (0 or 1 to report immediately) */
+    unsigned int            debounce;
+};
+
+/** A state transition */
+struct i2c_mon_event {
+    const struct i2c_mon_sensor* sensor;
+    enum i2c_mon_state      from;
+    enum i2c_mon_state      to;
+    /** The value that caused the transition (NAN for a fault) */
+    double                  value;
+    /** Bus time of the poll, see i2c_bus_time_ns() */
+    uint64_t                time_ns;
+};
+
+/** Called for each transition */
+typedef void (*i2c_mon_cb)(const struct i2c_mon_event* event, void* user);
+
+/** Monitor counters */
+struct i2c_mon_stats {
+    /** Sensor reads performed */
+    unsigned long           polls;
+    /** Reads that failed */
+    unsigned long           errors;
+    /** Polls made at the fast rate */
+    unsigned long           fast_polls;
+    /** Transitions reported */
+    unsigned long           events;
+};
+
+/**
+ * @brief Create a monitor for sensors on a bus
+ *
+ * @return The monitor, or NULL on failure with errno set
+ */
+struct i2c_mon* i2c_mon_create(
+    struct i2c_bus*         bus);
+
+/**
+ * @brief Set the poll periods
+ *
+ * Sensors are polled every period_ms, or every fast_period_ms while their
+ * value is within near_pct percent of the threshold span of a threshold, or
+ * a new state is waiting out its debounce.
+ */
+void i2c_mon_set_period(
+    struct i2c_mon*         mon,
+    unsigned long           period_ms,
+    unsigned long           fast_period_ms,
+    unsigned int            near_pct);
+
+/**
+ * @brief Add a sensor to the monitor
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int i2c_mon_add(
+    struct i2c_mon*         mon,
+    const struct i2c_mon_sensor* sensor);
+
+/**
+ * @brief Add the sensors and settings in a config file
+ *
+ * Blank lines and text after a '#' are ignored. Settings are
+ * "period <ms>", "fast_period <ms>" and "near <percent>", where the periods
+ * must be non-zero. Every other line
+ * is a sensor:
+ *
+ *   name addr reg offset_len bytes endian decode shift scale low high hyst debounce
+ *
+ * where endian is "be" or "le", decode is "u", "s" or "linear11" and low or
+ * high may be "-" for no threshold. Numbers may be decimal or 0x hex.
+ *
+ * @return 0 on success, -1 on failure with errno set (EINVAL for a bad
+ *         line, which is reported on stdout)
+ */
+int i2c_mon_load(
+    struct i2c_mon*         mon,
+    const char*             path);
+
+/**
+ * @brief Poll every sensor that is due at the current bus time
+ *
+ * @param mon - The monitor
+ * @param cb - Called for each transition
+ * @param user - Passed to cb
+ *
+ * @return The bus time at which the next sensor is due
+ */
+uint64_t i2c_mon_poll(
+    struct i2c_mon*         mon,
+    i2c_mon_cb              cb,
+    void*                   user);
+
+/**
+ * @brief Poll sensors as they become due, waiting in between with
+ *        i2c_bus_delay(), until duration_ns of bus time has passed (0 for
+ *        no limit) or *stop becomes non-zero
+ */
+void i2c_mon_run(
+    struct i2c_mon*         mon,
+    uint64_t                duration_ns,
+    volatile int*           stop,
+    i2c_mon_cb              cb,
+    void*                   user);
+
+/**
+ * @brief Get the monitor counters
+ */
+void i2c_mon_get_stats(
+    struct i2c_mon*         mon,
+    struct i2c_mon_stats*   stats);
+
+/**
+ * @brief Get the name of a state
+ */
+const char* i2c_mon_state_name(
+    enum i2c_mon_state      state);
+
+/**
+ * @brief Free a monitor. The bus is not closed
+ */
+void i2c_mon_destroy(
+    struct i2c_mon*         mon);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* I2C_MON_H */
@@ -0,0 +1,1195 @@
+/**
+ * Simulated I2C adapter and device models
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "i2c_sim.h"
+
+#define SIM_DEFAULT_HZ                  100000
+#define SIM_DEFAULT_IOCTL_US            50
+#define SIM_DEFAULT_TWR_US              5000
+/** Bits on the wire for a START (or repeated START) plus the address byte and
+ *  its ACK */
+#define SIM_ADDR_BITS                   10
+/** Extra bits for the second address byte of a 10-bit address */
+#define SIM_TEN_ADDR_BITS               9
+/** Bits on the wire for a data byte and its ACK */
+#define SIM_BYTE_BITS                   9
+#define SIM_MAX_PMBUS_PAGES             4
+#define SIM_MAX_MUX_CHANNELS            8
+
+/** PMBus command codes understood by the regulator model */
+#define PMBUS_PAGE                      0x00
+#define PMBUS_OPERATION                 0x01
+#define PMBUS_VOUT_MODE                 0x20
+#define PMBUS_STATUS_BYTE               0x78
+#define PMBUS_STATUS_WORD               0x79
+#define PMBUS_READ_VIN                  0x88
+#define PMBUS_READ_VOUT                 0x8b
+#define PMBUS_READ_IOUT                 0x8c
+#define PMBUS_READ_TEMPERATURE_1        0x8d
+#define PMBUS_REVISION                  0x98
+#define PMBUS_MFR_ID                    0x99
+#define PMBUS_MFR_MODEL                 0x9a
+/** VOUT_MODE reported by the model: linear format with an exponent of -9 */
+#define PMBUS_SIM_VOUT_MODE             0x17
+#define PMBUS_SIM_VOUT_EXP              9
+
+/** Sample IPMI FRU image (chassis, board, product and multirecord areas)
+ *  preloaded into the default 24C02 at 0x50 */
+static const uint8_t sim_fru_image[] = {
+    0x01, 0x00, 0x01, 0x04, 0x0a, 0x11, 0x00, 0xdf, 0x01, 0x03, 0x17, 0xc4,
+    0x43, 0x48, 0x2d, 0x39, 0x86, 0x23, 0x64, 0x9a, 0x65, 0x09, 0x00, 0xc1,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x5a, 0x01, 0x06, 0x00, 0xa0,
+    0x97, 0xb8, 0xc8, 0x53, 0x69, 0x6d, 0x20, 0x43, 0x6f, 0x72, 0x70, 0x86,
+    0x73, 0xda, 0x8a, 0x6f, 0x28, 0x93, 0x45, 0x12, 0x34, 0xb5, 0x67, 0x8a,
+    0xc7, 0x53, 0x42, 0x2d, 0x30, 0x30, 0x30, 0x31, 0x02, 0x01, 0x02, 0xc1,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x9d, 0x01, 0x07, 0x00, 0xc8,
+    0x53, 0x69, 0x6d, 0x20, 0x43, 0x6f, 0x72, 0x70, 0xd0, 0x53, 0x69, 0x6d,
+    0x75, 0x6c, 0x61, 0x74, 0x65, 0x64, 0x20, 0x53, 0x65, 0x72, 0x76, 0x65,
+    0x72, 0xc6, 0x53, 0x53, 0x2d, 0x31, 0x30, 0x30, 0xc2, 0x41, 0x31, 0x44,
+    0x20, 0x19, 0x01, 0x01, 0xc8, 0x41, 0x53, 0x53, 0x45, 0x54, 0x2d, 0x34,
+    0x32, 0x00, 0xc1, 0xcb, 0xc0, 0x82, 0x03, 0xfa, 0xc1, 0x01, 0x02, 0x03,
+};
+
+enum sim_kind {
+    SIM_EEPROM,
+    SIM_LM75,
+    SIM_MUX,
+    SIM_PMBUS,
+};
+
+struct i2c_sim_dev {
+    enum sim_kind           kind;
+    unsigned short          addr;
+    /** The mux this device sits behind and the channel it is on */
+    struct i2c_sim_dev*     parent;
+    unsigned int            channel;
+    /** Extra time each transaction addressed to this device takes */
+    uint64_t                latency_ns;
+    /** The bus the device is attached to */
+    struct sim_bus*         sim;
+    /** Bytes written to the device since the last START */
+    unsigned int            wr_idx;
+    /** Bytes read from the device since the last START */
+    unsigned int            rd_idx;
+    struct i2c_sim_dev*     next;
+
+    union {
+        struct {
+            uint8_t*        mem;
+            unsigned long   size;
+            unsigned int    page_size;
+            unsigned int    offset_len;
+            unsigned long   ptr;
+            uint64_t        twr_ns;
+            uint64_t        busy_until;
+            int             written;
+        } eeprom;
+        struct {
+            long            temp_mc;
+            uint8_t         ptr;
+            uint8_t         conf;
+            uint16_t        thyst;
+            uint16_t        tos;
+            uint16_t        wr_val;
+        } lm75;
+        struct {
+            unsigned int    channels;
+            uint8_t         ctrl;
+        } mux;
+        struct {
+            unsigned int    pages;
+            uint8_t         page;
+            uint8_t         cmd;
+            uint8_t         operation[SIM_MAX_PMBUS_PAGES];
+            long            vin[SIM_MAX_PMBUS_PAGES];
+            long            vout[SIM_MAX_PMBUS_PAGES];
+            long            iout[SIM_MAX_PMBUS_PAGES];
+            long            temp[SIM_MAX_PMBUS_PAGES];
+            uint8_t         wr_data[I2C_SMBUS_BLOCK_MAX + 1];
+            uint8_t         resp[I2C_SMBUS_BLOCK_MAX + 1];
+            unsigned int    resp_len;
+        } pmbus;
+    } u;
+};
+
+struct sim_bus {
+    struct i2c_bus          bus;
+    unsigned long           funcs;
+    /** The virtual clock */
+    uint64_t                now_ns;
+    uint64_t                bit_ns;
+    uint64_t                ioctl_ns;
+    uint64_t                default_latency_ns;
+    uint64_t                twr_ns;
+    int                     realtime;
+    /** Emulated adapter quirk: the most messages in one I2C_RDWR, 0 if
+     *  unlimited */
+    unsigned int            max_msgs;
+    unsigned short          slave_addr;
+    /** Non-zero once I2C_TENBIT has selected 10-bit slave addresses */
+    int                     slave_ten;
+    struct i2c_sim_dev*     devs;
+    struct i2c_sim_stats    stats;
+};
+
+static int sim_ioctl(
+    struct i2c_bus*         bus,
+    unsigned long           request,
+    void*                   arg);
+
+static void sim_delay(
+    struct i2c_bus*         bus,
+    unsigned long           usecs);
+
+static uint64_t sim_time_ns(
+    struct i2c_bus*         bus);
+
+static void sim_close(
+    struct i2c_bus*         bus);
+
+static int sim_parse_options(
+    struct sim_bus*         sim,
+    const char*             options,
+    int*                    empty);
+
+static void sim_add_defaults(
+    struct sim_bus*         sim);
+
+static struct i2c_sim_dev* sim_new_dev(
+    struct i2c_bus*         bus,
+    struct i2c_sim_dev*     mux,
+    unsigned int            channel,
+    unsigned short          addr,
+    enum sim_kind           kind);
+
+static int sim_xfer(
+    struct sim_bus*         sim,
+    struct i2c_msg*         msgs,
+    unsigned int            nmsgs);
+
+static int sim_smbus(
+    struct sim_bus*         sim,
+    struct i2c_smbus_ioctl_data* smb);
+
+static int dev_start(
+    struct i2c_sim_dev*     dev,
+    int                     read);
+
+static void dev_write(
+    struct i2c_sim_dev*     dev,
+    uint8_t                 byte);
+
+static uint8_t dev_read(
+    struct i2c_sim_dev*     dev);
+
+static void dev_stop(
+    struct i2c_sim_dev*     dev);
+
+static void pmbus_build_response(
+    struct i2c_sim_dev*     dev);
+
+static uint16_t pmbus_linear11(
+    long                    milli);
+
+static const struct i2c_bus_ops sim_ops = {
+    .ioctl = sim_ioctl,
+    .delay = sim_delay,
+    .time_ns = sim_time_ns,
+    .close = sim_close,
+};
+
+struct i2c_bus* i2c_sim_open(
+    const char*             options)
+{
+    struct sim_bus* sim = NULL;
+    int empty = 0;
+
+    sim = calloc(1, sizeof(*sim));
+    if(!sim) {
+        return NULL;
+    }
+
+    sim->bus.ops = &sim_ops;
+    sim->bus.fd = -1;
+    sim->bus.priv = sim;
+    /* The simulated adapter only exists within this process */
+    sim->bus.lock_fd = -1;
+    sim->bus.lock_disabled = 1;
+    snprintf(sim->bus.name, sizeof(sim->bus.name), "i2c-sim");
+
+    sim->funcs = I2C_FUNC_I2C | I2C_FUNC_10BIT_ADDR | I2C_FUNC_SMBUS_EMUL_ALL;
+    sim->bit_ns = 1000000000ull / SIM_DEFAULT_HZ;
+    sim->ioctl_ns = SIM_DEFAULT_IOCTL_US * 1000ull;
+    sim->twr_ns = SIM_DEFAULT_TWR_US * 1000ull;
+
+    if(sim_parse_options(sim, options, &empty) < 0) {
+        free(sim);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(!empty) {
+        sim_add_defaults(sim);
+    }
+
+    return &sim->bus;
+}
+
+int i2c_sim_is_sim(
+    struct i2c_bus*         bus)
+{
+    return bus && bus->ops == &sim_ops;
+}
+
+struct i2c_sim_dev* i2c_sim_add_eeprom(
+    struct i2c_bus*         bus,
+    struct i2c_sim_dev*     mux,
+    unsigned int            channel,
+    unsigned short          addr,
+    unsigned long           size,
+    unsigned int            page_size,
+    unsigned int            offset_len)
+{
+    struct i2c_sim_dev* dev = NULL;
+    uint8_t* mem = NULL;
+
+    if(!size || !page_size || (page_size & (page_size - 1)) ||
+       offset_len < 1 || offset_len > 4) {
+        return NULL;
+    }
+
+    /* Allocate before the device is linked into the bus, so a failure
+     * leaves nothing behind */
+    mem = malloc(size);
+    if(!mem) {
+        return NULL;
+    }
+
+    dev = sim_new_dev(bus, mux, channel, addr, SIM_EEPROM);
+    if(!dev) {
+        free(mem);
+        return NULL;
+    }
+
+    /* Ship erased */
+    memset(mem, 0xff, size);
+    dev->u.eeprom.mem = mem;
+    dev->u.eeprom.size = size;
+    dev->u.eeprom.page_size = page_size;
+    dev->u.eeprom.offset_len = offset_len;
+    dev->u.eeprom.twr_ns = dev->sim->twr_ns;
+
+    return dev;
+}
+
+struct i2c_sim_dev* i2c_sim_add_lm75(
+    struct i2c_bus*         bus,
+    struct i2c_sim_dev*     mux,
+    unsigned int            channel,
+    unsigned short          addr)
+{
+    struct i2c_sim_dev* dev = NULL;
+
+    dev = sim_new_dev(bus, mux, channel, addr, SIM_LM75);
+    if(!dev) {
+        return NULL;
+    }
+
+    /* Power on defaults: 25C, THYST 75C, TOS 80C */
+    dev->u.lm75.temp_mc = 25000;
+    dev->u.lm75.thyst = 75 << 8;
+    dev->u.lm75.tos = 80 << 8;
+
+    return dev;
+}
+
+struct i2c_sim_dev* i2c_sim_add_mux(
+    struct i2c_bus*         bus,
+    struct i2c_sim_dev*     mux,
+    unsigned int            channel,
+    unsigned short          addr,
+    unsigned int            channels)
+{
+    struct i2c_sim_dev* dev = NULL;
+
+    if(!channels || channels > SIM_MAX_MUX_CHANNELS) {
+        return NULL;
+    }
+
+    dev = sim_new_dev(bus, mux, channel, addr, SIM_MUX);
+    if(!dev) {
+        return NULL;
+    }
+
+    dev->u.mux.channels = channels;
+
+    return dev;
+}
+
+struct i2c_sim_dev* i2c_sim_add_pmbus(
+    struct i2c_bus*         bus,
+    struct i2c_sim_dev*     mux,
+    unsigned int            channel,
+    unsigned short          addr,
+    unsigned int            pages)
+{
+    struct i2c_sim_dev* dev = NULL;
+    unsigned int page = 0;
+
+    if(!pages || pages > SIM_MAX_PMBUS_PAGES) {
+        return NULL;
+    }
+
+    dev = sim_new_dev(bus, mux, channel, addr, SIM_PMBUS);
+    if(!dev) {
+        return NULL;
+    }
+
+    dev->u.pmbus.pages = pages;
+    for(page = 0; page < pages; ++page) {
+        dev->u.pmbus.operation[page] = 0x80;
+        dev->u.pmbus.vin[page] = 12000;
+        dev->u.pmbus.vout[page] = 1000 + 800 * page;
+        dev->u.pmbus.iout[page] = 10000;
+        dev->u.pmbus.temp[page] = 40000;
+    }
+
+    return dev;
+}
+
+void i2c_sim_set_latency(
+    struct i2c_sim_dev*     dev,
+    unsigned long           usecs)
+{
+    if(dev) {
+        dev->latency_ns = usecs * 1000ull;
+    }
+}
+
+void i2c_sim_eeprom_set_write_time(
+    struct i2c_sim_dev*     dev,
+    unsigned long           usecs)
+{
+    if(dev && dev->kind == SIM_EEPROM) {
+        dev->u.eeprom.twr_ns = usecs * 1000ull;
+    }
+}
+
+uint8_t* i2c_sim_eeprom_data(
+    struct i2c_sim_dev*     dev,
+    unsigned long*          size)
+{
+    if(!dev || dev->kind != SIM_EEPROM) {
+        return NULL;
+    }
+
+    if(size) {
+        *size = dev->u.eeprom.size;
+    }
+
+    return dev->u.eeprom.mem;
+}
+
+void i2c_sim_lm75_set_temp(
+    struct i2c_sim_dev*     dev,
+    long                    millideg)
+{
+    if(dev && dev->kind == SIM_LM75) {
+        dev->u.lm75.temp_mc = millideg;
+    }
+}
+
+void i2c_sim_pmbus_set(
+    struct i2c_sim_dev*     dev,
+    unsigned int            page,
+    unsigned char           command,
+    long                    milli)
+{
+    if(!dev || dev->kind != SIM_PMBUS || page >= dev->u.pmbus.pages) {
+        return;
+    }
+
+    switch(command) {
+        case PMBUS_READ_VIN:
+            dev->u.pmbus.vin[page] = milli;
+            break;
+        case PMBUS_READ_VOUT:
+            dev->u.pmbus.vout[page] = milli;
+            break;
+        case PMBUS_READ_IOUT:
+            dev->u.pmbus.iout[page] = milli;
+            break;
+        case PMBUS_READ_TEMPERATURE_1:
+            dev->u.pmbus.temp[page] = milli;
+            break;
+        default:
+            break;
+    }
+}
+
+void i2c_sim_get_stats(
+    struct i2c_bus*         bus,
+    struct i2c_sim_stats*   stats)
+{
+    if(!i2c_sim_is_sim(bus)) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    *stats = ((struct sim_bus*)bus->priv)->stats;
+}
+
+static int sim_parse_options(
+    struct sim_bus*         sim,
+    const char*             options,
+    int*                    empty)
+{
+    char* copy = NULL;
+    char* save = NULL;
+    char* opt = NULL;
+    char* val = NULL;
+    unsigned long num = 0;
+    int ret = 0;
+
+    if(!options || !*options) {
+        return 0;
+    }
+
+    copy = strdup(options);
+    if(!copy) {
+        return -1;
+    }
+
+    for(opt = strtok_r(copy, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+        val = strchr(opt, '=');
+        if(val) {
+            *val++ = '\0';
+            num = strtoul(val, NULL, 0);
+        }
+
+        if(strcmp(opt, "smbus") == 0) {
+            sim->funcs &= ~I2C_FUNC_I2C;
+            sim->funcs &= ~(I2C_FUNC_SMBUS_READ_BLOCK_DATA |
+                            I2C_FUNC_SMBUS_BLOCK_PROC_CALL);
+        } else if(strcmp(opt, "empty") == 0) {
+            *empty = 1;
+        } else if(strcmp(opt, "realtime") == 0) {
+            sim->realtime = 1;
+        } else if(strcmp(opt, "hz") == 0 && val && num) {
+            sim->bit_ns = 1000000000ull / num;
+        } else if(strcmp(opt, "ioctl_us") == 0 && val) {
+            sim->ioctl_ns = num * 1000ull;
+        } else if(strcmp(opt, "lat_us") == 0 && val) {
+            sim->default_latency_ns = num * 1000ull;
+        } else if(strcmp(opt, "twr_us") == 0 && val) {
+            sim->twr_ns = num * 1000ull;
+        } else if(strcmp(opt, "max_msgs") == 0 && val && num) {
+            sim->max_msgs = num;
+        } else {
+            printf("Unknown simulated adapter option: %s\n", opt);
+            ret = -1;
+            break;
+        }
+    }
+
+    free(copy);
+
+    return ret;
+}
+
+static void sim_add_defaults(
+    struct sim_bus*         sim)
+{
+    struct i2c_bus* bus = &sim->bus;
+    struct i2c_sim_dev* mux = NULL;
+    struct i2c_sim_dev* fru = NULL;
+
+    i2c_sim_add_pmbus(bus, NULL, 0, 0x40, 2);
+    i2c_sim_add_lm75(bus, NULL, 0, 0x48);
+
+    fru = i2c_sim_add_eeprom(bus, NULL, 0, 0x50, 256, 8, 1);
+    if(fru) {
+        memcpy(fru->u.eeprom.mem, sim_fru_image, sizeof(sim_fru_image));
+    }
+
+    i2c_sim_add_eeprom(bus, NULL, 0, 0x51, 32768, 64, 2);
+    i2c_sim_add_eeprom(bus, NULL, 0, 0x53, 131072, 256, 4);
+    i2c_sim_add_eeprom(bus, NULL, 0, 0x2a0 | I2C_ADDR_TEN, 262144, 256, 3);
+
+    mux = i2c_sim_add_mux(bus, NULL, 0, 0x70, 8);
+    i2c_sim_lm75_set_temp(i2c_sim_add_lm75(bus, mux, 0, 0x49), 30000);
+    i2c_sim_add_eeprom(bus, mux, 1, 0x54, 256, 8, 1);
+}
+
+static struct i2c_sim_dev* sim_new_dev(
+    struct i2c_bus*         bus,
+    struct i2c_sim_dev*     mux,
+    unsigned int            channel,
+    unsigned short          addr,
+    enum sim_kind           kind)
+{
+    struct sim_bus* sim = NULL;
+    struct i2c_sim_dev* dev = NULL;
+    struct i2c_sim_dev** tail = NULL;
+
+    if(!i2c_sim_is_sim(bus)) {
+        return NULL;
+    }
+
+    if(mux && (mux->kind != SIM_MUX || channel >= mux->u.mux.channels)) {
+        return NULL;
+    }
+
+    sim = bus->priv;
+
+    dev = calloc(1, sizeof(*dev));
+    if(!dev) {
+        return NULL;
+    }
+
+    dev->kind = kind;
+    dev->addr = addr;
+    dev->parent = mux;
+    dev->channel = channel;
+    dev->sim = sim;
+    dev->latency_ns = sim->default_latency_ns;
+
+    /* Keep the devices in the order they were added */
+    for(tail = &sim->devs; *tail; tail = &(*tail)->next);
+    *tail = dev;
+
+    return dev;
+}
+
+/**
+ * @brief Check whether a device is reachable, i.e. every mux between it and
+ *        the root bus has its channel enabled
+ */
+static int sim_dev_visible(
+    struct i2c_sim_dev*     dev)
+{
+    for(; dev->parent; dev = dev->parent) {
+        if(!(dev->parent->u.mux.ctrl & (1u << dev->channel))) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static struct i2c_sim_dev* sim_find(
+    struct sim_bus*         sim,
+    unsigned short          addr)
+{
+    struct i2c_sim_dev* dev = NULL;
+
+    for(dev = sim->devs; dev; dev = dev->next) {
+        if(dev->addr == addr && sim_dev_visible(dev)) {
+            return dev;
+        }
+    }
+
+    return NULL;
+}
+
+static void sim_advance(
+    struct sim_bus*         sim,
+    uint64_t                ns)
+{
+    struct timespec ts;
+
+    sim->now_ns += ns;
+
+    if(sim->realtime && ns) {
+        ts.tv_sec = ns / 1000000000ull;
+        ts.tv_nsec = ns % 1000000000ull;
+        nanosleep(&ts, NULL);
+    }
+}
+
+static int sim_ioctl(
+    struct i2c_bus*         bus,
+    unsigned long           request,
+    void*                   arg)
+{
+    struct sim_bus* sim = bus->priv;
+    struct i2c_rdwr_ioctl_data* rdwr = NULL;
+
+    switch(request) {
+        case I2C_FUNCS:
+            *(unsigned long*)arg = sim->funcs;
+            return 0;
+        case I2C_SLAVE:
+        case I2C_SLAVE_FORCE:
+            if((unsigned long)arg > (sim->slave_ten ? 0x3ffUL : 0x7fUL)) {
+                errno = EINVAL;
+                return -1;
+            }
+            sim->slave_addr = (unsigned short)(unsigned long)arg;
+            return 0;
+        case I2C_TENBIT:
+            if(arg && !(sim->funcs & I2C_FUNC_10BIT_ADDR)) {
+                errno = EINVAL;
+                return -1;
+            }
+            sim->slave_ten = !!arg;
+            return 0;
+        case I2C_RDWR:
+            if(!(sim->funcs & I2C_FUNC_I2C)) {
+                errno = EOPNOTSUPP;
+                return -1;
+            }
+            rdwr = arg;
+            if(!rdwr->nmsgs || rdwr->nmsgs > I2C_RDWR_IOCTL_MAX_MSGS) {
+                errno = EINVAL;
+                return -1;
+            }
+            /* Like the kernel's quirk check, before anything is sent */
+            if(sim->max_msgs && rdwr->nmsgs > sim->max_msgs) {
+                errno = EOPNOTSUPP;
+                return -1;
+            }
+            return sim_xfer(sim, rdwr->msgs, rdwr->nmsgs);
+        case I2C_SMBUS:
+            return sim_smbus(sim, arg);
+        default:
+            errno = ENOTTY;
+            return -1;
+    }
+}
+
+static void sim_delay(
+    struct i2c_bus*         bus,
+    unsigned long           usecs)
+{
+    sim_advance(bus->priv, usecs * 1000ull);
+}
+
+static uint64_t sim_time_ns(
+    struct i2c_bus*         bus)
+{
+    return ((struct sim_bus*)bus->priv)->now_ns;
+}
+
+static void sim_close(
+    struct i2c_bus*         bus)
+{
+    struct sim_bus* sim = bus->priv;
+    struct i2c_sim_dev* dev = NULL;
+    struct i2c_sim_dev* next = NULL;
+
+    for(dev = sim->devs; dev; dev = next) {
+        next = dev->next;
+        if(dev->kind == SIM_EEPROM) {
+            free(dev->u.eeprom.mem);
+        }
+        free(dev);
+    }
+
+    free(sim);
+}
+
+/**
+ * @brief Run a combined transaction: each message starts with a START (or a
+ *        repeated START) and the whole transaction ends with a single STOP
+ *
+ * @return The number of messages transferred, or -1 with errno set
+ */
+static int sim_xfer(
+    struct sim_bus*         sim,
+    struct i2c_msg*         msgs,
+    unsigned int            nmsgs)
+{
+    struct i2c_sim_dev* active = NULL;
+    struct i2c_sim_dev* dev = NULL;
+    unsigned int m = 0;
+    unsigned int b = 0;
+    unsigned int len = 0;
+    int read = 0;
+    int ret = (int)nmsgs;
+
+    sim->stats.transactions++;
+    sim_advance(sim, sim->ioctl_ns);
+
+    for(m = 0; m < nmsgs; ++m) {
+        read = !!(msgs[m].flags & I2C_M_RD);
+
+        sim->stats.messages++;
+        sim_advance(sim, SIM_ADDR_BITS * sim->bit_ns);
+
+        if(msgs[m].flags & I2C_M_TEN) {
+            sim_advance(sim, SIM_TEN_ADDR_BITS * sim->bit_ns);
+            dev = msgs[m].addr > 0x3ff ? NULL :
+                  sim_find(sim, msgs[m].addr | I2C_ADDR_TEN);
+        } else {
+            dev = sim_find(sim, msgs[m].addr);
+        }
+
+        /* A repeated START addressed to another device ends the current
+         * device's transaction as far as it is concerned */
+        if(active && active != dev) {
+            dev_stop(active);
+            active = NULL;
+        }
+
+        if(!dev || dev_start(dev, read) < 0) {
+            sim->stats.naks++;
+            errno = ENXIO;
+            ret = -1;
+            break;
+        }
+
+        active = dev;
+        sim_advance(sim, dev->latency_ns);
+
+        len = msgs[m].len;
+        for(b = 0; b < len; ++b) {
+            if(read) {
+                msgs[m].buf[b] = dev_read(dev);
+
+                /* SMBus block reads take their length from the first byte */
+                if(b == 0 && (msgs[m].flags & I2C_M_RECV_LEN)) {
+                    if(msgs[m].buf[0] > I2C_SMBUS_BLOCK_MAX) {
+                        errno = EPROTO;
+                        ret = -1;
+                        break;
+                    }
+                    len = msgs[m].buf[0] + 1;
+                    msgs[m].len = len;
+                }
+            } else {
+                dev_write(dev, msgs[m].buf[b]);
+            }
+        }
+
+        sim->stats.bytes += b;
+        sim_advance(sim, (uint64_t)b * SIM_BYTE_BITS * sim->bit_ns);
+
+        if(ret < 0) {
+            break;
+        }
+    }
+
+    if(active) {
+        dev_stop(active);
+    }
+
+    /* The STOP condition */
+    sim_advance(sim, sim->bit_ns);
+
+    return ret;
+}
+
+/**
+ * @brief Emulate an SMBus transfer on top of I2C messages, the same way the
+ *        kernel does for adapters that only implement master_xfer
+ */
+static int sim_smbus(
+    struct sim_bus*         sim,
+    struct i2c_smbus_ioctl_data* smb)
+{
+    union i2c_smbus_data* data = smb->data;
+    uint8_t wr_buf[I2C_SMBUS_BLOCK_MAX + 3] = {0};
+    uint8_t rd_buf[I2C_SMBUS_BLOCK_MAX + 2] = {0};
+    struct i2c_msg msgs[2] = {
+        { .addr = sim->slave_addr, .flags = 0, .len = 1, .buf = wr_buf },
+        { .addr = sim->slave_addr, .flags = I2C_M_RD, .len = 0, .buf = rd_buf },
+    };
+    unsigned int nmsgs = 2;
+    int read = smb->read_write == I2C_SMBUS_READ;
+    int ret = 0;
+
+    wr_buf[0] = smb->command;
+
+    switch(smb->size) {
+        case I2C_SMBUS_QUICK:
+            msgs[0].len = 0;
+            msgs[0].flags = read ? I2C_M_RD : 0;
+            nmsgs = 1;
+            break;
+        case I2C_SMBUS_BYTE:
+            if(read) {
+                msgs[0] = msgs[1];
+                msgs[0].len = 1;
+            }
+            nmsgs = 1;
+            break;
+        case I2C_SMBUS_BYTE_DATA:
+            if(read) {
+                msgs[1].len = 1;
+            } else {
+                msgs[0].len = 2;
+                wr_buf[1] = data->byte;
+                nmsgs = 1;
+            }
+            break;
+        case I2C_SMBUS_WORD_DATA:
+            if(read) {
+                msgs[1].len = 2;
+            } else {
+                msgs[0].len = 3;
+                wr_buf[1] = data->word & 0xff;
+                wr_buf[2] = data->word >> 8;
+                nmsgs = 1;
+            }
+            break;
+        case I2C_SMBUS_PROC_CALL:
+            msgs[0].len = 3;
+            wr_buf[1] = data->word & 0xff;
+            wr_buf[2] = data->word >> 8;
+            msgs[1].len = 2;
+            break;
+        case I2C_SMBUS_BLOCK_DATA:
+            if(read) {
+                if(!(sim->funcs & I2C_FUNC_SMBUS_READ_BLOCK_DATA)) {
+                    errno = EOPNOTSUPP;
+                    return -1;
+                }
+                msgs[1].flags |= I2C_M_RECV_LEN;
+                msgs[1].len = 1;
+            } else {
+                if(data->block[0] > I2C_SMBUS_BLOCK_MAX) {
+                    errno = EINVAL;
+                    return -1;
+                }
+                msgs[0].len = data->block[0] + 2;
+                memcpy(&wr_buf[1], data->block, data->block[0] + 1);
+                nmsgs = 1;
+            }
+            break;
+        case I2C_SMBUS_I2C_BLOCK_BROKEN:
+        case I2C_SMBUS_I2C_BLOCK_DATA:
+            if(data->block[0] > I2C_SMBUS_BLOCK_MAX) {
+                errno = EINVAL;
+                return -1;
+            }
+            if(read) {
+                msgs[1].len = data->block[0];
+            } else {
+                msgs[0].len = data->block[0] + 1;
+                memcpy(&wr_buf[1], &data->block[1], data->block[0]);
+                nmsgs = 1;
+            }
+            break;
+        default:
+            errno = EOPNOTSUPP;
+            return -1;
+    }
+
+    if(sim->slave_ten) {
+        msgs[0].flags |= I2C_M_TEN;
+        msgs[1].flags |= I2C_M_TEN;
+    }
+
+    /* Plain I2C transfers may be disabled, but the emulation still uses
+     * them internally */
+    ret = sim_xfer(sim, msgs, nmsgs);
+    if(ret < 0) {
+        return -1;
+    }
+
+    if(read) {
+        switch(smb->size) {
+            case I2C_SMBUS_BYTE:
+                data->byte = msgs[0].buf[0];
+                break;
+            case I2C_SMBUS_BYTE_DATA:
+                data->byte = rd_buf[0];
+                break;
+            case I2C_SMBUS_WORD_DATA:
+            case I2C_SMBUS_PROC_CALL:
+                data->word = rd_buf[0] | (rd_buf[1] << 8);
+                break;
+            case I2C_SMBUS_BLOCK_DATA:
+                memcpy(data->block, rd_buf, rd_buf[0] + 1);
+                break;
+            case I2C_SMBUS_I2C_BLOCK_BROKEN:
+            case I2C_SMBUS_I2C_BLOCK_DATA:
+                memcpy(&data->block[1], rd_buf, data->block[0]);
+                break;
+            default:
+                break;
+        }
+    } else if(smb->size == I2C_SMBUS_PROC_CALL) {
+        data->word = rd_buf[0] | (rd_buf[1] << 8);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Address a device
+ *
+ * @return 0 if the device ACKs, -1 if it NACKs
+ */
+static int dev_start(
+    struct i2c_sim_dev*     dev,
+    int                     read)
+{
+    if(dev->kind == SIM_EEPROM && dev->sim->now_ns < dev->u.eeprom.busy_until) {
+        /* Busy committing a previous write */
+        return -1;
+    }
+
+    if(!read) {
+        dev->wr_idx = 0;
+    }
+    dev->rd_idx = 0;
+
+    return 0;
+}
+
+static void dev_write(
+    struct i2c_sim_dev*     dev,
+    uint8_t                 byte)
+{
+    unsigned long ptr = 0;
+    unsigned int idx = dev->wr_idx++;
+
+    switch(dev->kind) {
+        case SIM_EEPROM:
+            if(idx < dev->u.eeprom.offset_len) {
+                /* Loading the address pointer, msb first */
+                ptr = idx ? dev->u.eeprom.ptr << 8 : 0;
+                dev->u.eeprom.ptr = (ptr | byte);
+                if(idx + 1 == dev->u.eeprom.offset_len) {
+                    dev->u.eeprom.ptr %= dev->u.eeprom.size;
+                }
+            } else {
+                /* Data - the address wraps within the current page */
+                ptr = dev->u.eeprom.ptr;
+                dev->u.eeprom.mem[ptr] = byte;
+                dev->u.eeprom.ptr = (ptr & ~(unsigned long)(dev->u.eeprom.page_size - 1)) |
+                                    ((ptr + 1) & (dev->u.eeprom.page_size - 1));
+                dev->u.eeprom.written = 1;
+            }
+            break;
+
+        case SIM_LM75:
+            if(idx == 0) {
+                dev->u.lm75.ptr = byte & 0x3;
+            } else if(dev->u.lm75.ptr == 1) {
+                dev->u.lm75.conf = byte;
+            } else if(dev->u.lm75.ptr >= 2 && idx <= 2) {
+                dev->u.lm75.wr_val = (dev->u.lm75.wr_val << 8) | byte;
+                if(idx == 2) {
+                    if(dev->u.lm75.ptr == 2) {
+                        dev->u.lm75.thyst = dev->u.lm75.wr_val & 0xff80;
+                    } else {
+                        dev->u.lm75.tos = dev->u.lm75.wr_val & 0xff80;
+                    }
+                }
+            }
+            break;
+
+        case SIM_MUX:
+            dev->u.mux.ctrl = byte & ((1u << dev->u.mux.channels) - 1);
+            break;
+
+        case SIM_PMBUS:
+            if(idx == 0) {
+                dev->u.pmbus.cmd = byte;
+            } else if(idx <= sizeof(dev->u.pmbus.wr_data)) {
+                dev->u.pmbus.wr_data[idx - 1] = byte;
+            }
+            break;
+    }
+}
+
+static uint8_t dev_read(
+    struct i2c_sim_dev*     dev)
+{
+    unsigned int idx = dev->rd_idx++;
+    uint16_t val = 0;
+    uint8_t byte = 0xff;
+
+    switch(dev->kind) {
+        case SIM_EEPROM:
+            byte = dev->u.eeprom.mem[dev->u.eeprom.ptr];
+            dev->u.eeprom.ptr = (dev->u.eeprom.ptr + 1) % dev->u.eeprom.size;
+            break;
+
+        case SIM_LM75:
+            switch(dev->u.lm75.ptr) {
+                case 0:
+                    val = (uint16_t)((int16_t)(dev->u.lm75.temp_mc / 500) << 7);
+                    break;
+                case 1:
+                    return dev->u.lm75.conf;
+                case 2:
+                    val = dev->u.lm75.thyst;
+                    break;
+                default:
+                    val = dev->u.lm75.tos;
+                    break;
+            }
+            /* 16 bit registers repeat msb, lsb for as long as we read */
+            byte = (idx & 1) ? (val & 0xff) : (val >> 8);
+            break;
+
+        case SIM_MUX:
+            byte = dev->u.mux.ctrl;
+            break;
+
+        case SIM_PMBUS:
+            if(idx == 0) {
+                pmbus_build_response(dev);
+            }
+            if(idx < dev->u.pmbus.resp_len) {
+                byte = dev->u.pmbus.resp[idx];
+            }
+            break;
+    }
+
+    return byte;
+}
+
+static void dev_stop(
+    struct i2c_sim_dev*     dev)
+{
+    switch(dev->kind) {
+        case SIM_EEPROM:
+            if(dev->u.eeprom.written) {
+                dev->u.eeprom.written = 0;
+                dev->u.eeprom.busy_until = dev->sim->now_ns + dev->u.eeprom.twr_ns;
+            }
+            break;
+
+        case SIM_PMBUS:
+            /* Commands with data take effect on the STOP */
+            if(dev->wr_idx >= 2) {
+                if(dev->u.pmbus.cmd == PMBUS_PAGE &&
+                   dev->u.pmbus.wr_data[0] < dev->u.pmbus.pages) {
+                    dev->u.pmbus.page = dev->u.pmbus.wr_data[0];
+                } else if(dev->u.pmbus.cmd == PMBUS_OPERATION) {
+                    dev->u.pmbus.operation[dev->u.pmbus.page] = dev->u.pmbus.wr_data[0];
+                }
+            }
+            dev->wr_idx = 0;
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void pmbus_put_word(
+    struct i2c_sim_dev*     dev,
+    uint16_t                word)
+{
+    dev->u.pmbus.resp[0] = word & 0xff;
+    dev->u.pmbus.resp[1] = word >> 8;
+    dev->u.pmbus.resp_len = 2;
+}
+
+static void pmbus_put_block(
+    struct i2c_sim_dev*     dev,
+    const char*             str)
+{
+    size_t len = strlen(str);
+
+    dev->u.pmbus.resp[0] = (uint8_t)len;
+    memcpy(&dev->u.pmbus.resp[1], str, len);
+    dev->u.pmbus.resp_len = len + 1;
+}
+
+static void pmbus_build_response(
+    struct i2c_sim_dev*     dev)
+{
+    unsigned int page = dev->u.pmbus.page;
+
+    dev->u.pmbus.resp_len = 1;
+
+    switch(dev->u.pmbus.cmd) {
+        case PMBUS_PAGE:
+            dev->u.pmbus.resp[0] = page;
+            break;
+        case PMBUS_OPERATION:
+            dev->u.pmbus.resp[0] = dev->u.pmbus.operation[page];
+            break;
+        case PMBUS_VOUT_MODE:
+            dev->u.pmbus.resp[0] = PMBUS_SIM_VOUT_MODE;
+            break;
+        case PMBUS_STATUS_BYTE:
+            dev->u.pmbus.resp[0] = 0;
+            break;
+        case PMBUS_STATUS_WORD:
+            pmbus_put_word(dev, 0);
+            break;
+        case PMBUS_READ_VIN:
+            pmbus_put_word(dev, pmbus_linear11(dev->u.pmbus.vin[page]));
+            break;
+        case PMBUS_READ_VOUT:
+            /* Linear16, with the exponent given by VOUT_MODE */
+            pmbus_put_word(dev, (uint16_t)((dev->u.pmbus.vout[page] << PMBUS_SIM_VOUT_EXP) / 1000));
+            break;
+        case PMBUS_READ_IOUT:
+            pmbus_put_word(dev, pmbus_linear11(dev->u.pmbus.iout[page]));
+            break;
+        case PMBUS_READ_TEMPERATURE_1:
+            pmbus_put_word(dev, pmbus_linear11(dev->u.pmbus.temp[page]));
+            break;
+        case PMBUS_REVISION:
+            dev->u.pmbus.resp[0] = 0x22;
+            break;
+        case PMBUS_MFR_ID:
+            pmbus_put_block(dev, "SIM");
+            break;
+        case PMBUS_MFR_MODEL:
+            pmbus_put_block(dev, "SIMREG-1");
+            break;
+        default:
+            dev->u.pmbus.resp[0] = 0xff;
+            break;
+    }
+}
+
+/**
+ * @brief Encode a value in the PMBus linear11 format: a 5 bit signed exponent
+ *        and an 11 bit signed mantissa, using the smallest exponent that fits
+ */
+static uint16_t pmbus_linear11(
+    long                    milli)
+{
+    int exp = 0;
+    long mantissa = 0;
+
+    for(exp = -16; exp < 15; ++exp) {
+        mantissa = lround(ldexp((double)milli / 1000.0, -exp));
+        if(mantissa >= -1024 && mantissa <= 1023) {
+            break;
+        }
+    }
+
+    return (uint16_t)(((exp & 0x1f) << 11) | (mantissa & 0x7ff));
+}
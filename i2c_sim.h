@@ -0,0 +1,201 @@
+/**
+ * Simulated I2C adapter and device models
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef I2C_SIM_H
+#define I2C_SIM_H
+
+#include <stdint.h>
+
+#include "i2c_bus.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** A device model attached to a simulated adapter */
+struct i2c_sim_dev;
+
+/** Counters kept by a simulated adapter */
+struct i2c_sim_stats {
+    /** Number of ioctls that performed a bus transaction */
+    unsigned long   transactions;
+    /** Number of messages (START or repeated START conditions) */
+    unsigned long   messages;
+    /** Number of data bytes transferred, excluding address bytes */
+    unsigned long   bytes;
+    /** Number of transactions that failed because a device NACKed */
+    unsigned long   naks;
+};
+
+/**
+ * @brief Open a simulated I2C adapter
+ *
+ * @param options - NULL, or a comma separated list of:
+ *                      smbus       - Only advertise SMBus functionality
+ *                      empty       - Don't populate the default devices
+ *                      hz=N        - Bus clock in Hz (default 100000)
+ *                      ioctl_us=N  - Fixed cost of each ioctl (default 50)
+ *                      lat_us=N    - Default per-transaction device latency
+ *                      twr_us=N    - EEPROM write cycle time (default 5000)
+ *                      realtime    - Sleep for the modelled transfer time as
+ *                                    well as advancing the virtual clock
+ *
+ * Unless "empty" is given, the adapter is populated with:
+ *      0x40 - PMBus regulator with 2 pages
+ *      0x48 - LM75 temperature sensor
+ *      0x50 - 24C02 EEPROM (256 bytes, 8 byte pages, 8 bit offset) holding
+ *             a sample IPMI FRU image
+ *      0x51 - 24C256 EEPROM (32KB, 64 byte pages, 16 bit offset)
+ *      0x53 - 128KB EEPROM (256 byte pages, 32 bit offset)
+ *      0x2a0 (10-bit) - 256KB EEPROM (256 byte pages, 24 bit offset)
+ *      0x70 - PCA9548 mux, with an LM75 at 0x49 on channel 0 and a 24C02 at
+ *             0x54 on channel 1
+ *
+ * @return The bus, or NULL on failure
+ */
+struct i2c_bus* i2c_sim_open(
+    const char*             options);
+
+/**
+ * @brief Check whether a bus is a simulated adapter
+ */
+int i2c_sim_is_sim(
+    struct i2c_bus*         bus);
+
+/**
+ * @brief Add a 24Cxx style EEPROM. Writes wrap within a page and the device
+ *        NACKs its address for the write cycle time after a write
+ *
+ * @param bus - The simulated bus
+ * @param mux - The mux the device sits behind, or NULL for the root bus
+ * @param channel - The mux channel (ignored if mux is NULL)
+ * @param addr - The 7-bit address of the device, or a 10-bit address OR'd
+ *               with I2C_ADDR_TEN
+ * @param size - The size of the array in bytes
+ * @param page_size - The write page size in bytes (a power of 2)
+ * @param offset_len - The number of offset bytes the device expects (1 to 4)
+ *
+ * @return The device, or NULL on failure
+ */
+struct i2c_sim_dev* i2c_sim_add_eeprom(
+    struct i2c_bus*         bus,
+    struct i2c_sim_dev*     mux,
+    unsigned int            channel,
+    unsigned short          addr,
+    unsigned long           size,
+    unsigned int            page_size,
+    unsigned int            offset_len);
+
+/**
+ * @brief Add an LM75 style temperature sensor (9-bit, 0.5C resolution)
+ */
+struct i2c_sim_dev* i2c_sim_add_lm75(
+    struct i2c_bus*         bus,
+    struct i2c_sim_dev*     mux,
+    unsigned int            channel,
+    unsigned short          addr);
+
+/**
+ * @brief Add a PCA954x style mux with a single channel enable register
+ *
+ * @param channels - The number of downstream channels (up to 8)
+ */
+struct i2c_sim_dev* i2c_sim_add_mux(
+    struct i2c_bus*         bus,
+    struct i2c_sim_dev*     mux,
+    unsigned int            channel,
+    unsigned short          addr,
+    unsigned int            channels);
+
+/**
+ * @brief Add a PMBus regulator supporting PAGE, VOUT_MODE, the READ_VIN,
+ *        READ_VOUT, READ_IOUT and READ_TEMPERATURE_1 telemetry commands and
+ *        the MFR_ID/MFR_MODEL block reads
+ *
+ * @param pages - The number of output rails (pages)
+ */
+struct i2c_sim_dev* i2c_sim_add_pmbus(
+    struct i2c_bus*         bus,
+    struct i2c_sim_dev*     mux,
+    unsigned int            channel,
+    unsigned short          addr,
+    unsigned int            pages);
+
+/**
+ * @brief Set the extra latency a device adds to each transaction addressed
+ *        to it (e.g. clock stretching while it fetches data)
+ */
+void i2c_sim_set_latency(
+    struct i2c_sim_dev*     dev,
+    unsigned long           usecs);
+
+/**
+ * @brief Set the write cycle time of an EEPROM model
+ */
+void i2c_sim_eeprom_set_write_time(
+    struct i2c_sim_dev*     dev,
+    unsigned long           usecs);
+
+/**
+ * @brief Get the backing array of an EEPROM model, e.g. to preload contents
+ *
+ * @param size - Optional pointer to store the array size in
+ */
+uint8_t* i2c_sim_eeprom_data(
+    struct i2c_sim_dev*     dev,
+    unsigned long*          size);
+
+/**
+ * @brief Set the temperature reported by an LM75 model
+ *
+ * @param millideg - The temperature in thousandths of a degree C
+ */
+void i2c_sim_lm75_set_temp(
+    struct i2c_sim_dev*     dev,
+    long                    millideg);
+
+/**
+ * @brief Set a telemetry value reported by a PMBus model
+ *
+ * @param page - The page (rail) to set the value for
+ * @param command - One of the READ_xxx PMBus command codes
+ * @param milli - The value in thousandths of the natural unit (V, A or C)
+ */
+void i2c_sim_pmbus_set(
+    struct i2c_sim_dev*     dev,
+    unsigned int            page,
+    unsigned char           command,
+    long                    milli);
+
+/**
+ * @brief Retrieve the counters of a simulated adapter
+ */
+void i2c_sim_get_stats(
+    struct i2c_bus*         bus,
+    struct i2c_sim_stats*   stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* I2C_SIM_H */
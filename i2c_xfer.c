@@ -0,0 +1,658 @@
+/**
+ * I2C transfer strategies for the userspace I2C utilities
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "i2c_xfer.h"
+
+#define SMBUS_MAX_BLOCK_LEN             32
+/** Number of bytes read sequentially before re-sending a multi byte offset when
+ *  emulating offset reads with smbus transfers */
+#define SMBUS_SEQ_READ_CHUNK            256
+/** Time to wait after each smbus write - we could be talking to an eeprom and
+ *  we get a NACK if it is busy committing data to the device */
+#define SMBUS_WRITE_DELAY_US            6000
+
+static const char* const method_names[I2C_XFER_NUM_METHODS] = {
+    [I2C_XFER_AUTO]         = "auto",
+    [I2C_XFER_RDWR]         = "rdwr",
+    [I2C_XFER_SMBUS_BYTE]   = "smbus-byte",
+    [I2C_XFER_SMBUS_BLOCK]  = "smbus-block",
+};
+
+static int xfer_rdwr(
+    struct i2c_bus*         bus,
+    unsigned short          addr,
+    unsigned int            offset_len,
+    const uint8_t*          wr_data,
+    unsigned long           wr_count,
+    uint8_t*                rd_data,
+    unsigned long           rd_count);
+
+static int xfer_smbus(
+    struct i2c_bus*         bus,
+    unsigned short          addr,
+    int                     block,
+    unsigned int            offset_len,
+    const uint8_t*          wr_data,
+    unsigned long           wr_count,
+    uint8_t*                rd_data,
+    unsigned long           rd_count);
+
+static int xfer_smbus_read(
+    struct i2c_bus*         bus,
+    int                     block,
+    unsigned int            offset_len,
+    const uint8_t*          wr_data,
+    uint8_t*                rd_data,
+    unsigned long           rd_count);
+
+static int xfer_smbus_write(
+    struct i2c_bus*         bus,
+    int                     block,
+    unsigned int            offset_len,
+    const uint8_t*          wr_data,
+    unsigned long           wr_count);
+
+static int smbus_set_pointer(
+    struct i2c_bus*         bus,
+    unsigned long           offset,
+    unsigned int            offset_len);
+
+static unsigned long get_offset(
+    const uint8_t*          buf,
+    unsigned int            offset_len);
+
+int i2c_xfer(
+    struct i2c_bus*         bus,
+    unsigned short          addr,
+    enum i2c_xfer_method    method,
+    unsigned int            offset_len,
+    const uint8_t*          wr_data,
+    unsigned long           wr_count,
+    uint8_t*                rd_data,
+    unsigned long           rd_count)
+{
+    unsigned long funcs = 0;
+    int read = (rd_data && rd_count);
+    int ret = 0;
+
+    if(offset_len > I2C_XFER_MAX_OFFSET_LEN || wr_count < offset_len) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(method == I2C_XFER_AUTO || (addr & I2C_ADDR_TEN)) {
+        if(i2c_bus_ioctl(bus, I2C_FUNCS, &funcs) < 0) {
+            return -1;
+        }
+    }
+
+    if((addr & I2C_ADDR_TEN) && !(funcs & I2C_FUNC_10BIT_ADDR)) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    if(method == I2C_XFER_AUTO) {
+        if(funcs & I2C_FUNC_I2C) {
+            method = I2C_XFER_RDWR;
+        } else if(i2c_xfer_supported(funcs, I2C_XFER_SMBUS_BLOCK, offset_len, read)) {
+            method = I2C_XFER_SMBUS_BLOCK;
+        } else {
+            method = I2C_XFER_SMBUS_BYTE;
+        }
+    }
+
+    if(i2c_bus_lock(bus) < 0) {
+        return -1;
+    }
+
+    if(method == I2C_XFER_RDWR) {
+        ret = xfer_rdwr(bus, addr, offset_len, wr_data, wr_count, rd_data, rd_count);
+    } else {
+        ret = xfer_smbus(bus, addr, method == I2C_XFER_SMBUS_BLOCK,
+                         offset_len, wr_data, wr_count, rd_data, rd_count);
+    }
+
+    i2c_bus_unlock(bus);
+
+    return ret;
+}
+
+static int xfer_smbus(
+    struct i2c_bus*         bus,
+    unsigned short          addr,
+    int                     block,
+    unsigned int            offset_len,
+    const uint8_t*          wr_data,
+    unsigned long           wr_count,
+    uint8_t*                rd_data,
+    unsigned long           rd_count)
+{
+    unsigned long ten_bit = (addr & I2C_ADDR_TEN) ? 1 : 0;
+    int ret = 0;
+
+    /* SMBus emulation. Note: this is more dangerous as there will be a stop
+     * between the write and read of offset based reads, so if we are on a
+     * multi master bus this could cause problems.
+     *
+     * Also note that this limits the size of an individual transfer due to
+     * the max block length of smbus */
+    if(ten_bit && i2c_bus_ioctl(bus, I2C_TENBIT, (void*)ten_bit) < 0) {
+        return -1;
+    }
+
+    ret = i2c_bus_ioctl(bus, I2C_SLAVE_FORCE,
+                        (void*)(unsigned long)(addr & ~I2C_ADDR_TEN));
+    if(ret == 0) {
+        if(rd_data && rd_count) {
+            ret = xfer_smbus_read(bus, block, offset_len, wr_data, rd_data, rd_count);
+        } else {
+            ret = xfer_smbus_write(bus, block, offset_len, wr_data, wr_count);
+        }
+    }
+
+    if(ten_bit) {
+        /* Put the file descriptor back to 7-bit addressing for the next
+         * caller, keeping the errno of the transfer */
+        int saved_errno = errno;
+
+        i2c_bus_ioctl(bus, I2C_TENBIT, (void*)0UL);
+        errno = saved_errno;
+    }
+
+    return ret;
+}
+
+void i2c_xfer_put_offset(
+    uint8_t*                buf,
+    unsigned long           offset,
+    unsigned int            offset_len)
+{
+    unsigned int i = 0;
+
+    for(i = 0; i < offset_len; ++i) {
+        buf[i] = (offset >> (8 * (offset_len - 1 - i))) & 0xff;
+    }
+}
+
+int i2c_xfer_supported(
+    unsigned long           funcs,
+    enum i2c_xfer_method    method,
+    unsigned int            offset_len,
+    int                     read)
+{
+    unsigned long needed = 0;
+
+    switch(method) {
+        case I2C_XFER_AUTO:
+            return 1;
+
+        case I2C_XFER_RDWR:
+            needed = I2C_FUNC_I2C;
+            break;
+
+        case I2C_XFER_SMBUS_BYTE:
+            if(offset_len == 0) {
+                needed = read ? I2C_FUNC_SMBUS_READ_BYTE : I2C_FUNC_SMBUS_WRITE_BYTE;
+            } else if(offset_len == 1) {
+                needed = read ? I2C_FUNC_SMBUS_READ_BYTE_DATA : I2C_FUNC_SMBUS_WRITE_BYTE_DATA;
+            } else if(offset_len == 2) {
+                needed = read ? (I2C_FUNC_SMBUS_WRITE_BYTE_DATA | I2C_FUNC_SMBUS_READ_BYTE) :
+                                I2C_FUNC_SMBUS_WRITE_WORD_DATA;
+            } else if(read && offset_len <= I2C_XFER_MAX_OFFSET_LEN) {
+                /* Larger offsets are loaded with an i2c block write, there is
+                 * no byte sized command that can carry them for a write */
+                needed = I2C_FUNC_SMBUS_WRITE_I2C_BLOCK | I2C_FUNC_SMBUS_READ_BYTE;
+            } else {
+                return 0;
+            }
+            break;
+
+        case I2C_XFER_SMBUS_BLOCK:
+            /* A block read sends a single command byte, so it only works for
+             * devices with 8 bit offsets */
+            if(read && offset_len == 1) {
+                needed = I2C_FUNC_SMBUS_READ_I2C_BLOCK;
+            } else if(!read && offset_len >= 1 && offset_len <= I2C_XFER_MAX_OFFSET_LEN) {
+                needed = I2C_FUNC_SMBUS_WRITE_I2C_BLOCK;
+            } else {
+                return 0;
+            }
+            break;
+
+        default:
+            return 0;
+    }
+
+    return (funcs & needed) == needed;
+}
+
+const char* i2c_xfer_method_name(
+    enum i2c_xfer_method    method)
+{
+    if((unsigned int)method >= I2C_XFER_NUM_METHODS) {
+        return "unknown";
+    }
+
+    return method_names[method];
+}
+
+int i2c_xfer_method_parse(
+    const char*             name)
+{
+    int i = 0;
+
+    for(i = 0; i < I2C_XFER_NUM_METHODS; ++i) {
+        if(strcmp(name, method_names[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static int xfer_rdwr(
+    struct i2c_bus*         bus,
+    unsigned short          addr,
+    unsigned int            offset_len,
+    const uint8_t*          wr_data,
+    unsigned long           wr_count,
+    uint8_t*                rd_data,
+    unsigned long           rd_count)
+{
+    struct i2c_msg msgs[2];
+    struct i2c_rdwr_ioctl_data ioctl_data = {0};
+    uint8_t offset_buf[I2C_XFER_MAX_OFFSET_LEN];
+    unsigned short flags = (addr & I2C_ADDR_TEN) ? I2C_M_TEN : 0;
+    unsigned long offset = get_offset(wr_data, offset_len);
+    unsigned long pos = 0;
+    unsigned long this_len = 0;
+    int msg_idx = 0;
+
+    addr &= ~I2C_ADDR_TEN;
+
+    if(wr_count > I2C_XFER_MAX_MSG_LEN) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    do {
+        msg_idx = 0;
+
+        /* If we have a write - add that first. Reads split over several
+         * transactions only re-send the offset after the first one */
+        if(pos == 0 && wr_count > 0 && wr_data) {
+            msgs[msg_idx].addr = addr;
+            msgs[msg_idx].len = wr_count;
+            msgs[msg_idx].buf = (uint8_t*)wr_data;
+            msgs[msg_idx].flags = flags;
+            ++msg_idx;
+        } else if(pos && offset_len) {
+            i2c_xfer_put_offset(offset_buf, offset + pos, offset_len);
+            msgs[msg_idx].addr = addr;
+            msgs[msg_idx].len = offset_len;
+            msgs[msg_idx].buf = offset_buf;
+            msgs[msg_idx].flags = flags;
+            ++msg_idx;
+        }
+
+        /* Add a read if we have one, up to the largest message i2c-dev
+         * accepts */
+        if(rd_count > 0 && rd_data) {
+            this_len = rd_count - pos;
+            if(this_len > I2C_XFER_MAX_MSG_LEN) {
+                this_len = I2C_XFER_MAX_MSG_LEN;
+            }
+
+            msgs[msg_idx].addr = addr;
+            msgs[msg_idx].len = this_len;
+            msgs[msg_idx].buf = &rd_data[pos];
+            msgs[msg_idx].flags = flags | I2C_M_RD;
+            ++msg_idx;
+        }
+
+        if(!msg_idx) {
+            return 0;
+        }
+
+        ioctl_data.msgs = msgs;
+        ioctl_data.nmsgs = msg_idx;
+
+        if(i2c_bus_ioctl(bus, I2C_RDWR, &ioctl_data) < 0) {
+            return -1;
+        }
+
+        pos += this_len;
+    } while(pos < rd_count);
+
+    return 0;
+}
+
+static int xfer_smbus_read(
+    struct i2c_bus*         bus,
+    int                     block,
+    unsigned int            offset_len,
+    const uint8_t*          wr_data,
+    uint8_t*                rd_data,
+    unsigned long           rd_count)
+{
+    struct i2c_smbus_ioctl_data smb;
+    union i2c_smbus_data data;
+    unsigned long offset = 0;
+    unsigned long this_len = 0;
+
+    if(offset_len == 0) {
+        /* 0 byte offset - we can just read byte-by-byte */
+        while(offset < rd_count) {
+            smb.read_write = I2C_SMBUS_READ;
+            smb.command = 0;
+            smb.size = I2C_SMBUS_BYTE;
+            smb.data = &data;
+
+            if(i2c_bus_ioctl(bus, I2C_SMBUS, &smb) < 0) {
+                return -1;
+            }
+
+            rd_data[offset] = data.byte;
+            ++offset;
+        }
+    } else if(offset_len == 1 && block) {
+        /* 1 byte offset - i2c block reads send the offset as the command and
+         * then read up to a full smbus block */
+        unsigned char dev_offset = wr_data[0];
+
+        while(offset < rd_count) {
+            this_len = rd_count - offset;
+            if(this_len > SMBUS_MAX_BLOCK_LEN) {
+                this_len = SMBUS_MAX_BLOCK_LEN;
+            }
+
+            data.block[0] = this_len;
+
+            smb.read_write = I2C_SMBUS_READ;
+            smb.command = dev_offset;
+            smb.size = I2C_SMBUS_I2C_BLOCK_DATA;
+            smb.data = &data;
+
+            if(i2c_bus_ioctl(bus, I2C_SMBUS, &smb) < 0) {
+                return -1;
+            }
+
+            memcpy(&rd_data[offset], &data.block[1], this_len);
+            offset += this_len;
+            dev_offset += this_len;
+        }
+    } else if(offset_len == 1) {
+        /* 1 byte offset - we use read byte commands, which send the offset
+         * and then read a byte, so we increment the offset for each byte
+         * we read */
+        unsigned char dev_offset = wr_data[0];
+
+        while(offset < rd_count) {
+            smb.read_write = I2C_SMBUS_READ;
+            smb.command = dev_offset;
+            smb.size = I2C_SMBUS_BYTE_DATA;
+            smb.data = &data;
+
+            if(i2c_bus_ioctl(bus, I2C_SMBUS, &smb) < 0) {
+                return -1;
+            }
+
+            rd_data[offset] = data.byte;
+            ++offset;
+            ++dev_offset;
+        }
+    } else if(offset_len >= 2 && offset_len <= I2C_XFER_MAX_OFFSET_LEN) {
+        /* Multi byte offset - we load the device's address pointer with a
+         * write and then use current address reads, relying on the
+         * device's internal auto-increment. This is one transaction per
+         * byte rather than two. We re-anchor the address at each chunk
+         * boundary so that a glitched read can only ever skew the data
+         * within one chunk */
+        unsigned long dev_offset = get_offset(wr_data, offset_len);
+
+        while(offset < rd_count) {
+            unsigned long chunk_end = offset + SMBUS_SEQ_READ_CHUNK;
+
+            if(chunk_end > rd_count) {
+                chunk_end = rd_count;
+            }
+
+            if(smbus_set_pointer(bus, dev_offset, offset_len) < 0) {
+                return -1;
+            }
+
+            while(offset < chunk_end) {
+                smb.read_write = I2C_SMBUS_READ;
+                smb.command = 0;
+                smb.size = I2C_SMBUS_BYTE;
+                smb.data = &data;
+
+                if(i2c_bus_ioctl(bus, I2C_SMBUS, &smb) < 0) {
+                    return -1;
+                }
+
+                rd_data[offset] = data.byte;
+                ++offset;
+                ++dev_offset;
+            }
+        }
+    } else {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int xfer_smbus_write(
+    struct i2c_bus*         bus,
+    int                     block,
+    unsigned int            offset_len,
+    const uint8_t*          wr_data,
+    unsigned long           wr_count)
+{
+    struct i2c_smbus_ioctl_data smb;
+    union i2c_smbus_data data;
+    unsigned long offset = 0;
+    unsigned long data_len = wr_count - offset_len;
+    unsigned long this_len = 0;
+
+    if(offset_len == 0) {
+        /* No offset - we can just write data byte-by-byte. The send byte
+         * command puts the data byte where the command would go */
+        while(offset < data_len) {
+            smb.read_write = I2C_SMBUS_WRITE;
+            smb.command = wr_data[offset];
+            smb.size = I2C_SMBUS_BYTE;
+            smb.data = NULL;
+
+            if(i2c_bus_ioctl(bus, I2C_SMBUS, &smb) < 0) {
+                return -1;
+            }
+
+            ++offset;
+            i2c_bus_delay(bus, SMBUS_WRITE_DELAY_US);
+        }
+    } else if(offset_len == 1 && block) {
+        /* 1 byte offset - we use i2c block write commands, which send the
+         * offset and then a block of data, so we increment the offset for
+         * each block we write */
+        unsigned char dev_offset = wr_data[0];
+
+        while(offset < data_len) {
+            this_len = data_len - offset;
+            if(this_len > SMBUS_MAX_BLOCK_LEN) {
+                this_len = SMBUS_MAX_BLOCK_LEN;
+            }
+
+            data.block[0] = this_len;
+            memcpy(&data.block[1], &wr_data[offset_len + offset], this_len);
+
+            smb.read_write = I2C_SMBUS_WRITE;
+            smb.command = dev_offset;
+            smb.size = I2C_SMBUS_I2C_BLOCK_DATA;
+            smb.data = &data;
+
+            if(i2c_bus_ioctl(bus, I2C_SMBUS, &smb) < 0) {
+                return -1;
+            }
+
+            offset += this_len;
+            dev_offset += this_len;
+            i2c_bus_delay(bus, SMBUS_WRITE_DELAY_US);
+        }
+    } else if(offset_len == 1) {
+        /* 1 byte offset - write byte commands send the offset and a single
+         * byte of data */
+        unsigned char dev_offset = wr_data[0];
+
+        while(offset < data_len) {
+            data.byte = wr_data[offset_len + offset];
+
+            smb.read_write = I2C_SMBUS_WRITE;
+            smb.command = dev_offset;
+            smb.size = I2C_SMBUS_BYTE_DATA;
+            smb.data = &data;
+
+            if(i2c_bus_ioctl(bus, I2C_SMBUS, &smb) < 0) {
+                return -1;
+            }
+
+            ++offset;
+            ++dev_offset;
+            i2c_bus_delay(bus, SMBUS_WRITE_DELAY_US);
+        }
+    } else if(offset_len >= 2 && offset_len <= I2C_XFER_MAX_OFFSET_LEN && block) {
+        /* Multi byte offset - we use i2c block write commands with the msb
+         * of the offset as the command, and the rest of the offset at the
+         * start of the block followed by the data. We increment the offset
+         * for each block we write */
+        unsigned long dev_offset = get_offset(wr_data, offset_len);
+        uint8_t offset_buf[I2C_XFER_MAX_OFFSET_LEN];
+
+        while(offset < data_len) {
+            this_len = data_len - offset;
+            if(this_len > (SMBUS_MAX_BLOCK_LEN - (offset_len - 1))) {
+                this_len = SMBUS_MAX_BLOCK_LEN - (offset_len - 1);
+            }
+
+            i2c_xfer_put_offset(offset_buf, dev_offset, offset_len);
+            data.block[0] = this_len + offset_len - 1;
+            memcpy(&data.block[1], &offset_buf[1], offset_len - 1);
+            memcpy(&data.block[offset_len], &wr_data[offset_len + offset], this_len);
+
+            smb.read_write = I2C_SMBUS_WRITE;
+            smb.command = offset_buf[0];
+            smb.size = I2C_SMBUS_I2C_BLOCK_DATA;
+            smb.data = &data;
+
+            if(i2c_bus_ioctl(bus, I2C_SMBUS, &smb) < 0) {
+                return -1;
+            }
+
+            offset += this_len;
+            dev_offset += this_len;
+            i2c_bus_delay(bus, SMBUS_WRITE_DELAY_US);
+        }
+    } else if(offset_len == 2) {
+        /* 2 byte offset - write word commands send the msb of the offset as
+         * the command and then the lsb of the offset followed by one byte of
+         * data */
+        unsigned short dev_offset = wr_data[0] << 8 | wr_data[1];
+
+        while(offset < data_len) {
+            data.word = (dev_offset & 0xff) | (wr_data[offset_len + offset] << 8);
+
+            smb.read_write = I2C_SMBUS_WRITE;
+            smb.command = dev_offset >> 8;
+            smb.size = I2C_SMBUS_WORD_DATA;
+            smb.data = &data;
+
+            if(i2c_bus_ioctl(bus, I2C_SMBUS, &smb) < 0) {
+                return -1;
+            }
+
+            ++offset;
+            ++dev_offset;
+            i2c_bus_delay(bus, SMBUS_WRITE_DELAY_US);
+        }
+    } else {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int smbus_set_pointer(
+    struct i2c_bus*         bus,
+    unsigned long           offset,
+    unsigned int            offset_len)
+{
+    struct i2c_smbus_ioctl_data smb;
+    union i2c_smbus_data data;
+    uint8_t offset_buf[I2C_XFER_MAX_OFFSET_LEN];
+
+    i2c_xfer_put_offset(offset_buf, offset, offset_len);
+
+    smb.read_write = I2C_SMBUS_WRITE;
+    smb.command = offset_buf[0];
+    smb.data = &data;
+
+    if(offset_len == 2) {
+        /* The msb of the offset goes in the command byte, the lsb in the
+         * data byte */
+        data.byte = offset_buf[1];
+        smb.size = I2C_SMBUS_BYTE_DATA;
+    } else {
+        /* Longer offsets don't fit a byte command, so send the rest of the
+         * offset as an i2c block with no data following it */
+        data.block[0] = offset_len - 1;
+        memcpy(&data.block[1], &offset_buf[1], offset_len - 1);
+        smb.size = I2C_SMBUS_I2C_BLOCK_DATA;
+    }
+
+    return i2c_bus_ioctl(bus, I2C_SMBUS, &smb) < 0 ? -1 : 0;
+}
+
+static unsigned long get_offset(
+    const uint8_t*          buf,
+    unsigned int            offset_len)
+{
+    unsigned long offset = 0;
+    unsigned int i = 0;
+
+    for(i = 0; i < offset_len; ++i) {
+        offset = offset << 8 | buf[i];
+    }
+
+    return offset;
+}
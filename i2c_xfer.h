@@ -0,0 +1,130 @@
+/**
+ * I2C transfer strategies for the userspace I2C utilities
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef I2C_XFER_H
+#define I2C_XFER_H
+
+#include <stdint.h>
+
+#include "i2c_bus.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Maximum length of a single I2C_RDWR message accepted by i2c-dev */
+#define I2C_XFER_MAX_MSG_LEN            8192
+/** Largest device offset supported, in bytes */
+#define I2C_XFER_MAX_OFFSET_LEN         4
+
+/** The ways a transfer can be put on the bus */
+enum i2c_xfer_method {
+    /** Plain I2C if the adapter supports it, otherwise the fastest SMBus
+     *  emulation the adapter supports */
+    I2C_XFER_AUTO = 0,
+    /** A single combined I2C_RDWR transaction (repeated START between the
+     *  offset write and the read) */
+    I2C_XFER_RDWR,
+    /** SMBus emulation using byte sized commands */
+    I2C_XFER_SMBUS_BYTE,
+    /** SMBus emulation using I2C block commands where the offset allows it */
+    I2C_XFER_SMBUS_BLOCK,
+    I2C_XFER_NUM_METHODS
+};
+
+/**
+ * @brief Perform a write, a read, or an offset write followed by a read
+ *
+ * Reads longer than I2C_XFER_MAX_MSG_LEN are split into several I2C_RDWR
+ * transactions, each re-sending the offset advanced by the bytes read so far
+ * (or continuing with plain reads when there is no offset).
+ *
+ * @param bus - The bus to use
+ * @param addr - The 7-bit address of the device, or a 10-bit address OR'd
+ *               with I2C_ADDR_TEN
+ * @param method - How to perform the transfer
+ * @param offset_len - The number of offset bytes (0 to
+ *                     I2C_XFER_MAX_OFFSET_LEN) at the start of wr_data
+ * @param wr_data - The offset followed by any data to write
+ * @param wr_count - The total number of bytes in wr_data
+ * @param rd_data - Buffer to read into, or NULL for a write
+ * @param rd_count - The number of bytes to read
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int i2c_xfer(
+    struct i2c_bus*         bus,
+    unsigned short          addr,
+    enum i2c_xfer_method    method,
+    unsigned int            offset_len,
+    const uint8_t*          wr_data,
+    unsigned long           wr_count,
+    uint8_t*                rd_data,
+    unsigned long           rd_count);
+
+/**
+ * @brief Store a device offset big-endian (msb first), as it is sent on the
+ *        bus
+ *
+ * @param buf - Where to store the offset, at least offset_len bytes
+ * @param offset - The offset
+ * @param offset_len - The number of offset bytes (0 to
+ *                     I2C_XFER_MAX_OFFSET_LEN)
+ */
+void i2c_xfer_put_offset(
+    uint8_t*                buf,
+    unsigned long           offset,
+    unsigned int            offset_len);
+
+/**
+ * @brief Check whether the adapter can perform a transfer with the given
+ *        method and offset length
+ *
+ * @param funcs - The adapter's I2C_FUNCS flags
+ * @param read - Non-zero for a read, zero for a write
+ */
+int i2c_xfer_supported(
+    unsigned long           funcs,
+    enum i2c_xfer_method    method,
+    unsigned int            offset_len,
+    int                     read);
+
+/**
+ * @brief Get the short name of a transfer method
+ */
+const char* i2c_xfer_method_name(
+    enum i2c_xfer_method    method);
+
+/**
+ * @brief Look up a transfer method by its short name
+ *
+ * @return The method, or -1 if the name is unknown
+ */
+int i2c_xfer_method_parse(
+    const char*             name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* I2C_XFER_H */
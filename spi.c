@@ -27,28 +27,591 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <linux/types.h>
 #include <linux/spi/spidev.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 
-#define SPI_BUFFER_SIZE             256
+#include "crc32.h"
+#include "spi_bus.h"
+#include "spi_capture.h"
+#include "spi_eeprom.h"
+#include "spi_layout.h"
+#include "spi_nand.h"
+#include "spi_nor.h"
+#include "spi_script.h"
+
+#define SPI_DEFAULT_SPEED_HZ        1000000
+#define SPI_DEFAULT_DELAY_US        1
+/** Flash dumps read into a ring of buffers that a writer thread empties */
+#define DUMP_BUFFERS                4
+#define DUMP_BUFFER_SIZE            (1024 * 1024)
+/** Uncorrectable NAND pages listed after a dump */
+#define NAND_REPORT_PAGES           16
+
+/** Gang programming writes and verifies in pieces of this size, reporting
+ *  progress every GANG_PROGRESS_MS */
+#define GANG_CHUNK                  (256 * 1024)
+#define GANG_PROGRESS_MS            1000
+
+/** Settings from the command line options */
+struct spi_opts {
+    /** Mode bits for SPI_IOC_WR_MODE(32) */
+    uint32_t        mode;
+    /** Clock, 0 to leave the device's maximum speed alone */
+    uint32_t        speed_hz;
+    uint8_t         bits;
+    /** Data lines to enable (1, 2 or 4), 0 for the default */
+    unsigned int    lines;
+    uint16_t        delay_us;
+    int             cs_hold;
+    int             verbose;
+    int             use_crc;
+    int             check_crc;
+    int             crc_type;
+    uint32_t        expected_crc;
+    /** Flash regions given with -i, to restrict flash operations to */
+    const char*     regions[SPI_LAYOUT_MAX_REGIONS];
+    unsigned int    num_regions;
+    /** Read flash dumps straight into a mapping of the output file */
+    int             map_output;
+};
+
+/** A buffer of a flash dump */
+struct dump_buf {
+    uint8_t*        data;
+    uint32_t        len;
+};
+
+/** Reads a piece of a dump, at a flash address, into buf */
+typedef int (*dump_read_fn)(
+    void*                   ctx,
+    uint64_t                addr,
+    uint8_t*                buf,
+    uint32_t                len);
+
+/** What a NOR flash dump reads */
+struct flash_dump {
+    struct spi_nor*         nor;
+    /** Regions to read, if -i was given */
+    const struct spi_layout_region* const* regions;
+    int                     count;
+};
+
+/** What a NAND dump reads and the ECC results of the pages read */
+struct nand_dump {
+    struct spi_nand*        nand;
+    uint8_t                 ecc[DUMP_BUFFER_SIZE / 512];
+    unsigned long           corrected;
+    unsigned long           failed;
+    uint32_t                failed_pages[NAND_REPORT_PAGES];
+};
+
+/** State shared by the thread reading a flash dump and the thread writing
+ *  it out */
+struct dump_pipe {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    struct dump_buf bufs[DUMP_BUFFERS];
+    /** Next buffer to read into, next buffer to write out and how many are
+     *  waiting to be written */
+    unsigned int    head;
+    unsigned int    tail;
+    unsigned int    filled;
+    /** Set when the reader has no more buffers */
+    int             done;
+    /** errno of a failed write, set by the writer with lock held */
+    int             error;
+    FILE*           out;
+    int             use_crc;
+    int             crc_type;
+    uint32_t        crc;
+};
+
+/** Where a device being gang programmed has got to */
+enum gang_state {
+    GANG_WAITING,
+    GANG_WRITING,
+    GANG_VERIFYING,
+    GANG_DONE,
+    GANG_FAILED,
+};
+
+/** A device being gang programmed */
+struct gang_dev {
+    const char*     spec;
+    /** Devices on the same controller are programmed in turn by one
+     *  thread */
+    char            controller[32];
+    enum gang_state state;
+    /** Bytes written or verified so far */
+    uint64_t        done;
+    /** Bus time taken */
+    uint64_t        ns;
+    struct spi_nor_update_result result;
+    char            error[80];
+};
+
+/** State shared by the gang programming threads. The device states and
+ *  progress are protected by lock */
+struct gang {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    const struct spi_opts* opts;
+    const uint8_t*  data;
+    uint64_t        size;
+    struct gang_dev* devs;
+    int             count;
+    /** Threads still running */
+    int             running;
+};
+
+/** A gang programming thread, handling the devices on the controller of
+ *  devs[first] */
+struct gang_worker {
+    struct gang*    gang;
+    int             first;
+    pthread_t       thread;
+};
+
+static const char* const gang_state_names[] = {
+    [GANG_WAITING] = "waiting",
+    [GANG_WRITING] = "writing",
+    [GANG_VERIFYING] = "verifying",
+    [GANG_DONE] = "done",
+    [GANG_FAILED] = "failed",
+};
 
 static void print_usage(
     void);
 
+static int parse_hz(
+    const char*     str,
+    uint32_t*       hz);
+
+static int parse_size(
+    const char*     str,
+    uint64_t*       size);
+
+static void print_config(
+    struct spi_bus*                 bus,
+    const struct spi_bus_config*    config);
+
+static struct spi_bus* open_device(
+    const char*             device,
+    const struct spi_opts*  opts,
+    uint8_t                 bits,
+    unsigned int            lines);
+
+static int run_flash(
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[]);
+
+static int run_capture(
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[]);
+
+static void capture_signal(
+    int                     sig);
+
+static int run_script(
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[]);
+
+static void script_received(
+    unsigned int            line,
+    const uint8_t*          rx,
+    uint32_t                len,
+    void*                   user);
+
+static int run_gang(
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[]);
+
+static void* gang_worker(
+    void*                   arg);
+
+static void gang_program(
+    struct gang*            gang,
+    struct gang_dev*        dev);
+
+static void gang_set(
+    struct gang*            gang,
+    struct gang_dev*        dev,
+    enum gang_state         state,
+    uint64_t                done);
+
+static void gang_controller(
+    const char*             spec,
+    int                     index,
+    char*                   controller,
+    size_t                  len);
+
+static void gang_progress(
+    struct gang*            gang);
+
+static int flash_info(
+    struct spi_nor*         nor);
+
+static int flash_read(
+    struct spi_nor*         nor,
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[]);
+
+static int flash_dump_read(
+    void*                   ctx,
+    uint64_t                addr,
+    uint8_t*                buf,
+    uint32_t                len);
+
+static int dump_file(
+    const struct spi_opts*  opts,
+    struct spi_bus*         bus,
+    const char*             path,
+    uint64_t                offset,
+    uint64_t                len,
+    dump_read_fn            read,
+    void*                   ctx,
+    uint64_t*               ns,
+    uint32_t*               crc);
+
+static void* dump_writer(
+    void*                   arg);
+
+static int dump_mapped(
+    struct dump_pipe*       pipe,
+    const char*             path,
+    uint64_t                offset,
+    uint64_t                len,
+    dump_read_fn            read,
+    void*                   ctx);
+
+static int dump_report(
+    const struct spi_opts*  opts,
+    const char*             path,
+    struct spi_bus*         bus,
+    uint64_t                bytes,
+    uint64_t                ns,
+    unsigned int            nbits,
+    const char*             how,
+    uint32_t                crc);
+
+static int run_nand(
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[]);
+
+static int nand_info(
+    struct spi_nand*        nand);
+
+static int nand_bbt(
+    struct spi_nand*        nand);
+
+static int nand_read(
+    struct spi_nand*        nand,
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[]);
+
+static int nand_dump_read(
+    void*                   ctx,
+    uint64_t                addr,
+    uint8_t*                buf,
+    uint32_t                len);
+
+static int run_eeprom(
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[]);
+
+static int eeprom_read(
+    struct spi_eeprom*      eeprom,
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[]);
+
+static int eeprom_write(
+    struct spi_eeprom*      eeprom,
+    int                     argc,
+    char*                   argv[]);
+
+static int eeprom_verify(
+    struct spi_eeprom*      eeprom,
+    int                     argc,
+    char*                   argv[]);
+
+static int eeprom_dump_read(
+    void*                   ctx,
+    uint64_t                addr,
+    uint8_t*                buf,
+    uint32_t                len);
+
+static uint8_t* eeprom_image(
+    struct spi_eeprom*      eeprom,
+    int                     argc,
+    char*                   argv[],
+    uint64_t*               offset,
+    uint64_t*               size);
+
+static int read_regions(
+    struct spi_nor*         nor,
+    const struct spi_layout_region* const* regions,
+    int                     count,
+    uint64_t                addr,
+    uint8_t*                buf,
+    uint32_t                len);
+
+static int flash_write(
+    struct spi_nor*         nor,
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[]);
+
+static int flash_erase(
+    struct spi_nor*         nor,
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[]);
+
+static int flash_verify(
+    struct spi_nor*         nor,
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[]);
+
+static int flash_layout(
+    struct spi_nor*         nor,
+    int                     argc,
+    char*                   argv[]);
+
+static int select_regions(
+    struct spi_nor*         nor,
+    const struct spi_opts*  opts,
+    const uint8_t*          image,
+    uint64_t                len,
+    struct spi_layout*      layout,
+    const struct spi_layout_region** selected);
+
+static int region_image(
+    struct spi_nor*         nor,
+    const struct spi_opts*  opts,
+    int                     argc,
+    const uint8_t*          data,
+    uint64_t                size,
+    struct spi_layout*      layout,
+    const struct spi_layout_region** selected);
+
+static uint8_t* load_file(
+    const char*             path,
+    uint64_t*               size);
+
+static void print_rate(
+    FILE*                   out,
+    const char*             what,
+    uint64_t                bytes,
+    uint64_t                ns);
+
 int main(int argc, char* argv[])
 {
     const char* device = NULL;
+    struct spi_bus* bus = NULL;
+    struct spi_xfer xfers[2];
+    struct spi_opts opts = {0};
     uint32_t bytes = 0;
-    uint8_t writeBuffer[SPI_BUFFER_SIZE] = {0};
-    uint8_t readBuffer[SPI_BUFFER_SIZE] = {0};
+    uint32_t len = 0;
+    uint32_t read_len = 0;
+    uint32_t rx_len = 0;
+    unsigned int tx_lines = 1;
+    unsigned int rx_lines = 1;
+    uint8_t* writeBuffer = NULL;
+    uint8_t* readBuffer = NULL;
+    struct spi_bus_config config = {0};
     int ret = 0;
-    int fd = 0;
-    uint8_t mode = SPI_MODE_3;
+    unsigned long mode = 3;
+    unsigned long bits = 8;
+    unsigned long delay_us = SPI_DEFAULT_DELAY_US;
+    int probe = 0;
+    int opt = 0;
+    uint32_t crc = 0;
+    char* save = NULL;
+    char* tok = NULL;
+
+    opts.crc_type = CRC_TYPE_CRC32;
+
+    while((opt = getopt(argc, argv, "+c:e:l:r:vs:m:Lb:d:C:pw:i:z")) != -1) {
+        switch(opt) {
+            case 's':
+                if(parse_hz(optarg, &opts.speed_hz) < 0) {
+                    printf("Invalid speed %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                mode = strtoul(optarg, NULL, 0);
+                if(mode > 3) {
+                    printf("The SPI mode must be 0 to 3\n");
+                    return 1;
+                }
+                break;
+            case 'L':
+                opts.mode |= SPI_LSB_FIRST;
+                break;
+            case 'b':
+                bits = strtoul(optarg, NULL, 0);
+                if(bits < 1 || bits > 32) {
+                    printf("Bits per word must be 1 to 32\n");
+                    return 1;
+                }
+                break;
+            case 'd':
+                delay_us = strtoul(optarg, NULL, 0);
+                if(delay_us > UINT16_MAX) {
+                    printf("The delay must be at most %u us\n", UINT16_MAX);
+                    return 1;
+                }
+                break;
+            case 'C':
+                if(strcmp(optarg, "high") == 0) {
+                    opts.mode |= SPI_CS_HIGH;
+                } else if(strcmp(optarg, "none") == 0) {
+                    opts.mode |= SPI_NO_CS;
+                } else if(strcmp(optarg, "hold") == 0) {
+                    opts.cs_hold = 1;
+                } else {
+                    printf("Unknown chip select option %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'p':
+                probe = 1;
+                break;
+            case 'z':
+                opts.map_output = 1;
+                break;
+            case 'w':
+                opts.lines = strtoul(optarg, NULL, 0);
+                if(opts.lines != 1 && opts.lines != 2 && opts.lines != 4) {
+                    printf("The data lines must be 1, 2 or 4\n");
+                    return 1;
+                }
+                break;
+            case 'i':
+                for(tok = strtok_r(optarg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+                    if(opts.num_regions == SPI_LAYOUT_MAX_REGIONS) {
+                        printf("Too many regions\n");
+                        return 1;
+                    }
+                    opts.regions[opts.num_regions++] = tok;
+                }
+                break;
+            case 'c':
+                opts.crc_type = crc_type_parse(optarg);
+                if(opts.crc_type < 0) {
+                    printf("Unknown checksum %s\n", optarg);
+                    return 1;
+                }
+                opts.use_crc = 1;
+                break;
+            case 'e':
+                opts.expected_crc = strtoul(optarg, NULL, 16);
+                opts.check_crc = 1;
+                opts.use_crc = 1;
+                break;
+            case 'l':
+                len = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                read_len = strtoul(optarg, NULL, 0);
+                if(!read_len) {
+                    printf("Invalid read length %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'v':
+                opts.verbose = 1;
+                break;
+            default:
+                print_usage();
+                return 1;
+        }
+    }
+
+    opts.mode |= mode;
+    opts.bits = bits;
+    opts.delay_us = delay_us;
+
+    /* Drop the options so the positional arguments are where we expect */
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if(argc > 1 && strcmp(argv[1], "flash") == 0) {
+        if(argc < 4) {
+            printf("Not enough arguments\n");
+            print_usage();
+            return 1;
+        }
+        return run_flash(&opts, argc - 2, argv + 2);
+    }
+
+    if(argc > 1 && strcmp(argv[1], "nand") == 0) {
+        if(argc < 4) {
+            printf("Not enough arguments\n");
+            print_usage();
+            return 1;
+        }
+        return run_nand(&opts, argc - 2, argv + 2);
+    }
 
-    if(argc < 3) {
+    if(argc > 1 && strcmp(argv[1], "eeprom") == 0) {
+        if(argc < 5) {
+            printf("Not enough arguments\n");
+            print_usage();
+            return 1;
+        }
+        return run_eeprom(&opts, argc - 2, argv + 2);
+    }
+
+    if(argc > 1 && strcmp(argv[1], "gang") == 0) {
+        if(argc < 4) {
+            printf("Not enough arguments\n");
+            print_usage();
+            return 1;
+        }
+        return run_gang(&opts, argc - 2, argv + 2);
+    }
+
+    if(argc > 1 && strcmp(argv[1], "capture") == 0) {
+        if(argc < 7) {
+            printf("Not enough arguments\n");
+            print_usage();
+            return 1;
+        }
+        return run_capture(&opts, argc - 2, argv + 2);
+    }
+
+    if(argc > 1 && strcmp(argv[1], "script") == 0) {
+        if(argc < 4) {
+            printf("Not enough arguments\n");
+            print_usage();
+            return 1;
+        }
+        return run_script(&opts, argc - 2, argv + 2);
+    }
+
+    if(argc < (probe || read_len ? 2 : 3)) {
         printf("Not enough arguments\n");
         print_usage();
         return 1;
@@ -57,54 +620,110 @@ int main(int argc, char* argv[])
     device = argv[1];
     bytes = (uint32_t)argc - 2;
 
+    if(read_len && len) {
+        printf("-l and -r can't be used together\n");
+        return 1;
+    }
+
+    /* The transfer can be padded out past the given bytes, to clock in a
+     * response. With -r the response is read after the bytes are sent
+     * instead */
+    if(len < bytes) {
+        len = bytes;
+    }
+    rx_len = read_len ? read_len : len;
+
+    writeBuffer = calloc(1, len ? len : 1);
+    readBuffer = calloc(1, rx_len ? rx_len : 1);
+    if(!writeBuffer || !readBuffer) {
+        printf("Unable to allocate %u byte buffers\n", len > rx_len ? len : rx_len);
+        return 1;
+    }
+
     for(int i = 2; i < argc; ++i) {
         writeBuffer[i - 2] = (unsigned char)strtoul(argv[i], NULL, 0);
     }
 
-    fd = open(device, O_RDWR);
-    if(fd < 0) {
-        printf("Unable to open spidev, fd: %d (errno: %d)\n", fd, errno);
+    bus = open_device(device, &opts, opts.bits, opts.lines);
+    if(!bus) {
         return 1;
     }
 
-    ret = ioctl(fd, SPI_IOC_WR_MODE, &mode);
-    if(ret == -1) {
-        printf("Unable to set SPI mode, fd: %d (errno: %d)\n", fd, errno);
-        return 1;
+    if(probe) {
+        if(spi_bus_get_config(bus, &config) < 0) {
+            printf("Unable to read the SPI settings (errno: %d)\n", errno);
+            return 1;
+        }
+
+        print_config(bus, &config);
+        spi_bus_close(bus);
+
+        return 0;
     }
 
-    struct spi_ioc_transfer transferData = {
-        .tx_buf = (long long unsigned int)writeBuffer,
-        .rx_buf = (long long unsigned int)readBuffer,
-        .len = bytes,
-        .speed_hz = 1000000,
-        .delay_usecs = 1,
-        .bits_per_word = 8,
-        .cs_change = 1,
-        .tx_nbits = 0,
-        .rx_nbits = 0
-    };
+    bus->speed_hz = opts.speed_hz ? opts.speed_hz : SPI_DEFAULT_SPEED_HZ;
+    bus->delay_usecs = opts.delay_us;
+    bus->cs_hold = opts.cs_hold;
 
-    ret = ioctl(fd, SPI_IOC_MESSAGE(1), &transferData);
-    if(ret < 1) {
-        printf("Unable to transfer SPI data. Ret: %d, errno: %d\n", ret, errno);
+    memset(xfers, 0, sizeof(xfers));
+    if(read_len) {
+        /* Command then response: a send-only transfer and a receive-only
+         * one in the same message, so nothing is clocked in while the
+         * command goes out and nothing but zeros goes out with the
+         * response. The response can use more data lines */
+        if(spi_bus_get_lines(bus, &tx_lines, &rx_lines) < 0) {
+            printf("Unable to read the SPI settings (errno: %d)\n", errno);
+            return 1;
+        }
+        xfers[0].tx = writeBuffer;
+        xfers[0].len = len;
+        xfers[1].rx = readBuffer;
+        xfers[1].len = read_len;
+        xfers[1].rx_nbits = rx_lines;
+        ret = spi_bus_transfer(bus, len ? xfers : &xfers[1], len ? 2 : 1);
+    } else {
+        xfers[0].tx = writeBuffer;
+        xfers[0].rx = readBuffer;
+        xfers[0].len = len;
+        ret = spi_bus_transfer(bus, xfers, 1);
+    }
+    if(ret < 0) {
+        printf("Unable to transfer SPI data (errno: %d)\n", errno);
         return 1;
     }
 
     printf("Sent:\n");
-    for(uint32_t b = 0; b < bytes; ++b) {
+    for(uint32_t b = 0; b < len; ++b) {
         printf("%02x ", writeBuffer[b]);
     }
 
     printf("\n\n");
 
     printf("Received:\n");
-    for(uint32_t b = 0; b < bytes; ++b) {
+    for(uint32_t b = 0; b < rx_len; ++b) {
         printf("%02x ", readBuffer[b]);
     }
     printf("\n");
 
-    close(fd);
+    if(opts.verbose) {
+        printf("\n%lu messages, %lu transfers (spidev bufsiz %u)\n",
+               bus->stats.messages, bus->stats.transfers, bus->bufsiz);
+    }
+
+    spi_bus_close(bus);
+
+    if(opts.use_crc) {
+        crc = crc_update(opts.crc_type, 0, readBuffer, rx_len);
+        printf("\nReceived %s: 0x%08x\n", crc_type_name(opts.crc_type), crc);
+
+        if(opts.check_crc && crc != opts.expected_crc) {
+            printf("Checksum mismatch, expected 0x%08x\n", opts.expected_crc);
+            return 1;
+        }
+    }
+
+    free(writeBuffer);
+    free(readBuffer);
 
     return 0;
 }
@@ -112,35 +731,2163 @@ int main(int argc, char* argv[])
 static void print_usage(
     void)
 {
-    printf("I2C read/write utility\n");
+    printf("SPI transfer utility\n");
     printf("Usage:\n");
-    printf("    ./i2c <op> <bus> <addr> [args...]\n");
+    printf("    ./spi [options] <device> <bytes...>\n");
+    printf("    ./spi [options] -r len <device> [bytes...]\n");
+    printf("    ./spi [options] -p <device>\n");
+    printf("    ./spi [options] flash <device> info\n");
+    printf("    ./spi [options] flash <device> read <file> [offset [len]]\n");
+    printf("    ./spi [options] flash <device> write <file> [offset]\n");
+    printf("    ./spi [options] flash <device> erase [offset len]\n");
+    printf("    ./spi [options] flash <device> verify <file> [offset]\n");
+    printf("    ./spi [options] flash <device> layout [file]\n");
+    printf("    ./spi [options] nand <device> info|bbt\n");
+    printf("    ./spi [options] nand <device> read <file> [offset [len]]\n");
+    printf("    ./spi [options] eeprom <device> <size[:page]> read <file> [offset [len]]\n");
+    printf("    ./spi [options] eeprom <device> <size[:page]> write|verify <file> [offset]\n");
+    printf("    ./spi [options] gang <file> <device...>\n");
+    printf("    ./spi [options] capture <device> <file> <rate> <samples> <bytes...>\n");
+    printf("    ./spi [options] script <device> <script>\n");
+    printf("\n");
+    printf("Options:\n");
+    printf("    -s hz   - Clock speed, with an optional k or M suffix (default\n");
+    printf("              1M, or the device's maximum for flash). Also sets the\n");
+    printf("              device's maximum speed\n");
+    printf("    -m mode - SPI mode 0 to 3 (default 3)\n");
+    printf("    -L      - Send the least significant bit first\n");
+    printf("    -b bits - Bits per word (default 8)\n");
+    printf("    -d us   - Delay after each transfer (default %d)\n", SPI_DEFAULT_DELAY_US);
+    printf("    -C cs   - Chip select: high (active high), none (don't drive\n");
+    printf("              it) or hold (leave the device selected afterwards)\n");
+    printf("    -w n    - Enable n (2 or 4) data lines for transfers that only\n");
+    printf("              send or receive, if the controller has them. Flash\n");
+    printf("              reads use up to 4 unless -w is given\n");
+    printf("    -i name - Restrict flash read, write, erase and verify to the\n");
+    printf("              named flash descriptor or FMAP regions (comma\n");
+    printf("              separated, or repeat -i)\n");
+    printf("    -z      - Read flash dumps straight into a mapping of the\n");
+    printf("              output file instead of copying them through a buffer\n");
+    printf("    -p      - Apply the settings, then print the settings the\n");
+    printf("              driver is using\n");
+    printf("    -l len  - Pad the transfer with zeros to len bytes, to clock in a\n");
+    printf("              longer response than the bytes sent\n");
+    printf("    -r len  - Send the bytes, then read a len byte response with the\n");
+    printf("              device still selected (half duplex)\n");
+    printf("    -v      - Print how the transfer was split into messages\n");
+    printf("    -c type - Print the checksum (crc32 or crc32c) of the received\n");
+    printf("              bytes\n");
+    printf("    -e crc  - Fail unless the checksum of the received bytes matches\n");
+    printf("              crc (hex), implies -c crc32 unless -c is given\n");
     printf("\n");
     printf("Where:\n");
-    printf("    op      - The Operation to perform. One of:\n");
-    printf("                * r     - Plain read from the device\n");
-    printf("                    Arguments: <count>\n");
-    printf("                        - count     - The number of bytes to read\n");
-    printf("                * w     - Plain write to the device\n");
-    printf("                    Arguments: <bytes...>\n");
-    printf("                        - bytes - The bytes to write\n");
-    printf("                * r8    - Read from an 8 bit offset\n");
-    printf("                    Arguments: <offset> <count>\n");
-    printf("                        - offset    - the offset to read from\n");
-    printf("                        - count     - The number of bytes to read\n");
-    printf("                * w8    - Write to an 8 bit offset\n");
-    printf("                    Arguments: <offset> <bytes...>\n");
-    printf("                        - offset - the offset to write to\n");
-    printf("                        - bytes - The bytes to write\n");
-    printf("                * r16   - Read from a 16 bit offset\n");
-    printf("                    Arguments: <offset> <count>\n");
-    printf("                        - offset - the offset to read from\n");
-    printf("                        - count     - The number of bytes to read\n");
-    printf("                * w16   - Write to a 16 bit offset\n");
-    printf("                    Arguments: <offset> <bytes...>\n");
-    printf("                        - offset - the offset to write to\n");
-    printf("                        - bytes - The bytes to write\n");
-    printf("    bus     - The I2C bus to perform the operation on\n");
-    printf("    addr    - The I2C address of the device to access (7-bit)\n");
-    printf("    val...  - Optional arguments for the operation (see above)\n");
+    printf("    device  - The spidev device to use, e.g. /dev/spidev0.0 or 0.0\n");
+    printf("    bytes   - The bytes to send. The same number of bytes is\n");
+    printf("              received. Transfers larger than the spidev buffer\n");
+    printf("              are split with the device kept selected\n");
+    printf("    file    - The image to read into or program from, - for stdout\n");
+    printf("    offset  - Flash offset and length, with an optional k or M suffix.\n");
+    printf("    len       Erases must be aligned to the smallest erase size,\n");
+    printf("              writes are padded out with the existing contents\n");
+    printf("    size    - EEPROM size, e.g. 32k for a 25256, and optionally\n");
+    printf("    page      its page size (default the smallest for the size)\n");
+    printf("    device... - Flashes to write the image to at offset 0 and\n");
+    printf("              verify, in parallel across controllers\n");
+    printf("    rate    - Samples per second to capture, with an optional k or\n");
+    printf("              M suffix\n");
+    printf("    samples - Sample periods to capture for, 0 to run until\n");
+    printf("              interrupted\n");
+    printf("    script  - A file of transfers to run, see the README\n");
+}
+
+static int parse_hz(
+    const char*     str,
+    uint32_t*       hz)
+{
+    char* end = NULL;
+    double val = 0;
+
+    val = strtod(str, &end);
+    if(end == str) {
+        return -1;
+    }
+
+    if(*end == 'k' || *end == 'K') {
+        val *= 1000;
+        ++end;
+    } else if(*end == 'M' || *end == 'm') {
+        val *= 1000000;
+        ++end;
+    }
+
+    if(*end != '\0' || val < 1 || val > UINT32_MAX) {
+        return -1;
+    }
+
+    *hz = (uint32_t)val;
+
+    return 0;
+}
+
+/**
+ * @brief Parse a byte count or offset, with an optional k or M (binary)
+ *        suffix
+ */
+static int parse_size(
+    const char*     str,
+    uint64_t*       size)
+{
+    char* end = NULL;
+    unsigned long long val = 0;
+
+    val = strtoull(str, &end, 0);
+    if(end == str) {
+        return -1;
+    }
+
+    if(*end == 'k' || *end == 'K') {
+        val <<= 10;
+        ++end;
+    } else if(*end == 'M' || *end == 'm') {
+        val <<= 20;
+        ++end;
+    }
+
+    if(*end != '\0') {
+        return -1;
+    }
+
+    *size = val;
+
+    return 0;
+}
+
+static void print_config(
+    struct spi_bus*                 bus,
+    const struct spi_bus_config*    config)
+{
+    printf("Device:        %s\n", bus->name);
+    printf("Mode:          %u (CPOL=%u CPHA=%u)\n",
+           (unsigned int)(config->mode & (SPI_CPOL | SPI_CPHA)),
+           config->mode & SPI_CPOL ? 1 : 0,
+           config->mode & SPI_CPHA ? 1 : 0);
+    printf("Bit order:     %s first\n", config->mode & SPI_LSB_FIRST ? "LSB" : "MSB");
+    printf("Chip select:   %s\n", config->mode & SPI_NO_CS ? "none" :
+                                  (config->mode & SPI_CS_HIGH ? "active high" : "active low"));
+    printf("Wiring:        %s\n", config->mode & SPI_3WIRE ? "3-wire" : "4-wire");
+    printf("Data lines:    %u out, %u in\n",
+           config->mode & SPI_TX_QUAD ? 4 : (config->mode & SPI_TX_DUAL ? 2 : 1),
+           config->mode & SPI_RX_QUAD ? 4 : (config->mode & SPI_RX_DUAL ? 2 : 1));
+    printf("Max speed:     %u Hz\n", config->max_speed_hz);
+    printf("Bits per word: %u\n", config->bits_per_word);
+    printf("Buffer size:   %u bytes\n", bus->bufsiz);
+}
+
+/**
+ * @brief Open and configure a device. The maximum speed is only changed
+ *        when asked for, otherwise transfers that don't set a speed run at
+ *        the device's existing maximum
+ */
+static struct spi_bus* open_device(
+    const char*             device,
+    const struct spi_opts*  opts,
+    uint8_t                 bits,
+    unsigned int            lines)
+{
+    struct spi_bus_config config = {0};
+    struct spi_bus* bus = NULL;
+
+    bus = spi_bus_open(device);
+    if(!bus) {
+        printf("Unable to open spidev %s (errno: %d)\n", device, errno);
+        return NULL;
+    }
+
+    config.mode = opts->mode;
+    config.max_speed_hz = opts->speed_hz;
+    config.bits_per_word = bits;
+
+    if(spi_bus_configure(bus, &config) < 0) {
+        printf("Unable to configure the SPI device (errno: %d)\n", errno);
+        spi_bus_close(bus);
+        return NULL;
+    }
+
+    if(lines > 1 && spi_bus_set_lines(bus, lines) < 0) {
+        printf("Unable to enable %u data lines (errno: %d)\n", lines, errno);
+        spi_bus_close(bus);
+        return NULL;
+    }
+
+    bus->speed_hz = opts->speed_hz;
+    bus->bits_per_word = bits;
+
+    return bus;
+}
+
+static int run_flash(
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[])
+{
+    struct spi_nor nor;
+    struct spi_bus* bus = NULL;
+    const char* op = argv[1];
+    int ret = 0;
+
+    /* Flash reads use as many lines as the controller has */
+    bus = open_device(argv[0], opts, 8, opts->lines ? opts->lines : 4);
+    if(!bus) {
+        return 1;
+    }
+
+    if(spi_nor_probe(&nor, bus) < 0) {
+        printf("No flash found on %s (errno: %d)\n", argv[0], errno);
+        spi_bus_close(bus);
+        return 1;
+    }
+
+    argc -= 2;
+    argv += 2;
+
+    if(strcmp(op, "info") == 0) {
+        ret = flash_info(&nor);
+    } else if(strcmp(op, "read") == 0) {
+        ret = flash_read(&nor, opts, argc, argv);
+    } else if(strcmp(op, "write") == 0) {
+        ret = flash_write(&nor, opts, argc, argv);
+    } else if(strcmp(op, "erase") == 0) {
+        ret = flash_erase(&nor, opts, argc, argv);
+    } else if(strcmp(op, "verify") == 0) {
+        ret = flash_verify(&nor, opts, argc, argv);
+    } else if(strcmp(op, "layout") == 0) {
+        ret = flash_layout(&nor, argc, argv);
+    } else {
+        printf("Unknown flash operation %s\n", op);
+        ret = 1;
+    }
+
+    spi_nor_release(&nor);
+
+    if(opts->verbose) {
+        fprintf(stderr, "%lu messages, %lu reads, %lu page programs, %lu erases, "
+                "%lu status polls\n", bus->stats.messages, nor.stats.reads,
+                nor.stats.programs, nor.stats.erases, nor.stats.status_polls);
+    }
+
+    spi_bus_close(bus);
+
+    return ret;
+}
+
+static int run_nand(
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[])
+{
+    struct spi_nand nand;
+    struct spi_bus* bus = NULL;
+    const char* op = argv[1];
+    int ret = 0;
+
+    bus = open_device(argv[0], opts, 8, opts->lines ? opts->lines : 4);
+    if(!bus) {
+        return 1;
+    }
+
+    if(spi_nand_probe(&nand, bus) < 0) {
+        if(errno == ENOTSUP) {
+            printf("Unknown SPI NAND on %s, ID %02x %02x %02x\n", argv[0],
+                   nand.id[0], nand.id[1], nand.id[2]);
+        } else {
+            printf("No SPI NAND found on %s (errno: %d)\n", argv[0], errno);
+        }
+        spi_bus_close(bus);
+        return 1;
+    }
+
+    argc -= 2;
+    argv += 2;
+
+    if(strcmp(op, "info") == 0) {
+        ret = nand_info(&nand);
+    } else if(strcmp(op, "bbt") == 0) {
+        ret = nand_bbt(&nand);
+    } else if(strcmp(op, "read") == 0) {
+        ret = nand_read(&nand, opts, argc, argv);
+    } else {
+        printf("Unknown NAND operation %s\n", op);
+        ret = 1;
+    }
+
+    spi_nand_release(&nand);
+
+    if(opts->verbose) {
+        fprintf(stderr, "%lu messages, %lu page reads, %lu cache reads, %lu reads from "
+                "cache, %lu status polls\n", bus->stats.messages, nand.stats.page_reads,
+                nand.stats.cache_reads, nand.stats.cache_outputs, nand.stats.status_polls);
+    }
+
+    spi_bus_close(bus);
+
+    return ret;
+}
+
+static int run_eeprom(
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[])
+{
+    struct spi_eeprom eeprom;
+    struct spi_bus* bus = NULL;
+    char* page = strchr(argv[1], ':');
+    const char* op = argv[2];
+    uint64_t size = 0;
+    uint64_t page_size = 0;
+    int ret = 0;
+
+    if(page) {
+        *page++ = '\0';
+        if(parse_size(page, &page_size) < 0 || page_size > UINT32_MAX) {
+            printf("Invalid page size %s\n", page);
+            return 1;
+        }
+    }
+
+    if(parse_size(argv[1], &size) < 0 || size > UINT32_MAX) {
+        printf("Invalid EEPROM size %s\n", argv[1]);
+        return 1;
+    }
+
+    /* EEPROMs only have the one data line */
+    bus = open_device(argv[0], opts, 8, 1);
+    if(!bus) {
+        return 1;
+    }
+
+    if(spi_eeprom_init(&eeprom, bus, (uint32_t)size, (uint32_t)page_size) < 0) {
+        printf("EEPROMs must be a power of 2 from 128 bytes to 16M, with a power "
+               "of 2 page size up to 256 bytes\n");
+        spi_bus_close(bus);
+        return 1;
+    }
+
+    argc -= 3;
+    argv += 3;
+
+    if(strcmp(op, "read") == 0) {
+        ret = eeprom_read(&eeprom, opts, argc, argv);
+    } else if(strcmp(op, "write") == 0) {
+        ret = eeprom_write(&eeprom, argc, argv);
+    } else if(strcmp(op, "verify") == 0) {
+        ret = eeprom_verify(&eeprom, argc, argv);
+    } else {
+        printf("Unknown EEPROM operation %s\n", op);
+        ret = 1;
+    }
+
+    if(opts->verbose) {
+        fprintf(stderr, "%lu messages, %lu reads, %lu page writes, %lu status polls\n",
+                bus->stats.messages, eeprom.stats.reads, eeprom.stats.writes,
+                eeprom.stats.status_polls);
+    }
+
+    spi_bus_close(bus);
+
+    return ret;
+}
+
+/** Set by SIGINT/SIGTERM to stop a capture */
+static volatile int capture_stop = 0;
+
+static void capture_signal(
+    int                     sig)
+{
+    (void)sig;
+    capture_stop = 1;
+}
+
+/**
+ * @brief Send the given bytes at a fixed rate, streaming what is received to
+ *        a file
+ */
+static int run_capture(
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[])
+{
+    struct spi_capture_config config;
+    struct spi_capture_stats stats;
+    struct sigaction sa;
+    struct spi_bus* bus = NULL;
+    uint8_t* tx = NULL;
+    FILE* out = NULL;
+    FILE* log = stdout;
+    uint64_t dropped = 0;
+    double secs = 0;
+    int ret = 1;
+    int i = 0;
+
+    memset(&config, 0, sizeof(config));
+    memset(&sa, 0, sizeof(sa));
+
+    if(parse_hz(argv[2], &config.rate_hz) < 0 || !config.rate_hz) {
+        printf("Invalid rate %s\n", argv[2]);
+        return 1;
+    }
+
+    config.samples = strtoull(argv[3], NULL, 0);
+    config.len = (uint32_t)argc - 4;
+
+    tx = malloc(config.len);
+    if(!tx) {
+        printf("Unable to allocate %u bytes\n", config.len);
+        return 1;
+    }
+
+    for(i = 4; i < argc; ++i) {
+        tx[i - 4] = (uint8_t)strtoul(argv[i], NULL, 0);
+    }
+    config.tx = tx;
+
+    if(strcmp(argv[1], "-") == 0) {
+        out = stdout;
+        log = stderr;
+    } else {
+        out = fopen(argv[1], "wb");
+        if(!out) {
+            printf("Unable to open %s (errno: %d)\n", argv[1], errno);
+            free(tx);
+            return 1;
+        }
+    }
+
+    bus = open_device(argv[0], opts, opts->bits, opts->lines);
+    if(!bus) {
+        goto out;
+    }
+
+    bus->speed_hz = opts->speed_hz ? opts->speed_hz : SPI_DEFAULT_SPEED_HZ;
+    bus->delay_usecs = opts->delay_us;
+
+    sa.sa_handler = capture_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if(spi_capture_run(bus, &config, out, &capture_stop, &stats) < 0) {
+        fprintf(log, "Capture failed (errno: %d)\n", errno);
+    } else if(fflush(out) != 0) {
+        fprintf(log, "Unable to write %s (errno: %d)\n", argv[1], errno);
+    } else {
+        ret = 0;
+    }
+
+    secs = stats.elapsed_ns / 1e9;
+    dropped = stats.dropped_late + stats.dropped_full;
+    fprintf(log, "Captured %llu samples in %.3f s (%.1f/s, %.1f%% of %u/s)\n",
+            (unsigned long long)stats.captured, secs,
+            secs > 0 ? stats.captured / secs : 0.0,
+            secs > 0 ? stats.captured / secs * 100.0 / config.rate_hz : 0.0,
+            config.rate_hz);
+    fprintf(log, "%llu dropped (%llu late, %llu while the writer was behind), "
+            "%llu batches of up to %u samples\n",
+            (unsigned long long)dropped, (unsigned long long)stats.dropped_late,
+            (unsigned long long)stats.dropped_full,
+            (unsigned long long)stats.batches, stats.batch);
+
+    if(opts->verbose) {
+        fprintf(log, "%lu messages, %lu transfers (spidev bufsiz %u)\n",
+                bus->stats.messages, bus->stats.transfers, bus->bufsiz);
+    }
+
+    spi_bus_close(bus);
+
+out:
+    if(out != stdout) {
+        fclose(out);
+    }
+    free(tx);
+
+    return ret;
+}
+
+/**
+ * @brief Run a script of transfers, printing what each line received
+ */
+static int run_script(
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[])
+{
+    struct spi_script* script = NULL;
+    struct spi_bus* bus = NULL;
+    unsigned int line = 0;
+    uint64_t t = 0;
+    int ret = 0;
+
+    (void)argc;
+
+    script = spi_script_load(argv[1]);
+    if(!script) {
+        if(errno != EINVAL) {
+            printf("Unable to load %s (errno: %d)\n", argv[1], errno);
+        }
+        return 1;
+    }
+
+    bus = open_device(argv[0], opts, opts->bits, opts->lines);
+    if(!bus) {
+        spi_script_free(script);
+        return 1;
+    }
+
+    bus->speed_hz = opts->speed_hz ? opts->speed_hz : SPI_DEFAULT_SPEED_HZ;
+    bus->delay_usecs = opts->delay_us;
+    bus->cs_hold = opts->cs_hold;
+
+    t = spi_bus_time_ns(bus);
+    if(spi_script_run(bus, script, script_received, NULL, &line) < 0) {
+        printf("%s:%u: failed (errno: %d)\n", argv[1], line, errno);
+        ret = 1;
+    }
+
+    if(opts->verbose) {
+        printf("%lu messages, %lu transfers in %.3f ms (spidev bufsiz %u)\n",
+               bus->stats.messages, bus->stats.transfers,
+               (spi_bus_time_ns(bus) - t) / 1e6, bus->bufsiz);
+    }
+
+    spi_bus_close(bus);
+    spi_script_free(script);
+
+    return ret;
+}
+
+static void script_received(
+    unsigned int            line,
+    const uint8_t*          rx,
+    uint32_t                len,
+    void*                   user)
+{
+    (void)user;
+
+    printf("%u:", line);
+    for(uint32_t b = 0; b < len; ++b) {
+        printf(" %02x", rx[b]);
+    }
+    printf("\n");
+}
+
+/**
+ * @brief Write an image to several flashes at once, one thread per
+ *        controller
+ */
+static int run_gang(
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[])
+{
+    struct gang gang;
+    pthread_condattr_t attr;
+    struct gang_worker* workers = NULL;
+    struct gang_dev* dev = NULL;
+    struct timespec start;
+    struct timespec now;
+    struct timespec wake;
+    int num_workers = 0;
+    int programmed = 0;
+    int i = 0;
+    int j = 0;
+    double secs = 0;
+
+    memset(&gang, 0, sizeof(gang));
+    gang.opts = opts;
+    gang.count = argc - 1;
+
+    gang.data = load_file(argv[0], &gang.size);
+    if(!gang.data) {
+        return 1;
+    }
+
+    gang.devs = calloc(gang.count, sizeof(*gang.devs));
+    workers = calloc(gang.count, sizeof(*workers));
+    if(!gang.devs || !workers) {
+        printf("Unable to allocate %d devices\n", gang.count);
+        return 1;
+    }
+
+    for(i = 0; i < gang.count; ++i) {
+        gang.devs[i].spec = argv[i + 1];
+        gang_controller(argv[i + 1], i, gang.devs[i].controller,
+                        sizeof(gang.devs[i].controller));
+    }
+
+    /* Progress is reported on CLOCK_MONOTONIC deadlines */
+    pthread_mutex_init(&gang.lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&gang.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* A thread for each controller, taking its devices in turn */
+    for(i = 0; i < gang.count; ++i) {
+        for(j = 0; j < i && strcmp(gang.devs[j].controller, gang.devs[i].controller); ++j);
+        if(j < i) {
+            continue;
+        }
+
+        workers[num_workers].gang = &gang;
+        workers[num_workers].first = i;
+
+        pthread_mutex_lock(&gang.lock);
+        gang.running++;
+        pthread_mutex_unlock(&gang.lock);
+
+        if(pthread_create(&workers[num_workers].thread, NULL, gang_worker,
+                          &workers[num_workers]) != 0) {
+            printf("Unable to start a thread for %s\n", gang.devs[i].controller);
+            pthread_mutex_lock(&gang.lock);
+            gang.running--;
+            for(j = i; j < gang.count; ++j) {
+                if(strcmp(gang.devs[j].controller, gang.devs[i].controller) == 0) {
+                    gang.devs[j].state = GANG_FAILED;
+                    snprintf(gang.devs[j].error, sizeof(gang.devs[j].error),
+                             "No thread to program it");
+                }
+            }
+            pthread_mutex_unlock(&gang.lock);
+            continue;
+        }
+        num_workers++;
+    }
+
+    printf("Programming %llu bytes into %d devices on %d controllers\n",
+           (unsigned long long)gang.size, gang.count, num_workers);
+
+    pthread_mutex_lock(&gang.lock);
+    while(gang.running) {
+        clock_gettime(CLOCK_MONOTONIC, &wake);
+        wake.tv_sec += GANG_PROGRESS_MS / 1000;
+        wake.tv_nsec += (GANG_PROGRESS_MS % 1000) * 1000000L;
+        if(wake.tv_nsec >= 1000000000L) {
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000L;
+        }
+
+        if(pthread_cond_timedwait(&gang.cond, &gang.lock, &wake) != 0 && gang.running) {
+            gang_progress(&gang);
+        }
+    }
+    pthread_mutex_unlock(&gang.lock);
+
+    for(i = 0; i < num_workers; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    secs = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+
+    for(i = 0; i < gang.count; ++i) {
+        dev = &gang.devs[i];
+        if(dev->state != GANG_DONE) {
+            printf("%s: %s: %s\n", dev->spec, gang_state_names[dev->state], dev->error);
+            continue;
+        }
+
+        programmed++;
+        printf("%s: written and verified in %.3f s (%.2f MB/s), %lu blocks "
+               "unchanged, %lu programmed, %lu erased\n", dev->spec, dev->ns / 1e9,
+               dev->ns ? gang.size * 1e3 / dev->ns : 0.0, dev->result.unchanged,
+               dev->result.programmed, dev->result.erased);
+    }
+
+    printf("%d of %d devices programmed in %.3f s\n", programmed, gang.count, secs);
+
+    pthread_cond_destroy(&gang.cond);
+    pthread_mutex_destroy(&gang.lock);
+    free(workers);
+    free(gang.devs);
+    free((void*)gang.data);
+
+    return programmed == gang.count ? 0 : 1;
+}
+
+static void* gang_worker(
+    void*                   arg)
+{
+    struct gang_worker* worker = arg;
+    struct gang* gang = worker->gang;
+    const char* controller = gang->devs[worker->first].controller;
+    int i = 0;
+
+    for(i = worker->first; i < gang->count; ++i) {
+        if(strcmp(gang->devs[i].controller, controller) == 0) {
+            gang_program(gang, &gang->devs[i]);
+        }
+    }
+
+    pthread_mutex_lock(&gang->lock);
+    gang->running--;
+    pthread_cond_signal(&gang->cond);
+    pthread_mutex_unlock(&gang->lock);
+
+    return NULL;
+}
+
+/**
+ * @brief Write and verify the image on one device, recording progress and
+ *        the outcome in dev
+ */
+static void gang_program(
+    struct gang*            gang,
+    struct gang_dev*        dev)
+{
+    struct spi_nor_update_result result;
+    struct spi_nor nor;
+    struct spi_bus* bus = NULL;
+    uint64_t mismatch = 0;
+    uint64_t start = 0;
+    uint64_t piece = 0;
+    uint64_t pos = 0;
+    int ret = 0;
+
+    bus = open_device(dev->spec, gang->opts, 8, gang->opts->lines ? gang->opts->lines : 4);
+    if(!bus) {
+        snprintf(dev->error, sizeof(dev->error), "Unable to open the device");
+        gang_set(gang, dev, GANG_FAILED, 0);
+        return;
+    }
+
+    if(spi_nor_probe(&nor, bus) < 0) {
+        snprintf(dev->error, sizeof(dev->error), "No flash found (errno: %d)", errno);
+        gang_set(gang, dev, GANG_FAILED, 0);
+        spi_bus_close(bus);
+        return;
+    }
+
+    if(gang->size > nor.size) {
+        snprintf(dev->error, sizeof(dev->error), "The image doesn't fit in the %llu byte flash",
+                 (unsigned long long)nor.size);
+        gang_set(gang, dev, GANG_FAILED, 0);
+        goto out;
+    }
+
+    start = spi_bus_time_ns(bus);
+
+    gang_set(gang, dev, GANG_WRITING, 0);
+    for(pos = 0; pos < gang->size; pos += piece) {
+        piece = gang->size - pos < GANG_CHUNK ? gang->size - pos : GANG_CHUNK;
+        if(spi_nor_update(&nor, pos, &gang->data[pos], piece, &result) < 0) {
+            snprintf(dev->error, sizeof(dev->error), "Unable to write at 0x%llx (errno: %d)",
+                     (unsigned long long)pos, errno);
+            gang_set(gang, dev, GANG_FAILED, pos);
+            goto out;
+        }
+
+        dev->result.unchanged += result.unchanged;
+        dev->result.programmed += result.programmed;
+        dev->result.erased += result.erased;
+        dev->result.pages += result.pages;
+        gang_set(gang, dev, GANG_WRITING, pos + piece);
+    }
+
+    gang_set(gang, dev, GANG_VERIFYING, 0);
+    for(pos = 0; pos < gang->size; pos += piece) {
+        piece = gang->size - pos < GANG_CHUNK ? gang->size - pos : GANG_CHUNK;
+        ret = spi_nor_verify(&nor, pos, &gang->data[pos], piece, &mismatch);
+        if(ret) {
+            if(ret < 0) {
+                snprintf(dev->error, sizeof(dev->error), "Unable to verify at 0x%llx (errno: %d)",
+                         (unsigned long long)pos, errno);
+            } else {
+                snprintf(dev->error, sizeof(dev->error), "Verify failed at 0x%llx",
+                         (unsigned long long)mismatch);
+            }
+            gang_set(gang, dev, GANG_FAILED, pos);
+            goto out;
+        }
+
+        gang_set(gang, dev, GANG_VERIFYING, pos + piece);
+    }
+
+    dev->ns = spi_bus_time_ns(bus) - start;
+    gang_set(gang, dev, GANG_DONE, gang->size);
+
+out:
+    spi_nor_release(&nor);
+    spi_bus_close(bus);
+}
+
+/**
+ * @brief Update a device's progress
+ */
+static void gang_set(
+    struct gang*            gang,
+    struct gang_dev*        dev,
+    enum gang_state         state,
+    uint64_t                done)
+{
+    pthread_mutex_lock(&gang->lock);
+    dev->state = state;
+    dev->done = done;
+    pthread_mutex_unlock(&gang->lock);
+}
+
+/**
+ * @brief Work out which controller a device is on, from the spidev node
+ *        rather than its name so that symlinks and other paths to the same
+ *        controller are grouped. The controller is the parent of the SPI
+ *        device in sysfs (e.g. spi1), falling back to X of the node's
+ *        canonical spidevX.Y name. Anything that isn't a character device,
+ *        such as a simulated controller, is taken to have a controller of its
+ *        own
+ */
+static void gang_controller(
+    const char*             spec,
+    int                     index,
+    char*                   controller,
+    size_t                  len)
+{
+    char node[PATH_MAX] = {0};
+    char sys[PATH_MAX] = {0};
+    char real[PATH_MAX] = {0};
+    struct stat st;
+    const char* p = NULL;
+    unsigned long num = 0;
+    unsigned long cs = 0;
+
+    /* The same resolution as spi_bus_open() */
+    if(spec[0] == '/') {
+        snprintf(node, sizeof(node), "%s", spec);
+    } else {
+        snprintf(node, sizeof(node), "/dev/spidev%s", spec);
+    }
+
+    if(strncmp(spec, "sim", 3) == 0 || stat(node, &st) < 0 || !S_ISCHR(st.st_mode)) {
+        snprintf(controller, len, "#%d", index);
+        return;
+    }
+
+    snprintf(sys, sizeof(sys), "/sys/dev/char/%u:%u/device/..",
+             major(st.st_rdev), minor(st.st_rdev));
+    if(realpath(sys, real)) {
+        p = strrchr(real, '/');
+        snprintf(controller, len, "%s", p ? p + 1 : real);
+        return;
+    }
+
+    /* Without sysfs, go by the spidevX.Y name the node resolves to */
+    if(realpath(node, real)) {
+        p = strrchr(real, '/');
+        if(p && sscanf(p + 1, "spidev%lu.%lu", &num, &cs) == 2) {
+            snprintf(controller, len, "spi%lu", num);
+            return;
+        }
+    }
+
+    snprintf(controller, len, "%u:%u", major(st.st_rdev), minor(st.st_rdev));
+}
+
+/**
+ * @brief Print the progress of every device, with the lock held
+ */
+static void gang_progress(
+    struct gang*            gang)
+{
+    const struct gang_dev* dev = NULL;
+    int i = 0;
+
+    for(i = 0; i < gang->count; ++i) {
+        dev = &gang->devs[i];
+        printf("%s%s %s", i ? ", " : "", dev->spec, gang_state_names[dev->state]);
+        if(dev->state == GANG_WRITING || dev->state == GANG_VERIFYING) {
+            printf(" %llu%%", (unsigned long long)(gang->size ? dev->done * 100 / gang->size : 0));
+        }
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static int flash_info(
+    struct spi_nor*         nor)
+{
+    const struct spi_nor_read_op* op = NULL;
+    unsigned int i = 0;
+
+    printf("JEDEC ID:      %02x %02x %02x\n", nor->id[0], nor->id[1], nor->id[2]);
+    if(nor->sfdp) {
+        printf("Parameters:    SFDP %u.%u\n", nor->sfdp_rev >> 8, nor->sfdp_rev & 0xff);
+    } else {
+        printf("Parameters:    guessed from the JEDEC ID (no SFDP)\n");
+    }
+    printf("Size:          %llu bytes\n", (unsigned long long)nor->size);
+    printf("Page size:     %u bytes\n", nor->page_size);
+
+    printf("Erase sizes:  ");
+    for(i = 0; i < nor->erase_count; ++i) {
+        printf(" %uK (0x%02x)", nor->erase[i].size >> 10, nor->erase[i].opcode);
+    }
+    printf("\n");
+
+    printf("Addressing:    %u-byte%s\n", nor->addr_len,
+           nor->opcodes_4b ? " opcodes" : (nor->addr4_mode ? " mode" : ""));
+
+    printf("Read modes:   ");
+    for(i = 0; i < SPI_NOR_READ_NUM; ++i) {
+        op = &nor->reads[i];
+        if(op->supported) {
+            printf(" %s (0x%02x)", spi_nor_read_mode_name(i), op->opcode);
+        }
+    }
+    printf("\n");
+
+    if(nor->quad_disabled) {
+        printf("               (quad reads unusable, Quad Enable bit not set)\n");
+    }
+
+    op = &nor->reads[nor->read_mode];
+    printf("Data lines:    %u out, %u in\n", nor->tx_lines, nor->rx_lines);
+    printf("Using:         %s (0x%02x, %u dummy clocks)\n",
+           spi_nor_read_mode_name(nor->read_mode), op->opcode, op->dummy_clocks);
+
+    return 0;
+}
+
+/**
+ * @brief Parse the optional offset and length of a flash range, defaulting
+ *        to the rest of the part
+ */
+static int parse_range(
+    struct spi_nor*         nor,
+    int                     argc,
+    char*                   argv[],
+    uint64_t*               offset,
+    uint64_t*               len)
+{
+    *offset = 0;
+    if(argc > 0 && parse_size(argv[0], offset) < 0) {
+        printf("Invalid offset %s\n", argv[0]);
+        return -1;
+    }
+
+    if(*offset > nor->size) {
+        printf("Offset 0x%llx is past the end of the flash\n",
+               (unsigned long long)*offset);
+        return -1;
+    }
+
+    *len = nor->size - *offset;
+    if(argc > 1 && parse_size(argv[1], len) < 0) {
+        printf("Invalid length %s\n", argv[1]);
+        return -1;
+    }
+
+    if(*len > nor->size - *offset) {
+        printf("The range is past the end of the flash\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Write completed dump buffers to the output, in order, while the
+ *        main thread reads the next ones
+ */
+static void* dump_writer(
+    void*                   arg)
+{
+    struct dump_pipe* pipe = arg;
+    struct dump_buf* buf = NULL;
+    int err = 0;
+
+    pthread_mutex_lock(&pipe->lock);
+
+    for(;;) {
+        while(!pipe->filled && !pipe->done) {
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+        }
+
+        if(!pipe->filled) {
+            break;
+        }
+
+        buf = &pipe->bufs[pipe->tail];
+        pthread_mutex_unlock(&pipe->lock);
+
+        if(pipe->use_crc) {
+            pipe->crc = crc_update(pipe->crc_type, pipe->crc, buf->data, buf->len);
+        }
+
+        /* After a failure the remaining buffers are only drained, and the
+         * error is published under the lock so the reader sees it when it
+         * is woken below */
+        if(!err && fwrite(buf->data, 1, buf->len, pipe->out) != buf->len) {
+            err = errno ? errno : EIO;
+        }
+
+        pthread_mutex_lock(&pipe->lock);
+        if(err) {
+            pipe->error = err;
+        }
+        pipe->tail = (pipe->tail + 1) % DUMP_BUFFERS;
+        pipe->filled--;
+        pthread_cond_broadcast(&pipe->cond);
+    }
+
+    pthread_mutex_unlock(&pipe->lock);
+
+    return NULL;
+}
+
+/**
+ * @brief Read a flash range straight into a shared mapping of the output
+ *        file, so the data is received into the page cache and written
+ *        back from there without being copied through a buffer and write()
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int dump_mapped(
+    struct dump_pipe*       pipe,
+    const char*             path,
+    uint64_t                offset,
+    uint64_t                len,
+    dump_read_fn            read,
+    void*                   ctx)
+{
+    uint8_t* map = MAP_FAILED;
+    uint64_t pos = 0;
+    uint32_t piece = 0;
+    int fd = -1;
+    int err = 0;
+    int ret = -1;
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        printf("Unable to open %s (errno: %d)\n", path, errno);
+        return -1;
+    }
+
+    if(!len) {
+        ret = 0;
+        goto out;
+    }
+
+    /* Allocate the blocks now, so a full disk is an error here rather than
+     * a SIGBUS part way through the dump */
+    err = posix_fallocate(fd, 0, len);
+    if(err) {
+        printf("Unable to size %s (errno: %d)\n", path, err);
+        goto out;
+    }
+
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) {
+        printf("Unable to map %s (errno: %d)\n", path, errno);
+        goto out;
+    }
+    madvise(map, len, MADV_SEQUENTIAL);
+
+    for(pos = 0; pos < len; pos += piece) {
+        piece = len - pos < DUMP_BUFFER_SIZE ? (uint32_t)(len - pos) : DUMP_BUFFER_SIZE;
+        if(read(ctx, offset + pos, map + pos, piece) < 0) {
+            printf("Unable to read the flash at 0x%llx (errno: %d)\n",
+                   (unsigned long long)(offset + pos), errno);
+            goto out;
+        }
+
+        if(pipe->use_crc) {
+            pipe->crc = crc_update(pipe->crc_type, pipe->crc, map + pos, piece);
+        }
+    }
+
+    if(msync(map, len, MS_SYNC) < 0) {
+        printf("Unable to write %s (errno: %d)\n", path, errno);
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    if(map != MAP_FAILED) {
+        munmap(map, len);
+    }
+    if(close(fd) < 0 && !ret) {
+        printf("Unable to write %s (errno: %d)\n", path, errno);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Dump a flash range to a file, or stdout for "-", with the writes
+ *        and checksums overlapping the reads (or into a mapping of the file
+ *        with -z)
+ *
+ * @param offset - Flash address of the start of the range, passed on to
+ *                 read
+ * @param ns - Where to store the time taken, including the last write
+ * @param crc - Where to store the checksum, if -c was given
+ *
+ * @return 0 on success, 1 on failure
+ */
+static int dump_file(
+    const struct spi_opts*  opts,
+    struct spi_bus*         bus,
+    const char*             path,
+    uint64_t                offset,
+    uint64_t                len,
+    dump_read_fn            read,
+    void*                   ctx,
+    uint64_t*               ns,
+    uint32_t*               crc)
+{
+    struct dump_pipe pipe;
+    struct dump_buf* buf = NULL;
+    pthread_t writer;
+    FILE* log = stdout;
+    uint64_t pos = 0;
+    uint64_t start = 0;
+    unsigned int i = 0;
+    int err = 0;
+    int ret = 0;
+
+    memset(&pipe, 0, sizeof(pipe));
+    pipe.use_crc = opts->use_crc;
+    pipe.crc_type = opts->crc_type;
+
+    if(opts->map_output) {
+        if(strcmp(path, "-") == 0) {
+            printf("-z needs an output file\n");
+            return 1;
+        }
+
+        start = spi_bus_time_ns(bus);
+        if(dump_mapped(&pipe, path, offset, len, read, ctx) < 0) {
+            return 1;
+        }
+        *ns = spi_bus_time_ns(bus) - start;
+        *crc = pipe.crc;
+        return 0;
+    }
+
+    if(strcmp(path, "-") == 0) {
+        /* Keep the messages out of the image */
+        pipe.out = stdout;
+        log = stderr;
+    } else {
+        pipe.out = fopen(path, "wb");
+        if(!pipe.out) {
+            printf("Unable to open %s (errno: %d)\n", path, errno);
+            return 1;
+        }
+    }
+
+    for(i = 0; i < DUMP_BUFFERS; ++i) {
+        pipe.bufs[i].data = malloc(DUMP_BUFFER_SIZE);
+        if(!pipe.bufs[i].data) {
+            fprintf(log, "Unable to allocate the read buffers\n");
+            ret = 1;
+            goto out;
+        }
+    }
+
+    pthread_mutex_init(&pipe.lock, NULL);
+    pthread_cond_init(&pipe.cond, NULL);
+    if(pthread_create(&writer, NULL, dump_writer, &pipe) != 0) {
+        fprintf(log, "Unable to start the writer thread\n");
+        ret = 1;
+        goto out;
+    }
+
+    start = spi_bus_time_ns(bus);
+
+    /* Read into whichever buffer the writer has finished with, so the file
+     * writes and checksums overlap the SPI reads */
+    for(pos = 0; pos < len && !ret; pos += buf->len) {
+        pthread_mutex_lock(&pipe.lock);
+        while(pipe.filled == DUMP_BUFFERS && !pipe.error) {
+            pthread_cond_wait(&pipe.cond, &pipe.lock);
+        }
+        buf = &pipe.bufs[pipe.head];
+        err = pipe.error;
+        pthread_mutex_unlock(&pipe.lock);
+
+        if(err) {
+            fprintf(log, "Unable to write %s (errno: %d)\n", path, err);
+            ret = 1;
+            break;
+        }
+
+        buf->len = len - pos < DUMP_BUFFER_SIZE ? (uint32_t)(len - pos) : DUMP_BUFFER_SIZE;
+        if(read(ctx, offset + pos, buf->data, buf->len) < 0) {
+            fprintf(log, "Unable to read the flash at 0x%llx (errno: %d)\n",
+                    (unsigned long long)(offset + pos), errno);
+            ret = 1;
+            break;
+        }
+
+        pthread_mutex_lock(&pipe.lock);
+        pipe.head = (pipe.head + 1) % DUMP_BUFFERS;
+        pipe.filled++;
+        pthread_cond_broadcast(&pipe.cond);
+        pthread_mutex_unlock(&pipe.lock);
+    }
+
+    pthread_mutex_lock(&pipe.lock);
+    pipe.done = 1;
+    pthread_cond_broadcast(&pipe.cond);
+    pthread_mutex_unlock(&pipe.lock);
+    pthread_join(writer, NULL);
+
+    if(!ret && pipe.error) {
+        fprintf(log, "Unable to write %s (errno: %d)\n", path, pipe.error);
+        ret = 1;
+    }
+
+    /* Include the last write, which is what the caller waits for */
+    *ns = spi_bus_time_ns(bus) - start;
+    *crc = pipe.crc;
+
+out:
+    for(i = 0; i < DUMP_BUFFERS; ++i) {
+        free(pipe.bufs[i].data);
+    }
+    if(pipe.out != stdout && fclose(pipe.out) != 0) {
+        printf("Unable to write %s (errno: %d)\n", path, errno);
+        ret = 1;
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Print the rate of a dump, how it compares with the line rate of
+ *        the clock and data lines in use, and its checksum
+ *
+ * @param how - The read command or method, for the line rate message
+ *
+ * @return 0, or 1 if the checksum didn't match the one expected
+ */
+static int dump_report(
+    const struct spi_opts*  opts,
+    const char*             path,
+    struct spi_bus*         bus,
+    uint64_t                bytes,
+    uint64_t                ns,
+    unsigned int            nbits,
+    const char*             how,
+    uint32_t                crc)
+{
+    struct spi_bus_config config;
+    FILE* log = strcmp(path, "-") == 0 ? stderr : stdout;
+    double line_rate = 0;
+    uint32_t hz = bus->speed_hz;
+
+    print_rate(log, "Read", bytes, ns);
+
+    if(!hz && spi_bus_get_config(bus, &config) == 0) {
+        hz = config.max_speed_hz;
+    }
+
+    line_rate = (double)hz * nbits / 8;
+    if(ns && line_rate > 0) {
+        fprintf(log, "%.0f%% of the %.2f MB/s line rate (%u Hz, %s)\n",
+                bytes / (ns / 1e9) / line_rate * 100, line_rate / 1e6, hz, how);
+    }
+
+    if(opts->use_crc) {
+        fprintf(log, "%s: 0x%08x\n", crc_type_name(opts->crc_type), crc);
+
+        if(opts->check_crc && crc != opts->expected_crc) {
+            fprintf(log, "Checksum mismatch, expected 0x%08x\n", opts->expected_crc);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int flash_dump_read(
+    void*                   ctx,
+    uint64_t                addr,
+    uint8_t*                buf,
+    uint32_t                len)
+{
+    struct flash_dump* dump = ctx;
+
+    if(dump->count) {
+        return read_regions(dump->nor, dump->regions, dump->count, addr, buf, len);
+    }
+
+    return spi_nor_read(dump->nor, addr, buf, len);
+}
+
+static int flash_read(
+    struct spi_nor*         nor,
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[])
+{
+    struct spi_layout layout;
+    const struct spi_layout_region* selected[SPI_LAYOUT_MAX_REGIONS];
+    struct flash_dump dump;
+    uint64_t offset = 0;
+    uint64_t len = 0;
+    uint64_t bytes = 0;
+    uint64_t ns = 0;
+    uint32_t crc = 0;
+    int count = 0;
+    int i = 0;
+
+    if(argc < 1) {
+        printf("No output file\n");
+        return 1;
+    }
+
+    if(opts->num_regions) {
+        /* The image keeps the layout, with 0xff outside the regions */
+        if(argc > 1) {
+            printf("An offset can't be used with -i\n");
+            return 1;
+        }
+        count = select_regions(nor, opts, NULL, 0, &layout, selected);
+        if(count < 0) {
+            return 1;
+        }
+        offset = 0;
+        len = nor->size;
+        for(i = 0; i < count; ++i) {
+            bytes += selected[i]->size;
+        }
+    } else if(parse_range(nor, argc - 1, argv + 1, &offset, &len) < 0) {
+        return 1;
+    } else {
+        bytes = len;
+    }
+
+    dump.nor = nor;
+    dump.regions = selected;
+    dump.count = count;
+
+    if(dump_file(opts, nor->bus, argv[0], offset, len, flash_dump_read, &dump,
+                 &ns, &crc) != 0) {
+        return 1;
+    }
+
+    return dump_report(opts, argv[0], nor->bus, bytes, ns,
+                       nor->reads[nor->read_mode].data_nbits,
+                       spi_nor_read_mode_name(nor->read_mode), crc);
+}
+
+/**
+ * @brief Fill a buffer with the parts of a flash range that fall inside the
+ *        selected regions, leaving the rest 0xff
+ */
+static int read_regions(
+    struct spi_nor*         nor,
+    const struct spi_layout_region* const* regions,
+    int                     count,
+    uint64_t                addr,
+    uint8_t*                buf,
+    uint32_t                len)
+{
+    uint64_t start = 0;
+    uint64_t end = 0;
+    int i = 0;
+
+    memset(buf, 0xff, len);
+
+    for(i = 0; i < count; ++i) {
+        start = regions[i]->offset > addr ? regions[i]->offset : addr;
+        end = regions[i]->offset + regions[i]->size;
+        if(end > addr + len) {
+            end = addr + len;
+        }
+
+        if(start < end &&
+           spi_nor_read(nor, start, buf + (start - addr), end - start) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Look up the regions named with -i, in the image's layout if it has
+ *        one, otherwise in the layout of the image on the flash
+ *
+ * @param image - The image being written or verified, or NULL
+ *
+ * @return The number of regions selected, or -1 on failure
+ */
+static int select_regions(
+    struct spi_nor*         nor,
+    const struct spi_opts*  opts,
+    const uint8_t*          image,
+    uint64_t                len,
+    struct spi_layout*      layout,
+    const struct spi_layout_region** selected)
+{
+    const struct spi_layout_region* region = NULL;
+    unsigned int i = 0;
+    unsigned int j = 0;
+
+    if(!image || spi_layout_from_image(layout, image, len) < 0) {
+        if(spi_layout_from_flash(layout, nor) < 0) {
+            if(errno == ENOENT) {
+                printf("No flash descriptor or FMAP found\n");
+            } else {
+                printf("Unable to read the flash layout (errno: %d)\n", errno);
+            }
+            return -1;
+        }
+    }
+
+    for(i = 0; i < opts->num_regions; ++i) {
+        region = spi_layout_find(layout, opts->regions[i]);
+        if(!region) {
+            printf("No region %s, the layout has:", opts->regions[i]);
+            for(j = 0; j < layout->count; ++j) {
+                printf(" %s", layout->regions[j].name);
+            }
+            printf("\n");
+            return -1;
+        }
+
+        if(region->offset > nor->size || region->size > nor->size - region->offset) {
+            printf("Region %s is past the end of the flash\n", region->name);
+            return -1;
+        }
+
+        selected[i] = region;
+    }
+
+    return (int)opts->num_regions;
+}
+
+/**
+ * @brief Load an image for a region write or verify, which has to cover the
+ *        whole flash so the region offsets apply to it
+ *
+ * @return The number of regions selected, or -1 on failure
+ */
+static int region_image(
+    struct spi_nor*         nor,
+    const struct spi_opts*  opts,
+    int                     argc,
+    const uint8_t*          data,
+    uint64_t                size,
+    struct spi_layout*      layout,
+    const struct spi_layout_region** selected)
+{
+    if(argc > 1) {
+        printf("An offset can't be used with -i\n");
+        return -1;
+    }
+
+    if(size != nor->size) {
+        printf("The image is %llu bytes but the flash is %llu, -i needs a whole "
+               "flash image\n", (unsigned long long)size, (unsigned long long)nor->size);
+        return -1;
+    }
+
+    return select_regions(nor, opts, data, size, layout, selected);
+}
+
+static int flash_write(
+    struct spi_nor*         nor,
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[])
+{
+    struct spi_layout layout;
+    const struct spi_layout_region* selected[SPI_LAYOUT_MAX_REGIONS];
+    struct spi_layout_region whole;
+    struct spi_nor_update_result result;
+    struct spi_nor_update_result part;
+    uint8_t* data = NULL;
+    uint64_t size = 0;
+    uint64_t offset = 0;
+    uint64_t base = 0;
+    uint64_t bytes = 0;
+    uint64_t mismatch = 0;
+    uint64_t t = 0;
+    int count = 1;
+    int i = 0;
+    int ret = 1;
+
+    if(argc < 1) {
+        printf("No image file\n");
+        return 1;
+    }
+
+    if(argc > 1 && parse_size(argv[1], &offset) < 0) {
+        printf("Invalid offset %s\n", argv[1]);
+        return 1;
+    }
+
+    data = load_file(argv[0], &size);
+    if(!data) {
+        return 1;
+    }
+
+    if(opts->num_regions) {
+        count = region_image(nor, opts, argc, data, size, &layout, selected);
+        if(count < 0) {
+            goto out;
+        }
+    } else if(offset > nor->size || size > nor->size - offset) {
+        printf("The image doesn't fit in the flash\n");
+        goto out;
+    } else {
+        /* Treat a plain write as one region so both take the same path */
+        memset(&whole, 0, sizeof(whole));
+        whole.offset = offset;
+        whole.size = size;
+        selected[0] = &whole;
+        base = offset;
+    }
+
+    memset(&result, 0, sizeof(result));
+    t = spi_bus_time_ns(nor->bus);
+    for(i = 0; i < count; ++i) {
+        if(opts->num_regions) {
+            printf("Writing %s at 0x%llx, %llu bytes\n", selected[i]->name,
+                   (unsigned long long)selected[i]->offset,
+                   (unsigned long long)selected[i]->size);
+        }
+
+        if(spi_nor_update(nor, selected[i]->offset, data + (selected[i]->offset - base),
+                          selected[i]->size, &part) < 0) {
+            printf("Unable to write the flash (errno: %d)\n", errno);
+            goto out;
+        }
+
+        result.unchanged += part.unchanged;
+        result.programmed += part.programmed;
+        result.erased += part.erased;
+        result.pages += part.pages;
+        bytes += selected[i]->size;
+    }
+    print_rate(stdout, "Wrote", bytes, spi_bus_time_ns(nor->bus) - t);
+    printf("%lu blocks of %u bytes unchanged, %lu programmed, %lu erased, %lu page programs\n",
+           result.unchanged, nor->erase[0].size, result.programmed, result.erased,
+           result.pages);
+
+    t = spi_bus_time_ns(nor->bus);
+    for(i = 0, ret = 0; i < count && !ret; ++i) {
+        ret = spi_nor_verify(nor, selected[i]->offset, data + (selected[i]->offset - base),
+                             selected[i]->size, &mismatch);
+    }
+    if(ret < 0) {
+        printf("Unable to verify the flash (errno: %d)\n", errno);
+        ret = 1;
+    } else if(ret) {
+        printf("Verify failed at 0x%llx\n", (unsigned long long)mismatch);
+    } else {
+        print_rate(stdout, "Verified", bytes, spi_bus_time_ns(nor->bus) - t);
+    }
+
+out:
+    free(data);
+
+    return ret;
+}
+
+static int flash_erase(
+    struct spi_nor*         nor,
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[])
+{
+    struct spi_layout layout;
+    const struct spi_layout_region* selected[SPI_LAYOUT_MAX_REGIONS];
+    uint64_t offset = 0;
+    uint64_t len = 0;
+    uint64_t t = 0;
+    int count = 0;
+    int i = 0;
+
+    if(opts->num_regions) {
+        if(argc > 0) {
+            printf("An offset can't be used with -i\n");
+            return 1;
+        }
+
+        count = select_regions(nor, opts, NULL, 0, &layout, selected);
+        if(count < 0) {
+            return 1;
+        }
+
+        for(i = 0; i < count; ++i) {
+            if(selected[i]->offset % nor->erase[0].size ||
+               selected[i]->size % nor->erase[0].size) {
+                printf("Region %s isn't aligned to the %u byte erase size\n",
+                       selected[i]->name, nor->erase[0].size);
+                return 1;
+            }
+        }
+
+        t = spi_bus_time_ns(nor->bus);
+        for(i = 0; i < count; ++i) {
+            printf("Erasing %s at 0x%llx, %llu bytes\n", selected[i]->name,
+                   (unsigned long long)selected[i]->offset,
+                   (unsigned long long)selected[i]->size);
+            if(spi_nor_erase(nor, selected[i]->offset, selected[i]->size) < 0) {
+                printf("Unable to erase the flash (errno: %d)\n", errno);
+                return 1;
+            }
+            len += selected[i]->size;
+        }
+
+        print_rate(stdout, "Erased", len, spi_bus_time_ns(nor->bus) - t);
+
+        return 0;
+    }
+
+    if(argc == 1) {
+        printf("Erase needs both an offset and a length\n");
+        return 1;
+    }
+
+    if(parse_range(nor, argc, argv, &offset, &len) < 0) {
+        return 1;
+    }
+
+    t = spi_bus_time_ns(nor->bus);
+
+    if(argc == 0) {
+        if(spi_nor_erase_chip(nor) < 0) {
+            printf("Unable to erase the flash (errno: %d)\n", errno);
+            return 1;
+        }
+    } else if(offset % nor->erase[0].size || len % nor->erase[0].size) {
+        printf("Erases must be aligned to %u bytes\n", nor->erase[0].size);
+        return 1;
+    } else if(spi_nor_erase(nor, offset, len) < 0) {
+        printf("Unable to erase the flash (errno: %d)\n", errno);
+        return 1;
+    }
+
+    print_rate(stdout, "Erased", len, spi_bus_time_ns(nor->bus) - t);
+
+    return 0;
+}
+
+static int flash_verify(
+    struct spi_nor*         nor,
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[])
+{
+    struct spi_layout layout;
+    const struct spi_layout_region* selected[SPI_LAYOUT_MAX_REGIONS];
+    uint8_t* data = NULL;
+    uint64_t size = 0;
+    uint64_t offset = 0;
+    uint64_t bytes = 0;
+    uint64_t mismatch = 0;
+    uint64_t t = 0;
+    int count = 0;
+    int i = 0;
+    int ret = 1;
+
+    if(argc < 1) {
+        printf("No image file\n");
+        return 1;
+    }
+
+    if(argc > 1 && parse_size(argv[1], &offset) < 0) {
+        printf("Invalid offset %s\n", argv[1]);
+        return 1;
+    }
+
+    data = load_file(argv[0], &size);
+    if(!data) {
+        return 1;
+    }
+
+    if(opts->num_regions) {
+        count = region_image(nor, opts, argc, data, size, &layout, selected);
+        if(count < 0) {
+            free(data);
+            return 1;
+        }
+
+        t = spi_bus_time_ns(nor->bus);
+        for(i = 0, ret = 0; i < count && !ret; ++i) {
+            ret = spi_nor_verify(nor, selected[i]->offset, data + selected[i]->offset,
+                                 selected[i]->size, &mismatch);
+            bytes += selected[i]->size;
+        }
+    } else if(offset > nor->size || size > nor->size - offset) {
+        printf("The image doesn't fit in the flash\n");
+        free(data);
+        return 1;
+    } else {
+        t = spi_bus_time_ns(nor->bus);
+        ret = spi_nor_verify(nor, offset, data, size, &mismatch);
+        bytes = size;
+    }
+
+    if(ret < 0) {
+        printf("Unable to read the flash (errno: %d)\n", errno);
+        ret = 1;
+    } else if(ret) {
+        printf("Mismatch at 0x%llx\n", (unsigned long long)mismatch);
+    } else {
+        print_rate(stdout, "Verified", bytes, spi_bus_time_ns(nor->bus) - t);
+    }
+
+    free(data);
+
+    return ret;
+}
+
+static int flash_layout(
+    struct spi_nor*         nor,
+    int                     argc,
+    char*                   argv[])
+{
+    struct spi_layout layout;
+    const struct spi_layout_region* region = NULL;
+    uint8_t* data = NULL;
+    uint64_t size = 0;
+    unsigned int i = 0;
+    int ret = 0;
+
+    if(argc > 0) {
+        data = load_file(argv[0], &size);
+        if(!data) {
+            return 1;
+        }
+        ret = spi_layout_from_image(&layout, data, size);
+        free(data);
+    } else {
+        ret = spi_layout_from_flash(&layout, nor);
+    }
+
+    if(ret < 0) {
+        if(errno == ENOENT) {
+            printf("No flash descriptor or FMAP found\n");
+        } else {
+            printf("Unable to read the flash layout (errno: %d)\n", errno);
+        }
+        return 1;
+    }
+
+    printf("%-32s %-10s %-10s %s\n", "Region", "Offset", "Size", "Source");
+    for(i = 0; i < layout.count; ++i) {
+        region = &layout.regions[i];
+        printf("%-32s 0x%08llx 0x%08llx %s\n", region->name,
+               (unsigned long long)region->offset, (unsigned long long)region->size,
+               region->source);
+    }
+
+    return 0;
+}
+
+static int nand_info(
+    struct spi_nand*        nand)
+{
+    unsigned int i = 0;
+
+    printf("JEDEC ID:      %02x %02x %02x\n", nand->id[0], nand->id[1], nand->id[2]);
+    printf("Part:          %s\n", nand->name);
+    printf("Size:          %llu bytes\n", (unsigned long long)nand->size);
+    printf("Page size:     %u + %u spare bytes\n", nand->page_size, nand->oob_size);
+    printf("Block size:    %u pages, %u blocks\n", nand->pages_per_block, nand->blocks);
+
+    printf("Read methods: ");
+    for(i = 0; i < SPI_NAND_READ_NUM; ++i) {
+        if(nand->methods & (1u << i)) {
+            printf(" %s", spi_nand_read_method_name(i));
+        }
+    }
+    printf("\n");
+
+    printf("Data lines:    %u in\n", nand->rx_lines);
+    printf("Using:         %s reads, read from cache 0x%02x (x%u)\n",
+           spi_nand_read_method_name(nand->read_method), nand->read_opcode,
+           nand->data_nbits);
+
+    return 0;
+}
+
+static int nand_bbt(
+    struct spi_nand*        nand)
+{
+    uint32_t block = 0;
+    uint64_t block_size = (uint64_t)nand->page_size * nand->pages_per_block;
+
+    if(spi_nand_scan_bad_blocks(nand) < 0) {
+        printf("Unable to scan the bad block markers (errno: %d)\n", errno);
+        return 1;
+    }
+
+    for(block = 0; block < nand->blocks; ++block) {
+        if(nand->bbt[block]) {
+            printf("Block %u (0x%llx) is bad\n", block,
+                   (unsigned long long)(block * block_size));
+        }
+    }
+
+    printf("%u of %u blocks bad\n", nand->bad_blocks, nand->blocks);
+
+    return 0;
+}
+
+static int nand_dump_read(
+    void*                   ctx,
+    uint64_t                addr,
+    uint8_t*                buf,
+    uint32_t                len)
+{
+    struct nand_dump* dump = ctx;
+    struct spi_nand* nand = dump->nand;
+    uint32_t page = (uint32_t)(addr / nand->page_size);
+    uint32_t count = len / nand->page_size;
+    uint32_t i = 0;
+
+    if(spi_nand_read(nand, page, count, buf, dump->ecc) < 0) {
+        return -1;
+    }
+
+    for(i = 0; i < count; ++i) {
+        if(dump->ecc[i] == SPI_NAND_ECC_CORRECTED) {
+            dump->corrected++;
+        } else if(dump->ecc[i] == SPI_NAND_ECC_UNCORRECTABLE) {
+            if(dump->failed < NAND_REPORT_PAGES) {
+                dump->failed_pages[dump->failed] = page + i;
+            }
+            dump->failed++;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Dump the data areas of a NAND, checking the ECC status of every
+ *        page. Bad blocks are dumped as they read, so offsets in the image
+ *        match the part
+ */
+static int nand_read(
+    struct spi_nand*        nand,
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[])
+{
+    struct nand_dump dump;
+    FILE* log = stdout;
+    uint64_t block_size = (uint64_t)nand->page_size * nand->pages_per_block;
+    uint64_t offset = 0;
+    uint64_t len = 0;
+    uint64_t ns = 0;
+    uint64_t block = 0;
+    uint32_t crc = 0;
+    unsigned int bad = 0;
+    unsigned long i = 0;
+    int ret = 0;
+
+    if(argc < 1) {
+        printf("No output file\n");
+        return 1;
+    }
+
+    if(argc > 1 && parse_size(argv[1], &offset) < 0) {
+        printf("Invalid offset %s\n", argv[1]);
+        return 1;
+    }
+
+    len = offset < nand->size ? nand->size - offset : 0;
+    if(argc > 2 && parse_size(argv[2], &len) < 0) {
+        printf("Invalid length %s\n", argv[2]);
+        return 1;
+    }
+
+    if(offset > nand->size || len > nand->size - offset) {
+        printf("The range is past the end of the flash\n");
+        return 1;
+    }
+
+    if(offset % nand->page_size || len % nand->page_size) {
+        printf("NAND reads must be aligned to the %u byte page size\n", nand->page_size);
+        return 1;
+    }
+
+    if(strcmp(argv[0], "-") == 0) {
+        log = stderr;
+    }
+
+    if(spi_nand_scan_bad_blocks(nand) < 0) {
+        fprintf(log, "Unable to scan the bad block markers (errno: %d)\n", errno);
+        return 1;
+    }
+
+    for(block = offset / block_size; len && block <= (offset + len - 1) / block_size; ++block) {
+        bad += nand->bbt[block];
+    }
+
+    memset(&dump, 0, sizeof(dump));
+    dump.nand = nand;
+
+    if(dump_file(opts, nand->bus, argv[0], offset, len, nand_dump_read, &dump,
+                 &ns, &crc) != 0) {
+        return 1;
+    }
+
+    ret = dump_report(opts, argv[0], nand->bus, len, ns, nand->data_nbits,
+                      spi_nand_read_method_name(nand->read_method), crc);
+
+    fprintf(log, "%lu pages with corrected bit flips, %lu uncorrectable, "
+            "%u bad blocks in the range\n", dump.corrected, dump.failed, bad);
+
+    for(i = 0; i < dump.failed && i < NAND_REPORT_PAGES; ++i) {
+        fprintf(log, "Uncorrectable page %u (0x%llx)\n", dump.failed_pages[i],
+                (unsigned long long)dump.failed_pages[i] * nand->page_size);
+    }
+
+    return dump.failed ? 1 : ret;
+}
+
+static int eeprom_dump_read(
+    void*                   ctx,
+    uint64_t                addr,
+    uint8_t*                buf,
+    uint32_t                len)
+{
+    return spi_eeprom_read(ctx, (uint32_t)addr, buf, len);
+}
+
+static int eeprom_read(
+    struct spi_eeprom*      eeprom,
+    const struct spi_opts*  opts,
+    int                     argc,
+    char*                   argv[])
+{
+    uint64_t offset = 0;
+    uint64_t len = 0;
+    uint64_t ns = 0;
+    uint32_t crc = 0;
+
+    if(argc < 1) {
+        printf("No output file\n");
+        return 1;
+    }
+
+    if(argc > 1 && parse_size(argv[1], &offset) < 0) {
+        printf("Invalid offset %s\n", argv[1]);
+        return 1;
+    }
+
+    len = offset < eeprom->size ? eeprom->size - offset : 0;
+    if(argc > 2 && parse_size(argv[2], &len) < 0) {
+        printf("Invalid length %s\n", argv[2]);
+        return 1;
+    }
+
+    if(offset > eeprom->size || len > eeprom->size - offset) {
+        printf("The range is past the end of the EEPROM\n");
+        return 1;
+    }
+
+    if(dump_file(opts, eeprom->bus, argv[0], offset, len, eeprom_dump_read, eeprom,
+                 &ns, &crc) != 0) {
+        return 1;
+    }
+
+    return dump_report(opts, argv[0], eeprom->bus, len, ns, 1, "read", crc);
+}
+
+/**
+ * @brief Load the image for an EEPROM write or verify and check it fits
+ *
+ * @return The image, or NULL on failure
+ */
+static uint8_t* eeprom_image(
+    struct spi_eeprom*      eeprom,
+    int                     argc,
+    char*                   argv[],
+    uint64_t*               offset,
+    uint64_t*               size)
+{
+    uint8_t* data = NULL;
+
+    if(argc < 1) {
+        printf("No image file\n");
+        return NULL;
+    }
+
+    *offset = 0;
+    if(argc > 1 && parse_size(argv[1], offset) < 0) {
+        printf("Invalid offset %s\n", argv[1]);
+        return NULL;
+    }
+
+    data = load_file(argv[0], size);
+    if(!data) {
+        return NULL;
+    }
+
+    if(*offset > eeprom->size || *size > eeprom->size - *offset) {
+        printf("The image doesn't fit in the EEPROM\n");
+        free(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+/**
+ * @brief Write an image, skipping pages that already hold it, then read it
+ *        back
+ */
+static int eeprom_write(
+    struct spi_eeprom*      eeprom,
+    int                     argc,
+    char*                   argv[])
+{
+    struct spi_eeprom_update_result result;
+    uint8_t* data = NULL;
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    uint64_t busy = eeprom->stats.busy_ns;
+    uint64_t ns = 0;
+    uint32_t mismatch = 0;
+    int ret = 1;
+
+    data = eeprom_image(eeprom, argc, argv, &offset, &size);
+    if(!data) {
+        return 1;
+    }
+
+    ns = spi_bus_time_ns(eeprom->bus);
+    if(spi_eeprom_update(eeprom, (uint32_t)offset, data, (uint32_t)size, &result) < 0) {
+        if(errno == EROFS) {
+            printf("The EEPROM's block protect bits cover part of the image\n");
+        } else {
+            printf("Unable to write the EEPROM (errno: %d)\n", errno);
+        }
+        goto out;
+    }
+    ns = spi_bus_time_ns(eeprom->bus) - ns;
+    busy = eeprom->stats.busy_ns - busy;
+
+    print_rate(stdout, "Wrote", size, ns);
+    printf("%lu pages of %u bytes unchanged, %lu written", result.unchanged,
+           eeprom->page_size, result.written);
+    if(ns) {
+        printf(", %.0f%% of the time waiting for page writes", busy * 100.0 / ns);
+    }
+    printf("\n");
+
+    ns = spi_bus_time_ns(eeprom->bus);
+    ret = spi_eeprom_verify(eeprom, (uint32_t)offset, data, (uint32_t)size, &mismatch);
+    if(ret < 0) {
+        printf("Unable to verify the EEPROM (errno: %d)\n", errno);
+        ret = 1;
+    } else if(ret) {
+        printf("Verify failed at 0x%x\n", mismatch);
+    } else {
+        print_rate(stdout, "Verified", size, spi_bus_time_ns(eeprom->bus) - ns);
+    }
+
+out:
+    free(data);
+
+    return ret;
+}
+
+static int eeprom_verify(
+    struct spi_eeprom*      eeprom,
+    int                     argc,
+    char*                   argv[])
+{
+    uint8_t* data = NULL;
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    uint64_t ns = 0;
+    uint32_t mismatch = 0;
+    int ret = 0;
+
+    data = eeprom_image(eeprom, argc, argv, &offset, &size);
+    if(!data) {
+        return 1;
+    }
+
+    ns = spi_bus_time_ns(eeprom->bus);
+    ret = spi_eeprom_verify(eeprom, (uint32_t)offset, data, (uint32_t)size, &mismatch);
+    if(ret < 0) {
+        printf("Unable to read the EEPROM (errno: %d)\n", errno);
+        ret = 1;
+    } else if(ret) {
+        printf("Verify failed at 0x%x\n", mismatch);
+    } else {
+        print_rate(stdout, "Verified", size, spi_bus_time_ns(eeprom->bus) - ns);
+    }
+
+    free(data);
+
+    return ret;
+}
+
+/**
+ * @brief Read a whole file into memory
+ *
+ * @return The contents, or NULL on failure
+ */
+static uint8_t* load_file(
+    const char*             path,
+    uint64_t*               size)
+{
+    uint8_t* data = NULL;
+    FILE* f = NULL;
+    long len = 0;
+
+    f = fopen(path, "rb");
+    if(!f) {
+        printf("Unable to open %s (errno: %d)\n", path, errno);
+        return NULL;
+    }
+
+    if(fseek(f, 0, SEEK_END) < 0 || (len = ftell(f)) < 0 ||
+       fseek(f, 0, SEEK_SET) < 0) {
+        printf("Unable to size %s (errno: %d)\n", path, errno);
+        fclose(f);
+        return NULL;
+    }
+
+    /* One extra byte so that an empty file still gets a buffer */
+    data = malloc(len + 1);
+    if(!data || fread(data, 1, len, f) != (size_t)len) {
+        printf("Unable to read %s\n", path);
+        free(data);
+        fclose(f);
+        return NULL;
+    }
+
+    fclose(f);
+    *size = len;
+
+    return data;
+}
+
+static void print_rate(
+    FILE*                   out,
+    const char*             what,
+    uint64_t                bytes,
+    uint64_t                ns)
+{
+    double secs = ns / 1e9;
+
+    fprintf(out, "%s %llu bytes in %.3f s", what, (unsigned long long)bytes, secs);
+    if(secs > 0) {
+        fprintf(out, " (%.2f MB/s)", bytes / secs / 1e6);
+    }
+    fprintf(out, "\n");
 }
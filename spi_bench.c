@@ -0,0 +1,395 @@
+/**
+ * SPI throughput benchmark and clock efficiency report
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <linux/types.h>
+#include <linux/spi/spidev.h>
+
+#include "spi_bus.h"
+#include "spi_sim.h"
+
+#define DEFAULT_ITERATIONS              50
+#define DEFAULT_SIZES                   "16,64,256,1024,4096"
+#define DEFAULT_COUNTS                  "1,8,64"
+#define DEFAULT_CLOCKS                  "1M,10M,50M"
+#define MAX_LIST                        16
+/** Stop timing a point after this much bus time, so slow clocks and large
+ *  transfers don't take minutes */
+#define POINT_TIME_NS                   250000000ull
+/** The transfer size recommended for bulk reads is the smallest reaching
+ *  this percentage of the best rate */
+#define GOOD_ENOUGH_PCT                 90
+
+/** Results of one clock, size and transfers per message combination */
+struct bench_result {
+    int             valid;
+    double          bytes_per_sec;
+    /** Messages issued per call, more than one if spidev's buffer split it */
+    double          ioctls_per_call;
+    /** Time per ioctl beyond the time the bits take on the wire */
+    double          overhead_us;
+    /** Achieved rate as a percentage of the clock rate */
+    double          efficiency;
+};
+
+static void print_usage(
+    void);
+
+static int parse_list(
+    const char*         list,
+    unsigned long*      vals,
+    int                 max_vals,
+    int                 hz);
+
+static int run_bench(
+    struct spi_bus*         bus,
+    uint32_t                speed_hz,
+    unsigned int            lines,
+    unsigned long           size,
+    unsigned long           count,
+    unsigned long           iterations,
+    uint8_t*                buf,
+    struct bench_result*    result);
+
+int main(int argc, char* argv[])
+{
+    struct spi_bus_config config = {0};
+    struct spi_bus* bus = NULL;
+    struct bench_result res;
+    struct bench_result best;
+    unsigned long iterations = DEFAULT_ITERATIONS;
+    unsigned long sizes[MAX_LIST] = {0};
+    unsigned long counts[MAX_LIST] = {0};
+    unsigned long clocks[MAX_LIST] = {0};
+    double single[MAX_LIST] = {0};
+    int num_sizes = 0;
+    int num_counts = 0;
+    int num_clocks = 0;
+    unsigned long max_bytes = 0;
+    unsigned long mode = 3;
+    unsigned long lines = 1;
+    unsigned int tx_lines = 1;
+    unsigned int rx_lines = 1;
+    uint8_t* buf = NULL;
+    int best_size = 0;
+    int best_count = 0;
+    int opt = 0;
+    int c = 0;
+    int s = 0;
+    int t = 0;
+
+    num_sizes = parse_list(DEFAULT_SIZES, sizes, MAX_LIST, 0);
+    num_counts = parse_list(DEFAULT_COUNTS, counts, MAX_LIST, 0);
+    num_clocks = parse_list(DEFAULT_CLOCKS, clocks, MAX_LIST, 1);
+
+    while((opt = getopt(argc, argv, "n:s:t:c:m:w:h")) != -1) {
+        switch(opt) {
+            case 'n':
+                iterations = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                num_sizes = parse_list(optarg, sizes, MAX_LIST, 0);
+                if(num_sizes <= 0) {
+                    printf("Invalid size list: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                num_counts = parse_list(optarg, counts, MAX_LIST, 0);
+                if(num_counts <= 0) {
+                    printf("Invalid transfer count list: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c':
+                num_clocks = parse_list(optarg, clocks, MAX_LIST, 1);
+                if(num_clocks <= 0) {
+                    printf("Invalid clock list: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                mode = strtoul(optarg, NULL, 0);
+                if(mode > 3) {
+                    printf("The SPI mode must be 0 to 3\n");
+                    return 1;
+                }
+                break;
+            case 'w':
+                lines = strtoul(optarg, NULL, 0);
+                if(lines != 1 && lines != 2 && lines != 4) {
+                    printf("The data lines must be 1, 2 or 4\n");
+                    return 1;
+                }
+                break;
+            default:
+                print_usage();
+                return 1;
+        }
+    }
+
+    if(argc - optind < 1) {
+        printf("Not enough arguments\n");
+        print_usage();
+        return 1;
+    }
+
+    if(!iterations) {
+        printf("Invalid iteration count\n");
+        return 1;
+    }
+
+    for(s = 0; s < num_sizes; ++s) {
+        for(t = 0; t < num_counts; ++t) {
+            if(counts[t] > SPI_BUS_MAX_MSG_XFERS) {
+                printf("At most %d transfers per message\n", SPI_BUS_MAX_MSG_XFERS);
+                return 1;
+            }
+            if(sizes[s] * counts[t] > max_bytes) {
+                max_bytes = sizes[s] * counts[t];
+            }
+        }
+    }
+
+    buf = malloc(max_bytes);
+    if(!buf) {
+        printf("Unable to allocate %lu bytes\n", max_bytes);
+        return 1;
+    }
+
+    bus = spi_bus_open(argv[optind]);
+    if(!bus) {
+        printf("Unable to open spidev %s (errno: %d)\n", argv[optind], errno);
+        return 1;
+    }
+
+    printf("Device %s, mode %lu, %lu data line%s, up to %lu messages per point, "
+           "spidev bufsiz %u%s\n",
+           bus->name, mode, lines, lines > 1 ? "s" : "", iterations, bus->bufsiz,
+           spi_sim_is_sim(bus) ? " (simulated, virtual time)" : "");
+    printf("Transfers only receive, sending zeros, with the device selected for\n");
+    printf("the whole message\n");
+    printf("\n");
+    printf("%-10s %-8s %-6s %10s %8s %14s %10s\n",
+           "clock", "size", "xfers", "MB/s", "ioctls", "overhead(us)", "efficiency");
+
+    for(c = 0; c < num_clocks; ++c) {
+        /* The mode write clears the dual/quad flags, so set the lines after
+         * it for every clock */
+        config.mode = mode;
+        config.max_speed_hz = clocks[c];
+        config.bits_per_word = 8;
+        if(spi_bus_configure(bus, &config) < 0 ||
+           (lines > 1 && spi_bus_set_lines(bus, lines) < 0) ||
+           spi_bus_get_lines(bus, &tx_lines, &rx_lines) < 0) {
+            printf("Unable to configure %lu Hz (errno: %d)\n", clocks[c], errno);
+            continue;
+        }
+
+        memset(&best, 0, sizeof(best));
+        for(s = 0; s < num_sizes; ++s) {
+            single[s] = 0;
+            for(t = 0; t < num_counts; ++t) {
+                if(run_bench(bus, clocks[c], rx_lines, sizes[s], counts[t],
+                             iterations, buf, &res) < 0) {
+                    printf("%-10lu %-8lu %-6lu failed (errno: %d)\n",
+                           clocks[c], sizes[s], counts[t], errno);
+                    continue;
+                }
+
+                printf("%-10lu %-8lu %-6lu %10.3f %8.1f %14.1f %9.1f%%\n",
+                       clocks[c], sizes[s], counts[t], res.bytes_per_sec / 1e6,
+                       res.ioctls_per_call, res.overhead_us, res.efficiency);
+
+                if(counts[t] == 1) {
+                    single[s] = res.bytes_per_sec;
+                }
+                if(!best.valid || res.bytes_per_sec > best.bytes_per_sec) {
+                    best = res;
+                    best_size = s;
+                    best_count = t;
+                }
+            }
+        }
+
+        if(!best.valid) {
+            continue;
+        }
+
+        printf("    Best %.3f MB/s (%.1f%%) with %lu x %lu bytes per message",
+               best.bytes_per_sec / 1e6, best.efficiency, counts[best_count],
+               sizes[best_size]);
+
+        /* Bulk reads such as flash dumps send one large transfer per
+         * command, so the useful number is the smallest single transfer
+         * that gets close to the best */
+        for(s = 0; s < num_sizes; ++s) {
+            if(single[s] * 100 >= best.bytes_per_sec * GOOD_ENOUGH_PCT) {
+                printf(", %d%% of it with single %lu byte transfers",
+                       GOOD_ENOUGH_PCT, sizes[s]);
+                break;
+            }
+        }
+        printf("\n");
+    }
+
+    spi_bus_close(bus);
+    free(buf);
+
+    return 0;
+}
+
+static void print_usage(
+    void)
+{
+    printf("SPI throughput benchmark\n");
+    printf("Usage:\n");
+    printf("    ./spi_bench [options] <device>\n");
+    printf("\n");
+    printf("Where:\n");
+    printf("    device  - The spidev device, e.g. /dev/spidev0.0 or 0.0, or\n");
+    printf("              sim[:options] for the simulated controller\n");
+    printf("\n");
+    printf("Options:\n");
+    printf("    -n <count>      - Most messages per point (default %d)\n", DEFAULT_ITERATIONS);
+    printf("    -s <sizes>      - Comma separated transfer sizes in bytes (default\n");
+    printf("                      %s)\n", DEFAULT_SIZES);
+    printf("    -t <counts>     - Comma separated transfers per message (default\n");
+    printf("                      %s)\n", DEFAULT_COUNTS);
+    printf("    -c <clocks>     - Comma separated clocks in Hz, with an optional k\n");
+    printf("                      or M suffix (default %s)\n", DEFAULT_CLOCKS);
+    printf("    -m <mode>       - SPI mode 0 to 3 (default 3)\n");
+    printf("    -w <lines>      - Receive on up to 2 or 4 data lines\n");
+    printf("\n");
+    printf("Transfers only clock in data, sending zeros, which SPI flashes and\n");
+    printf("most other devices ignore. Efficiency is the achieved rate against\n");
+    printf("the clock rate times the data lines, and the overhead is the time per\n");
+    printf("ioctl beyond what the bits take on the wire.\n");
+}
+
+static int parse_list(
+    const char*         list,
+    unsigned long*      vals,
+    int                 max_vals,
+    int                 hz)
+{
+    const char* p = list;
+    char* end = NULL;
+    int count = 0;
+
+    while(*p && count < max_vals) {
+        vals[count] = strtoul(p, &end, 0);
+        if(end == p || !vals[count]) {
+            return -1;
+        }
+
+        p = end;
+        if(hz && *p == 'k') {
+            vals[count] *= 1000;
+            ++p;
+        } else if(hz && *p == 'M') {
+            vals[count] *= 1000000;
+            ++p;
+        }
+        ++count;
+
+        if(*p == ',') {
+            ++p;
+        } else if(*p) {
+            return -1;
+        }
+    }
+
+    return count;
+}
+
+static int run_bench(
+    struct spi_bus*         bus,
+    uint32_t                speed_hz,
+    unsigned int            lines,
+    unsigned long           size,
+    unsigned long           count,
+    unsigned long           iterations,
+    uint8_t*                buf,
+    struct bench_result*    result)
+{
+    struct spi_xfer* xfers = NULL;
+    unsigned long messages = 0;
+    unsigned long done = 0;
+    unsigned long i = 0;
+    uint64_t start = 0;
+    uint64_t elapsed = 0;
+    double wire_ns = 0;
+    int ret = 0;
+
+    memset(result, 0, sizeof(*result));
+
+    xfers = calloc(count, sizeof(*xfers));
+    if(!xfers) {
+        return -1;
+    }
+
+    for(i = 0; i < count; ++i) {
+        xfers[i].rx = &buf[i * size];
+        xfers[i].len = (uint32_t)size;
+        xfers[i].speed_hz = speed_hz;
+        xfers[i].rx_nbits = (uint8_t)lines;
+    }
+
+    /* Transfer delays would count against the controller */
+    bus->delay_usecs = 0;
+
+    /* One untimed message to warm up the controller and check it works */
+    ret = spi_bus_transfer(bus, xfers, (unsigned int)count);
+
+    messages = bus->stats.messages;
+    start = spi_bus_time_ns(bus);
+    for(done = 0; done < iterations && ret >= 0; ++done) {
+        ret = spi_bus_transfer(bus, xfers, (unsigned int)count);
+        elapsed = spi_bus_time_ns(bus) - start;
+        if(elapsed > POINT_TIME_NS) {
+            ++done;
+            break;
+        }
+    }
+    messages = bus->stats.messages - messages;
+
+    if(ret >= 0 && elapsed) {
+        wire_ns = (double)done * count * size * 8 * 1e9 / ((double)speed_hz * lines);
+
+        result->valid = 1;
+        result->bytes_per_sec = (double)done * count * size * 1e9 / elapsed;
+        result->ioctls_per_call = (double)messages / done;
+        result->overhead_us = elapsed > wire_ns ? (elapsed - wire_ns) / messages / 1000 : 0;
+        result->efficiency = wire_ns * 100 / elapsed;
+    }
+
+    free(xfers);
+
+    return ret < 0 ? -1 : 0;
+}
@@ -0,0 +1,468 @@
+/**
+ * SPI bus abstraction for the userspace SPI utilities
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <linux/types.h>
+#include <linux/spi/spidev.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "spi_bus.h"
+#include "spi_sim.h"
+
+/** Where spidev publishes the size of its bounce buffers */
+#define SPIDEV_BUFSIZ_PATH              "/sys/module/spidev/parameters/bufsiz"
+
+static int dev_ioctl(
+    struct spi_bus*         bus,
+    unsigned long           request,
+    void*                   arg);
+
+static void dev_delay(
+    struct spi_bus*         bus,
+    unsigned long           usecs);
+
+static uint64_t dev_time_ns(
+    struct spi_bus*         bus);
+
+static void dev_close(
+    struct spi_bus*         bus);
+
+static uint32_t read_bufsiz(
+    void);
+
+static int send_message(
+    struct spi_bus*         bus,
+    struct spi_ioc_transfer* msg,
+    unsigned int            count,
+    int                     hold_cs);
+
+/** Backend for real devices accessed through /dev/spidevB.C */
+static const struct spi_bus_ops dev_ops = {
+    .ioctl = dev_ioctl,
+    .delay = dev_delay,
+    .time_ns = dev_time_ns,
+    .close = dev_close,
+};
+
+struct spi_bus* spi_bus_open(
+    const char*             spec)
+{
+    struct spi_bus* bus = NULL;
+    char path[32] = {0};
+
+    if(!spec) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(strncmp(spec, "sim", 3) == 0 && (spec[3] == '\0' || spec[3] == ':')) {
+        return spi_sim_open(spec[3] == ':' ? &spec[4] : NULL);
+    }
+
+    if(spec[0] == '/') {
+        snprintf(path, sizeof(path), "%s", spec);
+    } else {
+        snprintf(path, sizeof(path), "/dev/spidev%s", spec);
+    }
+
+    bus = calloc(1, sizeof(*bus));
+    if(!bus) {
+        return NULL;
+    }
+
+    bus->fd = open(path, O_RDWR);
+    if(bus->fd < 0) {
+        free(bus);
+        return NULL;
+    }
+
+    bus->ops = &dev_ops;
+    bus->bufsiz = read_bufsiz();
+    snprintf(bus->name, sizeof(bus->name), "%s",
+             strncmp(path, "/dev/", 5) == 0 ? &path[5] : path);
+
+    return bus;
+}
+
+void spi_bus_close(
+    struct spi_bus*         bus)
+{
+    if(bus) {
+        free(bus->msg_buf);
+        bus->msg_buf = NULL;
+        bus->ops->close(bus);
+    }
+}
+
+int spi_bus_ioctl(
+    struct spi_bus*         bus,
+    unsigned long           request,
+    void*                   arg)
+{
+    return bus->ops->ioctl(bus, request, arg);
+}
+
+void spi_bus_delay(
+    struct spi_bus*         bus,
+    unsigned long           usecs)
+{
+    bus->ops->delay(bus, usecs);
+}
+
+uint64_t spi_bus_time_ns(
+    struct spi_bus*         bus)
+{
+    return bus->ops->time_ns(bus);
+}
+
+int spi_bus_transfer(
+    struct spi_bus*         bus,
+    const struct spi_xfer*  xfers,
+    unsigned int            count)
+{
+    struct spi_ioc_transfer* msg = bus->msg_buf;
+    const struct spi_xfer* xfer = NULL;
+    uint32_t max_piece = bus->bufsiz;
+    uint32_t align = 1;
+    uint32_t word = 1;
+    uint32_t piece = 0;
+    uint32_t acct = 0;
+    uint32_t pos = 0;
+    uint32_t tx_total = 0;
+    uint32_t rx_total = 0;
+    unsigned int n = 0;
+    unsigned int i = 0;
+    int last_deselect = 0;
+    uint8_t bpw = 0;
+
+    if(!msg) {
+        msg = calloc(SPI_BUS_MAX_MSG_XFERS, sizeof(*msg));
+        if(!msg) {
+            return -1;
+        }
+        bus->msg_buf = msg;
+    }
+
+    /* Keep every piece a whole number of DMA alignment units so that a full
+     * sized piece is accounted by spidev as exactly what it is */
+    if(max_piece >= SPI_BUS_DMA_ALIGN) {
+        align = SPI_BUS_DMA_ALIGN;
+        max_piece -= max_piece % SPI_BUS_DMA_ALIGN;
+    }
+
+    for(i = 0; i < count; ++i) {
+        xfer = &xfers[i];
+        bpw = xfer->bits_per_word ? xfer->bits_per_word : bus->bits_per_word;
+        word = bpw > 16 ? 4 : (bpw > 8 ? 2 : 1);
+
+        if(xfer->len % word) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        pos = 0;
+        do {
+            piece = xfer->len - pos;
+            if(piece > max_piece - max_piece % word) {
+                piece = max_piece - max_piece % word;
+            }
+            if(!piece && pos < xfer->len) {
+                /* The spidev buffer is smaller than a word */
+                errno = EMSGSIZE;
+                return -1;
+            }
+            acct = (piece + align - 1) / align * align;
+
+            /* Start a new message if this piece won't fit, keeping the
+             * device selected across the boundary */
+            if(n && (n == SPI_BUS_MAX_MSG_XFERS ||
+                     (xfer->tx && tx_total + acct > bus->bufsiz) ||
+                     (xfer->rx && rx_total + acct > bus->bufsiz))) {
+                if(send_message(bus, msg, n, !last_deselect) < 0) {
+                    return -1;
+                }
+                n = 0;
+                tx_total = 0;
+                rx_total = 0;
+            }
+
+            memset(&msg[n], 0, sizeof(msg[n]));
+            msg[n].tx_buf = xfer->tx ? (uintptr_t)xfer->tx + pos : 0;
+            msg[n].rx_buf = xfer->rx ? (uintptr_t)xfer->rx + pos : 0;
+            msg[n].len = piece;
+            msg[n].speed_hz = xfer->speed_hz ? xfer->speed_hz : bus->speed_hz;
+            msg[n].bits_per_word = bpw;
+            msg[n].tx_nbits = xfer->tx_nbits;
+            msg[n].rx_nbits = xfer->rx_nbits;
+
+            pos += piece;
+            last_deselect = 0;
+            if(pos == xfer->len) {
+                /* Only the end of the caller's transfer gets its delay and
+                 * chip select change */
+                msg[n].delay_usecs = xfer->delay_usecs ? xfer->delay_usecs :
+                                                         bus->delay_usecs;
+                if(xfer->cs_change && i + 1 < count) {
+                    msg[n].cs_change = 1;
+                    last_deselect = 1;
+                }
+            }
+
+            tx_total += xfer->tx ? acct : 0;
+            rx_total += xfer->rx ? acct : 0;
+            ++n;
+        } while(pos < xfer->len);
+    }
+
+    if(!n) {
+        return 0;
+    }
+
+    return send_message(bus, msg, n, bus->cs_hold);
+}
+
+int spi_bus_command(
+    struct spi_bus*         bus,
+    const void*             cmd,
+    uint32_t                cmd_len,
+    void*                   rx,
+    uint32_t                rx_len)
+{
+    struct spi_xfer xfers[2];
+
+    memset(xfers, 0, sizeof(xfers));
+    xfers[0].tx = cmd;
+    xfers[0].len = cmd_len;
+    xfers[1].rx = rx;
+    xfers[1].len = rx_len;
+
+    return spi_bus_transfer(bus, xfers, rx_len ? 2 : 1);
+}
+
+int spi_bus_configure(
+    struct spi_bus*         bus,
+    const struct spi_bus_config* config)
+{
+    uint32_t mode32 = config->mode;
+    uint8_t mode = config->mode & 0xff;
+    uint32_t speed = config->max_speed_hz;
+    uint8_t bits = config->bits_per_word;
+
+    /* Only use the 32 bit mode ioctl when we need it, older kernels don't
+     * have it */
+    if(config->mode > 0xff) {
+        if(spi_bus_ioctl(bus, SPI_IOC_WR_MODE32, &mode32) < 0) {
+            return -1;
+        }
+    } else if(spi_bus_ioctl(bus, SPI_IOC_WR_MODE, &mode) < 0) {
+        return -1;
+    }
+
+    if(speed && spi_bus_ioctl(bus, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0) {
+        return -1;
+    }
+
+    if(bits && spi_bus_ioctl(bus, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int spi_bus_get_config(
+    struct spi_bus*         bus,
+    struct spi_bus_config*  config)
+{
+    uint32_t mode32 = 0;
+    uint8_t mode = 0;
+
+    memset(config, 0, sizeof(*config));
+
+    if(spi_bus_ioctl(bus, SPI_IOC_RD_MODE32, &mode32) == 0) {
+        config->mode = mode32;
+    } else if(spi_bus_ioctl(bus, SPI_IOC_RD_MODE, &mode) == 0) {
+        config->mode = mode;
+    } else {
+        return -1;
+    }
+
+    if(spi_bus_ioctl(bus, SPI_IOC_RD_MAX_SPEED_HZ, &config->max_speed_hz) < 0 ||
+       spi_bus_ioctl(bus, SPI_IOC_RD_BITS_PER_WORD, &config->bits_per_word) < 0) {
+        return -1;
+    }
+
+    /* spidev reports 0 for the default of 8 bits */
+    if(!config->bits_per_word) {
+        config->bits_per_word = 8;
+    }
+
+    return 0;
+}
+
+int spi_bus_set_lines(
+    struct spi_bus*         bus,
+    unsigned int            lines)
+{
+    struct spi_bus_config config;
+    unsigned int tx_lines = 0;
+    unsigned int rx_lines = 0;
+    uint32_t base = 0;
+
+    if(spi_bus_get_config(bus, &config) < 0) {
+        return -1;
+    }
+
+    base = config.mode & ~(SPI_TX_DUAL | SPI_TX_QUAD | SPI_RX_DUAL | SPI_RX_QUAD);
+
+    for(; lines > 1; lines /= 2) {
+        memset(&config, 0, sizeof(config));
+        config.mode = base | (lines == 4 ? SPI_TX_QUAD | SPI_RX_QUAD :
+                                           SPI_TX_DUAL | SPI_RX_DUAL);
+
+        /* Kernels without SPI_IOC_WR_MODE32 can only do single I/O */
+        if(spi_bus_configure(bus, &config) < 0) {
+            break;
+        }
+
+        if(spi_bus_get_lines(bus, &tx_lines, &rx_lines) < 0) {
+            return -1;
+        }
+
+        if(rx_lines == lines) {
+            return (int)lines;
+        }
+    }
+
+    config.mode = base;
+    if(spi_bus_configure(bus, &config) < 0) {
+        return -1;
+    }
+
+    return 1;
+}
+
+int spi_bus_get_lines(
+    struct spi_bus*         bus,
+    unsigned int*           tx_lines,
+    unsigned int*           rx_lines)
+{
+    struct spi_bus_config config;
+
+    if(spi_bus_get_config(bus, &config) < 0) {
+        return -1;
+    }
+
+    *tx_lines = config.mode & SPI_TX_QUAD ? 4 : (config.mode & SPI_TX_DUAL ? 2 : 1);
+    *rx_lines = config.mode & SPI_RX_QUAD ? 4 : (config.mode & SPI_RX_DUAL ? 2 : 1);
+
+    return 0;
+}
+
+/**
+ * @brief Issue one SPI_IOC_MESSAGE
+ *
+ * @param hold_cs - Non-zero if the transaction continues in another message,
+ *                  so the device should stay selected afterwards
+ */
+static int send_message(
+    struct spi_bus*         bus,
+    struct spi_ioc_transfer* msg,
+    unsigned int            count,
+    int                     hold_cs)
+{
+    unsigned int i = 0;
+
+    /* On the last transfer of a message cs_change means the opposite of
+     * what it does elsewhere: leave the device selected */
+    msg[count - 1].cs_change = hold_cs ? 1 : 0;
+
+    if(spi_bus_ioctl(bus, SPI_IOC_MESSAGE(count), msg) < 0) {
+        return -1;
+    }
+
+    bus->stats.messages++;
+    bus->stats.transfers += count;
+    for(i = 0; i < count; ++i) {
+        bus->stats.bytes += msg[i].len;
+    }
+
+    return 0;
+}
+
+static uint32_t read_bufsiz(
+    void)
+{
+    unsigned long bufsiz = 0;
+    FILE* f = NULL;
+
+    f = fopen(SPIDEV_BUFSIZ_PATH, "r");
+    if(f) {
+        if(fscanf(f, "%lu", &bufsiz) != 1) {
+            bufsiz = 0;
+        }
+        fclose(f);
+    }
+
+    return bufsiz ? (uint32_t)bufsiz : SPI_BUS_DEFAULT_BUFSIZ;
+}
+
+static int dev_ioctl(
+    struct spi_bus*         bus,
+    unsigned long           request,
+    void*                   arg)
+{
+    return ioctl(bus->fd, request, arg);
+}
+
+static void dev_delay(
+    struct spi_bus*         bus,
+    unsigned long           usecs)
+{
+    (void)bus;
+    usleep(usecs);
+}
+
+static uint64_t dev_time_ns(
+    struct spi_bus*         bus)
+{
+    struct timespec ts;
+
+    (void)bus;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void dev_close(
+    struct spi_bus*         bus)
+{
+    close(bus->fd);
+    free(bus);
+}
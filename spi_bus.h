@@ -0,0 +1,257 @@
+/**
+ * SPI bus abstraction for the userspace SPI utilities
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef SPI_BUS_H
+#define SPI_BUS_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** spidev's default bounce buffer size, used if the module parameter can't
+ *  be read */
+#define SPI_BUS_DEFAULT_BUFSIZ          4096
+/** Most transfers that fit in one SPI_IOC_MESSAGE, the ioctl size field
+ *  being 14 bits */
+#define SPI_BUS_MAX_MSG_XFERS           511
+/** spidev rounds each transfer up to the DMA alignment (ARCH_DMA_MINALIGN)
+ *  when accounting it against bufsiz. x86 is DMA coherent and uses the
+ *  kernel's default; elsewhere assume the largest alignment any architecture
+ *  uses (arm64's 128) */
+#if defined(__x86_64__) || defined(__i386__)
+#define SPI_BUS_DMA_ALIGN               __alignof__(unsigned long long)
+#else
+#define SPI_BUS_DMA_ALIGN               128
+#endif
+
+struct spi_bus;
+
+/** Transfer counters */
+struct spi_bus_stats {
+    /** SPI_IOC_MESSAGE ioctls issued */
+    unsigned long           messages;
+    /** Kernel transfers issued, after splitting */
+    unsigned long           transfers;
+    /** Bytes clocked */
+    unsigned long long      bytes;
+};
+
+/** Device settings, as set and read by the SPI_IOC_WR_x/SPI_IOC_RD_x
+ *  ioctls */
+struct spi_bus_config {
+    /** SPI_MODE_0 to SPI_MODE_3 OR'd with flags such as SPI_LSB_FIRST,
+     *  SPI_CS_HIGH and SPI_NO_CS */
+    uint32_t                mode;
+    /** Maximum clock in Hz, 0 to leave unchanged when configuring */
+    uint32_t                max_speed_hz;
+    /** Word size in bits, 0 to leave unchanged when configuring */
+    uint8_t                 bits_per_word;
+};
+
+/** Operations implemented by a bus backend. The ioctl operation takes the same
+ *  requests and arguments as a spidev file descriptor (SPI_IOC_MESSAGE(N) and
+ *  the SPI_IOC_RD_x/SPI_IOC_WR_x settings) and reports errors the same way,
+ *  by returning -1 and setting errno */
+struct spi_bus_ops {
+    int (*ioctl)(struct spi_bus* bus, unsigned long request, void* arg);
+    void (*delay)(struct spi_bus* bus, unsigned long usecs);
+    uint64_t (*time_ns)(struct spi_bus* bus);
+    void (*close)(struct spi_bus* bus);
+};
+
+/** An open SPI device */
+struct spi_bus {
+    /** The backend implementing this bus */
+    const struct spi_bus_ops* ops;
+    /** A short name for the device, used in messages */
+    char name[32];
+    /** The spidev file descriptor, or -1 for buses without one */
+    int fd;
+    /** Backend private data */
+    void* priv;
+    /** Most bytes spidev accepts in each direction in one message */
+    uint32_t bufsiz;
+    /** Defaults for transfers that don't set their own */
+    uint32_t speed_hz;
+    uint8_t bits_per_word;
+    uint16_t delay_usecs;
+    /** Non-zero to leave the device selected after each transaction */
+    int cs_hold;
+    /** Kernel transfer array used to build messages */
+    void* msg_buf;
+    struct spi_bus_stats stats;
+};
+
+/** One transfer within a transaction */
+struct spi_xfer {
+    /** Data to send, or NULL to send zeros */
+    const void*             tx;
+    /** Where to store the received data, or NULL to discard it */
+    void*                   rx;
+    /** Length in bytes, any size */
+    uint32_t                len;
+    /** Clock for this transfer, 0 for the bus default */
+    uint32_t                speed_hz;
+    /** Delay after this transfer, 0 for the bus default */
+    uint16_t                delay_usecs;
+    /** Word size for this transfer, 0 for the bus default */
+    uint8_t                 bits_per_word;
+    /** Data lines used to send and receive: 1, 2 or 4 (0 for 1). More
+     *  than one needs SPI_TX_DUAL/QUAD or SPI_RX_DUAL/QUAD in the mode and
+     *  a transfer that only sends or only receives */
+    uint8_t                 tx_nbits;
+    uint8_t                 rx_nbits;
+    /** Non-zero to deselect the device between this transfer and the
+     *  next one */
+    uint8_t                 cs_change;
+};
+
+/**
+ * @brief Open a SPI device
+ *
+ * @param spec - A spidev path ("/dev/spidev0.1"), bus.cs ("0.1") or
+ *               "sim[:options]" for a simulated controller (see
+ *               spi_sim_open())
+ *
+ * @return The opened bus, or NULL on failure (with errno set)
+ */
+struct spi_bus* spi_bus_open(
+    const char*             spec);
+
+/**
+ * @brief Close a bus opened with spi_bus_open
+ */
+void spi_bus_close(
+    struct spi_bus*         bus);
+
+/**
+ * @brief Perform a spidev style ioctl on the bus
+ *
+ * @return >= 0 on success, -1 on failure with errno set
+ */
+int spi_bus_ioctl(
+    struct spi_bus*         bus,
+    unsigned long           request,
+    void*                   arg);
+
+/**
+ * @brief Wait for a number of microseconds. Simulated buses advance their
+ *        virtual clock instead of sleeping
+ */
+void spi_bus_delay(
+    struct spi_bus*         bus,
+    unsigned long           usecs);
+
+/**
+ * @brief Get the current bus time in nanoseconds. This is CLOCK_MONOTONIC for
+ *        real buses and the virtual clock for simulated ones
+ */
+uint64_t spi_bus_time_ns(
+    struct spi_bus*         bus);
+
+/**
+ * @brief Apply device settings. The mode is always written, the speed and
+ *        word size only if non-zero
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int spi_bus_configure(
+    struct spi_bus*         bus,
+    const struct spi_bus_config* config);
+
+/**
+ * @brief Read back the settings the driver is actually using, which may
+ *        differ from those requested (e.g. the speed rounded to what the
+ *        controller can do)
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int spi_bus_get_config(
+    struct spi_bus*         bus,
+    struct spi_bus_config*  config);
+
+/**
+ * @brief Ask for dual or quad I/O, on top of the mode already set. spidev
+ *        silently drops the flags the controller doesn't support, so quad
+ *        falls back to dual and dual to single
+ *
+ * @param lines - The most data lines to use: 1, 2 or 4
+ *
+ * @return The number of lines now enabled, or -1 on failure with errno set
+ */
+int spi_bus_set_lines(
+    struct spi_bus*         bus,
+    unsigned int            lines);
+
+/**
+ * @brief Get the number of data lines enabled in the device mode for
+ *        sending and receiving
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int spi_bus_get_lines(
+    struct spi_bus*         bus,
+    unsigned int*           tx_lines,
+    unsigned int*           rx_lines);
+
+/**
+ * @brief Perform a transaction: a sequence of transfers with the device
+ *        selected throughout (unless a transfer asks for a deselect)
+ *
+ * Transfers larger than the spidev buffer are split, and as many transfers
+ * as fit are sent in each SPI_IOC_MESSAGE. Where a transaction needs several
+ * messages, the last transfer of each but the final message has cs_change
+ * set, which asks the controller to keep the device selected until the next
+ * message. The device is deselected at the end unless cs_hold is set on the
+ * bus.
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int spi_bus_transfer(
+    struct spi_bus*         bus,
+    const struct spi_xfer*  xfers,
+    unsigned int            count);
+
+/**
+ * @brief Send a command and optionally read a response, one data line each
+ *        way, as a single transaction. This is the shape of most flash and
+ *        EEPROM commands (opcode, address, then status or data)
+ *
+ * @param rx_len - Bytes to read after the command, 0 for none
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int spi_bus_command(
+    struct spi_bus*         bus,
+    const void*             cmd,
+    uint32_t                cmd_len,
+    void*                   rx,
+    uint32_t                rx_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SPI_BUS_H */
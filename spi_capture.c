@@ -0,0 +1,341 @@
+/**
+ * Streaming capture of repeated SPI transactions
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "spi_capture.h"
+
+/** Batches are sized to take about this long, so the cost of an ioctl is
+ *  shared by many samples while the writer still gets data regularly */
+#define CAPTURE_BATCH_NS                10000000ull
+/** Batches the writer can fall behind by, a power of two */
+#define CAPTURE_RING_SLOTS              64
+/** How long the writer sleeps when it has nothing to write */
+#define CAPTURE_WRITER_IDLE_US          1000
+/** The SPI core's default delay when a transfer deselects the device */
+#define CAPTURE_CS_CHANGE_NS            10000ull
+
+/** Batches passed from the capturing thread to the writer. Only the
+ *  capturing thread advances head and only the writer advances tail */
+struct capture_ring {
+    /** CAPTURE_RING_SLOTS slots of slot_size bytes, each a header followed
+     *  by the samples */
+    uint8_t*                slots;
+    size_t                  slot_size;
+    _Atomic uint64_t        head;
+    _Atomic uint64_t        tail;
+    /** Set once the capturing thread has added its last batch */
+    atomic_int              done;
+    /** errno of a failed write */
+    atomic_int              error;
+    FILE*                   out;
+};
+
+static void* capture_writer(
+    void*                   arg);
+
+static uint32_t choose_batch(
+    struct spi_bus*         bus,
+    const struct spi_capture_config* config,
+    uint64_t                period_ns);
+
+static uint16_t sample_gap(
+    struct spi_bus*         bus,
+    const struct spi_capture_config* config,
+    uint64_t                period_ns);
+
+int spi_capture_run(
+    struct spi_bus*         bus,
+    const struct spi_capture_config* config,
+    FILE*                   out,
+    volatile int*           stop,
+    struct spi_capture_stats* stats)
+{
+    struct spi_capture_stats st;
+    struct capture_ring ring;
+    struct spi_capture_header* header = NULL;
+    struct spi_xfer* xfers = NULL;
+    uint8_t* spare = NULL;
+    uint8_t* slot = NULL;
+    pthread_t writer;
+    uint64_t period_ns = 0;
+    uint64_t start_ns = 0;
+    uint64_t next_ns = 0;
+    uint64_t now = 0;
+    uint64_t index = 0;
+    uint64_t late = 0;
+    uint64_t head = 0;
+    uint64_t took = 0;
+    uint64_t trim = 0;
+    uint32_t count = 0;
+    uint32_t i = 0;
+    uint16_t gap_us = 0;
+    int running = 0;
+    int ret = -1;
+
+    memset(&st, 0, sizeof(st));
+    memset(&ring, 0, sizeof(ring));
+
+    if(!config->len || !config->rate_hz) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    period_ns = 1000000000ull / config->rate_hz;
+    st.batch = choose_batch(bus, config, period_ns);
+    gap_us = sample_gap(bus, config, period_ns);
+
+    /* Keep the headers in the ring aligned */
+    ring.slot_size = (sizeof(*header) + (size_t)st.batch * config->len + 7) & ~(size_t)7;
+    ring.slots = malloc(ring.slot_size * CAPTURE_RING_SLOTS);
+    spare = malloc(ring.slot_size);
+    xfers = calloc(st.batch, sizeof(*xfers));
+    if(!ring.slots || !spare || !xfers) {
+        goto out;
+    }
+
+    /* Deselect between samples and wait out the rest of the sample period,
+     * so a batch samples at the requested rate */
+    for(i = 0; i < st.batch; ++i) {
+        xfers[i].tx = config->tx;
+        xfers[i].len = config->len;
+        xfers[i].delay_usecs = gap_us;
+        xfers[i].cs_change = 1;
+    }
+
+    ring.out = out;
+    atomic_init(&ring.head, 0);
+    atomic_init(&ring.tail, 0);
+    atomic_init(&ring.done, 0);
+    atomic_init(&ring.error, 0);
+
+    if((errno = pthread_create(&writer, NULL, capture_writer, &ring)) != 0) {
+        goto out;
+    }
+    running = 1;
+
+    start_ns = spi_bus_time_ns(bus);
+    next_ns = start_ns;
+
+    while(!(stop && *stop) && !atomic_load(&ring.error) &&
+          (!config->samples || index < config->samples)) {
+        now = spi_bus_time_ns(bus);
+        if(now < next_ns) {
+            spi_bus_delay(bus, (unsigned long)((next_ns - now + 999) / 1000));
+            now = spi_bus_time_ns(bus);
+        } else if(now - next_ns >= st.batch * period_ns) {
+            /* Fell a whole batch behind: drop the periods that have passed
+             * rather than bunching samples up to catch up. Less than that
+             * is scheduling jitter, which the next batch absorbs */
+            late = (now - next_ns) / period_ns;
+            if(config->samples && late > config->samples - index) {
+                late = config->samples - index;
+            }
+            st.dropped_late += late;
+            index += late;
+            next_ns += late * period_ns;
+            continue;
+        }
+
+        count = st.batch;
+        if(config->samples && count > config->samples - index) {
+            count = (uint32_t)(config->samples - index);
+        }
+
+        /* Read straight into the next free slot, or into the spare buffer
+         * to be discarded if the writer hasn't freed one */
+        head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+        if(head - atomic_load_explicit(&ring.tail, memory_order_acquire) < CAPTURE_RING_SLOTS) {
+            slot = &ring.slots[(head % CAPTURE_RING_SLOTS) * ring.slot_size];
+        } else {
+            slot = spare;
+        }
+
+        header = (struct spi_capture_header*)slot;
+        header->time_ns = now;
+        header->first = index;
+        header->count = count;
+        header->sample_len = config->len;
+        for(i = 0; i < count; ++i) {
+            xfers[i].rx = &slot[sizeof(*header) + (size_t)i * config->len];
+        }
+
+        if(spi_bus_transfer(bus, xfers, count) < 0) {
+            goto out;
+        }
+
+        /* Trim the gap to what the controller actually takes per sample,
+         * so that batches don't drift behind the schedule */
+        took = spi_bus_time_ns(bus) - now;
+        if(count > 1) {
+            if(took > count * period_ns) {
+                trim = (took - count * period_ns) / count / 1000 + 1;
+                gap_us = trim > gap_us ? 0 : gap_us - (uint16_t)trim;
+            } else if(took + count * 1000ull < count * period_ns && gap_us < UINT16_MAX) {
+                gap_us++;
+            }
+
+            for(i = 0; i < st.batch; ++i) {
+                xfers[i].delay_usecs = gap_us;
+            }
+        }
+
+        st.batches++;
+        if(slot == spare) {
+            st.dropped_full += count;
+        } else {
+            st.captured += count;
+            atomic_store_explicit(&ring.head, head + 1, memory_order_release);
+        }
+
+        index += count;
+        next_ns += count * period_ns;
+    }
+
+    ret = 0;
+
+out:
+    if(running) {
+        st.elapsed_ns = spi_bus_time_ns(bus) - start_ns;
+
+        atomic_store(&ring.done, 1);
+        pthread_join(writer, NULL);
+
+        if(atomic_load(&ring.error)) {
+            errno = atomic_load(&ring.error);
+            ret = -1;
+        }
+    }
+
+    if(stats) {
+        *stats = st;
+    }
+
+    free(xfers);
+    free(spare);
+    free(ring.slots);
+
+    return ret;
+}
+
+/**
+ * @brief Write out batches as they are added to the ring
+ */
+static void* capture_writer(
+    void*                   arg)
+{
+    struct capture_ring* ring = arg;
+    const struct spi_capture_header* header = NULL;
+    uint64_t tail = 0;
+    uint64_t head = 0;
+    int done = 0;
+
+    for(;;) {
+        /* done is set after the last batch is added, so seeing it before
+         * reading head means head is final */
+        done = atomic_load(&ring->done);
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        if(tail == head) {
+            if(done) {
+                break;
+            }
+            usleep(CAPTURE_WRITER_IDLE_US);
+            continue;
+        }
+
+        header = (const struct spi_capture_header*)
+                 &ring->slots[(tail % CAPTURE_RING_SLOTS) * ring->slot_size];
+        if(fwrite(header, sizeof(*header) + (size_t)header->count * header->sample_len,
+                  1, ring->out) != 1) {
+            atomic_store(&ring->error, errno ? errno : EIO);
+            break;
+        }
+
+        atomic_store_explicit(&ring->tail, ++tail, memory_order_release);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Choose how many samples to send in each message: about
+ *        CAPTURE_BATCH_NS worth, as long as they fit in one message
+ */
+static uint32_t choose_batch(
+    struct spi_bus*         bus,
+    const struct spi_capture_config* config,
+    uint64_t                period_ns)
+{
+    uint32_t acct = (config->len + SPI_BUS_DMA_ALIGN - 1) / SPI_BUS_DMA_ALIGN *
+                    SPI_BUS_DMA_ALIGN;
+    uint64_t batch = config->batch;
+
+    if(!batch) {
+        batch = CAPTURE_BATCH_NS / period_ns;
+        if(batch > SPI_BUS_MAX_MSG_XFERS) {
+            batch = SPI_BUS_MAX_MSG_XFERS;
+        }
+        if(batch > bus->bufsiz / acct) {
+            batch = bus->bufsiz / acct;
+        }
+    }
+
+    return batch ? (uint32_t)batch : 1;
+}
+
+/**
+ * @brief Work out the delay after each sample that spaces samples at the
+ *        sample period, allowing for the time clocking the sample and
+ *        deselecting take
+ */
+static uint16_t sample_gap(
+    struct spi_bus*         bus,
+    const struct spi_capture_config* config,
+    uint64_t                period_ns)
+{
+    struct spi_bus_config dev = {0};
+    uint64_t speed = bus->speed_hz;
+    uint64_t busy_ns = CAPTURE_CS_CHANGE_NS;
+
+    if(!speed && spi_bus_get_config(bus, &dev) == 0) {
+        speed = dev.max_speed_hz;
+    }
+    if(speed) {
+        busy_ns += config->len * 8ull * 1000000000ull / speed;
+    }
+
+    if(period_ns <= busy_ns) {
+        return 0;
+    }
+
+    return (period_ns - busy_ns) / 1000 > UINT16_MAX ? UINT16_MAX :
+                                                      (uint16_t)((period_ns - busy_ns) / 1000);
+}
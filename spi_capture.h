@@ -0,0 +1,111 @@
+/**
+ * Streaming capture of repeated SPI transactions
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef SPI_CAPTURE_H
+#define SPI_CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "spi_bus.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Header written before the samples of each batch. Fields are in host byte
+ *  order */
+struct spi_capture_header {
+    /** Bus time when the batch's message was started, in nanoseconds */
+    uint64_t                time_ns;
+    /** Index of the batch's first sample. Dropped samples leave gaps */
+    uint64_t                first;
+    /** Samples in the batch */
+    uint32_t                count;
+    /** Bytes in each sample */
+    uint32_t                sample_len;
+};
+
+/** What to capture */
+struct spi_capture_config {
+    /** The transaction sent for each sample, which is also the number of
+     *  bytes received */
+    const uint8_t*          tx;
+    uint32_t                len;
+    /** Samples per second */
+    uint32_t                rate_hz;
+    /** Sample periods to run for, 0 for no limit */
+    uint64_t                samples;
+    /** Most samples to send in one message, 0 to choose from the rate and
+     *  the spidev buffer size */
+    uint32_t                batch;
+};
+
+/** Capture counters */
+struct spi_capture_stats {
+    /** Samples read and handed to the writer */
+    uint64_t                captured;
+    /** Samples skipped because the capture fell behind its schedule */
+    uint64_t                dropped_late;
+    /** Samples read but discarded because the writer fell behind */
+    uint64_t                dropped_full;
+    /** Batches (SPI_IOC_MESSAGEs, unless spidev's buffer splits them) */
+    uint64_t                batches;
+    /** Samples per batch used */
+    uint32_t                batch;
+    /** Bus time from the first batch to the end of the last */
+    uint64_t                elapsed_ns;
+};
+
+/**
+ * @brief Repeat a transaction at a fixed rate and stream what it receives
+ *
+ * Samples are sent in batches, each one message with the device deselected
+ * between samples and the transfer delays spacing them at the sample period
+ * (trimmed as batches are timed), so the rate isn't limited by the ioctl
+ * rate. Between batches the bus is
+ * idle until the next batch is due. If a batch is more than a batch late the
+ * sample periods that were missed are counted as dropped rather than caught
+ * up.
+ *
+ * A writer thread writes each batch to out as a struct spi_capture_header
+ * followed by the samples. Batches are handed over through a lock-free ring;
+ * if the writer falls behind and the ring is full, batches are discarded.
+ *
+ * @param stop - Optional flag that ends the capture when it becomes non-zero
+ * @param stats - Optional pointer to store the counters
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int spi_capture_run(
+    struct spi_bus*         bus,
+    const struct spi_capture_config* config,
+    FILE*                   out,
+    volatile int*           stop,
+    struct spi_capture_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SPI_CAPTURE_H */
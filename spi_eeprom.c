@@ -0,0 +1,462 @@
+/**
+ * 25xx SPI serial EEPROM access
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "spi_eeprom.h"
+
+#define EEPROM_CMD_WRITE                0x02
+#define EEPROM_CMD_READ                 0x03
+#define EEPROM_CMD_RDSR                 0x05
+#define EEPROM_CMD_WREN                 0x06
+/** Address bit 8 of 512 byte parts */
+#define EEPROM_CMD_A8                   0x08
+
+#define EEPROM_SR_WIP                   0x01
+#define EEPROM_SR_BP_MASK               0x0c
+#define EEPROM_SR_BP_SHIFT              2
+
+#define EEPROM_MIN_SIZE                 128u
+#define EEPROM_MAX_SIZE                 (16u << 20)
+#define EEPROM_MAX_PAGE_SIZE            256u
+/** Worst case page write time of common parts is 5 or 10ms */
+#define EEPROM_WRITE_TIMEOUT_US         20000ull
+/** Status polls start once this share of the last page write time has
+ *  passed, then back off to a sixteenth of the time since the write began
+ *  within these limits, so a write is caught within a few percent of
+ *  finishing */
+#define EEPROM_WRITE_HEADSTART_PCT      75
+#define EEPROM_POLL_MIN_US              10
+#define EEPROM_POLL_MAX_US              100
+#define EEPROM_POLL_BACKOFF_SHIFT       4
+
+static unsigned int put_addr(
+    struct spi_eeprom*      eeprom,
+    uint8_t*                cmd,
+    uint8_t                 opcode,
+    uint32_t                addr);
+
+static int poll_ready(
+    struct spi_eeprom*      eeprom,
+    uint64_t                begin,
+    uint64_t                timeout_us);
+
+static uint32_t protected_start(
+    struct spi_eeprom*      eeprom,
+    uint8_t                 status);
+
+static int page_write(
+    struct spi_eeprom*      eeprom,
+    uint32_t                addr,
+    const uint8_t*          buf,
+    uint32_t                len);
+
+static uint32_t page_piece(
+    struct spi_eeprom*      eeprom,
+    uint32_t                addr,
+    uint32_t                len);
+
+int spi_eeprom_init(
+    struct spi_eeprom*      eeprom,
+    struct spi_bus*         bus,
+    uint32_t                size,
+    uint32_t                page_size)
+{
+    memset(eeprom, 0, sizeof(*eeprom));
+    eeprom->bus = bus;
+
+    if(size < EEPROM_MIN_SIZE || size > EEPROM_MAX_SIZE || (size & (size - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The smallest page common parts of each size have: 16 bytes up to the
+     * 25xx160, 32 for the 25xx320 and 640, 64 for the 25xx128 and 256, 128
+     * for the 25xx512 and 256 above that */
+    if(!page_size) {
+        if(size <= 2048) {
+            page_size = 16;
+        } else if(size <= 8192) {
+            page_size = 32;
+        } else if(size <= 32768) {
+            page_size = 64;
+        } else if(size <= 65536) {
+            page_size = 128;
+        } else {
+            page_size = 256;
+        }
+    }
+
+    if(page_size > EEPROM_MAX_PAGE_SIZE || page_size > size ||
+       !page_size || (page_size & (page_size - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    eeprom->size = size;
+    eeprom->page_size = page_size;
+    eeprom->addr_len = size <= 512 ? 1 : (size <= 65536 ? 2 : 3);
+    eeprom->a8_in_opcode = size == 512;
+
+    return 0;
+}
+
+int spi_eeprom_read(
+    struct spi_eeprom*      eeprom,
+    uint32_t                addr,
+    void*                   buf,
+    uint32_t                len)
+{
+    uint8_t cmd[4];
+
+    if(addr > eeprom->size || len > eeprom->size - addr) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!len) {
+        return 0;
+    }
+
+    /* The address counter runs on through the whole array, so one command
+     * reads any range. spi_bus_command() keeps the part selected across
+     * however many messages the data needs */
+    eeprom->stats.reads++;
+
+    return spi_bus_command(eeprom->bus, cmd, put_addr(eeprom, cmd, EEPROM_CMD_READ, addr),
+                           buf, len);
+}
+
+int spi_eeprom_write(
+    struct spi_eeprom*      eeprom,
+    uint32_t                addr,
+    const void*             buf,
+    uint32_t                len)
+{
+    const uint8_t* data = buf;
+    uint32_t piece = 0;
+    uint8_t status = 0;
+
+    if(addr > eeprom->size || len > eeprom->size - addr) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!len) {
+        return 0;
+    }
+
+    /* Writes to protected blocks are silently dropped by the part */
+    if(spi_eeprom_read_status(eeprom, &status) < 0) {
+        return -1;
+    }
+
+    if(addr + len > protected_start(eeprom, status)) {
+        errno = EROFS;
+        return -1;
+    }
+
+    for(; len; addr += piece, data += piece, len -= piece) {
+        piece = page_piece(eeprom, addr, len);
+        if(page_write(eeprom, addr, data, piece) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int spi_eeprom_update(
+    struct spi_eeprom*      eeprom,
+    uint32_t                addr,
+    const void*             buf,
+    uint32_t                len,
+    struct spi_eeprom_update_result* result)
+{
+    const uint8_t* data = buf;
+    uint8_t* cur = NULL;
+    uint32_t piece = 0;
+    uint32_t pos = 0;
+    uint32_t last = 0;
+    uint8_t status = 0;
+    int ret = -1;
+
+    if(result) {
+        memset(result, 0, sizeof(*result));
+    }
+
+    if(addr > eeprom->size || len > eeprom->size - addr) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!len) {
+        return 0;
+    }
+
+    cur = malloc(len);
+    if(!cur) {
+        return -1;
+    }
+
+    if(spi_eeprom_read(eeprom, addr, cur, len) < 0 ||
+       spi_eeprom_read_status(eeprom, &status) < 0) {
+        goto out;
+    }
+
+    /* Check the last byte that changes against the block protect bits
+     * before writing anything, so a protected range fails as a whole */
+    for(last = len; last && cur[last - 1] == data[last - 1]; --last);
+    if(last && addr + last > protected_start(eeprom, status)) {
+        errno = EROFS;
+        goto out;
+    }
+
+    for(pos = 0; pos < len; pos += piece) {
+        piece = page_piece(eeprom, addr + pos, len - pos);
+        if(memcmp(&cur[pos], &data[pos], piece) == 0) {
+            if(result) {
+                result->unchanged++;
+            }
+            continue;
+        }
+
+        if(page_write(eeprom, addr + pos, &data[pos], piece) < 0) {
+            goto out;
+        }
+
+        if(result) {
+            result->written++;
+        }
+    }
+
+    ret = 0;
+
+out:
+    free(cur);
+
+    return ret;
+}
+
+int spi_eeprom_verify(
+    struct spi_eeprom*      eeprom,
+    uint32_t                addr,
+    const void*             buf,
+    uint32_t                len,
+    uint32_t*               mismatch)
+{
+    const uint8_t* data = buf;
+    uint8_t* cur = NULL;
+    uint32_t i = 0;
+    int ret = 0;
+
+    cur = malloc(len ? len : 1);
+    if(!cur) {
+        return -1;
+    }
+
+    if(spi_eeprom_read(eeprom, addr, cur, len) < 0) {
+        free(cur);
+        return -1;
+    }
+
+    for(i = 0; i < len; ++i) {
+        if(cur[i] != data[i]) {
+            if(mismatch) {
+                *mismatch = addr + i;
+            }
+            ret = 1;
+            break;
+        }
+    }
+
+    free(cur);
+
+    return ret;
+}
+
+int spi_eeprom_read_status(
+    struct spi_eeprom*      eeprom,
+    uint8_t*                status)
+{
+    const uint8_t rdsr = EEPROM_CMD_RDSR;
+
+    return spi_bus_command(eeprom->bus, &rdsr, 1, status, 1);
+}
+
+int spi_eeprom_wait_ready(
+    struct spi_eeprom*      eeprom,
+    uint64_t                timeout_us)
+{
+    return poll_ready(eeprom, spi_bus_time_ns(eeprom->bus), timeout_us);
+}
+
+/**
+ * @brief Poll the status register until WIP clears, backing off with the
+ *        time since begin (bus time in ns)
+ */
+static int poll_ready(
+    struct spi_eeprom*      eeprom,
+    uint64_t                begin,
+    uint64_t                timeout_us)
+{
+    uint64_t waited_us = 0;
+    uint64_t poll_us = 0;
+    uint8_t status = 0;
+
+    for(;;) {
+        if(spi_eeprom_read_status(eeprom, &status) < 0) {
+            return -1;
+        }
+
+        eeprom->stats.status_polls++;
+        if(!(status & EEPROM_SR_WIP)) {
+            return 0;
+        }
+
+        waited_us = (spi_bus_time_ns(eeprom->bus) - begin) / 1000;
+        if(waited_us > timeout_us) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        poll_us = waited_us >> EEPROM_POLL_BACKOFF_SHIFT;
+        if(poll_us < EEPROM_POLL_MIN_US) {
+            poll_us = EEPROM_POLL_MIN_US;
+        } else if(poll_us > EEPROM_POLL_MAX_US) {
+            poll_us = EEPROM_POLL_MAX_US;
+        }
+
+        spi_bus_delay(eeprom->bus, (unsigned long)poll_us);
+    }
+}
+
+/**
+ * @brief Build a read or write command for an address
+ *
+ * @return The length of the command
+ */
+static unsigned int put_addr(
+    struct spi_eeprom*      eeprom,
+    uint8_t*                cmd,
+    uint8_t                 opcode,
+    uint32_t                addr)
+{
+    unsigned int i = 0;
+
+    if(eeprom->a8_in_opcode && (addr & 0x100)) {
+        opcode |= EEPROM_CMD_A8;
+    }
+
+    cmd[0] = opcode;
+    for(i = 0; i < eeprom->addr_len; ++i) {
+        cmd[1 + i] = (addr >> (8 * (eeprom->addr_len - 1 - i))) & 0xff;
+    }
+
+    return 1 + eeprom->addr_len;
+}
+
+/**
+ * @brief Get the first address the block protect bits cover: none, the
+ *        upper quarter, the upper half or the whole array
+ */
+static uint32_t protected_start(
+    struct spi_eeprom*      eeprom,
+    uint8_t                 status)
+{
+    switch((status & EEPROM_SR_BP_MASK) >> EEPROM_SR_BP_SHIFT) {
+        case 1:
+            return eeprom->size - eeprom->size / 4;
+        case 2:
+            return eeprom->size / 2;
+        case 3:
+            return 0;
+        default:
+            return eeprom->size;
+    }
+}
+
+/**
+ * @brief Get how much of a range fits before the next page boundary
+ */
+static uint32_t page_piece(
+    struct spi_eeprom*      eeprom,
+    uint32_t                addr,
+    uint32_t                len)
+{
+    uint32_t room = eeprom->page_size - addr % eeprom->page_size;
+
+    return len < room ? len : room;
+}
+
+/**
+ * @brief Write within one page and wait for it. The write enable and the
+ *        write go in one message, and polling starts once most of the time
+ *        the last page write took has passed
+ */
+static int page_write(
+    struct spi_eeprom*      eeprom,
+    uint32_t                addr,
+    const uint8_t*          buf,
+    uint32_t                len)
+{
+    struct spi_xfer xfers[3];
+    const uint8_t wren = EEPROM_CMD_WREN;
+    uint8_t cmd[4];
+    uint64_t begin = 0;
+    uint64_t took = 0;
+
+    memset(xfers, 0, sizeof(xfers));
+    xfers[0].tx = &wren;
+    xfers[0].len = 1;
+    xfers[0].cs_change = 1;
+    xfers[1].tx = cmd;
+    xfers[1].len = put_addr(eeprom, cmd, EEPROM_CMD_WRITE, addr);
+    xfers[2].tx = buf;
+    xfers[2].len = len;
+
+    if(spi_bus_transfer(eeprom->bus, xfers, 3) < 0) {
+        return -1;
+    }
+
+    eeprom->stats.writes++;
+    begin = spi_bus_time_ns(eeprom->bus);
+
+    if(eeprom->write_us) {
+        spi_bus_delay(eeprom->bus, eeprom->write_us * EEPROM_WRITE_HEADSTART_PCT / 100);
+    }
+
+    if(poll_ready(eeprom, begin, EEPROM_WRITE_TIMEOUT_US) < 0) {
+        return -1;
+    }
+
+    took = spi_bus_time_ns(eeprom->bus) - begin;
+    eeprom->stats.busy_ns += took;
+    eeprom->write_us = (uint32_t)(took / 1000);
+
+    return 0;
+}
@@ -0,0 +1,166 @@
+/**
+ * 25xx SPI serial EEPROM access
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef SPI_EEPROM_H
+#define SPI_EEPROM_H
+
+#include <stdint.h>
+
+#include "spi_bus.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Counters kept by the EEPROM engine */
+struct spi_eeprom_stats {
+    /** Read and page write commands issued */
+    unsigned long           reads;
+    unsigned long           writes;
+    /** Status register reads while waiting for page writes */
+    unsigned long           status_polls;
+    /** Time spent waiting for page writes to finish */
+    uint64_t                busy_ns;
+};
+
+/** What spi_eeprom_update() did, counted in pages */
+struct spi_eeprom_update_result {
+    /** Pages that already held the new data */
+    unsigned long           unchanged;
+    /** Pages written */
+    unsigned long           written;
+};
+
+/** A 25xx EEPROM. These parts have no ID, so the size is given */
+struct spi_eeprom {
+    struct spi_bus*         bus;
+    uint32_t                size;
+    uint32_t                page_size;
+    /** Address bytes, 1 to 3 */
+    unsigned int            addr_len;
+    /** Non-zero for 512 byte parts, which take address bit 8 in bit 3 of
+     *  the read and write opcodes */
+    int                     a8_in_opcode;
+    /** How long the last page write took. The next one isn't polled until
+     *  most of this time has passed */
+    uint32_t                write_us;
+    struct spi_eeprom_stats stats;
+};
+
+/**
+ * @brief Set up access to a 25xx EEPROM
+ *
+ * @param size - Array size in bytes, a power of 2 from 128 bytes to 16MB.
+ *               This sets the number of address bytes: 1 up to 512 bytes,
+ *               2 up to 64K and 3 above that
+ * @param page_size - Write page size, or 0 for the smallest page used by
+ *                    common parts of that size. A smaller page than the
+ *                    part's always works, just more slowly
+ *
+ * @return 0 on success, -1 on failure with errno set (EINVAL for a size or
+ *         page size that isn't supported)
+ */
+int spi_eeprom_init(
+    struct spi_eeprom*      eeprom,
+    struct spi_bus*         bus,
+    uint32_t                size,
+    uint32_t                page_size);
+
+/**
+ * @brief Read a range with a single read command, however long it is
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int spi_eeprom_read(
+    struct spi_eeprom*      eeprom,
+    uint32_t                addr,
+    void*                   buf,
+    uint32_t                len);
+
+/**
+ * @brief Write a range, split into page aligned writes each sent together
+ *        with its write enable, waiting for each to finish
+ *
+ * @return 0 on success, -1 on failure with errno set (EROFS if the block
+ *         protect bits cover part of the range)
+ */
+int spi_eeprom_write(
+    struct spi_eeprom*      eeprom,
+    uint32_t                addr,
+    const void*             buf,
+    uint32_t                len);
+
+/**
+ * @brief Write a range, skipping the pages that already hold the new data
+ *
+ * @param result - Optional pointer to store what was done
+ *
+ * @return 0 on success, -1 on failure with errno set (EROFS, before anything
+ *         is written, if the block protect bits cover a byte that changes)
+ */
+int spi_eeprom_update(
+    struct spi_eeprom*      eeprom,
+    uint32_t                addr,
+    const void*             buf,
+    uint32_t                len,
+    struct spi_eeprom_update_result* result);
+
+/**
+ * @brief Compare a range of the EEPROM with a buffer
+ *
+ * @param mismatch - Optional pointer to store the first differing address
+ *
+ * @return 0 if it matches, 1 if it doesn't, -1 on failure with errno set
+ */
+int spi_eeprom_verify(
+    struct spi_eeprom*      eeprom,
+    uint32_t                addr,
+    const void*             buf,
+    uint32_t                len,
+    uint32_t*               mismatch);
+
+/**
+ * @brief Read the status register
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int spi_eeprom_read_status(
+    struct spi_eeprom*      eeprom,
+    uint8_t*                status);
+
+/**
+ * @brief Wait for a write to complete
+ *
+ * @param timeout_us - How long to wait before failing with ETIMEDOUT
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int spi_eeprom_wait_ready(
+    struct spi_eeprom*      eeprom,
+    uint64_t                timeout_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SPI_EEPROM_H */
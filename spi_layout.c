@@ -0,0 +1,364 @@
+/**
+ * Flash layouts from Intel flash descriptors and FMAPs
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include "spi_layout.h"
+
+/** The flash descriptor signature, at offset 16 in current descriptors and
+ *  at offset 0 in the oldest (ICH8) ones */
+#define IFD_SIGNATURE                   0x0ff0a55a
+#define IFD_SIG_OFFSET                  16
+#define IFD_MAX_REGIONS                 16
+/** Region base and limit fields count 4K blocks */
+#define IFD_REGION_SHIFT                12
+/** Enough of the start of the flash to hold the descriptor's maps and
+ *  region section */
+#define IFD_READ_SIZE                   4096
+
+/** coreboot FMAP, version 1 */
+#define FMAP_SIGNATURE                  "__FMAP__"
+#define FMAP_SIG_LEN                    8
+#define FMAP_VER_MAJOR                  1
+#define FMAP_HEADER_LEN                 56
+#define FMAP_AREA_LEN                   42
+#define FMAP_NAME_LEN                   32
+/** Smallest alignment the FMAP is looked for at on a flash */
+#define FMAP_MIN_STRIDE                 4096
+
+static const char* const ifd_names[IFD_MAX_REGIONS] = {
+    [0] = "fd",
+    [1] = "bios",
+    [2] = "me",
+    [3] = "gbe",
+    [4] = "pd",
+    [5] = "devexp",
+    [6] = "bios2",
+    [8] = "ec",
+    [10] = "ie",
+    [11] = "10gbe0",
+    [12] = "10gbe1",
+};
+
+static int parse_ifd(
+    struct spi_layout*      layout,
+    const uint8_t*          buf,
+    uint64_t                len);
+
+static int fmap_areas(
+    const uint8_t*          buf,
+    uint64_t                len);
+
+static void parse_fmap(
+    struct spi_layout*      layout,
+    const uint8_t*          buf);
+
+static void add_region(
+    struct spi_layout*      layout,
+    const char*             name,
+    size_t                  name_len,
+    uint64_t                offset,
+    uint64_t                size,
+    const char*             source);
+
+static uint16_t get_le16(
+    const uint8_t*          buf);
+
+static uint32_t get_le32(
+    const uint8_t*          buf);
+
+int spi_layout_from_image(
+    struct spi_layout*      layout,
+    const uint8_t*          image,
+    uint64_t                len)
+{
+    const uint8_t* p = image;
+    const uint8_t* end = image + len;
+    int found = 0;
+
+    memset(layout, 0, sizeof(*layout));
+
+    found = parse_ifd(layout, image, len);
+
+    /* The FMAP can be anywhere, so check every place the first signature
+     * byte appears */
+    while(end - p >= FMAP_HEADER_LEN &&
+          (p = memchr(p, FMAP_SIGNATURE[0], end - p - FMAP_HEADER_LEN + 1)) != NULL) {
+        if(fmap_areas(p, end - p) > 0) {
+            parse_fmap(layout, p);
+            found = 1;
+            break;
+        }
+        ++p;
+    }
+
+    if(!found) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    return 0;
+}
+
+int spi_layout_from_flash(
+    struct spi_layout*      layout,
+    struct spi_nor*         nor)
+{
+    uint8_t header[FMAP_HEADER_LEN];
+    uint8_t sig[FMAP_SIG_LEN];
+    uint8_t* buf = NULL;
+    uint64_t len = nor->size < IFD_READ_SIZE ? nor->size : IFD_READ_SIZE;
+    uint64_t stride = 0;
+    uint64_t offset = 0;
+    int areas = 0;
+    int found = 0;
+
+    memset(layout, 0, sizeof(*layout));
+
+    buf = malloc(len);
+    if(!buf) {
+        return -1;
+    }
+
+    if(spi_nor_read(nor, 0, buf, len) < 0) {
+        free(buf);
+        return -1;
+    }
+
+    found = parse_ifd(layout, buf, len);
+    free(buf);
+    buf = NULL;
+
+    /* Check the offsets with the largest alignment first, each offset
+     * once, as the FMAP is usually well aligned */
+    for(stride = nor->size / 2; stride >= FMAP_MIN_STRIDE && !areas; stride /= 2) {
+        for(offset = 0; offset + FMAP_HEADER_LEN <= nor->size; offset += stride) {
+            if(stride < nor->size / 2 && offset % (stride * 2) == 0) {
+                continue;
+            }
+
+            /* Each probe costs a message whatever its size, so only read
+             * the signature and fetch the header on a match */
+            if(spi_nor_read(nor, offset, sig, sizeof(sig)) < 0) {
+                return -1;
+            }
+
+            if(memcmp(sig, FMAP_SIGNATURE, FMAP_SIG_LEN) != 0) {
+                continue;
+            }
+
+            if(spi_nor_read(nor, offset, header, sizeof(header)) < 0) {
+                return -1;
+            }
+
+            if((areas = fmap_areas(header, nor->size - offset)) > 0) {
+                break;
+            }
+        }
+    }
+
+    if(areas > 0) {
+        len = FMAP_HEADER_LEN + (uint64_t)areas * FMAP_AREA_LEN;
+        buf = malloc(len);
+        if(!buf) {
+            return -1;
+        }
+
+        if(spi_nor_read(nor, offset, buf, len) < 0) {
+            free(buf);
+            return -1;
+        }
+
+        parse_fmap(layout, buf);
+        free(buf);
+        found = 1;
+    }
+
+    if(!found) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    return 0;
+}
+
+const struct spi_layout_region* spi_layout_find(
+    const struct spi_layout* layout,
+    const char*             name)
+{
+    unsigned int i = 0;
+
+    for(i = 0; i < layout->count; ++i) {
+        if(strcasecmp(layout->regions[i].name, name) == 0) {
+            return &layout->regions[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Add the regions of a flash descriptor at the start of buf
+ *
+ * @return 1 if there was a descriptor, otherwise 0
+ */
+static int parse_ifd(
+    struct spi_layout*      layout,
+    const uint8_t*          buf,
+    uint64_t                len)
+{
+    char name[16] = {0};
+    uint64_t sig = IFD_SIG_OFFSET;
+    uint32_t flmap0 = 0;
+    uint32_t flmap1 = 0;
+    uint32_t frba = 0;
+    uint32_t fmba = 0;
+    uint32_t reg = 0;
+    uint64_t base = 0;
+    uint64_t limit = 0;
+    unsigned int count = 0;
+    unsigned int i = 0;
+
+    if(len < sig + 12 || get_le32(&buf[sig]) != IFD_SIGNATURE) {
+        sig = 0;
+        if(len < 12 || get_le32(buf) != IFD_SIGNATURE) {
+            return 0;
+        }
+    }
+
+    /* FLMAP0 and FLMAP1 give the region and master section addresses, in
+     * 16 byte units. The region section runs up to the master section */
+    flmap0 = get_le32(&buf[sig + 4]);
+    flmap1 = get_le32(&buf[sig + 8]);
+    frba = ((flmap0 >> 16) & 0xff) << 4;
+    fmba = (flmap1 & 0xff) << 4;
+
+    count = fmba > frba ? (fmba - frba) / 4 : 5;
+    if(count > IFD_MAX_REGIONS) {
+        count = IFD_MAX_REGIONS;
+    }
+
+    for(i = 0; i < count && frba + 4 * (i + 1) <= len; ++i) {
+        reg = get_le32(&buf[frba + 4 * i]);
+        base = (uint64_t)(reg & 0x7fff) << IFD_REGION_SHIFT;
+        limit = ((uint64_t)((reg >> 16) & 0x7fff) << IFD_REGION_SHIFT) |
+                ((1u << IFD_REGION_SHIFT) - 1);
+
+        /* Unused regions have their limit below their base */
+        if(limit < base) {
+            continue;
+        }
+
+        if(ifd_names[i]) {
+            snprintf(name, sizeof(name), "%s", ifd_names[i]);
+        } else {
+            snprintf(name, sizeof(name), "reg%u", i);
+        }
+        add_region(layout, name, strlen(name), base, limit - base + 1, "ifd");
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Check for a valid FMAP header at the start of buf
+ *
+ * @param len - Bytes available from buf onwards
+ *
+ * @return The number of areas, or -1 if there isn't an FMAP there
+ */
+static int fmap_areas(
+    const uint8_t*          buf,
+    uint64_t                len)
+{
+    uint16_t areas = 0;
+
+    if(len < FMAP_HEADER_LEN || memcmp(buf, FMAP_SIGNATURE, FMAP_SIG_LEN) != 0 ||
+       buf[8] != FMAP_VER_MAJOR) {
+        return -1;
+    }
+
+    areas = get_le16(&buf[54]);
+    if(!areas || len < FMAP_HEADER_LEN + (uint64_t)areas * FMAP_AREA_LEN) {
+        return -1;
+    }
+
+    return areas;
+}
+
+/**
+ * @brief Add the areas of a validated FMAP
+ */
+static void parse_fmap(
+    struct spi_layout*      layout,
+    const uint8_t*          buf)
+{
+    const uint8_t* area = NULL;
+    uint16_t areas = get_le16(&buf[54]);
+    uint16_t i = 0;
+
+    for(i = 0; i < areas; ++i) {
+        area = &buf[FMAP_HEADER_LEN + i * FMAP_AREA_LEN];
+        add_region(layout, (const char*)&area[8], strnlen((const char*)&area[8], FMAP_NAME_LEN),
+                   get_le32(area), get_le32(&area[4]), "fmap");
+    }
+}
+
+static void add_region(
+    struct spi_layout*      layout,
+    const char*             name,
+    size_t                  name_len,
+    uint64_t                offset,
+    uint64_t                size,
+    const char*             source)
+{
+    struct spi_layout_region* region = NULL;
+
+    if(layout->count == SPI_LAYOUT_MAX_REGIONS || !size) {
+        return;
+    }
+
+    region = &layout->regions[layout->count++];
+    memcpy(region->name, name, name_len);
+    region->name[name_len] = '\0';
+    region->offset = offset;
+    region->size = size;
+    region->source = source;
+}
+
+static uint16_t get_le16(
+    const uint8_t*          buf)
+{
+    return buf[0] | (buf[1] << 8);
+}
+
+static uint32_t get_le32(
+    const uint8_t*          buf)
+{
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
@@ -0,0 +1,96 @@
+/**
+ * Flash layouts from Intel flash descriptors and FMAPs
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef SPI_LAYOUT_H
+#define SPI_LAYOUT_H
+
+#include <stdint.h>
+
+#include "spi_nor.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SPI_LAYOUT_MAX_REGIONS          64
+#define SPI_LAYOUT_NAME_LEN             33
+
+/** A named range of a flash */
+struct spi_layout_region {
+    char                    name[SPI_LAYOUT_NAME_LEN];
+    uint64_t                offset;
+    uint64_t                size;
+    /** Where the region came from: "ifd" or "fmap" */
+    const char*             source;
+};
+
+/** The regions of a flash image */
+struct spi_layout {
+    struct spi_layout_region regions[SPI_LAYOUT_MAX_REGIONS];
+    unsigned int            count;
+};
+
+/**
+ * @brief Find the regions described by an image's Intel flash descriptor
+ *        and coreboot FMAP, if it has them
+ *
+ * The descriptor regions are named fd, bios, me, gbe, pd, devexp, bios2,
+ * ec, ie, 10gbe0 and 10gbe1 (others regN), and the FMAP areas keep their
+ * own names. Regions in both are listed, descriptor ones first.
+ *
+ * @return 0 on success, -1 if neither was found with errno set to ENOENT
+ */
+int spi_layout_from_image(
+    struct spi_layout*      layout,
+    const uint8_t*          image,
+    uint64_t                len);
+
+/**
+ * @brief Find the regions of the image on a flash. The descriptor is read
+ *        from the start of the part, and the FMAP is looked for at 4K
+ *        aligned offsets, largest alignment first, with an 8 byte read at
+ *        each. A well aligned FMAP is found in a few reads, but a part
+ *        without one (such as a descriptor only Intel image) takes one read
+ *        per 4K: 8192 on a 32MB part, a few hundred ms
+ *
+ * @return 0 on success, -1 on failure with errno set (ENOENT if neither was
+ *         found)
+ */
+int spi_layout_from_flash(
+    struct spi_layout*      layout,
+    struct spi_nor*         nor);
+
+/**
+ * @brief Look a region up by name, ignoring case
+ *
+ * @return The region, or NULL if there isn't one
+ */
+const struct spi_layout_region* spi_layout_find(
+    const struct spi_layout* layout,
+    const char*             name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SPI_LAYOUT_H */
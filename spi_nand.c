@@ -0,0 +1,714 @@
+/**
+ * SPI NAND flash access with page cache reads and ECC status
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "spi_nand.h"
+
+#define NAND_CMD_RESET                  0xff
+#define NAND_CMD_RDID                   0x9f
+#define NAND_CMD_GET_FEATURE            0x0f
+#define NAND_CMD_SET_FEATURE            0x1f
+#define NAND_CMD_PAGE_READ              0x13
+#define NAND_CMD_CACHE_READ_SEQ         0x31
+#define NAND_CMD_CACHE_READ_END         0x3f
+#define NAND_CMD_READ_CACHE             0x0b
+#define NAND_CMD_READ_CACHE_X2          0x3b
+#define NAND_CMD_READ_CACHE_X4          0x6b
+
+/** Feature registers */
+#define NAND_REG_CONFIG                 0xb0
+#define NAND_REG_STATUS                 0xc0
+
+#define NAND_CONFIG_ECC_EN              0x10
+/** Winbond's buffer read mode bit, clear for continuous reads */
+#define NAND_CONFIG_BUF                 0x08
+
+#define NAND_STATUS_OIP                 0x01
+#define NAND_STATUS_ECC_MASK            0x30
+#define NAND_STATUS_ECC_SHIFT           4
+#define NAND_STATUS_ECC_UNCORRECTABLE   2
+
+/** Typical time to move a loaded page into the cache during a cache read,
+ *  allowed for before checking the status */
+#define NAND_CACHE_BUSY_US              5
+/** Worst case reset and page read times of common parts, with margin */
+#define NAND_RESET_TIMEOUT_US           10000ull
+#define NAND_READ_TIMEOUT_US            2000ull
+/** Status polls back off to a quarter of the time waited so far, within
+ *  these limits. Page reads take tens of microseconds, so the limits are
+ *  much lower than for NOR programs and erases */
+#define NAND_POLL_MIN_US                2
+#define NAND_POLL_MAX_US                100
+#define NAND_POLL_BACKOFF_SHIFT         2
+
+#define METHOD(m)                       (1u << (m))
+#define METHODS_PAGE                    METHOD(SPI_NAND_READ_PAGE)
+#define METHODS_CACHE                   (METHODS_PAGE | METHOD(SPI_NAND_READ_CACHE))
+#define METHODS_CONTINUOUS              (METHODS_PAGE | METHOD(SPI_NAND_READ_CONTINUOUS))
+
+/** A known part */
+struct nand_part {
+    const char*             name;
+    uint8_t                 id[3];
+    unsigned int            id_len;
+    uint32_t                page_size;
+    uint32_t                oob_size;
+    uint32_t                pages_per_block;
+    uint32_t                blocks;
+    unsigned int            methods;
+};
+
+static const struct nand_part nand_parts[] = {
+    { "W25N01GV",        { 0xef, 0xaa, 0x21 }, 3, 2048, 64,  64, 1024, METHODS_CONTINUOUS },
+    { "W25N02KV",        { 0xef, 0xaa, 0x22 }, 3, 2048, 128, 64, 2048, METHODS_PAGE },
+    { "MT29F1G01ABAFD",  { 0x2c, 0x14 },       2, 2048, 128, 64, 1024, METHODS_CACHE },
+    { "MX35LF1GE4AB",    { 0xc2, 0x12 },       2, 2048, 64,  64, 1024, METHODS_PAGE },
+    { "TC58CVG0S3HRAIJ", { 0x98, 0xc2 },       2, 2048, 64,  64, 1024, METHODS_PAGE },
+};
+
+static const char* const read_method_names[SPI_NAND_READ_NUM] = {
+    [SPI_NAND_READ_PAGE] = "page",
+    [SPI_NAND_READ_CACHE] = "cache",
+    [SPI_NAND_READ_CONTINUOUS] = "continuous",
+};
+
+static const char* const ecc_names[] = {
+    [SPI_NAND_ECC_OK] = "ok",
+    [SPI_NAND_ECC_CORRECTED] = "corrected",
+    [SPI_NAND_ECC_UNCORRECTABLE] = "uncorrectable",
+};
+
+static int get_feature(
+    struct spi_nand*        nand,
+    uint8_t                 reg,
+    uint8_t*                val);
+
+static int set_feature(
+    struct spi_nand*        nand,
+    uint8_t                 reg,
+    uint8_t                 val);
+
+static int set_continuous(
+    struct spi_nand*        nand,
+    int                     on);
+
+static int page_to_cache(
+    struct spi_nand*        nand,
+    uint8_t                 opcode,
+    uint32_t                page,
+    uint8_t*                status);
+
+static int read_cache(
+    struct spi_nand*        nand,
+    uint32_t                column,
+    void*                   buf,
+    uint32_t                len);
+
+static int read_page(
+    struct spi_nand*        nand,
+    uint32_t                page,
+    uint32_t                column,
+    void*                   buf,
+    uint32_t                len,
+    enum spi_nand_ecc*      ecc);
+
+static int cache_read_page(
+    struct spi_nand*        nand,
+    uint8_t                 opcode,
+    void*                   buf,
+    uint8_t*                status);
+
+static int read_continuous(
+    struct spi_nand*        nand,
+    uint32_t                page,
+    uint32_t                count,
+    uint8_t*                data,
+    uint8_t*                ecc);
+
+static enum spi_nand_ecc note_ecc(
+    struct spi_nand*        nand,
+    uint8_t                 status);
+
+int spi_nand_probe(
+    struct spi_nand*        nand,
+    struct spi_bus*         bus)
+{
+    const uint8_t rdid[2] = { NAND_CMD_RDID, 0x00 };
+    const uint8_t reset = NAND_CMD_RESET;
+    const struct nand_part* part = NULL;
+    unsigned int tx_lines = 0;
+    unsigned int i = 0;
+    uint8_t config = 0;
+
+    memset(nand, 0, sizeof(*nand));
+    nand->bus = bus;
+
+    /* The ID follows a dummy byte */
+    if(spi_bus_command(nand->bus, rdid, sizeof(rdid), nand->id, sizeof(nand->id)) < 0) {
+        return -1;
+    }
+
+    /* A floating or shorted MISO line */
+    if((nand->id[0] == 0xff && nand->id[1] == 0xff && nand->id[2] == 0xff) ||
+       (nand->id[0] == 0x00 && nand->id[1] == 0x00 && nand->id[2] == 0x00)) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    for(i = 0; i < sizeof(nand_parts) / sizeof(nand_parts[0]); ++i) {
+        if(memcmp(nand->id, nand_parts[i].id, nand_parts[i].id_len) == 0) {
+            part = &nand_parts[i];
+            break;
+        }
+    }
+
+    if(!part) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    nand->name = part->name;
+    nand->page_size = part->page_size;
+    nand->oob_size = part->oob_size;
+    nand->pages_per_block = part->pages_per_block;
+    nand->blocks = part->blocks;
+    nand->size = (uint64_t)part->page_size * part->pages_per_block * part->blocks;
+    nand->methods = part->methods;
+
+    if(spi_bus_command(nand->bus, &reset, 1, NULL, 0) < 0 ||
+       spi_nand_wait_ready(nand, NULL, NAND_RESET_TIMEOUT_US) < 0) {
+        return -1;
+    }
+
+    /* Reads are only worth doing with the ECC on, and the buffer mode bit
+     * only exists on parts with continuous reads */
+    if(get_feature(nand, NAND_REG_CONFIG, &config) < 0) {
+        return -1;
+    }
+    config |= NAND_CONFIG_ECC_EN;
+    if(nand->methods & METHOD(SPI_NAND_READ_CONTINUOUS)) {
+        config |= NAND_CONFIG_BUF;
+    }
+    if(set_feature(nand, NAND_REG_CONFIG, config) < 0) {
+        return -1;
+    }
+
+    if(spi_bus_get_lines(bus, &tx_lines, &nand->rx_lines) < 0) {
+        return -1;
+    }
+
+    /* Every part has the x1, x2 and x4 output reads from cache, with a
+     * 2 byte column and a dummy byte on one line */
+    if(nand->rx_lines >= 4) {
+        nand->read_opcode = NAND_CMD_READ_CACHE_X4;
+        nand->data_nbits = 4;
+    } else if(nand->rx_lines >= 2) {
+        nand->read_opcode = NAND_CMD_READ_CACHE_X2;
+        nand->data_nbits = 2;
+    } else {
+        nand->read_opcode = NAND_CMD_READ_CACHE;
+        nand->data_nbits = 1;
+    }
+
+    for(i = SPI_NAND_READ_NUM; i-- > 0;) {
+        if(nand->methods & METHOD(i)) {
+            nand->read_method = i;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+void spi_nand_release(
+    struct spi_nand*        nand)
+{
+    /* Drivers and boot loaders expect the default buffer mode */
+    set_continuous(nand, 0);
+
+    free(nand->bbt);
+    nand->bbt = NULL;
+}
+
+int spi_nand_read_page(
+    struct spi_nand*        nand,
+    uint32_t                page,
+    void*                   buf,
+    uint32_t                len,
+    enum spi_nand_ecc*      ecc)
+{
+    if(page >= nand->blocks * nand->pages_per_block ||
+       len > nand->page_size + nand->oob_size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return read_page(nand, page, 0, buf, len, ecc);
+}
+
+int spi_nand_read(
+    struct spi_nand*        nand,
+    uint32_t                page,
+    uint32_t                count,
+    void*                   buf,
+    uint8_t*                ecc)
+{
+    uint8_t* data = buf;
+    enum spi_nand_ecc result = SPI_NAND_ECC_OK;
+    uint8_t status = 0;
+    uint8_t opcode = 0;
+    uint32_t i = 0;
+
+    if(page > nand->blocks * nand->pages_per_block ||
+       count > nand->blocks * nand->pages_per_block - page ||
+       !(nand->methods & METHOD(nand->read_method))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!count) {
+        return 0;
+    }
+
+    if(nand->read_method == SPI_NAND_READ_CONTINUOUS && count > 1) {
+        return read_continuous(nand, page, count, data, ecc);
+    }
+
+    if(nand->read_method == SPI_NAND_READ_CACHE && count > 1) {
+        /* Each 0x31 moves the page loaded last into the cache and starts
+         * loading the next one, which overlaps the read from cache. The
+         * last page uses 0x3f so nothing past the run is loaded */
+        if(set_continuous(nand, 0) < 0 ||
+           page_to_cache(nand, NAND_CMD_PAGE_READ, page, NULL) < 0) {
+            return -1;
+        }
+
+        for(i = 0; i < count; ++i) {
+            opcode = i + 1 < count ? NAND_CMD_CACHE_READ_SEQ : NAND_CMD_CACHE_READ_END;
+            if(cache_read_page(nand, opcode, &data[i * nand->page_size], &status) < 0) {
+                return -1;
+            }
+
+            result = note_ecc(nand, status);
+            if(ecc) {
+                ecc[i] = result;
+            }
+        }
+
+        return 0;
+    }
+
+    for(i = 0; i < count; ++i) {
+        if(read_page(nand, page + i, 0, &data[i * nand->page_size],
+                     nand->page_size, &result) < 0) {
+            return -1;
+        }
+        if(ecc) {
+            ecc[i] = result;
+        }
+    }
+
+    return 0;
+}
+
+int spi_nand_scan_bad_blocks(
+    struct spi_nand*        nand)
+{
+    uint8_t marker = 0;
+    uint32_t block = 0;
+
+    free(nand->bbt);
+    nand->bad_blocks = 0;
+    nand->bbt = calloc(nand->blocks, 1);
+    if(!nand->bbt) {
+        return -1;
+    }
+
+    for(block = 0; block < nand->blocks; ++block) {
+        if(read_page(nand, block * nand->pages_per_block, nand->page_size,
+                     &marker, 1, NULL) < 0) {
+            free(nand->bbt);
+            nand->bbt = NULL;
+            return -1;
+        }
+
+        if(marker != 0xff) {
+            nand->bbt[block] = 1;
+            nand->bad_blocks++;
+        }
+    }
+
+    return (int)nand->bad_blocks;
+}
+
+int spi_nand_read_status(
+    struct spi_nand*        nand,
+    uint8_t*                status)
+{
+    return get_feature(nand, NAND_REG_STATUS, status);
+}
+
+int spi_nand_wait_ready(
+    struct spi_nand*        nand,
+    uint8_t*                status,
+    uint64_t                timeout_us)
+{
+    uint64_t begin = spi_bus_time_ns(nand->bus);
+    uint64_t waited_us = 0;
+    uint64_t poll_us = 0;
+    uint8_t val = 0;
+
+    for(;;) {
+        if(spi_nand_read_status(nand, &val) < 0) {
+            return -1;
+        }
+
+        nand->stats.status_polls++;
+        if(!(val & NAND_STATUS_OIP)) {
+            if(status) {
+                *status = val;
+            }
+            return 0;
+        }
+
+        waited_us = (spi_bus_time_ns(nand->bus) - begin) / 1000;
+        if(waited_us > timeout_us) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        poll_us = waited_us >> NAND_POLL_BACKOFF_SHIFT;
+        if(poll_us < NAND_POLL_MIN_US) {
+            poll_us = NAND_POLL_MIN_US;
+        } else if(poll_us > NAND_POLL_MAX_US) {
+            poll_us = NAND_POLL_MAX_US;
+        }
+
+        spi_bus_delay(nand->bus, (unsigned long)poll_us);
+    }
+}
+
+const char* spi_nand_read_method_name(
+    enum spi_nand_read_method method)
+{
+    return method < SPI_NAND_READ_NUM ? read_method_names[method] : "unknown";
+}
+
+const char* spi_nand_ecc_name(
+    enum spi_nand_ecc       ecc)
+{
+    return ecc <= SPI_NAND_ECC_UNCORRECTABLE ? ecc_names[ecc] : "unknown";
+}
+
+static int get_feature(
+    struct spi_nand*        nand,
+    uint8_t                 reg,
+    uint8_t*                val)
+{
+    const uint8_t cmd[2] = { NAND_CMD_GET_FEATURE, reg };
+
+    return spi_bus_command(nand->bus, cmd, sizeof(cmd), val, 1);
+}
+
+static int set_feature(
+    struct spi_nand*        nand,
+    uint8_t                 reg,
+    uint8_t                 val)
+{
+    const uint8_t cmd[3] = { NAND_CMD_SET_FEATURE, reg, val };
+
+    return spi_bus_command(nand->bus, cmd, sizeof(cmd), NULL, 0);
+}
+
+/**
+ * @brief Switch a part with continuous reads between continuous and buffer
+ *        read mode, if it isn't in that mode already
+ */
+static int set_continuous(
+    struct spi_nand*        nand,
+    int                     on)
+{
+    uint8_t config = 0;
+
+    if(nand->continuous == on) {
+        return 0;
+    }
+
+    if(get_feature(nand, NAND_REG_CONFIG, &config) < 0) {
+        return -1;
+    }
+
+    config = on ? config & ~NAND_CONFIG_BUF : config | NAND_CONFIG_BUF;
+    if(set_feature(nand, NAND_REG_CONFIG, config) < 0) {
+        return -1;
+    }
+
+    nand->continuous = on;
+
+    return 0;
+}
+
+/**
+ * @brief Load a page into the cache with a page read (which takes the page
+ *        address) or a cache read (which doesn't) and wait for it
+ *
+ * @param status - Optional pointer to store the final status in, which
+ *                 holds the ECC status of the page now in the cache
+ */
+static int page_to_cache(
+    struct spi_nand*        nand,
+    uint8_t                 opcode,
+    uint32_t                page,
+    uint8_t*                status)
+{
+    uint8_t cmd[4];
+
+    cmd[0] = opcode;
+    cmd[1] = (page >> 16) & 0xff;
+    cmd[2] = (page >> 8) & 0xff;
+    cmd[3] = page & 0xff;
+
+    if(spi_bus_command(nand->bus, cmd, opcode == NAND_CMD_PAGE_READ ? 4 : 1, NULL, 0) < 0) {
+        return -1;
+    }
+
+    if(opcode == NAND_CMD_PAGE_READ) {
+        nand->stats.page_reads++;
+    } else {
+        nand->stats.cache_reads++;
+    }
+
+    return spi_nand_wait_ready(nand, status, NAND_READ_TIMEOUT_US);
+}
+
+/**
+ * @brief Read from the cache. In buffer mode this starts at a column of
+ *        the page, in continuous mode it starts at the page loaded last and
+ *        runs on through the pages after it
+ */
+static int read_cache(
+    struct spi_nand*        nand,
+    uint32_t                column,
+    void*                   buf,
+    uint32_t                len)
+{
+    struct spi_xfer xfers[2];
+    uint8_t cmd[5] = {0};
+
+    memset(xfers, 0, sizeof(xfers));
+    cmd[0] = nand->read_opcode;
+    xfers[0].tx = cmd;
+    if(nand->continuous) {
+        /* Four dummy bytes in place of the column and dummy byte */
+        xfers[0].len = 5;
+    } else {
+        cmd[1] = (column >> 8) & 0xff;
+        cmd[2] = column & 0xff;
+        xfers[0].len = 4;
+    }
+    xfers[1].rx = buf;
+    xfers[1].len = len;
+    xfers[1].rx_nbits = nand->data_nbits;
+
+    nand->stats.cache_outputs++;
+
+    return spi_bus_transfer(nand->bus, xfers, 2);
+}
+
+/**
+ * @brief Read part of a page in buffer mode
+ */
+static int read_page(
+    struct spi_nand*        nand,
+    uint32_t                page,
+    uint32_t                column,
+    void*                   buf,
+    uint32_t                len,
+    enum spi_nand_ecc*      ecc)
+{
+    enum spi_nand_ecc result = SPI_NAND_ECC_OK;
+    uint8_t status = 0;
+
+    if(set_continuous(nand, 0) < 0 ||
+       page_to_cache(nand, NAND_CMD_PAGE_READ, page, &status) < 0 ||
+       read_cache(nand, column, buf, len) < 0) {
+        return -1;
+    }
+
+    result = note_ecc(nand, status);
+    if(ecc) {
+        *ecc = result;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Move the next page of a cache read into the cache and read it out.
+ *        The command, a status read and the read from cache go in one
+ *        message, with a short delay for the move, so each page costs a
+ *        single ioctl unless the part turns out to still be busy
+ */
+static int cache_read_page(
+    struct spi_nand*        nand,
+    uint8_t                 opcode,
+    void*                   buf,
+    uint8_t*                status)
+{
+    struct spi_xfer xfers[5];
+    const uint8_t get_status[2] = { NAND_CMD_GET_FEATURE, NAND_REG_STATUS };
+    uint8_t read[4] = { nand->read_opcode, 0, 0, 0 };
+
+    memset(xfers, 0, sizeof(xfers));
+    xfers[0].tx = &opcode;
+    xfers[0].len = 1;
+    xfers[0].delay_usecs = NAND_CACHE_BUSY_US;
+    xfers[0].cs_change = 1;
+    xfers[1].tx = get_status;
+    xfers[1].len = sizeof(get_status);
+    xfers[2].rx = status;
+    xfers[2].len = 1;
+    xfers[2].cs_change = 1;
+    xfers[3].tx = read;
+    xfers[3].len = sizeof(read);
+    xfers[4].rx = buf;
+    xfers[4].len = nand->page_size;
+    xfers[4].rx_nbits = nand->data_nbits;
+
+    if(spi_bus_transfer(nand->bus, xfers, 5) < 0) {
+        return -1;
+    }
+
+    nand->stats.cache_reads++;
+    nand->stats.status_polls++;
+    nand->stats.cache_outputs++;
+
+    if(!(*status & NAND_STATUS_OIP)) {
+        return 0;
+    }
+
+    /* Still loading, so the read from cache was too early */
+    if(spi_nand_wait_ready(nand, status, NAND_READ_TIMEOUT_US) < 0) {
+        return -1;
+    }
+
+    return read_cache(nand, 0, buf, nand->page_size);
+}
+
+/**
+ * @brief Read a run of pages with continuous reads, a block at a time. Each
+ *        block comes out of one read from cache, with the part loading each
+ *        page while the previous one is clocked out
+ *
+ * The status after a continuous read only gives the worst ECC result of the
+ * block. When it isn't clean, each page is loaded again with a page read to
+ * find its own status, which costs the page read time and a status poll but
+ * not the transfer. The streamed data is kept, other than for uncorrectable
+ * pages, which are read out again from the cache in buffer mode so they
+ * hold the same data a page read gives.
+ */
+static int read_continuous(
+    struct spi_nand*        nand,
+    uint32_t                page,
+    uint32_t                count,
+    uint8_t*                data,
+    uint8_t*                ecc)
+{
+    enum spi_nand_ecc result = SPI_NAND_ECC_OK;
+    uint8_t status = 0;
+    uint32_t run = 0;
+    uint32_t i = 0;
+
+    for(; count; page += run, count -= run, data += run * nand->page_size) {
+        run = nand->pages_per_block - page % nand->pages_per_block;
+        if(run > count) {
+            run = count;
+        }
+
+        if(set_continuous(nand, 1) < 0 ||
+           page_to_cache(nand, NAND_CMD_PAGE_READ, page, NULL) < 0 ||
+           read_cache(nand, 0, data, run * nand->page_size) < 0 ||
+           spi_nand_read_status(nand, &status) < 0) {
+            return -1;
+        }
+
+        if(!(status & NAND_STATUS_ECC_MASK)) {
+            if(ecc) {
+                memset(ecc, SPI_NAND_ECC_OK, run);
+                ecc += run;
+            }
+            continue;
+        }
+
+        if(set_continuous(nand, 0) < 0) {
+            return -1;
+        }
+
+        for(i = 0; i < run; ++i) {
+            if(page_to_cache(nand, NAND_CMD_PAGE_READ, page + i, &status) < 0) {
+                return -1;
+            }
+
+            result = note_ecc(nand, status);
+            if(result == SPI_NAND_ECC_UNCORRECTABLE &&
+               read_cache(nand, 0, &data[i * nand->page_size], nand->page_size) < 0) {
+                return -1;
+            }
+
+            if(ecc) {
+                *ecc++ = result;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Decode and count the ECC status of a page. The two bit field is
+ *        common to the known parts, and parts with a wider field still use
+ *        2 in these bits for uncorrectable pages
+ */
+static enum spi_nand_ecc note_ecc(
+    struct spi_nand*        nand,
+    uint8_t                 status)
+{
+    unsigned int field = (status & NAND_STATUS_ECC_MASK) >> NAND_STATUS_ECC_SHIFT;
+
+    if(field == NAND_STATUS_ECC_UNCORRECTABLE) {
+        nand->stats.ecc_failed++;
+        return SPI_NAND_ECC_UNCORRECTABLE;
+    }
+
+    if(field) {
+        nand->stats.ecc_corrected++;
+        return SPI_NAND_ECC_CORRECTED;
+    }
+
+    return SPI_NAND_ECC_OK;
+}
@@ -0,0 +1,203 @@
+/**
+ * SPI NAND flash access with page cache reads and ECC status
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef SPI_NAND_H
+#define SPI_NAND_H
+
+#include <stdint.h>
+
+#include "spi_bus.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** How a page's data came back from the on-die ECC */
+enum spi_nand_ecc {
+    SPI_NAND_ECC_OK,
+    SPI_NAND_ECC_CORRECTED,
+    SPI_NAND_ECC_UNCORRECTABLE,
+};
+
+/** Ways of reading a run of pages, slowest first */
+enum spi_nand_read_method {
+    /** Page read to cache, wait, read from cache, for each page */
+    SPI_NAND_READ_PAGE,
+    /** Cache read sequential (0x31): the next page is loaded from the
+     *  array while the current one is read out of the cache */
+    SPI_NAND_READ_CACHE,
+    /** Continuous read (Winbond BUF=0): one page read to cache, then the
+     *  following pages stream out of a single read from cache */
+    SPI_NAND_READ_CONTINUOUS,
+    SPI_NAND_READ_NUM,
+};
+
+/** Counters kept by the NAND engine */
+struct spi_nand_stats {
+    /** Page read to cache and cache read sequential commands issued */
+    unsigned long           page_reads;
+    unsigned long           cache_reads;
+    /** Read from cache commands issued */
+    unsigned long           cache_outputs;
+    /** Status register reads while waiting for the part */
+    unsigned long           status_polls;
+    /** Pages reported as corrected and as uncorrectable */
+    unsigned long           ecc_corrected;
+    unsigned long           ecc_failed;
+};
+
+/** A probed SPI NAND */
+struct spi_nand {
+    struct spi_bus*         bus;
+    uint8_t                 id[3];
+    const char*             name;
+    /** Data and spare bytes per page */
+    uint32_t                page_size;
+    uint32_t                oob_size;
+    uint32_t                pages_per_block;
+    uint32_t                blocks;
+    /** Data bytes in the array, not counting the spare areas */
+    uint64_t                size;
+    /** The read methods the part supports, a bit per method */
+    unsigned int            methods;
+    /** The method used by spi_nand_read(). Probing picks the fastest one,
+     *  a slower supported one may be set afterwards */
+    enum spi_nand_read_method read_method;
+    /** Read from cache command and the data lines it uses */
+    uint8_t                 read_opcode;
+    uint8_t                 data_nbits;
+    /** Data lines the device mode allows for receiving */
+    unsigned int            rx_lines;
+    /** Non-zero while the part is in continuous read mode */
+    int                     continuous;
+    /** One byte per block, non-zero if it's marked bad. NULL until
+     *  spi_nand_scan_bad_blocks() is called */
+    uint8_t*                bbt;
+    unsigned int            bad_blocks;
+    struct spi_nand_stats   stats;
+};
+
+/**
+ * @brief Reset and identify a SPI NAND, enable its on-die ECC and pick the
+ *        fastest read from cache command the device mode allows
+ *
+ * The geometry and read methods come from a table of known parts.
+ *
+ * @return 0 on success, -1 on failure with errno set (ENODEV if nothing
+ *         answered, ENOTSUP for an unknown part)
+ */
+int spi_nand_probe(
+    struct spi_nand*        nand,
+    struct spi_bus*         bus);
+
+/**
+ * @brief Return the part to its default buffer read mode and free the bad
+ *        block table
+ */
+void spi_nand_release(
+    struct spi_nand*        nand);
+
+/**
+ * @brief Read one page, or the start of it, including the spare area if
+ *        len is more than the page size
+ *
+ * @param ecc - Optional pointer to store the page's ECC status
+ *
+ * @return 0 on success, -1 on failure with errno set. An uncorrectable page
+ *         isn't a failure, check ecc
+ */
+int spi_nand_read_page(
+    struct spi_nand*        nand,
+    uint32_t                page,
+    void*                   buf,
+    uint32_t                len,
+    enum spi_nand_ecc*      ecc);
+
+/**
+ * @brief Read the data areas of a run of pages with the selected read
+ *        method
+ *
+ * In continuous mode the part only reports the worst ECC status of the
+ * run, so a run with errors is read again a page at a time to find them.
+ *
+ * @param buf - count * page_size bytes
+ * @param ecc - Optional array of count entries to store each page's ECC
+ *              status in (enum spi_nand_ecc)
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int spi_nand_read(
+    struct spi_nand*        nand,
+    uint32_t                page,
+    uint32_t                count,
+    void*                   buf,
+    uint8_t*                ecc);
+
+/**
+ * @brief Build the bad block table from the factory markers: a block is
+ *        bad if the first spare byte of its first page isn't 0xff
+ *
+ * @return The number of bad blocks, or -1 on failure with errno set
+ */
+int spi_nand_scan_bad_blocks(
+    struct spi_nand*        nand);
+
+/**
+ * @brief Read the status register
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int spi_nand_read_status(
+    struct spi_nand*        nand,
+    uint8_t*                status);
+
+/**
+ * @brief Wait for the part to finish an operation
+ *
+ * @param status - Optional pointer to store the final status in
+ * @param timeout_us - How long to wait before failing with ETIMEDOUT
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int spi_nand_wait_ready(
+    struct spi_nand*        nand,
+    uint8_t*                status,
+    uint64_t                timeout_us);
+
+/**
+ * @brief Get the name of a read method, e.g. "continuous"
+ */
+const char* spi_nand_read_method_name(
+    enum spi_nand_read_method method);
+
+/**
+ * @brief Get the name of an ECC status, e.g. "corrected"
+ */
+const char* spi_nand_ecc_name(
+    enum spi_nand_ecc       ecc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SPI_NAND_H */
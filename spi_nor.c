@@ -0,0 +1,1109 @@
+/**
+ * SPI NOR flash access with JEDEC ID and SFDP discovery
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "spi_nor.h"
+
+#define NOR_CMD_PP                      0x02
+#define NOR_CMD_PP_4B                   0x12
+#define NOR_CMD_RDSR                    0x05
+#define NOR_CMD_WREN                    0x06
+#define NOR_CMD_FAST_READ               0x0b
+#define NOR_CMD_SE                      0x20
+#define NOR_CMD_RDSR2                   0x35
+#define NOR_CMD_RDSR3_QE                0x3f
+#define NOR_CMD_SFDP                    0x5a
+#define NOR_CMD_RDID                    0x9f
+#define NOR_CMD_EN4B                    0xb7
+#define NOR_CMD_CE                      0xc7
+#define NOR_CMD_BE64                    0xd8
+#define NOR_CMD_EX4B                    0xe9
+
+#define NOR_SR_WIP                      0x01
+
+/** Per block state used by spi_nor_update() */
+#define BLOCK_UNCHANGED                 0
+#define BLOCK_PROGRAM                   1
+#define BLOCK_ERASE                     2
+
+/** Quad Enable requirements (JESD216B DWORD 15 bits 22:20) */
+#define QER_NONE                        0
+#define QER_SR2_BIT1_NO_RDSR2           1
+#define QER_SR1_BIT6                    2
+#define QER_SR2_BIT7                    3
+#define QER_SR2_BIT1                    4
+#define QER_SR2_BIT1_RDSR2              5
+#define QER_SR2_BIT1_WRSR2              6
+/** Our marker for tables too old to say */
+#define QER_UNKNOWN                     0xff
+
+#define SFDP_SIGNATURE                  0x50444653
+#define SFDP_MAX_HEADERS                16
+/** Parameter IDs of the basic flash parameter table and the 4-byte address
+ *  instruction table */
+#define SFDP_ID_BFPT                    0xff00
+#define SFDP_ID_4BAIT                   0xff84
+/** DWORDs of the basic flash parameter table that are used */
+#define SFDP_BFPT_DWORDS                16
+
+/** Parts larger than this need 4-byte addresses */
+#define NOR_3B_LIMIT                    (16ull << 20)
+#define NOR_DEFAULT_PAGE_SIZE           256
+/** Worst case program and erase times of common parts, with margin */
+#define NOR_PROGRAM_TIMEOUT_US          10000ull
+#define NOR_ERASE_TIMEOUT_US            5000000ull
+#define NOR_CHIP_ERASE_US_PER_MB        15000000ull
+/** Status polls back off to a quarter of the time waited so far, within
+ *  these limits, so short page programs are caught quickly without polling
+ *  a long erase thousands of times */
+#define NOR_POLL_MIN_US                 10
+#define NOR_POLL_MAX_US                 2000
+#define NOR_POLL_BACKOFF_SHIFT          2
+/** Buffer used when verifying */
+#define NOR_VERIFY_CHUNK                65536
+
+static int nor_write_enable(
+    struct spi_nor*         nor);
+
+static int read_sfdp(
+    struct spi_nor*         nor,
+    uint32_t                addr,
+    void*                   buf,
+    uint32_t                len);
+
+static int parse_sfdp(
+    struct spi_nor*         nor);
+
+static void parse_bfpt(
+    struct spi_nor*         nor,
+    const uint32_t*         dw,
+    unsigned int            count,
+    uint8_t*                erase_opcodes,
+    unsigned int*           qer);
+
+static void parse_4bait(
+    struct spi_nor*         nor,
+    const uint32_t*         dw,
+    unsigned int            count,
+    const uint8_t*          erase_opcodes);
+
+static int check_quad_enable(
+    struct spi_nor*         nor,
+    unsigned int            qer);
+
+static int guess_from_id(
+    struct spi_nor*         nor);
+
+static int setup_addressing(
+    struct spi_nor*         nor);
+
+static void choose_read(
+    struct spi_nor*         nor);
+
+static int read_usable(
+    struct spi_nor*         nor,
+    const struct spi_nor_read_op* op);
+
+static uint32_t nor_read_chunk(
+    struct spi_nor*         nor);
+
+static unsigned int put_addr(
+    struct spi_nor*         nor,
+    uint8_t*                buf,
+    uint64_t                addr);
+
+static void add_erase_type(
+    struct spi_nor*         nor,
+    uint32_t                size,
+    uint8_t                 opcode);
+
+static int all_ff(
+    const uint8_t*          buf,
+    uint32_t                len);
+
+static void promote_erases(
+    struct spi_nor*         nor,
+    uint8_t*                state,
+    uint64_t                start,
+    uint64_t                blocks);
+
+static uint32_t get_le32(
+    const uint8_t*          buf);
+
+static const char* const read_mode_names[SPI_NOR_READ_NUM] = {
+    [SPI_NOR_READ_1_1_1] = "1-1-1",
+    [SPI_NOR_READ_1_1_2] = "1-1-2",
+    [SPI_NOR_READ_1_2_2] = "1-2-2",
+    [SPI_NOR_READ_1_1_4] = "1-1-4",
+    [SPI_NOR_READ_1_4_4] = "1-4-4",
+};
+
+int spi_nor_probe(
+    struct spi_nor*         nor,
+    struct spi_bus*         bus)
+{
+    const uint8_t rdid = NOR_CMD_RDID;
+
+    memset(nor, 0, sizeof(*nor));
+    nor->bus = bus;
+
+    if(spi_bus_command(nor->bus, &rdid, 1, nor->id, sizeof(nor->id)) < 0) {
+        return -1;
+    }
+
+    /* A floating or shorted MISO line */
+    if((nor->id[0] == 0xff && nor->id[1] == 0xff && nor->id[2] == 0xff) ||
+       (nor->id[0] == 0x00 && nor->id[1] == 0x00 && nor->id[2] == 0x00)) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    /* Every part takes a plain fast read, 3-byte page program and 3-byte
+     * chip erase */
+    nor->reads[SPI_NOR_READ_1_1_1].supported = 1;
+    nor->reads[SPI_NOR_READ_1_1_1].opcode = NOR_CMD_FAST_READ;
+    nor->reads[SPI_NOR_READ_1_1_1].addr_nbits = 1;
+    nor->reads[SPI_NOR_READ_1_1_1].data_nbits = 1;
+    nor->reads[SPI_NOR_READ_1_1_1].dummy_clocks = 8;
+    nor->program_opcode = NOR_CMD_PP;
+    nor->page_size = NOR_DEFAULT_PAGE_SIZE;
+    nor->addr_len = 3;
+
+    if(parse_sfdp(nor) < 0) {
+        if(errno != ENOENT || guess_from_id(nor) < 0) {
+            return -1;
+        }
+    }
+
+    if(!nor->size || !nor->erase_count) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    if(setup_addressing(nor) < 0 ||
+       spi_bus_get_lines(bus, &nor->tx_lines, &nor->rx_lines) < 0) {
+        return -1;
+    }
+
+    choose_read(nor);
+
+    return 0;
+}
+
+void spi_nor_release(
+    struct spi_nor*         nor)
+{
+    const uint8_t ex4b = NOR_CMD_EX4B;
+
+    if(nor->addr4_mode) {
+        /* Firmware booting from the part expects 3-byte addresses */
+        spi_bus_command(nor->bus, &ex4b, 1, NULL, 0);
+        nor->addr4_mode = 0;
+    }
+}
+
+int spi_nor_read(
+    struct spi_nor*         nor,
+    uint64_t                addr,
+    void*                   buf,
+    uint64_t                len)
+{
+    const struct spi_nor_read_op* op = &nor->reads[nor->read_mode];
+    struct spi_xfer xfers[3];
+    uint8_t cmd[32] = {0};
+    uint32_t chunk = nor_read_chunk(nor);
+    uint32_t piece = 0;
+    unsigned int dummy = op->dummy_clocks * op->addr_nbits / 8;
+    unsigned int n = 0;
+
+    if(addr > nor->size || len > nor->size - addr) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The opcode always goes on one line. The address and dummy bytes go
+     * with it unless they use more lines, then the data comes in on its
+     * own lines. The mode bits are sent as 1s, which never select a
+     * continuous read mode */
+    memset(xfers, 0, sizeof(xfers));
+    xfers[0].tx = cmd;
+    if(op->addr_nbits > 1) {
+        xfers[0].len = 1;
+        xfers[1].tx = &cmd[1];
+        xfers[1].len = nor->addr_len + dummy;
+        xfers[1].tx_nbits = op->addr_nbits;
+        n = 2;
+    } else {
+        xfers[0].len = 1 + nor->addr_len + dummy;
+        n = 1;
+    }
+    xfers[n].rx_nbits = op->data_nbits;
+
+    cmd[0] = op->opcode;
+    memset(&cmd[1 + nor->addr_len], 0xff, dummy);
+
+    while(len) {
+        piece = len < chunk ? (uint32_t)len : chunk;
+
+        /* Each read is a command with its own address, so it fits in a
+         * single message and doesn't depend on the device staying selected
+         * between messages */
+        put_addr(nor, &cmd[1], addr);
+        xfers[n].rx = buf;
+        xfers[n].len = piece;
+
+        if(spi_bus_transfer(nor->bus, xfers, n + 1) < 0) {
+            return -1;
+        }
+
+        nor->stats.reads++;
+        buf = (uint8_t*)buf + piece;
+        addr += piece;
+        len -= piece;
+    }
+
+    return 0;
+}
+
+int spi_nor_erase(
+    struct spi_nor*         nor,
+    uint64_t                addr,
+    uint64_t                len)
+{
+    const struct spi_nor_erase_type* type = NULL;
+    uint8_t cmd[5] = {0};
+    unsigned int cmd_len = 0;
+    unsigned int i = 0;
+
+    if(addr > nor->size || len > nor->size - addr ||
+       addr % nor->erase[0].size || len % nor->erase[0].size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while(len) {
+        /* The largest erase that starts here and doesn't go past the end */
+        for(i = nor->erase_count; i-- > 0;) {
+            type = &nor->erase[i];
+            if(addr % type->size == 0 && len >= type->size) {
+                break;
+            }
+        }
+
+        cmd[0] = type->opcode;
+        cmd_len = 1 + put_addr(nor, &cmd[1], addr);
+
+        if(nor_write_enable(nor) < 0 ||
+           spi_bus_command(nor->bus, cmd, cmd_len, NULL, 0) < 0 ||
+           spi_nor_wait_ready(nor, NOR_ERASE_TIMEOUT_US) < 0) {
+            return -1;
+        }
+
+        nor->stats.erases++;
+        addr += type->size;
+        len -= type->size;
+    }
+
+    return 0;
+}
+
+int spi_nor_erase_chip(
+    struct spi_nor*         nor)
+{
+    const uint8_t ce = NOR_CMD_CE;
+    uint64_t timeout = (nor->size >> 20) * NOR_CHIP_ERASE_US_PER_MB;
+
+    if(nor_write_enable(nor) < 0 ||
+       spi_bus_command(nor->bus, &ce, 1, NULL, 0) < 0) {
+        return -1;
+    }
+
+    nor->stats.erases++;
+
+    return spi_nor_wait_ready(nor, timeout > NOR_ERASE_TIMEOUT_US ? timeout :
+                                                                    NOR_ERASE_TIMEOUT_US);
+}
+
+int spi_nor_program(
+    struct spi_nor*         nor,
+    uint64_t                addr,
+    const void*             buf,
+    uint64_t                len)
+{
+    struct spi_xfer xfers[2];
+    uint8_t cmd[5] = {0};
+    uint32_t piece = 0;
+
+    if(addr > nor->size || len > nor->size - addr) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(xfers, 0, sizeof(xfers));
+    xfers[0].tx = cmd;
+    xfers[0].len = 1 + nor->addr_len;
+
+    while(len) {
+        /* A page program wraps within the page, so stop at its end */
+        piece = nor->page_size - (uint32_t)(addr % nor->page_size);
+        if(piece > len) {
+            piece = (uint32_t)len;
+        }
+
+        /* Programming 0xff leaves erased bits as they are */
+        if(!all_ff(buf, piece)) {
+            cmd[0] = nor->program_opcode;
+            put_addr(nor, &cmd[1], addr);
+            xfers[1].tx = buf;
+            xfers[1].len = piece;
+
+            if(nor_write_enable(nor) < 0 ||
+               spi_bus_transfer(nor->bus, xfers, 2) < 0 ||
+               spi_nor_wait_ready(nor, NOR_PROGRAM_TIMEOUT_US) < 0) {
+                return -1;
+            }
+
+            nor->stats.programs++;
+        }
+
+        buf = (const uint8_t*)buf + piece;
+        addr += piece;
+        len -= piece;
+    }
+
+    return 0;
+}
+
+int spi_nor_update(
+    struct spi_nor*         nor,
+    uint64_t                addr,
+    const void*             buf,
+    uint64_t                len,
+    struct spi_nor_update_result* result)
+{
+    struct spi_nor_update_result res;
+    uint32_t granule = nor->erase[0].size;
+    uint8_t* cur = NULL;
+    uint8_t* want = NULL;
+    uint8_t* state = NULL;
+    uint64_t start = 0;
+    uint64_t blocks = 0;
+    uint64_t first = 0;
+    uint64_t i = 0;
+    unsigned long programs = nor->stats.programs;
+    int ret = -1;
+
+    memset(&res, 0, sizeof(res));
+
+    if(addr > nor->size || len > nor->size - addr) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    start = addr - addr % granule;
+    blocks = (addr + len - start + granule - 1) / granule;
+
+    cur = malloc(blocks * granule);
+    want = malloc(blocks * granule);
+    state = malloc(blocks);
+    if(!cur || !want || !state) {
+        goto out;
+    }
+
+    if(spi_nor_read(nor, start, cur, blocks * granule) < 0) {
+        goto out;
+    }
+
+    memcpy(want, cur, blocks * granule);
+    memcpy(&want[addr - start], buf, len);
+
+    for(i = 0; i < blocks; ++i) {
+        if(memcmp(&cur[i * granule], &want[i * granule], granule) == 0) {
+            state[i] = BLOCK_UNCHANGED;
+        } else if(all_ff(&cur[i * granule], granule)) {
+            state[i] = BLOCK_PROGRAM;
+        } else {
+            state[i] = BLOCK_ERASE;
+        }
+    }
+
+    promote_erases(nor, state, start, blocks);
+
+    /* Erase each run of blocks, spi_nor_erase() picking the largest erases
+     * that fit */
+    for(i = 0; i < blocks; ++i) {
+        if(state[i] != BLOCK_ERASE) {
+            continue;
+        }
+
+        for(first = i; i < blocks && state[i] == BLOCK_ERASE; ++i);
+
+        if(spi_nor_erase(nor, start + first * granule, (i - first) * granule) < 0) {
+            goto out;
+        }
+    }
+
+    for(i = 0; i < blocks; ++i) {
+        switch(state[i]) {
+            case BLOCK_UNCHANGED:
+                res.unchanged++;
+                continue;
+            case BLOCK_PROGRAM:
+                res.programmed++;
+                break;
+            default:
+                res.erased++;
+                break;
+        }
+
+        if(spi_nor_program(nor, start + i * granule, &want[i * granule], granule) < 0) {
+            goto out;
+        }
+    }
+
+    ret = 0;
+
+out:
+    res.pages = nor->stats.programs - programs;
+    if(result) {
+        *result = res;
+    }
+
+    free(state);
+    free(want);
+    free(cur);
+
+    return ret;
+}
+
+int spi_nor_verify(
+    struct spi_nor*         nor,
+    uint64_t                addr,
+    const void*             buf,
+    uint64_t                len,
+    uint64_t*               mismatch)
+{
+    const uint8_t* expected = buf;
+    uint8_t* data = NULL;
+    uint64_t pos = 0;
+    uint32_t piece = 0;
+    uint32_t i = 0;
+    int ret = 0;
+
+    data = malloc(NOR_VERIFY_CHUNK);
+    if(!data) {
+        return -1;
+    }
+
+    for(pos = 0; pos < len && ret == 0; pos += piece) {
+        piece = len - pos < NOR_VERIFY_CHUNK ? (uint32_t)(len - pos) : NOR_VERIFY_CHUNK;
+
+        if(spi_nor_read(nor, addr + pos, data, piece) < 0) {
+            ret = -1;
+            break;
+        }
+
+        if(memcmp(data, &expected[pos], piece) != 0) {
+            for(i = 0; data[i] == expected[pos + i]; ++i);
+            if(mismatch) {
+                *mismatch = addr + pos + i;
+            }
+            ret = 1;
+        }
+    }
+
+    free(data);
+
+    return ret;
+}
+
+int spi_nor_read_status(
+    struct spi_nor*         nor,
+    uint8_t*                status)
+{
+    const uint8_t rdsr = NOR_CMD_RDSR;
+
+    return spi_bus_command(nor->bus, &rdsr, 1, status, 1);
+}
+
+int spi_nor_wait_ready(
+    struct spi_nor*         nor,
+    uint64_t                timeout_us)
+{
+    uint64_t begin = spi_bus_time_ns(nor->bus);
+    uint64_t waited_us = 0;
+    uint64_t poll_us = 0;
+    uint8_t status = 0;
+
+    for(;;) {
+        if(spi_nor_read_status(nor, &status) < 0) {
+            return -1;
+        }
+
+        nor->stats.status_polls++;
+        if(!(status & NOR_SR_WIP)) {
+            return 0;
+        }
+
+        waited_us = (spi_bus_time_ns(nor->bus) - begin) / 1000;
+        if(waited_us > timeout_us) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        poll_us = waited_us >> NOR_POLL_BACKOFF_SHIFT;
+        if(poll_us < NOR_POLL_MIN_US) {
+            poll_us = NOR_POLL_MIN_US;
+        } else if(poll_us > NOR_POLL_MAX_US) {
+            poll_us = NOR_POLL_MAX_US;
+        }
+
+        spi_bus_delay(nor->bus, (unsigned long)poll_us);
+    }
+}
+
+const char* spi_nor_read_mode_name(
+    enum spi_nor_read_mode  mode)
+{
+    return mode < SPI_NOR_READ_NUM ? read_mode_names[mode] : "unknown";
+}
+
+static int nor_write_enable(
+    struct spi_nor*         nor)
+{
+    const uint8_t wren = NOR_CMD_WREN;
+
+    return spi_bus_command(nor->bus, &wren, 1, NULL, 0);
+}
+
+static int read_sfdp(
+    struct spi_nor*         nor,
+    uint32_t                addr,
+    void*                   buf,
+    uint32_t                len)
+{
+    /* Always a 3-byte address and 8 dummy clocks, whatever the part's
+     * address mode */
+    uint8_t cmd[5] = {
+        NOR_CMD_SFDP,
+        (addr >> 16) & 0xff,
+        (addr >> 8) & 0xff,
+        addr & 0xff,
+        0,
+    };
+
+    return spi_bus_command(nor->bus, cmd, sizeof(cmd), buf, len);
+}
+
+/**
+ * @brief Read the SFDP header and the parameter tables we use
+ *
+ * @return 0 on success, -1 with errno set to ENOENT if the part has no SFDP
+ *         or to something else on failure
+ */
+static int parse_sfdp(
+    struct spi_nor*         nor)
+{
+    uint8_t header[8] = {0};
+    uint8_t params[SFDP_MAX_HEADERS * 8] = {0};
+    uint8_t table[SFDP_BFPT_DWORDS * 4] = {0};
+    uint32_t dw[SFDP_BFPT_DWORDS] = {0};
+    uint8_t erase_opcodes[SPI_NOR_MAX_ERASE_TYPES] = {0};
+    const uint8_t* param = NULL;
+    unsigned int nph = 0;
+    unsigned int count = 0;
+    unsigned int id = 0;
+    unsigned int i = 0;
+    unsigned int j = 0;
+    uint32_t ptr = 0;
+    unsigned int qer = QER_UNKNOWN;
+    int have_bfpt = 0;
+
+    if(read_sfdp(nor, 0, header, sizeof(header)) < 0) {
+        return -1;
+    }
+
+    if(get_le32(header) != SFDP_SIGNATURE) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    nph = header[6] + 1u;
+    if(nph > SFDP_MAX_HEADERS) {
+        nph = SFDP_MAX_HEADERS;
+    }
+
+    if(read_sfdp(nor, sizeof(header), params, nph * 8) < 0) {
+        return -1;
+    }
+
+    for(i = 0; i < nph; ++i) {
+        param = &params[i * 8];
+        id = (param[7] << 8) | param[0];
+        ptr = param[4] | (param[5] << 8) | ((uint32_t)param[6] << 16);
+        count = param[3] < SFDP_BFPT_DWORDS ? param[3] : SFDP_BFPT_DWORDS;
+
+        /* Only the first basic table counts, later ones are vendor
+         * alternatives */
+        if((id == SFDP_ID_BFPT && !have_bfpt) || id == SFDP_ID_4BAIT) {
+            if(!count || read_sfdp(nor, ptr, table, count * 4) < 0) {
+                return -1;
+            }
+            for(j = 0; j < count; ++j) {
+                dw[j] = get_le32(&table[j * 4]);
+            }
+        }
+
+        if(id == SFDP_ID_BFPT && !have_bfpt) {
+            nor->sfdp_rev = (param[2] << 8) | param[1];
+            parse_bfpt(nor, dw, count, erase_opcodes, &qer);
+            have_bfpt = 1;
+        } else if(id == SFDP_ID_4BAIT && have_bfpt) {
+            parse_4bait(nor, dw, count, erase_opcodes);
+        }
+    }
+
+    if(!have_bfpt) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    nor->sfdp = 1;
+
+    if((nor->reads[SPI_NOR_READ_1_1_4].supported ||
+        nor->reads[SPI_NOR_READ_1_4_4].supported) &&
+       check_quad_enable(nor, qer) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Check the Quad Enable bit where the part has one, marking the quad
+ *        reads unusable if it's clear
+ */
+static int check_quad_enable(
+    struct spi_nor*         nor,
+    unsigned int            qer)
+{
+    uint8_t cmd = 0;
+    uint8_t bit = 0;
+    uint8_t status = 0;
+
+    switch(qer) {
+        case QER_NONE:
+            return 0;
+        case QER_SR1_BIT6:
+            cmd = NOR_CMD_RDSR;
+            bit = 0x40;
+            break;
+        case QER_SR2_BIT7:
+            cmd = NOR_CMD_RDSR3_QE;
+            bit = 0x80;
+            break;
+        case QER_SR2_BIT1:
+        case QER_SR2_BIT1_RDSR2:
+        case QER_SR2_BIT1_WRSR2:
+            cmd = NOR_CMD_RDSR2;
+            bit = 0x02;
+            break;
+        default:
+            /* No way to read status register 2, or a table too old to say
+             * where the bit is */
+            nor->quad_disabled = 1;
+            return 0;
+    }
+
+    if(spi_bus_command(nor->bus, &cmd, 1, &status, 1) < 0) {
+        return -1;
+    }
+
+    nor->quad_disabled = !(status & bit);
+
+    return 0;
+}
+
+/**
+ * @brief Read one 16 bit fast read description (JESD216 DWORDs 3 and 4)
+ */
+static void parse_read(
+    struct spi_nor_read_op* op,
+    uint16_t                desc,
+    uint8_t                 addr_nbits,
+    uint8_t                 data_nbits)
+{
+    op->opcode = desc >> 8;
+    op->addr_nbits = addr_nbits;
+    op->data_nbits = data_nbits;
+    /* Mode clocks are just more dummy clocks to us */
+    op->dummy_clocks = (desc & 0x1f) + ((desc >> 5) & 0x07);
+    op->supported = op->opcode != 0;
+}
+
+static void parse_bfpt(
+    struct spi_nor*         nor,
+    const uint32_t*         dw,
+    unsigned int            count,
+    uint8_t*                erase_opcodes,
+    unsigned int*           qer)
+{
+    unsigned int shift = 0;
+    unsigned int i = 0;
+
+    if(count < 2) {
+        return;
+    }
+
+    /* Density in bits, either N - 1 or 2^N */
+    if(dw[1] & 0x80000000) {
+        shift = dw[1] & 0x7fffffff;
+        nor->size = shift >= 3 && shift < 64 ? 1ull << (shift - 3) : 0;
+    } else {
+        nor->size = ((uint64_t)dw[1] + 1) / 8;
+    }
+
+    /* 3 or 4 byte addressing. Parts that take either power up in 3-byte
+     * mode, which is enough for the first 16MB */
+    nor->addr_len = ((dw[0] >> 17) & 0x3) == 2 || nor->size > NOR_3B_LIMIT ? 4 : 3;
+
+    if(count >= 4) {
+        if(dw[0] & (1u << 16)) {
+            parse_read(&nor->reads[SPI_NOR_READ_1_1_2], dw[3] & 0xffff, 1, 2);
+        }
+        if(dw[0] & (1u << 20)) {
+            parse_read(&nor->reads[SPI_NOR_READ_1_2_2], dw[3] >> 16, 2, 2);
+        }
+        if(dw[0] & (1u << 21)) {
+            parse_read(&nor->reads[SPI_NOR_READ_1_4_4], dw[2] & 0xffff, 4, 4);
+        }
+        if(dw[0] & (1u << 22)) {
+            parse_read(&nor->reads[SPI_NOR_READ_1_1_4], dw[2] >> 16, 1, 4);
+        }
+    }
+
+    if(count >= 9) {
+        for(i = 0; i < SPI_NOR_MAX_ERASE_TYPES; ++i) {
+            shift = (dw[7 + i / 2] >> (16 * (i % 2))) & 0xff;
+            erase_opcodes[i] = (dw[7 + i / 2] >> (16 * (i % 2) + 8)) & 0xff;
+            if(shift && shift < 32) {
+                add_erase_type(nor, 1u << shift, erase_opcodes[i]);
+            }
+        }
+    }
+
+    /* Revision A tables only describe the 4K erase */
+    if(!nor->erase_count && (dw[0] & 0x3) == 0x1) {
+        add_erase_type(nor, 4096, (dw[0] >> 8) & 0xff);
+    }
+
+    if(count >= 11) {
+        nor->page_size = 1u << ((dw[10] >> 4) & 0xf);
+    }
+
+    *qer = count >= 15 ? (dw[14] >> 20) & 0x7 : QER_UNKNOWN;
+
+    /* How to enter 4-byte mode: B7, or write enable then B7 */
+    if(count >= 16 && !(dw[15] & (1u << 24)) && (dw[15] & (1u << 25))) {
+        nor->addr4_wren = 1;
+    }
+}
+
+/**
+ * @brief Use the 4-byte opcodes from the 4-byte address instruction table,
+ *        if they cover programming and every erase type
+ *
+ * @param erase_opcodes - The erase opcodes in the basic table's order, which
+ *                        is the order the table's support bits use
+ */
+static void parse_4bait(
+    struct spi_nor*         nor,
+    const uint32_t*         dw,
+    unsigned int            count,
+    const uint8_t*          erase_opcodes)
+{
+    /* Support bit and opcode of the 4-byte version of each read mode */
+    static const struct {
+        enum spi_nor_read_mode mode;
+        unsigned int bit;
+        uint8_t opcode;
+    } reads_4b[] = {
+        { SPI_NOR_READ_1_1_1, 1, 0x0c },
+        { SPI_NOR_READ_1_1_2, 2, 0x3c },
+        { SPI_NOR_READ_1_2_2, 3, 0xbc },
+        { SPI_NOR_READ_1_1_4, 4, 0x6c },
+        { SPI_NOR_READ_1_4_4, 5, 0xec },
+    };
+    uint8_t opcodes[SPI_NOR_MAX_ERASE_TYPES] = {0};
+    unsigned int i = 0;
+    unsigned int j = 0;
+
+    if(count < 2 || nor->size <= NOR_3B_LIMIT || !(dw[0] & (1u << 1)) ||
+       !(dw[0] & (1u << 6))) {
+        return;
+    }
+
+    for(i = 0; i < nor->erase_count; ++i) {
+        for(j = 0; j < SPI_NOR_MAX_ERASE_TYPES; ++j) {
+            if(erase_opcodes[j] == nor->erase[i].opcode) {
+                break;
+            }
+        }
+        if(j == SPI_NOR_MAX_ERASE_TYPES || !(dw[0] & (1u << (9 + j)))) {
+            /* An erase without a 4-byte version, so use the address mode */
+            return;
+        }
+        opcodes[i] = (dw[1] >> (8 * j)) & 0xff;
+    }
+
+    for(i = 0; i < nor->erase_count; ++i) {
+        nor->erase[i].opcode = opcodes[i];
+    }
+
+    for(i = 0; i < sizeof(reads_4b) / sizeof(reads_4b[0]); ++i) {
+        nor->reads[reads_4b[i].mode].opcode = reads_4b[i].opcode;
+        if(!(dw[0] & (1u << reads_4b[i].bit))) {
+            nor->reads[reads_4b[i].mode].supported = 0;
+        }
+    }
+
+    nor->program_opcode = NOR_CMD_PP_4B;
+    nor->opcodes_4b = 1;
+}
+
+/**
+ * @brief Fill in the geometry of a part without SFDP from its JEDEC ID. Most
+ *        vendors encode the size as a power of 2 in the last byte
+ */
+static int guess_from_id(
+    struct spi_nor*         nor)
+{
+    unsigned int order = nor->id[2];
+
+    /* 0x20 and up continue from 64MB (2^26) on */
+    if(order >= 0x20 && order <= 0x22) {
+        order -= 6;
+    }
+
+    if(order < 16 || order > 28) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    nor->size = 1ull << order;
+    nor->addr_len = nor->size > NOR_3B_LIMIT ? 4 : 3;
+    add_erase_type(nor, 4096, NOR_CMD_SE);
+    add_erase_type(nor, 65536, NOR_CMD_BE64);
+
+    return 0;
+}
+
+/**
+ * @brief Put parts over 16MB without 4-byte opcodes in 4-byte address mode
+ */
+static int setup_addressing(
+    struct spi_nor*         nor)
+{
+    const uint8_t en4b = NOR_CMD_EN4B;
+
+    if(nor->addr_len == 3 || nor->opcodes_4b) {
+        return 0;
+    }
+
+    if(nor->addr4_wren && nor_write_enable(nor) < 0) {
+        return -1;
+    }
+
+    if(spi_bus_command(nor->bus, &en4b, 1, NULL, 0) < 0) {
+        return -1;
+    }
+
+    nor->addr4_mode = 1;
+
+    return 0;
+}
+
+/**
+ * @brief Pick the read mode that moves a full sized read in the fewest
+ *        clocks, counting the command, address and dummy phases
+ */
+static void choose_read(
+    struct spi_nor*         nor)
+{
+    const struct spi_nor_read_op* op = NULL;
+    uint64_t chunk = nor_read_chunk(nor);
+    uint64_t clocks = 0;
+    uint64_t best = UINT64_MAX;
+    unsigned int i = 0;
+
+    for(i = 0; i < SPI_NOR_READ_NUM; ++i) {
+        op = &nor->reads[i];
+        if(!read_usable(nor, op)) {
+            continue;
+        }
+
+        clocks = 8 + nor->addr_len * 8 / op->addr_nbits + op->dummy_clocks +
+                 chunk * 8 / op->data_nbits;
+        if(clocks < best) {
+            best = clocks;
+            nor->read_mode = i;
+        }
+    }
+}
+
+/**
+ * @brief Check whether a read mode can be used: the device mode has to
+ *        allow its lines, and as spidev transfers are in bytes its mode and
+ *        dummy cycles have to make up whole bytes
+ */
+static int read_usable(
+    struct spi_nor*         nor,
+    const struct spi_nor_read_op* op)
+{
+    if(!op->supported || op->addr_nbits > nor->tx_lines ||
+       op->data_nbits > nor->rx_lines ||
+       (op->dummy_clocks * op->addr_nbits) % 8) {
+        return 0;
+    }
+
+    return op->data_nbits < 4 || !nor->quad_disabled;
+}
+
+/**
+ * @brief The most data a single read command fetches: a whole spidev
+ *        buffer, so that each read is one message
+ */
+static uint32_t nor_read_chunk(
+    struct spi_nor*         nor)
+{
+    uint32_t bufsiz = nor->bus->bufsiz;
+
+    return bufsiz >= SPI_BUS_DMA_ALIGN ? bufsiz - bufsiz % SPI_BUS_DMA_ALIGN : bufsiz;
+}
+
+/**
+ * @brief Store an address in the part's address length, msb first
+ *
+ * @return The number of address bytes
+ */
+static unsigned int put_addr(
+    struct spi_nor*         nor,
+    uint8_t*                buf,
+    uint64_t                addr)
+{
+    unsigned int i = 0;
+
+    for(i = 0; i < nor->addr_len; ++i) {
+        buf[i] = (addr >> (8 * (nor->addr_len - 1 - i))) & 0xff;
+    }
+
+    return nor->addr_len;
+}
+
+/**
+ * @brief Add an erase type, keeping the list sorted smallest first
+ */
+static void add_erase_type(
+    struct spi_nor*         nor,
+    uint32_t                size,
+    uint8_t                 opcode)
+{
+    unsigned int i = 0;
+
+    if(nor->erase_count == SPI_NOR_MAX_ERASE_TYPES || !opcode) {
+        return;
+    }
+
+    for(i = nor->erase_count; i > 0 && nor->erase[i - 1].size > size; --i) {
+        nor->erase[i] = nor->erase[i - 1];
+    }
+
+    nor->erase[i].size = size;
+    nor->erase[i].opcode = opcode;
+    nor->erase_count++;
+}
+
+/**
+ * @brief Check whether a buffer is all 0xff, i.e. erased
+ */
+static int all_ff(
+    const uint8_t*          buf,
+    uint32_t                len)
+{
+    uint32_t i = 0;
+
+    for(i = 0; i < len; ++i) {
+        if(buf[i] != 0xff) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Erase whole larger erase blocks when at least half of the smallest
+ *        blocks in them need erasing. The rest of such a block is put back
+ *        by programming, which is cheaper than the extra small erases
+ */
+static void promote_erases(
+    struct spi_nor*         nor,
+    uint8_t*                state,
+    uint64_t                start,
+    uint64_t                blocks)
+{
+    uint32_t granule = nor->erase[0].size;
+    uint64_t per = 0;
+    uint64_t first = 0;
+    uint64_t count = 0;
+    uint64_t i = 0;
+    unsigned int type = 0;
+
+    for(type = nor->erase_count; type-- > 1;) {
+        per = nor->erase[type].size / granule;
+
+        /* Only blocks that lie wholly within the range that was read */
+        first = (start + nor->erase[type].size - 1) / nor->erase[type].size *
+                nor->erase[type].size;
+        for(first = (first - start) / granule; first + per <= blocks; first += per) {
+            for(i = first, count = 0; i < first + per; ++i) {
+                count += state[i] == BLOCK_ERASE;
+            }
+
+            if(count * 2 >= per) {
+                memset(&state[first], BLOCK_ERASE, per);
+            }
+        }
+    }
+}
+
+static uint32_t get_le32(
+    const uint8_t*          buf)
+{
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
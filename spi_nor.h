@@ -0,0 +1,263 @@
+/**
+ * SPI NOR flash access with JEDEC ID and SFDP discovery
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef SPI_NOR_H
+#define SPI_NOR_H
+
+#include <stdint.h>
+
+#include "spi_bus.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Most erase types SFDP can describe */
+#define SPI_NOR_MAX_ERASE_TYPES         4
+
+/** The read commands a part can advertise, named by the lines used for the
+ *  command, address and data. The dual and quad ones are used when the
+ *  device mode enables SPI_TX/RX_DUAL or QUAD (see spi_bus_set_lines()) */
+enum spi_nor_read_mode {
+    SPI_NOR_READ_1_1_1,
+    SPI_NOR_READ_1_1_2,
+    SPI_NOR_READ_1_2_2,
+    SPI_NOR_READ_1_1_4,
+    SPI_NOR_READ_1_4_4,
+    SPI_NOR_READ_NUM,
+};
+
+/** A read command */
+struct spi_nor_read_op {
+    /** Non-zero if the part supports this mode */
+    uint8_t                 supported;
+    uint8_t                 opcode;
+    /** Lines used for the address (and mode/dummy cycles) and the data */
+    uint8_t                 addr_nbits;
+    uint8_t                 data_nbits;
+    /** Mode plus dummy clocks between the address and the data */
+    uint8_t                 dummy_clocks;
+};
+
+/** An erase command */
+struct spi_nor_erase_type {
+    uint32_t                size;
+    uint8_t                 opcode;
+};
+
+/** Counters kept by the flash engine */
+struct spi_nor_stats {
+    /** Read, program and erase commands issued */
+    unsigned long           reads;
+    unsigned long           programs;
+    unsigned long           erases;
+    /** Status register reads while waiting for the part */
+    unsigned long           status_polls;
+};
+
+/** What spi_nor_update() did, counted in blocks of the smallest erase size */
+struct spi_nor_update_result {
+    /** Blocks that already held the new data */
+    unsigned long           unchanged;
+    /** Blocks that were already erased and only needed programming */
+    unsigned long           programmed;
+    /** Blocks that were erased and reprogrammed */
+    unsigned long           erased;
+    /** Page programs issued */
+    unsigned long           pages;
+};
+
+/** A probed NOR flash */
+struct spi_nor {
+    struct spi_bus*         bus;
+    uint8_t                 id[3];
+    /** Non-zero if the geometry came from SFDP rather than the JEDEC ID */
+    int                     sfdp;
+    /** SFDP basic flash parameter table revision (major << 8 | minor) */
+    uint16_t                sfdp_rev;
+    uint64_t                size;
+    uint32_t                page_size;
+    /** Erase types, smallest first */
+    struct spi_nor_erase_type erase[SPI_NOR_MAX_ERASE_TYPES];
+    unsigned int            erase_count;
+    /** Address bytes used, 3 or 4 */
+    unsigned int            addr_len;
+    /** Non-zero if the part has separate 4-byte address opcodes, otherwise
+     *  parts over 16MB are switched into 4-byte address mode */
+    int                     opcodes_4b;
+    /** Non-zero if the part needs a write enable before it can be put in
+     *  4-byte address mode */
+    int                     addr4_wren;
+    /** Non-zero while the part has been put in 4-byte address mode */
+    int                     addr4_mode;
+    struct spi_nor_read_op  reads[SPI_NOR_READ_NUM];
+    /** Data lines the device mode allows for sending and receiving */
+    unsigned int            tx_lines;
+    unsigned int            rx_lines;
+    /** Non-zero if quad reads are advertised but can't be used because the
+     *  part's Quad Enable bit is clear (or its location isn't known) */
+    int                     quad_disabled;
+    /** The read mode used by spi_nor_read() */
+    enum spi_nor_read_mode  read_mode;
+    uint8_t                 program_opcode;
+    struct spi_nor_stats    stats;
+};
+
+/**
+ * @brief Identify a flash and learn its geometry. SFDP is used if the part
+ *        has it, otherwise the size is taken from the JEDEC ID and the
+ *        common 4K/64K erase commands are assumed
+ *
+ * The read mode is the fastest one the part advertises that the device mode
+ * allows. Quad modes also need the part's Quad Enable bit, which is checked
+ * but never set, as setting it is a non-volatile change that turns the
+ * WP# and HOLD# pins into data lines.
+ *
+ * Parts over 16MB use 4-byte addresses: the 4-byte opcodes if SFDP lists
+ * them, otherwise the part is put in 4-byte address mode until
+ * spi_nor_release() is called.
+ *
+ * @return 0 on success, -1 on failure with errno set (ENODEV if nothing
+ *         answered)
+ */
+int spi_nor_probe(
+    struct spi_nor*         nor,
+    struct spi_bus*         bus);
+
+/**
+ * @brief Return the part to 3-byte address mode if probing changed it
+ */
+void spi_nor_release(
+    struct spi_nor*         nor);
+
+/**
+ * @brief Read from the flash using the selected read mode
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int spi_nor_read(
+    struct spi_nor*         nor,
+    uint64_t                addr,
+    void*                   buf,
+    uint64_t                len);
+
+/**
+ * @brief Erase a range, using the largest erase that fits each aligned
+ *        part of it
+ *
+ * @param addr - Start of the range, aligned to the smallest erase size
+ * @param len - Length of the range, a multiple of the smallest erase size
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int spi_nor_erase(
+    struct spi_nor*         nor,
+    uint64_t                addr,
+    uint64_t                len);
+
+/**
+ * @brief Erase the whole part
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int spi_nor_erase_chip(
+    struct spi_nor*         nor);
+
+/**
+ * @brief Program an erased range, one page program per page it covers.
+ *        Pages that are all 0xff are left alone
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int spi_nor_program(
+    struct spi_nor*         nor,
+    uint64_t                addr,
+    const void*             buf,
+    uint64_t                len);
+
+/**
+ * @brief Write a range, only erasing and programming what has changed
+ *
+ * The blocks of the smallest erase size that the range touches are read and
+ * compared with the new data (data outside the range is kept). Blocks that
+ * already match are skipped and blocks that are erased are only
+ * programmed. The rest are erased, using a larger erase instead when at least
+ * half of the blocks it covers need erasing, and programmed a page at a
+ * time, skipping pages that are all 0xff.
+ *
+ * @param result - Optional pointer to store what was done
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int spi_nor_update(
+    struct spi_nor*         nor,
+    uint64_t                addr,
+    const void*             buf,
+    uint64_t                len,
+    struct spi_nor_update_result* result);
+
+/**
+ * @brief Compare a range of the flash with a buffer
+ *
+ * @param mismatch - Optional pointer to store the first differing address
+ *
+ * @return 0 if it matches, 1 if it doesn't, -1 on failure with errno set
+ */
+int spi_nor_verify(
+    struct spi_nor*         nor,
+    uint64_t                addr,
+    const void*             buf,
+    uint64_t                len,
+    uint64_t*               mismatch);
+
+/**
+ * @brief Read the status register
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int spi_nor_read_status(
+    struct spi_nor*         nor,
+    uint8_t*                status);
+
+/**
+ * @brief Wait for a program or erase to complete
+ *
+ * @param timeout_us - How long to wait before failing with ETIMEDOUT
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+int spi_nor_wait_ready(
+    struct spi_nor*         nor,
+    uint64_t                timeout_us);
+
+/**
+ * @brief Get the name of a read mode, e.g. "1-1-4"
+ */
+const char* spi_nor_read_mode_name(
+    enum spi_nor_read_mode  mode);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SPI_NOR_H */
@@ -0,0 +1,582 @@
+/**
+ * SPI transaction scripts
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "spi_script.h"
+
+/** How often a poll line resends its command */
+#define SCRIPT_POLL_US                  100
+#define SCRIPT_DELIMS                   " \t\r\n"
+
+enum script_op {
+    SCRIPT_XFER,
+    SCRIPT_SLEEP,
+    SCRIPT_POLL,
+};
+
+/** One step of a script */
+struct script_step {
+    enum script_op          op;
+    unsigned int            line;
+    /** The transfer, or the command of a poll. Its tx and rx buffers belong
+     *  to the step */
+    struct spi_xfer         xfer;
+    /** Sleep time, or poll timeout */
+    uint32_t                us;
+    uint8_t                 mask;
+    uint8_t                 match;
+};
+
+struct spi_script {
+    struct script_step*     steps;
+    unsigned int            count;
+    unsigned int            alloc;
+};
+
+static int parse_line(
+    struct spi_script*      script,
+    char*                   line,
+    unsigned int            line_no,
+    uint32_t*               speed_hz);
+
+static struct script_step* add_step(
+    struct spi_script*      script,
+    enum script_op          op,
+    unsigned int            line_no);
+
+static struct script_step* last_xfer(
+    struct spi_script*      script);
+
+static int parse_bytes(
+    char*                   tok,
+    uint8_t**               data,
+    uint32_t*               len);
+
+static int parse_num(
+    const char*             str,
+    unsigned long           max,
+    unsigned long*          val);
+
+static int load_range(
+    const char*             path,
+    unsigned long           offset,
+    unsigned long           len,
+    struct spi_xfer*        xfer);
+
+static int run_poll(
+    struct spi_bus*         bus,
+    struct script_step*     step,
+    uint8_t*                status);
+
+struct spi_script* spi_script_load(
+    const char*             path)
+{
+    struct spi_script* script = NULL;
+    char* line = NULL;
+    size_t line_len = 0;
+    unsigned int line_no = 0;
+    uint32_t speed_hz = 0;
+    char* hash = NULL;
+    FILE* f = NULL;
+    int err = 0;
+
+    f = fopen(path, "r");
+    if(!f) {
+        return NULL;
+    }
+
+    script = calloc(1, sizeof(*script));
+    if(!script) {
+        fclose(f);
+        return NULL;
+    }
+
+    while(getline(&line, &line_len, f) >= 0) {
+        ++line_no;
+
+        hash = strchr(line, '#');
+        if(hash) {
+            *hash = '\0';
+        }
+
+        if(parse_line(script, line, line_no, &speed_hz) < 0) {
+            err = errno;
+            if(err == EINVAL) {
+                printf("%s:%u: invalid script line\n", path, line_no);
+            }
+            break;
+        }
+    }
+
+    free(line);
+    fclose(f);
+
+    if(err) {
+        spi_script_free(script);
+        errno = err;
+        return NULL;
+    }
+
+    return script;
+}
+
+void spi_script_free(
+    struct spi_script*      script)
+{
+    unsigned int i = 0;
+
+    if(!script) {
+        return;
+    }
+
+    for(i = 0; i < script->count; ++i) {
+        free((void*)script->steps[i].xfer.tx);
+        free(script->steps[i].xfer.rx);
+    }
+
+    free(script->steps);
+    free(script);
+}
+
+int spi_script_run(
+    struct spi_bus*         bus,
+    struct spi_script*      script,
+    spi_script_cb           cb,
+    void*                   user,
+    unsigned int*           line)
+{
+    struct spi_xfer* xfers = NULL;
+    struct script_step* step = NULL;
+    unsigned int first = 0;
+    unsigned int n = 0;
+    unsigned int i = 0;
+    unsigned int j = 0;
+    uint8_t status = 0;
+    int ret = -1;
+
+    xfers = calloc(script->count ? script->count : 1, sizeof(*xfers));
+    if(!xfers) {
+        return -1;
+    }
+
+    while(i < script->count) {
+        /* Everything up to the next step that needs us to wait or look at
+         * what came back goes in one transaction */
+        for(first = i, n = 0; i < script->count && script->steps[i].op == SCRIPT_XFER; ++i) {
+            xfers[n++] = script->steps[i].xfer;
+        }
+
+        if(n) {
+            if(spi_bus_transfer(bus, xfers, n) < 0) {
+                if(line) {
+                    *line = script->steps[first].line;
+                }
+                goto out;
+            }
+
+            for(j = first; cb && j < i; ++j) {
+                if(script->steps[j].xfer.rx) {
+                    cb(script->steps[j].line, script->steps[j].xfer.rx,
+                       script->steps[j].xfer.len, user);
+                }
+            }
+        }
+
+        if(i == script->count) {
+            break;
+        }
+
+        step = &script->steps[i++];
+        if(step->op == SCRIPT_SLEEP) {
+            spi_bus_delay(bus, step->us);
+        } else if(run_poll(bus, step, &status) < 0) {
+            if(line) {
+                *line = step->line;
+            }
+            goto out;
+        } else if(cb) {
+            cb(step->line, &status, 1, user);
+        }
+    }
+
+    ret = 0;
+
+out:
+    free(xfers);
+
+    return ret;
+}
+
+/**
+ * @brief Parse a line of a script, with any comment removed
+ *
+ * @return 0 on success, -1 on failure with errno set (EINVAL for a bad line)
+ */
+static int parse_line(
+    struct spi_script*      script,
+    char*                   line,
+    unsigned int            line_no,
+    uint32_t*               speed_hz)
+{
+    struct script_step* step = NULL;
+    unsigned long val[3] = {0};
+    char* save = NULL;
+    char* cmd = NULL;
+    char* arg = NULL;
+    char* path = NULL;
+    char* end = NULL;
+    double hz = 0;
+    unsigned int i = 0;
+
+    cmd = strtok_r(line, SCRIPT_DELIMS, &save);
+    if(!cmd) {
+        /* Blank line */
+        return 0;
+    }
+
+    arg = strtok_r(NULL, "", &save);
+
+    if(strcmp(cmd, "tx") == 0 || strcmp(cmd, "xfer") == 0) {
+        step = add_step(script, SCRIPT_XFER, line_no);
+        if(!step || parse_bytes(arg, (uint8_t**)&step->xfer.tx, &step->xfer.len) < 0) {
+            return -1;
+        }
+        if(cmd[0] == 'x' && !(step->xfer.rx = malloc(step->xfer.len))) {
+            return -1;
+        }
+    } else if(strcmp(cmd, "txfile") == 0) {
+        path = arg ? strtok_r(arg, SCRIPT_DELIMS, &save) : NULL;
+        arg = path ? strtok_r(NULL, SCRIPT_DELIMS, &save) : NULL;
+        val[0] = 0;
+        val[1] = 0;
+        if(!path ||
+           (arg && parse_num(arg, ULONG_MAX, &val[0]) < 0) ||
+           (arg && (arg = strtok_r(NULL, SCRIPT_DELIMS, &save)) &&
+            parse_num(arg, UINT32_MAX, &val[1]) < 0)) {
+            errno = EINVAL;
+            return -1;
+        }
+        step = add_step(script, SCRIPT_XFER, line_no);
+        if(!step || load_range(path, val[0], val[1], &step->xfer) < 0) {
+            if(step && errno != EINVAL && errno != ENOMEM) {
+                printf("Unable to read %s (errno: %d)\n", path, errno);
+            }
+            return -1;
+        }
+    } else if(strcmp(cmd, "rx") == 0) {
+        if(!arg || parse_num(strtok_r(arg, SCRIPT_DELIMS, &save), UINT32_MAX, &val[0]) < 0 ||
+           !val[0]) {
+            errno = EINVAL;
+            return -1;
+        }
+        step = add_step(script, SCRIPT_XFER, line_no);
+        if(!step || !(step->xfer.rx = malloc(val[0]))) {
+            return -1;
+        }
+        step->xfer.len = (uint32_t)val[0];
+    } else if(strcmp(cmd, "speed") == 0) {
+        hz = arg ? strtod(arg, &end) : 0;
+        if(!arg || end == arg) {
+            errno = EINVAL;
+            return -1;
+        }
+        if(*end == 'k' || *end == 'K') {
+            hz *= 1000;
+        } else if(*end == 'M') {
+            hz *= 1000000;
+        }
+        if(hz < 1 || hz > UINT32_MAX) {
+            errno = EINVAL;
+            return -1;
+        }
+        *speed_hz = (uint32_t)hz;
+        return 0;
+    } else if(strcmp(cmd, "delay") == 0 || strcmp(cmd, "sleep") == 0) {
+        if(!arg || parse_num(strtok_r(arg, SCRIPT_DELIMS, &save), UINT32_MAX, &val[0]) < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        /* A delay after a transfer is done by the kernel within the
+         * message, anything else needs us to wait */
+        step = last_xfer(script);
+        if(cmd[0] == 'd' && step && !step->xfer.delay_usecs && val[0] && val[0] <= UINT16_MAX) {
+            step->xfer.delay_usecs = (uint16_t)val[0];
+            return 0;
+        }
+
+        step = add_step(script, SCRIPT_SLEEP, line_no);
+        if(!step) {
+            return -1;
+        }
+        step->us = (uint32_t)val[0];
+        return 0;
+    } else if(strcmp(cmd, "cs") == 0) {
+        step = last_xfer(script);
+        if(step) {
+            step->xfer.cs_change = 1;
+        }
+        return 0;
+    } else if(strcmp(cmd, "poll") == 0) {
+        for(i = 0; i < 3; ++i) {
+            arg = strtok_r(i ? NULL : arg, SCRIPT_DELIMS, &save);
+            if(!arg || parse_num(arg, i < 2 ? 0xff : UINT32_MAX, &val[i]) < 0) {
+                errno = EINVAL;
+                return -1;
+            }
+        }
+        step = add_step(script, SCRIPT_POLL, line_no);
+        if(!step || parse_bytes(strtok_r(NULL, "", &save), (uint8_t**)&step->xfer.tx,
+                                &step->xfer.len) < 0) {
+            return -1;
+        }
+        step->mask = (uint8_t)val[0];
+        step->match = (uint8_t)val[1];
+        step->us = (uint32_t)val[2];
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+
+    step->xfer.speed_hz = *speed_hz;
+
+    return 0;
+}
+
+/**
+ * @brief Append an empty step
+ *
+ * @return The step, or NULL on failure with errno set
+ */
+static struct script_step* add_step(
+    struct spi_script*      script,
+    enum script_op          op,
+    unsigned int            line_no)
+{
+    struct script_step* steps = NULL;
+    struct script_step* step = NULL;
+
+    if(script->count == script->alloc) {
+        steps = realloc(script->steps, (script->alloc ? script->alloc * 2 : 64) * sizeof(*steps));
+        if(!steps) {
+            return NULL;
+        }
+        script->steps = steps;
+        script->alloc = script->alloc ? script->alloc * 2 : 64;
+    }
+
+    step = &script->steps[script->count++];
+    memset(step, 0, sizeof(*step));
+    step->op = op;
+    step->line = line_no;
+
+    return step;
+}
+
+/**
+ * @brief Get the last step if it is a transfer
+ */
+static struct script_step* last_xfer(
+    struct spi_script*      script)
+{
+    struct script_step* step = NULL;
+
+    if(!script->count) {
+        return NULL;
+    }
+
+    step = &script->steps[script->count - 1];
+
+    return step->op == SCRIPT_XFER ? step : NULL;
+}
+
+/**
+ * @brief Parse a list of bytes into an allocated buffer
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+static int parse_bytes(
+    char*                   tok,
+    uint8_t**               data,
+    uint32_t*               len)
+{
+    unsigned long val = 0;
+    uint32_t count = 0;
+    char* save = NULL;
+    char* str = NULL;
+
+    /* Every byte takes at least two characters with its separator */
+    *data = malloc(tok ? strlen(tok) / 2 + 1 : 1);
+    if(!*data) {
+        return -1;
+    }
+
+    for(str = tok ? strtok_r(tok, SCRIPT_DELIMS, &save) : NULL; str;
+        str = strtok_r(NULL, SCRIPT_DELIMS, &save)) {
+        if(parse_num(str, 0xff, &val) < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        (*data)[count++] = (uint8_t)val;
+    }
+
+    if(!count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *len = count;
+
+    return 0;
+}
+
+/**
+ * @brief Parse a whole decimal or 0x hex number no larger than max
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int parse_num(
+    const char*             str,
+    unsigned long           max,
+    unsigned long*          val)
+{
+    char* end = NULL;
+
+    if(!str) {
+        return -1;
+    }
+
+    errno = 0;
+    *val = strtoul(str, &end, 0);
+    if(end == str || *end || errno || *val > max) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Read part of a file into a transfer's transmit buffer
+ *
+ * @param len - Bytes to read, 0 for the rest of the file
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+static int load_range(
+    const char*             path,
+    unsigned long           offset,
+    unsigned long           len,
+    struct spi_xfer*        xfer)
+{
+    uint8_t* data = NULL;
+    FILE* f = NULL;
+    long size = 0;
+
+    f = fopen(path, "rb");
+    if(!f) {
+        return -1;
+    }
+
+    if(fseek(f, 0, SEEK_END) < 0 || (size = ftell(f)) < 0) {
+        fclose(f);
+        return -1;
+    }
+
+    if(offset >= (unsigned long)size || (len && len > (unsigned long)size - offset) ||
+       (!len && (unsigned long)size - offset > UINT32_MAX)) {
+        fclose(f);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!len) {
+        len = (unsigned long)size - offset;
+    }
+
+    data = malloc(len);
+    if(!data) {
+        fclose(f);
+        return -1;
+    }
+
+    if(fseek(f, (long)offset, SEEK_SET) < 0 || fread(data, 1, len, f) != len) {
+        if(!errno) {
+            errno = EIO;
+        }
+        free(data);
+        fclose(f);
+        return -1;
+    }
+
+    fclose(f);
+
+    xfer->tx = data;
+    xfer->len = (uint32_t)len;
+
+    return 0;
+}
+
+/**
+ * @brief Send a poll line's command and read a byte until it matches
+ *
+ * @param status - Where to store the last byte read
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+static int run_poll(
+    struct spi_bus*         bus,
+    struct script_step*     step,
+    uint8_t*                status)
+{
+    struct spi_xfer xfers[2];
+    uint64_t deadline = spi_bus_time_ns(bus) + step->us * 1000ull;
+
+    memset(xfers, 0, sizeof(xfers));
+    xfers[0] = step->xfer;
+    xfers[1].rx = status;
+    xfers[1].len = 1;
+    xfers[1].speed_hz = step->xfer.speed_hz;
+
+    for(;;) {
+        if(spi_bus_transfer(bus, xfers, 2) < 0) {
+            return -1;
+        }
+
+        if((*status & step->mask) == step->match) {
+            return 0;
+        }
+
+        if(spi_bus_time_ns(bus) > deadline) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        spi_bus_delay(bus, SCRIPT_POLL_US);
+    }
+}
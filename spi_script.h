@@ -0,0 +1,112 @@
+/**
+ * SPI transaction scripts
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef SPI_SCRIPT_H
+#define SPI_SCRIPT_H
+
+#include <stdint.h>
+
+#include "spi_bus.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct spi_script;
+
+/**
+ * @brief Called with the bytes received by a script line that reads
+ *
+ * @param line - The line number in the script
+ * @param rx - The bytes received
+ * @param len - How many bytes were received
+ * @param user - As passed to spi_script_run()
+ */
+typedef void (*spi_script_cb)(
+    unsigned int            line,
+    const uint8_t*          rx,
+    uint32_t                len,
+    void*                   user);
+
+/**
+ * @brief Load a script
+ *
+ * Blank lines and text after a '#' are ignored. Numbers may be decimal or 0x
+ * hex. Each line is one of:
+ *
+ *   tx <bytes...>                      Send bytes
+ *   txfile <path> [offset [len]]       Send a file, or part of one
+ *   rx <len>                           Receive len bytes
+ *   xfer <bytes...>                    Send bytes, receiving as many
+ *   speed <hz>                         Clock for the transfers that follow,
+ *                                      with an optional k or M suffix
+ *   delay <us>                         Wait after the previous transfer.
+ *                                      Delays over 65535us, or not after a
+ *                                      transfer, end the transaction
+ *   cs                                 Deselect the device after the
+ *                                      previous transfer
+ *   sleep <us>                         End the transaction and wait
+ *   poll <mask> <value> <timeout_us> <bytes...>
+ *                                      End the transaction, then send the
+ *                                      bytes and read one byte until the
+ *                                      byte AND mask equals value
+ *
+ * Transfers up to a sleep or poll (or the end) form one transaction, with
+ * the device kept selected unless a cs line says otherwise, and are sent
+ * with as few SPI_IOC_MESSAGEs as the spidev buffer allows.
+ *
+ * @return The script, or NULL on failure with errno set (EINVAL for a bad
+ *         line, which is reported on stdout)
+ */
+struct spi_script* spi_script_load(
+    const char*             path);
+
+/**
+ * @brief Free a script
+ */
+void spi_script_free(
+    struct spi_script*      script);
+
+/**
+ * @brief Run a script
+ *
+ * @param cb - Optional callback for the bytes received by rx, xfer and poll
+ *             lines, called in script order once each transaction completes
+ * @param user - Passed to cb
+ * @param line - Optional pointer to store the line that failed
+ *
+ * @return 0 on success, -1 on failure with errno set (ETIMEDOUT if a poll
+ *         timed out)
+ */
+int spi_script_run(
+    struct spi_bus*         bus,
+    struct spi_script*      script,
+    spi_script_cb           cb,
+    void*                   user,
+    unsigned int*           line);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SPI_SCRIPT_H */
@@ -0,0 +1,1823 @@
+/**
+ * Simulated SPI controller and device models
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <linux/types.h>
+#include <linux/spi/spidev.h>
+#include <sys/ioctl.h>
+
+#include "spi_sim.h"
+
+#define SIM_DEFAULT_HZ                  100000000
+#define SIM_DEFAULT_DEV_HZ              1000000
+#define SIM_DEFAULT_IOCTL_US            20
+#define SIM_DEFAULT_FLASH_SIZE          (16ull << 20)
+#define SIM_DEFAULT_TPP_US              700
+#define SIM_DEFAULT_TSE_US              45000
+#define SIM_DEFAULT_TBE_US              150000
+/** Fixed cost of each transfer within a message */
+#define SIM_XFER_NS                     1000
+/** The SPI core's default delay when a transfer deselects the device before
+ *  the next one */
+#define SIM_CS_CHANGE_US                10
+#define SIM_MAX_FLASH_SIZE              (1ull << 30)
+#define SIM_REG_COUNT                   128
+#define SIM_ADC_CHANNELS                8
+#define SIM_DEFAULT_TRD_US              45
+#define SIM_DEFAULT_TRCBSY_US           3
+#define SIM_NAND_RESET_US               5
+#define SIM_DEFAULT_EEPROM_SIZE         32768
+#define SIM_DEFAULT_EEPROM_PAGE         64
+#define SIM_DEFAULT_TWC_US              3000
+#define SIM_MAX_EEPROM_SIZE             (16u << 20)
+
+/** Flash commands understood by the NOR model */
+#define NOR_WRSR                        0x01
+#define NOR_PP                          0x02
+#define NOR_READ                        0x03
+#define NOR_WRDI                        0x04
+#define NOR_RDSR                        0x05
+#define NOR_WREN                        0x06
+#define NOR_FAST_READ                   0x0b
+#define NOR_FAST_READ_4B                0x0c
+#define NOR_PP_4B                       0x12
+#define NOR_READ_4B                     0x13
+#define NOR_SE                          0x20
+#define NOR_SE_4B                       0x21
+#define NOR_READ_1_1_2                  0x3b
+#define NOR_READ_1_1_2_4B               0x3c
+#define NOR_BE32                        0x52
+#define NOR_SFDP                        0x5a
+#define NOR_BE32_4B                     0x5c
+#define NOR_CE_ALT                      0x60
+#define NOR_RSTEN                       0x66
+#define NOR_READ_1_1_4                  0x6b
+#define NOR_READ_1_1_4_4B               0x6c
+#define NOR_RST                         0x99
+#define NOR_RDID                        0x9f
+#define NOR_EN4B                        0xb7
+#define NOR_READ_1_2_2                  0xbb
+#define NOR_READ_1_2_2_4B               0xbc
+#define NOR_CE                          0xc7
+#define NOR_BE64                        0xd8
+#define NOR_BE64_4B                     0xdc
+#define NOR_EX4B                        0xe9
+#define NOR_READ_1_4_4                  0xeb
+#define NOR_READ_1_4_4_4B               0xec
+
+#define NOR_SR_WIP                      0x01
+#define NOR_SR_WEL                      0x02
+
+#define NOR_PAGE_SIZE                   256
+#define NOR_SFDP_SIZE                   0x80
+#define NOR_SFDP_BFPT                   0x30
+#define NOR_SFDP_4BAIT                  0x70
+
+/** Commands understood by the NAND model */
+#define NAND_READ_CACHE_SLOW            0x03
+#define NAND_READ_CACHE                 0x0b
+#define NAND_GET_FEATURE                0x0f
+#define NAND_PAGE_READ                  0x13
+#define NAND_SET_FEATURE                0x1f
+#define NAND_CACHE_READ_SEQ             0x31
+#define NAND_READ_CACHE_X2              0x3b
+#define NAND_CACHE_READ_END             0x3f
+#define NAND_READ_CACHE_X4              0x6b
+#define NAND_RDID                       0x9f
+#define NAND_RESET                      0xff
+
+#define NAND_REG_PROTECT                0xa0
+#define NAND_REG_CONFIG                 0xb0
+#define NAND_REG_STATUS                 0xc0
+#define NAND_CONFIG_ECC_EN              0x10
+#define NAND_CONFIG_BUF                 0x08
+#define NAND_STATUS_OIP                 0x01
+
+/** Commands understood by the EEPROM model. 512 byte parts take address
+ *  bit 8 in bit 3 of the read and write opcodes */
+#define EEPROM_WRSR                     0x01
+#define EEPROM_WRITE                    0x02
+#define EEPROM_READ                     0x03
+#define EEPROM_WRDI                     0x04
+#define EEPROM_RDSR                     0x05
+#define EEPROM_WREN                     0x06
+#define EEPROM_A8                       0x08
+#define EEPROM_SR_WIP                   0x01
+#define EEPROM_SR_WEL                   0x02
+#define EEPROM_SR_BP                    0x0c
+#define EEPROM_MAX_PAGE                 256
+
+#define NAND_PAGE_SIZE                  2048
+#define NAND_PAGES_PER_BLOCK            64
+#define NAND_BLOCKS                     1024
+
+enum sim_kind {
+    SIM_NOR,
+    SIM_REGS,
+    SIM_ADC,
+    SIM_NAND,
+    SIM_EEPROM,
+};
+
+/** The SPI NAND parts the model can be */
+enum nand_kind {
+    /** Winbond W25N01GV, with continuous reads */
+    NAND_CONTINUOUS,
+    /** Micron MT29F1G01ABAFD, with cache read sequential */
+    NAND_CACHE,
+    /** Macronix MX35LF1GE4AB, page reads only */
+    NAND_PLAIN,
+};
+
+/** What a flash command does once its address and dummy bytes are in */
+enum nor_op {
+    NOR_OP_NONE,
+    NOR_OP_READ,
+    NOR_OP_SFDP,
+    NOR_OP_PROGRAM,
+    NOR_OP_ERASE,
+};
+
+/** How the flash model decodes each command */
+struct nor_cmd {
+    uint8_t                 opcode;
+    enum nor_op             op;
+    /** Address bytes, or 0 for the current address mode */
+    uint8_t                 addr_len;
+    /** Mode and dummy bytes after the address */
+    uint8_t                 dummy;
+    /** I/O lines used for the address and for the data */
+    uint8_t                 addr_nbits;
+    uint8_t                 data_nbits;
+    /** Bytes erased, for erase commands */
+    uint32_t                erase_size;
+};
+
+static const struct nor_cmd nor_cmds[] = {
+    { NOR_READ,             NOR_OP_READ,    0, 0, 1, 1, 0 },
+    { NOR_FAST_READ,        NOR_OP_READ,    0, 1, 1, 1, 0 },
+    { NOR_READ_1_1_2,       NOR_OP_READ,    0, 1, 1, 2, 0 },
+    { NOR_READ_1_2_2,       NOR_OP_READ,    0, 1, 2, 2, 0 },
+    { NOR_READ_1_1_4,       NOR_OP_READ,    0, 1, 1, 4, 0 },
+    { NOR_READ_1_4_4,       NOR_OP_READ,    0, 3, 4, 4, 0 },
+    { NOR_READ_4B,          NOR_OP_READ,    4, 0, 1, 1, 0 },
+    { NOR_FAST_READ_4B,     NOR_OP_READ,    4, 1, 1, 1, 0 },
+    { NOR_READ_1_1_2_4B,    NOR_OP_READ,    4, 1, 1, 2, 0 },
+    { NOR_READ_1_2_2_4B,    NOR_OP_READ,    4, 1, 2, 2, 0 },
+    { NOR_READ_1_1_4_4B,    NOR_OP_READ,    4, 1, 1, 4, 0 },
+    { NOR_READ_1_4_4_4B,    NOR_OP_READ,    4, 3, 4, 4, 0 },
+    { NOR_SFDP,             NOR_OP_SFDP,    3, 1, 1, 1, 0 },
+    { NOR_PP,               NOR_OP_PROGRAM, 0, 0, 1, 1, 0 },
+    { NOR_PP_4B,            NOR_OP_PROGRAM, 4, 0, 1, 1, 0 },
+    { NOR_SE,               NOR_OP_ERASE,   0, 0, 1, 1, 4096 },
+    { NOR_SE_4B,            NOR_OP_ERASE,   4, 0, 1, 1, 4096 },
+    { NOR_BE32,             NOR_OP_ERASE,   0, 0, 1, 1, 32768 },
+    { NOR_BE32_4B,          NOR_OP_ERASE,   4, 0, 1, 1, 32768 },
+    { NOR_BE64,             NOR_OP_ERASE,   0, 0, 1, 1, 65536 },
+    { NOR_BE64_4B,          NOR_OP_ERASE,   4, 0, 1, 1, 65536 },
+};
+
+struct sim_nor {
+    uint8_t*                mem;
+    uint64_t                size;
+    uint8_t                 id[3];
+    uint8_t                 sfdp[NOR_SFDP_SIZE];
+    int                     has_sfdp;
+    /** Non-zero in 4-byte address mode */
+    int                     addr4;
+    int                     wel;
+    uint64_t                busy_until;
+    uint64_t                tpp_ns;
+    uint64_t                tse_ns;
+    uint64_t                tbe_ns;
+    /** The command being decoded */
+    const struct nor_cmd*   cmd;
+    uint8_t                 opcode;
+    unsigned int            addr_len;
+    uint64_t                addr;
+    /** Set when a busy device ignores the command */
+    int                     ignored;
+    /** Set when a phase was clocked on the wrong number of lines */
+    int                     garbled;
+    /** Data of a page program, applied when the device is deselected */
+    uint8_t                 page[NOR_PAGE_SIZE];
+    uint8_t                 page_valid[NOR_PAGE_SIZE];
+    uint64_t                page_bytes;
+};
+
+struct sim_nand {
+    enum nand_kind          kind;
+    /** Pages of page_size data bytes followed by oob_size spare bytes */
+    uint8_t*                mem;
+    uint8_t                 id[3];
+    uint32_t                oob_size;
+    uint32_t                pages;
+    uint8_t                 config;
+    uint64_t                busy_until;
+    uint64_t                trd_ns;
+    uint64_t                trcbsy_ns;
+    /** Page in the cache, and the ECC status bits reported for it (the
+     *  worst of the pages read so far in a continuous read) */
+    uint32_t                cache_page;
+    uint8_t                 ecc;
+    /** Page in the data register during cache reads, and when it has
+     *  finished loading */
+    uint32_t                reg_page;
+    uint64_t                reg_ready;
+    /** Every flips'th page reports corrected bit flips, 0 for none */
+    uint32_t                flips;
+    /** A page that reports an uncorrectable error, or -1 */
+    int64_t                 uecc;
+    /** Blocks marked bad */
+    uint32_t                bad;
+    /** The command being decoded */
+    uint8_t                 opcode;
+    uint8_t                 arg[3];
+    uint8_t                 data_nbits;
+    /** Command bytes before the data of a read from cache, and whether it
+     *  is a continuous read */
+    unsigned int            header;
+    int                     continuous;
+    int                     ignored;
+    int                     garbled;
+};
+
+struct sim_eeprom {
+    uint8_t*                mem;
+    uint32_t                size;
+    uint32_t                page_size;
+    unsigned int            addr_len;
+    /** Block protect bits */
+    uint8_t                 bp;
+    int                     wel;
+    uint64_t                busy_until;
+    uint64_t                twc_ns;
+    /** The command being decoded */
+    uint8_t                 opcode;
+    uint32_t                addr;
+    uint8_t                 new_status;
+    int                     ignored;
+    /** Data of a page write, applied when the device is deselected */
+    uint8_t                 page[EEPROM_MAX_PAGE];
+    uint8_t                 page_valid[EEPROM_MAX_PAGE];
+    uint32_t                page_bytes;
+};
+
+struct sim_bus {
+    struct spi_bus          bus;
+    enum sim_kind           kind;
+    /** Device settings */
+    uint32_t                mode;
+    uint32_t                max_speed_hz;
+    uint8_t                 bits_per_word;
+    /** Optional mode bits the controller supports */
+    uint32_t                mode_bits;
+    uint32_t                ctlr_max_hz;
+    /** The virtual clock */
+    uint64_t                now_ns;
+    uint64_t                ioctl_ns;
+    int                     realtime;
+    int                     selected;
+    /** Bytes received since the device was selected */
+    uint64_t                idx;
+    struct spi_sim_stats    stats;
+
+    struct sim_nor          nor;
+    struct sim_nand         nand;
+    struct sim_eeprom       eeprom;
+    struct {
+        uint8_t             regs[SIM_REG_COUNT];
+        uint8_t             ptr;
+        int                 read;
+    } regs;
+    struct {
+        uint16_t            next[SIM_ADC_CHANNELS];
+        uint8_t             cmd[2];
+        uint16_t            sample;
+    } adc;
+};
+
+static int sim_ioctl(
+    struct spi_bus*         bus,
+    unsigned long           request,
+    void*                   arg);
+
+static void sim_delay(
+    struct spi_bus*         bus,
+    unsigned long           usecs);
+
+static uint64_t sim_time_ns(
+    struct spi_bus*         bus);
+
+static void sim_close(
+    struct spi_bus*         bus);
+
+static int sim_parse_options(
+    struct sim_bus*         sim,
+    const char*             options,
+    int*                    fill,
+    char**                  image);
+
+static int sim_set_mode(
+    struct sim_bus*         sim,
+    uint32_t                mode);
+
+static unsigned long long parse_num(
+    const char*             str,
+    unsigned int            unit);
+
+static int sim_message(
+    struct sim_bus*         sim,
+    struct spi_ioc_transfer* xfers,
+    unsigned int            count);
+
+static void sim_advance(
+    struct sim_bus*         sim,
+    uint64_t                ns);
+
+static void dev_select(
+    struct sim_bus*         sim);
+
+static uint8_t dev_byte(
+    struct sim_bus*         sim,
+    uint8_t                 tx,
+    unsigned int            nbits);
+
+static void dev_deselect(
+    struct sim_bus*         sim);
+
+static int nor_init(
+    struct sim_bus*         sim,
+    int                     fill,
+    const char*             image);
+
+static void nor_build_sfdp(
+    struct sim_nor*         nor);
+
+static uint8_t nor_byte(
+    struct sim_bus*         sim,
+    uint8_t                 tx,
+    unsigned int            nbits);
+
+static void nor_deselect(
+    struct sim_bus*         sim);
+
+static int nand_init(
+    struct sim_bus*         sim,
+    int                     fill,
+    const char*             image);
+
+static uint8_t nand_page_ecc(
+    struct sim_nand*        nand,
+    uint32_t                page);
+
+static uint8_t nand_byte(
+    struct sim_bus*         sim,
+    uint8_t                 tx,
+    unsigned int            nbits);
+
+static void nand_deselect(
+    struct sim_bus*         sim);
+
+static int eeprom_init(
+    struct sim_bus*         sim,
+    int                     fill,
+    const char*             image);
+
+static uint8_t eeprom_byte(
+    struct sim_bus*         sim,
+    uint8_t                 tx);
+
+static void eeprom_deselect(
+    struct sim_bus*         sim);
+
+static uint32_t xorshift32(
+    uint32_t                x);
+
+static uint8_t regs_byte(
+    struct sim_bus*         sim,
+    uint8_t                 tx);
+
+static uint8_t adc_byte(
+    struct sim_bus*         sim,
+    uint8_t                 tx);
+
+static uint8_t bit_reverse(
+    uint8_t                 val);
+
+static void put_le32(
+    uint8_t*                buf,
+    uint32_t                val);
+
+static const struct spi_bus_ops sim_ops = {
+    .ioctl = sim_ioctl,
+    .delay = sim_delay,
+    .time_ns = sim_time_ns,
+    .close = sim_close,
+};
+
+struct spi_bus* spi_sim_open(
+    const char*             options)
+{
+    struct sim_bus* sim = NULL;
+    char* image = NULL;
+    int fill = 0;
+    int ret = 0;
+
+    sim = calloc(1, sizeof(*sim));
+    if(!sim) {
+        return NULL;
+    }
+
+    sim->bus.ops = &sim_ops;
+    sim->bus.fd = -1;
+    sim->bus.priv = sim;
+    sim->bus.bufsiz = SPI_BUS_DEFAULT_BUFSIZ;
+
+    sim->kind = SIM_NOR;
+    sim->max_speed_hz = SIM_DEFAULT_DEV_HZ;
+    sim->ctlr_max_hz = SIM_DEFAULT_HZ;
+    sim->mode_bits = SPI_TX_DUAL | SPI_TX_QUAD | SPI_RX_DUAL | SPI_RX_QUAD;
+    sim->ioctl_ns = SIM_DEFAULT_IOCTL_US * 1000ull;
+    sim->nor.size = SIM_DEFAULT_FLASH_SIZE;
+    sim->nor.has_sfdp = 1;
+    sim->nor.tpp_ns = SIM_DEFAULT_TPP_US * 1000ull;
+    sim->nor.tse_ns = SIM_DEFAULT_TSE_US * 1000ull;
+    sim->nor.tbe_ns = SIM_DEFAULT_TBE_US * 1000ull;
+    sim->nand.trd_ns = SIM_DEFAULT_TRD_US * 1000ull;
+    sim->nand.trcbsy_ns = SIM_DEFAULT_TRCBSY_US * 1000ull;
+    sim->nand.uecc = -1;
+    sim->eeprom.page_size = SIM_DEFAULT_EEPROM_PAGE;
+    sim->eeprom.twc_ns = SIM_DEFAULT_TWC_US * 1000ull;
+
+    ret = sim_parse_options(sim, options, &fill, &image);
+    if(ret == 0 && sim->kind == SIM_NOR) {
+        ret = nor_init(sim, fill, image);
+    } else if(ret == 0 && sim->kind == SIM_NAND) {
+        ret = nand_init(sim, fill, image);
+    } else if(ret == 0 && sim->kind == SIM_EEPROM) {
+        ret = eeprom_init(sim, fill, image);
+    }
+
+    free(image);
+
+    if(ret < 0) {
+        free(sim);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    snprintf(sim->bus.name, sizeof(sim->bus.name), "spi-sim");
+
+    if(sim->kind == SIM_REGS) {
+        /* An identification register, like a sensor's WHO_AM_I */
+        sim->regs.regs[0] = 0x5a;
+    } else if(sim->kind == SIM_ADC) {
+        for(unsigned int ch = 0; ch < SIM_ADC_CHANNELS; ++ch) {
+            sim->adc.next[ch] = ch * 512;
+        }
+    }
+
+    return &sim->bus;
+}
+
+int spi_sim_is_sim(
+    struct spi_bus*         bus)
+{
+    return bus && bus->ops == &sim_ops;
+}
+
+uint8_t* spi_sim_flash_data(
+    struct spi_bus*         bus,
+    uint64_t*               size)
+{
+    struct sim_bus* sim = NULL;
+
+    if(!spi_sim_is_sim(bus)) {
+        return NULL;
+    }
+
+    sim = bus->priv;
+    if(sim->kind != SIM_NOR) {
+        return NULL;
+    }
+
+    if(size) {
+        *size = sim->nor.size;
+    }
+
+    return sim->nor.mem;
+}
+
+void spi_sim_get_stats(
+    struct spi_bus*         bus,
+    struct spi_sim_stats*   stats)
+{
+    if(!spi_sim_is_sim(bus)) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    *stats = ((struct sim_bus*)bus->priv)->stats;
+}
+
+static int sim_parse_options(
+    struct sim_bus*         sim,
+    const char*             options,
+    int*                    fill,
+    char**                  image)
+{
+    char* copy = NULL;
+    char* save = NULL;
+    char* opt = NULL;
+    char* val = NULL;
+    unsigned long long num = 0;
+    int ret = 0;
+
+    if(!options || !*options) {
+        return 0;
+    }
+
+    copy = strdup(options);
+    if(!copy) {
+        return -1;
+    }
+
+    for(opt = strtok_r(copy, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+        val = strchr(opt, '=');
+        if(val) {
+            *val++ = '\0';
+        }
+        num = val ? parse_num(val, strcmp(opt, "hz") == 0 ? 1000 : 1024) : 0;
+
+        if(strcmp(opt, "dev") == 0 && val && strcmp(val, "nor") == 0) {
+            sim->kind = SIM_NOR;
+        } else if(strcmp(opt, "dev") == 0 && val && strcmp(val, "regs") == 0) {
+            sim->kind = SIM_REGS;
+        } else if(strcmp(opt, "dev") == 0 && val && strcmp(val, "adc") == 0) {
+            sim->kind = SIM_ADC;
+        } else if(strcmp(opt, "dev") == 0 && val && strcmp(val, "nand") == 0) {
+            sim->kind = SIM_NAND;
+            sim->nand.kind = NAND_CONTINUOUS;
+        } else if(strcmp(opt, "dev") == 0 && val && strcmp(val, "nand-cache") == 0) {
+            sim->kind = SIM_NAND;
+            sim->nand.kind = NAND_CACHE;
+        } else if(strcmp(opt, "dev") == 0 && val && strcmp(val, "nand-plain") == 0) {
+            sim->kind = SIM_NAND;
+            sim->nand.kind = NAND_PLAIN;
+        } else if(strcmp(opt, "dev") == 0 && val && strcmp(val, "eeprom") == 0) {
+            sim->kind = SIM_EEPROM;
+        } else if(strcmp(opt, "size") == 0 && num) {
+            sim->nor.size = num;
+        } else if(strcmp(opt, "hz") == 0 && num && num <= UINT32_MAX) {
+            sim->ctlr_max_hz = (uint32_t)num;
+        } else if(strcmp(opt, "ioctl_us") == 0 && val) {
+            sim->ioctl_ns = num * 1000ull;
+        } else if(strcmp(opt, "bufsiz") == 0 && num && num <= UINT32_MAX) {
+            sim->bus.bufsiz = (uint32_t)num;
+        } else if(strcmp(opt, "single") == 0) {
+            sim->mode_bits = 0;
+        } else if(strcmp(opt, "dual") == 0) {
+            sim->mode_bits = SPI_TX_DUAL | SPI_RX_DUAL;
+        } else if(strcmp(opt, "nosfdp") == 0) {
+            sim->nor.has_sfdp = 0;
+        } else if(strcmp(opt, "fill") == 0) {
+            *fill = 1;
+        } else if(strcmp(opt, "image") == 0 && val && *val) {
+            free(*image);
+            *image = strdup(val);
+        } else if(strcmp(opt, "tpp_us") == 0 && val) {
+            sim->nor.tpp_ns = num * 1000ull;
+        } else if(strcmp(opt, "tse_us") == 0 && val) {
+            sim->nor.tse_ns = num * 1000ull;
+        } else if(strcmp(opt, "tbe_us") == 0 && val) {
+            sim->nor.tbe_ns = num * 1000ull;
+        } else if(strcmp(opt, "page") == 0 && num) {
+            sim->eeprom.page_size = (uint32_t)num;
+        } else if(strcmp(opt, "twc_us") == 0 && val) {
+            sim->eeprom.twc_ns = num * 1000ull;
+        } else if(strcmp(opt, "trd_us") == 0 && val) {
+            sim->nand.trd_ns = num * 1000ull;
+        } else if(strcmp(opt, "flips") == 0 && val) {
+            sim->nand.flips = (uint32_t)num;
+        } else if(strcmp(opt, "uecc") == 0 && val) {
+            sim->nand.uecc = (int64_t)strtoll(val, NULL, 0);
+        } else if(strcmp(opt, "bad") == 0 && val) {
+            sim->nand.bad = (uint32_t)num;
+        } else if(strcmp(opt, "realtime") == 0) {
+            sim->realtime = 1;
+        } else {
+            printf("Unknown simulated controller option: %s\n", opt);
+            ret = -1;
+            break;
+        }
+    }
+
+    free(copy);
+
+    return ret;
+}
+
+/**
+ * @brief Parse a number with an optional k, M or G suffix
+ *
+ * @param unit - What the k suffix multiplies by, 1000 or 1024
+ *
+ * @return The number, or 0 if it isn't valid
+ */
+static unsigned long long parse_num(
+    const char*             str,
+    unsigned int            unit)
+{
+    char* end = NULL;
+    unsigned long long val = 0;
+
+    val = strtoull(str, &end, 0);
+    if(end == str) {
+        return 0;
+    }
+
+    switch(*end) {
+        case 'G':
+        case 'g':
+            val *= unit;
+            /* Fall through */
+        case 'M':
+        case 'm':
+            val *= unit;
+            /* Fall through */
+        case 'K':
+        case 'k':
+            val *= unit;
+            ++end;
+            break;
+        default:
+            break;
+    }
+
+    return *end == '\0' ? val : 0;
+}
+
+static int sim_ioctl(
+    struct spi_bus*         bus,
+    unsigned long           request,
+    void*                   arg)
+{
+    struct sim_bus* sim = bus->priv;
+    unsigned int size = 0;
+
+    switch(request) {
+        case SPI_IOC_RD_MODE:
+            *(uint8_t*)arg = sim->mode & 0xff;
+            return 0;
+        case SPI_IOC_WR_MODE:
+            /* The 8 bit ioctl leaves the upper mode bits alone */
+            return sim_set_mode(sim, (sim->mode & ~0xffu) | *(uint8_t*)arg);
+        case SPI_IOC_RD_MODE32:
+            *(uint32_t*)arg = sim->mode;
+            return 0;
+        case SPI_IOC_WR_MODE32:
+            return sim_set_mode(sim, *(uint32_t*)arg);
+        case SPI_IOC_RD_LSB_FIRST:
+            *(uint8_t*)arg = sim->mode & SPI_LSB_FIRST ? 1 : 0;
+            return 0;
+        case SPI_IOC_WR_LSB_FIRST:
+            return sim_set_mode(sim, *(uint8_t*)arg ? sim->mode | SPI_LSB_FIRST :
+                                                      sim->mode & ~SPI_LSB_FIRST);
+        case SPI_IOC_RD_BITS_PER_WORD:
+            *(uint8_t*)arg = sim->bits_per_word;
+            return 0;
+        case SPI_IOC_WR_BITS_PER_WORD:
+            if(*(uint8_t*)arg > 32) {
+                errno = EINVAL;
+                return -1;
+            }
+            sim->bits_per_word = *(uint8_t*)arg;
+            return 0;
+        case SPI_IOC_RD_MAX_SPEED_HZ:
+            *(uint32_t*)arg = sim->max_speed_hz;
+            return 0;
+        case SPI_IOC_WR_MAX_SPEED_HZ:
+            /* Like the SPI core, limit the device to what the controller
+             * can do */
+            sim->max_speed_hz = *(uint32_t*)arg;
+            if(!sim->max_speed_hz || sim->max_speed_hz > sim->ctlr_max_hz) {
+                sim->max_speed_hz = sim->ctlr_max_hz;
+            }
+            return 0;
+        default:
+            break;
+    }
+
+    if(_IOC_TYPE(request) != SPI_IOC_MAGIC || _IOC_NR(request) != 0 ||
+       _IOC_DIR(request) != _IOC_WRITE) {
+        errno = ENOTTY;
+        return -1;
+    }
+
+    size = _IOC_SIZE(request);
+    if(size % sizeof(struct spi_ioc_transfer)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return sim_message(sim, arg, size / sizeof(struct spi_ioc_transfer));
+}
+
+/**
+ * @brief Apply a new mode the way spi_setup() does: dual and quad bits the
+ *        controller doesn't support are dropped, conflicting ones rejected
+ */
+static int sim_set_mode(
+    struct sim_bus*         sim,
+    uint32_t                mode)
+{
+    if((mode & ~SPI_MODE_USER_MASK) ||
+       ((mode & SPI_TX_DUAL) && (mode & SPI_TX_QUAD)) ||
+       ((mode & SPI_RX_DUAL) && (mode & SPI_RX_QUAD))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mode &= ~((SPI_TX_DUAL | SPI_TX_QUAD | SPI_RX_DUAL | SPI_RX_QUAD |
+               SPI_TX_OCTAL | SPI_RX_OCTAL) & ~sim->mode_bits);
+    sim->mode = mode;
+
+    return 0;
+}
+
+static void sim_delay(
+    struct spi_bus*         bus,
+    unsigned long           usecs)
+{
+    sim_advance(bus->priv, usecs * 1000ull);
+}
+
+static uint64_t sim_time_ns(
+    struct spi_bus*         bus)
+{
+    return ((struct sim_bus*)bus->priv)->now_ns;
+}
+
+static void sim_close(
+    struct spi_bus*         bus)
+{
+    struct sim_bus* sim = bus->priv;
+
+    free(sim->nor.mem);
+    free(sim->nand.mem);
+    free(sim->eeprom.mem);
+    free(sim);
+}
+
+static void sim_advance(
+    struct sim_bus*         sim,
+    uint64_t                ns)
+{
+    struct timespec ts;
+
+    sim->now_ns += ns;
+
+    if(sim->realtime && ns) {
+        ts.tv_sec = ns / 1000000000ull;
+        ts.tv_nsec = ns % 1000000000ull;
+        nanosleep(&ts, NULL);
+    }
+}
+
+/**
+ * @brief Check that the lines a transfer uses are enabled in the mode, as
+ *        the SPI core does
+ */
+static int nbits_valid(
+    uint8_t                 nbits,
+    uint32_t                mode,
+    uint32_t                dual,
+    uint32_t                quad)
+{
+    switch(nbits) {
+        case 0:
+        case 1:
+            return 1;
+        case 2:
+            return (mode & (dual | quad)) != 0;
+        case 4:
+            return (mode & quad) != 0;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @brief Perform one SPI_IOC_MESSAGE
+ *
+ * @return The number of bytes transferred, or -1 with errno set
+ */
+static int sim_message(
+    struct sim_bus*         sim,
+    struct spi_ioc_transfer* xfers,
+    unsigned int            count)
+{
+    struct spi_ioc_transfer* xfer = NULL;
+    const uint8_t* tx = NULL;
+    uint8_t* rx = NULL;
+    uint64_t tx_total = 0;
+    uint64_t rx_total = 0;
+    uint64_t acct = 0;
+    uint64_t total = 0;
+    uint64_t ns = 0;
+    uint32_t speed = 0;
+    unsigned int nbits = 0;
+    unsigned int i = 0;
+    uint8_t val = 0;
+
+    /* spidev's checks: both directions have to fit the buffer, with each
+     * transfer rounded up to the DMA alignment */
+    for(i = 0; i < count; ++i) {
+        xfer = &xfers[i];
+        acct = ((uint64_t)xfer->len + SPI_BUS_DMA_ALIGN - 1) /
+               SPI_BUS_DMA_ALIGN * SPI_BUS_DMA_ALIGN;
+        tx_total += xfer->tx_buf ? acct : 0;
+        rx_total += xfer->rx_buf ? acct : 0;
+        if(tx_total > sim->bus.bufsiz || rx_total > sim->bus.bufsiz) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        if((xfer->tx_buf && !nbits_valid(xfer->tx_nbits, sim->mode,
+                                         SPI_TX_DUAL, SPI_TX_QUAD)) ||
+           (xfer->rx_buf && !nbits_valid(xfer->rx_nbits, sim->mode,
+                                         SPI_RX_DUAL, SPI_RX_QUAD)) ||
+           (xfer->tx_buf && xfer->rx_buf &&
+            (xfer->tx_nbits > 1 || xfer->rx_nbits > 1)) ||
+           xfer->bits_per_word > 32) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    sim_advance(sim, sim->ioctl_ns);
+    sim->stats.messages++;
+
+    for(i = 0; i < count; ++i) {
+        xfer = &xfers[i];
+        tx = (const uint8_t*)(uintptr_t)xfer->tx_buf;
+        rx = (uint8_t*)(uintptr_t)xfer->rx_buf;
+        nbits = tx ? xfer->tx_nbits : xfer->rx_nbits;
+        nbits = nbits ? nbits : 1;
+        speed = xfer->speed_hz ? xfer->speed_hz : sim->max_speed_hz;
+        if(speed > sim->ctlr_max_hz) {
+            speed = sim->ctlr_max_hz;
+        }
+
+        if(!sim->selected) {
+            dev_select(sim);
+        }
+
+        for(uint32_t b = 0; b < xfer->len; ++b) {
+            val = tx ? tx[b] : 0;
+            if(sim->mode & SPI_LSB_FIRST) {
+                val = bit_reverse(dev_byte(sim, bit_reverse(val), nbits));
+            } else {
+                val = dev_byte(sim, val, nbits);
+            }
+            if(rx) {
+                rx[b] = val;
+            }
+        }
+
+        ns = SIM_XFER_NS + (uint64_t)xfer->len * 8 * 1000000000ull / (nbits * (uint64_t)speed);
+        ns += xfer->delay_usecs * 1000ull;
+        sim_advance(sim, ns);
+
+        sim->stats.transfers++;
+        sim->stats.bytes += xfer->len;
+        total += xfer->len;
+
+        /* cs_change deselects between transfers, but on the last transfer
+         * it leaves the device selected */
+        if(i + 1 < count) {
+            if(xfer->cs_change) {
+                dev_deselect(sim);
+                sim_advance(sim, SIM_CS_CHANGE_US * 1000ull);
+            }
+        } else if(!xfer->cs_change) {
+            dev_deselect(sim);
+        }
+    }
+
+    return (int)total;
+}
+
+static void dev_select(
+    struct sim_bus*         sim)
+{
+    sim->selected = 1;
+    sim->idx = 0;
+    sim->stats.selects++;
+
+    if(sim->kind == SIM_NOR) {
+        sim->nor.cmd = NULL;
+        sim->nor.ignored = 0;
+        sim->nor.garbled = 0;
+        sim->nor.addr = 0;
+        sim->nor.page_bytes = 0;
+        memset(sim->nor.page_valid, 0, sizeof(sim->nor.page_valid));
+    } else if(sim->kind == SIM_NAND) {
+        sim->nand.ignored = 0;
+        sim->nand.garbled = 0;
+    } else if(sim->kind == SIM_EEPROM) {
+        sim->eeprom.ignored = 0;
+        sim->eeprom.addr = 0;
+        sim->eeprom.page_bytes = 0;
+        memset(sim->eeprom.page_valid, 0, sizeof(sim->eeprom.page_valid));
+    }
+}
+
+static uint8_t dev_byte(
+    struct sim_bus*         sim,
+    uint8_t                 tx,
+    unsigned int            nbits)
+{
+    switch(sim->kind) {
+        case SIM_NOR:
+            return nor_byte(sim, tx, nbits);
+        case SIM_REGS:
+            return regs_byte(sim, tx);
+        case SIM_ADC:
+            return adc_byte(sim, tx);
+        case SIM_NAND:
+            return nand_byte(sim, tx, nbits);
+        case SIM_EEPROM:
+            return eeprom_byte(sim, tx);
+        default:
+            return 0xff;
+    }
+}
+
+static void dev_deselect(
+    struct sim_bus*         sim)
+{
+    if(sim->kind == SIM_NOR) {
+        nor_deselect(sim);
+    } else if(sim->kind == SIM_NAND) {
+        nand_deselect(sim);
+    } else if(sim->kind == SIM_EEPROM) {
+        eeprom_deselect(sim);
+    }
+
+    sim->selected = 0;
+}
+
+static int nor_init(
+    struct sim_bus*         sim,
+    int                     fill,
+    const char*             image)
+{
+    struct sim_nor* nor = &sim->nor;
+    FILE* f = NULL;
+    uint32_t x = 0x12345678;
+    unsigned int order = 0;
+
+    if(nor->size < 65536 || nor->size > SIM_MAX_FLASH_SIZE ||
+       (nor->size & (nor->size - 1))) {
+        printf("The simulated flash size must be a power of 2 from 64K to 1G\n");
+        return -1;
+    }
+
+    nor->mem = malloc(nor->size);
+    if(!nor->mem) {
+        return -1;
+    }
+
+    memset(nor->mem, 0xff, nor->size);
+
+    if(fill) {
+        /* xorshift32, so the contents are the same every run */
+        for(uint64_t i = 0; i < nor->size; i += 4) {
+            x = xorshift32(x);
+            put_le32(&nor->mem[i], x);
+        }
+    }
+
+    if(image) {
+        f = fopen(image, "rb");
+        if(!f) {
+            printf("Unable to open flash image %s\n", image);
+            free(nor->mem);
+            nor->mem = NULL;
+            return -1;
+        }
+        if(fread(nor->mem, 1, nor->size, f) == 0 && ferror(f)) {
+            printf("Unable to read flash image %s\n", image);
+        }
+        fclose(f);
+    }
+
+    /* A Winbond W25Q style ID, whose last byte encodes the size */
+    for(order = 0; (1ull << order) < nor->size; ++order);
+    nor->id[0] = 0xef;
+    nor->id[1] = 0x40;
+    nor->id[2] = order <= 25 ? order : 0x20 + order - 26;
+
+    if(nor->has_sfdp) {
+        nor_build_sfdp(nor);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Build an SFDP table (JESD216B) with a basic flash parameter table
+ *        and, for parts over 16MB, a 4-byte address instruction table
+ */
+static void nor_build_sfdp(
+    struct sim_nor*         nor)
+{
+    uint8_t* sfdp = nor->sfdp;
+    uint8_t* bfpt = &sfdp[NOR_SFDP_BFPT];
+    uint64_t bits = nor->size * 8;
+    unsigned int order = 0;
+    int large = nor->size > (16ull << 20);
+
+    memset(sfdp, 0xff, sizeof(nor->sfdp));
+
+    memcpy(sfdp, "SFDP", 4);
+    sfdp[4] = 6;
+    sfdp[5] = 1;
+    sfdp[6] = large ? 1 : 0;
+    sfdp[7] = 0xff;
+
+    /* Basic flash parameter table header */
+    sfdp[8] = 0x00;
+    sfdp[9] = 6;
+    sfdp[10] = 1;
+    sfdp[11] = 16;
+    sfdp[12] = NOR_SFDP_BFPT;
+    sfdp[13] = 0;
+    sfdp[14] = 0;
+    sfdp[15] = 0xff;
+
+    /* 4K erase (0x20), 64 byte or larger write granularity, 1-1-2, 1-2-2,
+     * 1-4-4 and 1-1-4 reads, 3 or 4 byte addressing on large parts */
+    put_le32(&bfpt[0], 0xff800000 | 0x00700000 | 0x00010000 |
+                       (large ? 0x00020000 : 0) | (NOR_SE << 8) | 0x05);
+    if(bits <= 0x80000000ull) {
+        put_le32(&bfpt[4], (uint32_t)(bits - 1));
+    } else {
+        for(order = 0; (1ull << order) < bits; ++order);
+        put_le32(&bfpt[4], 0x80000000 | order);
+    }
+    /* 1-4-4: 2 mode + 4 dummy clocks, 1-1-4: 8 dummy clocks */
+    put_le32(&bfpt[8], (NOR_READ_1_1_4 << 24) | (8 << 16) |
+                       (NOR_READ_1_4_4 << 8) | (2 << 5) | 4);
+    /* 1-1-2: 8 dummy clocks, 1-2-2: 4 mode clocks */
+    put_le32(&bfpt[12], (NOR_READ_1_2_2 << 24) | (4 << 21) |
+                        (NOR_READ_1_1_2 << 8) | 8);
+    /* No 2-2-2 or 4-4-4 */
+    put_le32(&bfpt[16], 0xffffffee);
+    put_le32(&bfpt[20], 0x0000ffff);
+    put_le32(&bfpt[24], 0x0000ffff);
+    /* Erase types: 4K, 32K and 64K */
+    put_le32(&bfpt[28], (NOR_BE32 << 24) | (15 << 16) | (NOR_SE << 8) | 12);
+    put_le32(&bfpt[32], (NOR_BE64 << 8) | 16);
+    put_le32(&bfpt[36], 0);
+    /* 256 byte pages */
+    put_le32(&bfpt[40], 0x00000081);
+    put_le32(&bfpt[44], 0);
+    put_le32(&bfpt[48], 0);
+    put_le32(&bfpt[52], 0);
+    put_le32(&bfpt[56], 0);
+    /* Enter 4-byte mode with B7, exit with E9 */
+    put_le32(&bfpt[60], large ? 0x01004000 : 0);
+
+    if(large) {
+        sfdp[16] = 0x84;
+        sfdp[17] = 0;
+        sfdp[18] = 1;
+        sfdp[19] = 2;
+        sfdp[20] = NOR_SFDP_4BAIT;
+        sfdp[21] = 0;
+        sfdp[22] = 0;
+        sfdp[23] = 0xff;
+
+        /* 4-byte reads, page program and erase types 1 to 3 */
+        put_le32(&sfdp[NOR_SFDP_4BAIT], 0x00000e7f);
+        put_le32(&sfdp[NOR_SFDP_4BAIT + 4], 0xff000000 | (NOR_BE64_4B << 16) |
+                                            (NOR_BE32_4B << 8) | NOR_SE_4B);
+    }
+}
+
+static uint8_t nor_status(
+    struct sim_bus*         sim)
+{
+    return (sim->now_ns < sim->nor.busy_until ? NOR_SR_WIP : 0) |
+           (sim->nor.wel ? NOR_SR_WEL : 0);
+}
+
+static uint8_t nor_byte(
+    struct sim_bus*         sim,
+    uint8_t                 tx,
+    unsigned int            nbits)
+{
+    struct sim_nor* nor = &sim->nor;
+    const struct nor_cmd* cmd = NULL;
+    uint64_t i = sim->idx++;
+    uint64_t n = 0;
+    uint8_t val = 0;
+
+    if(i == 0) {
+        nor->opcode = tx;
+        /* A busy part only answers status reads */
+        if((sim->now_ns < nor->busy_until && tx != NOR_RDSR) || nbits != 1) {
+            nor->ignored = 1;
+            return 0xff;
+        }
+
+        for(n = 0; n < sizeof(nor_cmds) / sizeof(nor_cmds[0]); ++n) {
+            if(nor_cmds[n].opcode == tx) {
+                nor->cmd = &nor_cmds[n];
+                nor->addr_len = nor->cmd->addr_len ? nor->cmd->addr_len :
+                                                     (nor->addr4 ? 4 : 3);
+                break;
+            }
+        }
+
+        if(nor->cmd && nor->cmd->op == NOR_OP_SFDP && !nor->has_sfdp) {
+            nor->cmd = NULL;
+        }
+
+        return 0xff;
+    }
+
+    if(nor->ignored) {
+        return 0xff;
+    }
+
+    cmd = nor->cmd;
+    if(!cmd) {
+        switch(nor->opcode) {
+            case NOR_RDSR:
+                return nor_status(sim);
+            case NOR_RDID:
+                return i <= 3 ? nor->id[i - 1] : 0;
+            default:
+                /* Commands without data shouldn't have any */
+                nor->garbled = 1;
+                return 0xff;
+        }
+    }
+
+    if(i <= nor->addr_len) {
+        nor->garbled |= nbits != cmd->addr_nbits;
+        nor->addr = (nor->addr << 8) | tx;
+        return 0xff;
+    }
+
+    if(i <= nor->addr_len + cmd->dummy) {
+        nor->garbled |= nbits != cmd->addr_nbits;
+        return 0xff;
+    }
+
+    n = i - 1 - nor->addr_len - cmd->dummy;
+
+    switch(cmd->op) {
+        case NOR_OP_READ:
+            /* Reads wrap around at the end of the array */
+            nor->garbled |= nbits != cmd->data_nbits;
+            val = nor->mem[(nor->addr + n) & (nor->size - 1)];
+            return nor->garbled ? (uint8_t)~val : val;
+        case NOR_OP_SFDP:
+            return nor->addr + n < NOR_SFDP_SIZE ? nor->sfdp[nor->addr + n] : 0xff;
+        case NOR_OP_PROGRAM:
+            /* Data past the end of the page wraps to its start */
+            nor->garbled |= nbits != cmd->data_nbits;
+            nor->page[(nor->addr + n) % NOR_PAGE_SIZE] = tx;
+            nor->page_valid[(nor->addr + n) % NOR_PAGE_SIZE] = 1;
+            nor->page_bytes++;
+            return 0xff;
+        default:
+            nor->garbled = 1;
+            return 0xff;
+    }
+}
+
+static void nor_deselect(
+    struct sim_bus*         sim)
+{
+    struct sim_nor* nor = &sim->nor;
+    const struct nor_cmd* cmd = nor->cmd;
+    uint64_t base = 0;
+
+    if(!sim->idx || nor->ignored || nor->garbled) {
+        return;
+    }
+
+    if(!cmd) {
+        switch(nor->opcode) {
+            case NOR_WREN:
+                nor->wel = 1;
+                break;
+            case NOR_WRDI:
+                nor->wel = 0;
+                break;
+            case NOR_EN4B:
+                nor->addr4 = 1;
+                break;
+            case NOR_EX4B:
+                nor->addr4 = 0;
+                break;
+            case NOR_RST:
+                nor->addr4 = 0;
+                nor->wel = 0;
+                break;
+            case NOR_CE:
+            case NOR_CE_ALT:
+                if(nor->wel) {
+                    memset(nor->mem, 0xff, nor->size);
+                    nor->busy_until = sim->now_ns + nor->tbe_ns * (nor->size / 65536);
+                    nor->wel = 0;
+                    sim->stats.erases++;
+                    sim->stats.erased_bytes += nor->size;
+                }
+                break;
+            default:
+                break;
+        }
+        return;
+    }
+
+    if(!nor->wel || sim->idx < 1 + nor->addr_len) {
+        return;
+    }
+
+    if(cmd->op == NOR_OP_PROGRAM && nor->page_bytes) {
+        base = (nor->addr & (nor->size - 1)) & ~(uint64_t)(NOR_PAGE_SIZE - 1);
+        for(unsigned int col = 0; col < NOR_PAGE_SIZE; ++col) {
+            if(nor->page_valid[col]) {
+                nor->mem[base + col] &= nor->page[col];
+            }
+        }
+        nor->busy_until = sim->now_ns + nor->tpp_ns;
+        nor->wel = 0;
+        sim->stats.programs++;
+    } else if(cmd->op == NOR_OP_ERASE && sim->idx == 1 + nor->addr_len) {
+        base = (nor->addr & (nor->size - 1)) & ~(uint64_t)(cmd->erase_size - 1);
+        memset(&nor->mem[base], 0xff, cmd->erase_size);
+        nor->busy_until = sim->now_ns + (cmd->erase_size == 4096 ? nor->tse_ns :
+                          (cmd->erase_size == 65536 ? nor->tbe_ns : nor->tbe_ns * 4 / 5));
+        nor->wel = 0;
+        sim->stats.erases++;
+        sim->stats.erased_bytes += cmd->erase_size;
+    }
+}
+
+static int nand_init(
+    struct sim_bus*         sim,
+    int                     fill,
+    const char*             image)
+{
+    static const uint8_t ids[][3] = {
+        [NAND_CONTINUOUS] = { 0xef, 0xaa, 0x21 },
+        [NAND_CACHE] = { 0x2c, 0x14, 0x00 },
+        [NAND_PLAIN] = { 0xc2, 0x12, 0x00 },
+    };
+    struct sim_nand* nand = &sim->nand;
+    uint32_t stride = 0;
+    uint32_t x = 0x12345678;
+    uint32_t page = 0;
+    uint32_t block = 0;
+    FILE* f = NULL;
+    uint8_t* mem = NULL;
+
+    memcpy(nand->id, ids[nand->kind], sizeof(nand->id));
+    nand->oob_size = nand->kind == NAND_CACHE ? 128 : 64;
+    nand->pages = NAND_BLOCKS * NAND_PAGES_PER_BLOCK;
+    nand->config = NAND_CONFIG_ECC_EN | (nand->kind == NAND_CONTINUOUS ? NAND_CONFIG_BUF : 0);
+    stride = NAND_PAGE_SIZE + nand->oob_size;
+
+    nand->mem = malloc((size_t)nand->pages * stride);
+    if(!nand->mem) {
+        return -1;
+    }
+
+    memset(nand->mem, 0xff, (size_t)nand->pages * stride);
+
+    if(image) {
+        f = fopen(image, "rb");
+        if(!f) {
+            printf("Unable to open flash image %s\n", image);
+            free(nand->mem);
+            nand->mem = NULL;
+            return -1;
+        }
+    }
+
+    /* Images and the fill pattern only cover the data areas */
+    for(page = 0; page < nand->pages; ++page) {
+        mem = &nand->mem[(size_t)page * stride];
+        if(f) {
+            if(fread(mem, 1, NAND_PAGE_SIZE, f) < NAND_PAGE_SIZE) {
+                fclose(f);
+                f = NULL;
+            }
+        } else if(fill) {
+            for(uint32_t i = 0; i < NAND_PAGE_SIZE; i += 4) {
+                x = xorshift32(x);
+                put_le32(&mem[i], x);
+            }
+        }
+    }
+
+    if(f) {
+        fclose(f);
+    }
+
+    /* Spread the factory bad block markers over the part */
+    for(uint32_t n = 0; n < nand->bad && n < NAND_BLOCKS; ++n) {
+        block = (n * 397 + 5) % NAND_BLOCKS;
+        nand->mem[(size_t)block * NAND_PAGES_PER_BLOCK * stride + NAND_PAGE_SIZE] = 0x00;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief The ECC status bits a page reads back with
+ */
+static uint8_t nand_page_ecc(
+    struct sim_nand*        nand,
+    uint32_t                page)
+{
+    if((int64_t)page == nand->uecc) {
+        return 0x20;
+    }
+
+    return nand->flips && (page + 1) % nand->flips == 0 ? 0x10 : 0;
+}
+
+static uint8_t nand_byte(
+    struct sim_bus*         sim,
+    uint8_t                 tx,
+    unsigned int            nbits)
+{
+    struct sim_nand* nand = &sim->nand;
+    uint32_t stride = NAND_PAGE_SIZE + nand->oob_size;
+    uint64_t i = sim->idx++;
+    uint64_t n = 0;
+    uint32_t page = 0;
+    uint32_t col = 0;
+    uint8_t ecc = 0;
+    uint8_t val = 0;
+
+    if(i == 0) {
+        nand->opcode = tx;
+        /* A busy part only answers feature reads */
+        if((sim->now_ns < nand->busy_until && tx != NAND_GET_FEATURE) || nbits != 1) {
+            nand->ignored = 1;
+            return 0xff;
+        }
+
+        nand->data_nbits = tx == NAND_READ_CACHE_X4 ? 4 : (tx == NAND_READ_CACHE_X2 ? 2 : 1);
+        /* Reads from cache take a column and a dummy byte, or in
+         * continuous mode dummy bytes only */
+        nand->continuous = nand->kind == NAND_CONTINUOUS &&
+                           !(nand->config & NAND_CONFIG_BUF);
+        if(nand->continuous) {
+            nand->header = tx == NAND_READ_CACHE_SLOW ? 3 : 4;
+        } else {
+            nand->header = 3;
+        }
+        return 0xff;
+    }
+
+    if(nand->ignored) {
+        return 0xff;
+    }
+
+    switch(nand->opcode) {
+        case NAND_RDID:
+            return i >= 2 && i <= 4 ? nand->id[i - 2] : 0x00;
+        case NAND_GET_FEATURE:
+            if(i == 1) {
+                nand->arg[0] = tx;
+                return 0xff;
+            }
+            switch(nand->arg[0]) {
+                case NAND_REG_CONFIG:
+                    return nand->config;
+                case NAND_REG_STATUS:
+                    return nand->ecc | (sim->now_ns < nand->busy_until ? NAND_STATUS_OIP : 0);
+                case NAND_REG_PROTECT:
+                    return 0x00;
+                default:
+                    return 0xff;
+            }
+        case NAND_SET_FEATURE:
+        case NAND_PAGE_READ:
+            if(i <= 3) {
+                nand->arg[i - 1] = tx;
+            } else {
+                nand->garbled = 1;
+            }
+            return 0xff;
+        case NAND_READ_CACHE_SLOW:
+        case NAND_READ_CACHE:
+        case NAND_READ_CACHE_X2:
+        case NAND_READ_CACHE_X4:
+            break;
+        default:
+            /* Commands without data shouldn't have any */
+            nand->garbled = 1;
+            return 0xff;
+    }
+
+    if(i <= nand->header) {
+        nand->garbled |= nbits != 1;
+        if(i <= 2) {
+            nand->arg[i - 1] = tx;
+        }
+        return 0xff;
+    }
+
+    nand->garbled |= nbits != nand->data_nbits;
+    n = i - 1 - nand->header;
+
+    if(!nand->continuous) {
+        /* Buffer mode: from the column to the end of the spare area */
+        col = (((uint32_t)nand->arg[0] << 8 | nand->arg[1]) & 0xfff) + (uint32_t)n;
+        val = col < stride ? nand->mem[(size_t)nand->cache_page * stride + col] : 0xff;
+    } else {
+        /* Continuous mode: the data areas of the pages from the cached one
+         * on, with the ECC status the worst of them */
+        page = nand->cache_page + (uint32_t)(n / NAND_PAGE_SIZE);
+        col = n % NAND_PAGE_SIZE;
+        if(page >= nand->pages) {
+            return 0xff;
+        }
+        if(!col) {
+            ecc = nand_page_ecc(nand, page);
+            nand->ecc = ecc > nand->ecc ? ecc : nand->ecc;
+        }
+        val = nand->mem[(size_t)page * stride + col];
+    }
+
+    return nand->garbled ? (uint8_t)~val : val;
+}
+
+static void nand_deselect(
+    struct sim_bus*         sim)
+{
+    struct sim_nand* nand = &sim->nand;
+    uint64_t start = 0;
+    uint32_t page = 0;
+
+    if(!sim->idx || nand->ignored || nand->garbled) {
+        return;
+    }
+
+    switch(nand->opcode) {
+        case NAND_RESET:
+            nand->config = NAND_CONFIG_ECC_EN |
+                           (nand->kind == NAND_CONTINUOUS ? NAND_CONFIG_BUF : 0);
+            nand->ecc = 0;
+            nand->busy_until = sim->now_ns + SIM_NAND_RESET_US * 1000ull;
+            break;
+        case NAND_SET_FEATURE:
+            if(sim->idx == 3 && nand->arg[0] == NAND_REG_CONFIG) {
+                nand->config = nand->arg[1];
+            }
+            break;
+        case NAND_PAGE_READ:
+            page = (uint32_t)nand->arg[0] << 16 | (uint32_t)nand->arg[1] << 8 | nand->arg[2];
+            if(sim->idx != 4 || page >= nand->pages) {
+                break;
+            }
+            nand->cache_page = page;
+            nand->reg_page = page;
+            nand->ecc = nand_page_ecc(nand, page);
+            nand->busy_until = sim->now_ns + nand->trd_ns;
+            nand->reg_ready = nand->busy_until;
+            break;
+        case NAND_CACHE_READ_SEQ:
+        case NAND_CACHE_READ_END:
+            /* The page in the data register moves to the cache once it has
+             * loaded, and a sequential read starts loading the next one */
+            if(nand->kind != NAND_CACHE || sim->idx != 1) {
+                break;
+            }
+            start = sim->now_ns > nand->reg_ready ? sim->now_ns : nand->reg_ready;
+            nand->cache_page = nand->reg_page;
+            nand->ecc = nand_page_ecc(nand, nand->cache_page);
+            nand->busy_until = start + nand->trcbsy_ns;
+            if(nand->opcode == NAND_CACHE_READ_SEQ && nand->reg_page + 1 < nand->pages) {
+                nand->reg_page++;
+                nand->reg_ready = nand->busy_until + nand->trd_ns;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static int eeprom_init(
+    struct sim_bus*         sim,
+    int                     fill,
+    const char*             image)
+{
+    struct sim_eeprom* eeprom = &sim->eeprom;
+    FILE* f = NULL;
+    uint32_t x = 0x12345678;
+
+    /* The flash size option doubles as the array size, with a smaller
+     * default */
+    eeprom->size = sim->nor.size == SIM_DEFAULT_FLASH_SIZE ? SIM_DEFAULT_EEPROM_SIZE :
+                                                            (uint32_t)sim->nor.size;
+    if(eeprom->size < 128 || eeprom->size > SIM_MAX_EEPROM_SIZE ||
+       (eeprom->size & (eeprom->size - 1)) || sim->nor.size > SIM_MAX_EEPROM_SIZE) {
+        printf("The simulated EEPROM size must be a power of 2 from 128 to 16M\n");
+        return -1;
+    }
+
+    if(eeprom->page_size > EEPROM_MAX_PAGE || eeprom->page_size > eeprom->size ||
+       (eeprom->page_size & (eeprom->page_size - 1))) {
+        printf("The simulated EEPROM page size must be a power of 2 up to 256\n");
+        return -1;
+    }
+
+    eeprom->addr_len = eeprom->size <= 512 ? 1 : (eeprom->size <= 65536 ? 2 : 3);
+
+    eeprom->mem = malloc(eeprom->size);
+    if(!eeprom->mem) {
+        return -1;
+    }
+
+    memset(eeprom->mem, 0xff, eeprom->size);
+
+    if(fill) {
+        for(uint32_t i = 0; i < eeprom->size; i += 4) {
+            x = xorshift32(x);
+            put_le32(&eeprom->mem[i], x);
+        }
+    }
+
+    if(image) {
+        f = fopen(image, "rb");
+        if(!f) {
+            printf("Unable to open EEPROM image %s\n", image);
+            free(eeprom->mem);
+            eeprom->mem = NULL;
+            return -1;
+        }
+        if(fread(eeprom->mem, 1, eeprom->size, f) == 0 && ferror(f)) {
+            printf("Unable to read EEPROM image %s\n", image);
+        }
+        fclose(f);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Get the first address the block protect bits cover
+ */
+static uint32_t eeprom_protected(
+    struct sim_eeprom*      eeprom)
+{
+    switch(eeprom->bp >> 2) {
+        case 1:
+            return eeprom->size - eeprom->size / 4;
+        case 2:
+            return eeprom->size / 2;
+        case 3:
+            return 0;
+        default:
+            return eeprom->size;
+    }
+}
+
+static uint8_t eeprom_byte(
+    struct sim_bus*         sim,
+    uint8_t                 tx)
+{
+    struct sim_eeprom* eeprom = &sim->eeprom;
+    uint64_t i = sim->idx++;
+    uint32_t n = 0;
+    uint8_t opcode = 0;
+
+    if(i == 0) {
+        eeprom->opcode = tx;
+        /* A busy part only answers status reads */
+        if(sim->now_ns < eeprom->busy_until && tx != EEPROM_RDSR) {
+            eeprom->ignored = 1;
+        }
+        if(eeprom->size == 512 && (tx & ~EEPROM_A8) <= EEPROM_READ) {
+            eeprom->addr = tx & EEPROM_A8 ? 1 : 0;
+        }
+        return 0xff;
+    }
+
+    if(eeprom->ignored) {
+        return 0xff;
+    }
+
+    opcode = eeprom->size == 512 ? eeprom->opcode & ~EEPROM_A8 : eeprom->opcode;
+
+    switch(opcode) {
+        case EEPROM_RDSR:
+            return eeprom->bp | (eeprom->wel ? EEPROM_SR_WEL : 0) |
+                   (sim->now_ns < eeprom->busy_until ? EEPROM_SR_WIP : 0);
+        case EEPROM_WRSR:
+            eeprom->new_status = tx;
+            return 0xff;
+        case EEPROM_READ:
+        case EEPROM_WRITE:
+            break;
+        default:
+            return 0xff;
+    }
+
+    if(i <= eeprom->addr_len) {
+        eeprom->addr = (eeprom->addr << 8) | tx;
+        return 0xff;
+    }
+
+    n = (uint32_t)(i - 1 - eeprom->addr_len);
+
+    if(opcode == EEPROM_READ) {
+        /* Reads wrap around at the end of the array */
+        return eeprom->mem[(eeprom->addr + n) & (eeprom->size - 1)];
+    }
+
+    /* Data past the end of the page wraps to its start */
+    eeprom->page[(eeprom->addr + n) % eeprom->page_size] = tx;
+    eeprom->page_valid[(eeprom->addr + n) % eeprom->page_size] = 1;
+    eeprom->page_bytes++;
+
+    return 0xff;
+}
+
+static void eeprom_deselect(
+    struct sim_bus*         sim)
+{
+    struct sim_eeprom* eeprom = &sim->eeprom;
+    uint32_t base = 0;
+    uint8_t opcode = eeprom->size == 512 ? eeprom->opcode & ~EEPROM_A8 : eeprom->opcode;
+
+    if(!sim->idx || eeprom->ignored) {
+        return;
+    }
+
+    switch(opcode) {
+        case EEPROM_WREN:
+            eeprom->wel = 1;
+            break;
+        case EEPROM_WRDI:
+            eeprom->wel = 0;
+            break;
+        case EEPROM_WRSR:
+            if(eeprom->wel && sim->idx == 2) {
+                eeprom->bp = eeprom->new_status & EEPROM_SR_BP;
+                eeprom->busy_until = sim->now_ns + eeprom->twc_ns;
+                eeprom->wel = 0;
+            }
+            break;
+        case EEPROM_WRITE:
+            if(!eeprom->wel || !eeprom->page_bytes) {
+                break;
+            }
+            /* Writes to protected blocks are dropped, without a busy
+             * time */
+            eeprom->wel = 0;
+            base = (eeprom->addr & (eeprom->size - 1)) & ~(eeprom->page_size - 1);
+            if(base >= eeprom_protected(eeprom)) {
+                break;
+            }
+            for(uint32_t col = 0; col < eeprom->page_size; ++col) {
+                if(eeprom->page_valid[col]) {
+                    eeprom->mem[base + col] = eeprom->page[col];
+                }
+            }
+            eeprom->busy_until = sim->now_ns + eeprom->twc_ns;
+            sim->stats.programs++;
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * @brief The register file: the first byte selects a register, with bit 7
+ *        set for a read, and the address increments after each data byte.
+ *        Register 0 is a read-only identification register
+ */
+static uint8_t regs_byte(
+    struct sim_bus*         sim,
+    uint8_t                 tx)
+{
+    uint8_t val = 0xff;
+
+    if(sim->idx++ == 0) {
+        sim->regs.ptr = tx & (SIM_REG_COUNT - 1);
+        sim->regs.read = tx & 0x80 ? 1 : 0;
+        return 0xff;
+    }
+
+    if(sim->regs.read) {
+        val = sim->regs.regs[sim->regs.ptr];
+    } else if(sim->regs.ptr) {
+        sim->regs.regs[sim->regs.ptr] = tx;
+    }
+
+    sim->regs.ptr = (sim->regs.ptr + 1) & (SIM_REG_COUNT - 1);
+
+    return val;
+}
+
+/**
+ * @brief The ADC, using the MCP3208's byte aligned framing: 0x06 | ch >> 2,
+ *        ch << 6, 0 in and the 12-bit result in the low nibble of the second
+ *        byte and the third byte out. Each conversion of a channel returns
+ *        one more than the last, starting from the channel number * 512
+ */
+static uint8_t adc_byte(
+    struct sim_bus*         sim,
+    uint8_t                 tx)
+{
+    uint64_t i = sim->idx++;
+    unsigned int ch = 0;
+
+    if(i == 0) {
+        sim->adc.cmd[0] = tx;
+        return 0xff;
+    }
+
+    if(!(sim->adc.cmd[0] & 0x04)) {
+        /* No start bit */
+        return 0xff;
+    }
+
+    if(i == 1) {
+        ch = ((sim->adc.cmd[0] & 0x01) << 2) | (tx >> 6);
+        sim->adc.sample = sim->adc.next[ch];
+        sim->adc.next[ch] = (sim->adc.next[ch] + 1) & 0xfff;
+        return (sim->adc.sample >> 8) & 0x0f;
+    }
+
+    return i == 2 ? sim->adc.sample & 0xff : 0;
+}
+
+static uint32_t xorshift32(
+    uint32_t                x)
+{
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return x;
+}
+
+static uint8_t bit_reverse(
+    uint8_t                 val)
+{
+    val = (uint8_t)((val & 0xf0) >> 4 | (val & 0x0f) << 4);
+    val = (uint8_t)((val & 0xcc) >> 2 | (val & 0x33) << 2);
+    val = (uint8_t)((val & 0xaa) >> 1 | (val & 0x55) << 1);
+
+    return val;
+}
+
+static void put_le32(
+    uint8_t*                buf,
+    uint32_t                val)
+{
+    buf[0] = val & 0xff;
+    buf[1] = (val >> 8) & 0xff;
+    buf[2] = (val >> 16) & 0xff;
+    buf[3] = (val >> 24) & 0xff;
+}
@@ -0,0 +1,133 @@
+/**
+ * Simulated SPI controller and device models
+ *
+ * Copyright 2019 Mark Walton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef SPI_SIM_H
+#define SPI_SIM_H
+
+#include <stdint.h>
+
+#include "spi_bus.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Counters kept by a simulated controller */
+struct spi_sim_stats {
+    /** SPI_IOC_MESSAGE ioctls */
+    unsigned long           messages;
+    /** Transfers within those messages */
+    unsigned long           transfers;
+    /** Bytes clocked */
+    unsigned long long      bytes;
+    /** Times the device was selected */
+    unsigned long           selects;
+    /** Flash page programs performed */
+    unsigned long           programs;
+    /** Flash erases performed and the number of bytes they erased */
+    unsigned long           erases;
+    unsigned long long      erased_bytes;
+};
+
+/**
+ * @brief Open a simulated SPI controller with one device attached
+ *
+ * @param options - NULL, or a comma separated list of:
+ *                      dev=nor     - JEDEC NOR flash with SFDP (default)
+ *                      dev=regs    - 128 byte register file, addressed by
+ *                                    the first byte (bit 7 set to read)
+ *                      dev=adc     - MCP3208 style 8 channel 12-bit ADC
+ *                      dev=nand    - 1Gbit W25N01GV style SPI NAND, with
+ *                                    continuous reads
+ *                      dev=nand-cache - 1Gbit MT29F1G01 style SPI NAND,
+ *                                    with cache read sequential
+ *                      dev=nand-plain - 1Gbit MX35LF1GE4 style SPI NAND,
+ *                                    with page reads only
+ *                      dev=eeprom  - 25xx EEPROM, 32K unless size is
+ *                                    given
+ *                      size=N      - Flash size (default 16M)
+ *                      hz=N        - Fastest clock the controller can
+ *                                    generate (default 100M)
+ *                      ioctl_us=N  - Fixed cost of each message (default 20)
+ *                      bufsiz=N    - spidev buffer size (default 4096)
+ *                      single      - Controller without dual/quad I/O
+ *                      dual        - Controller with dual but not quad I/O
+ *                      nosfdp      - Flash without an SFDP table
+ *                      fill        - Fill the flash with a fixed pseudo
+ *                                    random pattern rather than erased
+ *                      image=path  - Preload the flash from a file (the
+ *                                    data areas of a NAND)
+ *                      tpp_us=N    - Page program time (default 700)
+ *                      tse_us=N    - 4K sector erase time (default 45000)
+ *                      tbe_us=N    - 64K block erase time (default 150000)
+ *                      trd_us=N    - NAND page read time (default 45)
+ *                      flips=N     - Every Nth NAND page reports corrected
+ *                                    bit flips
+ *                      uecc=N      - NAND page N reports an uncorrectable
+ *                                    error
+ *                      bad=N       - Mark N NAND blocks bad
+ *                      page=N      - EEPROM page size (default 64)
+ *                      twc_us=N    - EEPROM page write time (default 3000)
+ *                      realtime    - Sleep for the modelled transfer time
+ *                                    as well as advancing the virtual clock
+ *
+ * Transfers take the time the clock and I/O width give them, plus a fixed
+ * cost per message and per transfer. Messages are checked the way spidev
+ * checks them, including the bufsiz limit with each transfer rounded up to
+ * SPI_BUS_DMA_ALIGN.
+ *
+ * @return The bus, or NULL on failure
+ */
+struct spi_bus* spi_sim_open(
+    const char*             options);
+
+/**
+ * @brief Check whether a bus is a simulated controller
+ */
+int spi_sim_is_sim(
+    struct spi_bus*         bus);
+
+/**
+ * @brief Get the array of a simulated flash, e.g. to preload or check its
+ *        contents
+ *
+ * @param size - Optional pointer to store the array size in
+ *
+ * @return The array, or NULL if the device isn't a flash
+ */
+uint8_t* spi_sim_flash_data(
+    struct spi_bus*         bus,
+    uint64_t*               size);
+
+/**
+ * @brief Retrieve the counters of a simulated controller
+ */
+void spi_sim_get_stats(
+    struct spi_bus*         bus,
+    struct spi_sim_stats*   stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SPI_SIM_H */